@@ -116,6 +116,10 @@
    /* to compare to the PWV RX_CREDITS UUID.                          */
 #define PWV_COMPARE_PWV_RX_CREDITS_UUID_TO_UUID_128(_x)     COMPARE_BLUETOOTH_UUID_128_TO_CONSTANT((_x), 0xE0, 0x6D, 0x5E, 0xFB, 0x4F, 0x4A, 0x45, 0xc0, 0x9E, 0xB1, 0x37, 0x1A, 0xE5, 0xA1, 0x4A, 0xD4)
 
+   /* The following defines the PWV RX_CREDITS Characteristic UUID    */
+   /* that is used when building the PWV Service Table.               */
+#define PWV_RX_CREDITS_CHARACTERISTIC_BLUETOOTH_UUID_CONSTANT { 0xD4, 0x4A, 0xA1, 0xE5, 0x1A, 0x37, 0xB1, 0x9E, 0xc0, 0x45, 0x4A, 0x4F, 0xFB, 0x5E, 0x6D, 0xE0 }
+
    /* The following defines the PWV Control Point Characteristic UUID    */
    /* that is used when building the PWV Service Table.                  */
 #define PWV_CONTROL_POINT_CHARACTERISTIC_BLUETOOTH_UUID_CONSTANT { 0x54, 0x2A, 0x9F, 0x83, 0xB5, 0x5E, 0xAA, 0x9E, 0x14, 0x4F, 0x01, 0x00, 0x7A, 0xD8, 0x3A, 0x42 }
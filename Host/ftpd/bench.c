@@ -0,0 +1,193 @@
+//------------------------------------------------------------------------------------
+// FTP server benchmark.
+//
+// Runs the card's FTP server (Src/FTPd) on a file image, talks to it over a socket
+// pair with the framing the Bluetooth link uses, and times STOR + SRFT, RETR and
+// LIST.  Every file read back is compared with what was stored.  Prints the
+// throughput and latency of each command, then the card's own /device/stats.
+//
+//   ftpd_bench [-n rounds] [-s bytes] [-i image] [-v]
+//
+// Exits with 1 when a command fails or a file does not read back.
+//------------------------------------------------------------------------------------
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "client.h"
+
+#define BENCH_PATH              "/apps/vault/data/"
+
+typedef struct {
+    const char *Name;
+    unsigned long Count;
+    unsigned long long Bytes;
+    double TotalMs;
+    double MaxMs;
+}BenchStats_t;
+
+enum { BENCH_STOR, BENCH_SRFT, BENCH_RETR, BENCH_LIST, BENCH_COUNT };
+
+static BenchStats_t Stats[BENCH_COUNT] = {
+    {"STOR"}, {"SRFT"}, {"RETR"}, {"LIST"},
+};
+
+static double NowMs(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+static void AddStat(int Cmd, double StartMs, unsigned long long Bytes)
+{
+    double Ms = NowMs() - StartMs;
+
+    Stats[Cmd].Count++;
+    Stats[Cmd].Bytes += Bytes;
+    Stats[Cmd].TotalMs += Ms;
+    if (Ms > Stats[Cmd].MaxMs){
+        Stats[Cmd].MaxMs = Ms;
+    }
+}
+
+//------------------------------------------------------------------------------------
+// STOR a file, ending the data with an empty frame, then SRFT to commit it.
+//------------------------------------------------------------------------------------
+static int BenchStor(const char *Name, const unsigned char *Data, unsigned long Size)
+{
+    char Path[200];
+    double Start;
+    int Reply;
+
+    snprintf(Path, sizeof(Path), BENCH_PATH "%s", Name);
+    Start = NowMs();
+    Reply = ClientStor(Path, Data, Size);
+    if (Reply != 226){
+        fprintf(stderr, "STOR %s: reply %d\n", Name, Reply);
+        return -1;
+    }
+    AddStat(BENCH_STOR, Start, Size);
+
+    Start = NowMs();
+    if (ClientCommand("SRFT 20240101120000 %s", Path) || ClientExpect(213, "SRFT")){
+        return -1;
+    }
+    AddStat(BENCH_SRFT, Start, 0);
+    return 0;
+}
+
+static int BenchRetr(const char *Name, const unsigned char *Expected, unsigned long Size)
+{
+    char Path[200];
+    unsigned char *Data = malloc(Size + 1);
+    unsigned long Got;
+    double Start;
+    int Result = -1;
+
+    snprintf(Path, sizeof(Path), BENCH_PATH "%s", Name);
+    Start = NowMs();
+    if (ClientRetr(Path, Data, Size, &Got) != 226){
+        fprintf(stderr, "RETR %s failed\n", Name);
+    }else if (Got != Size || memcmp(Data, Expected, Size)){
+        fprintf(stderr, "RETR %s: %lu bytes back, %lu stored, or different data\n", Name, Got, Size);
+    }else{
+        AddStat(BENCH_RETR, Start, Size);
+        Result = 0;
+    }
+    free(Data);
+    return Result;
+}
+
+static int BenchList(void)
+{
+    unsigned long Got = 0;
+    double Start = NowMs();
+
+    if (ClientCommand("LIST %s", BENCH_PATH) || ClientExpect(150, "LIST")){
+        return -1;
+    }
+    if (ClientReply(NULL, 0, &Got) != 226){
+        fprintf(stderr, "LIST failed\n");
+        return -1;
+    }
+    AddStat(BENCH_LIST, Start, Got);
+    return 0;
+}
+
+// Print the card's transfer statistics
+static int CardStats(void)
+{
+    static unsigned char Data[4096];
+    unsigned long Got = 0;
+
+    if (ClientRetr("/device/stats", Data, sizeof(Data) - 1, &Got) != 226 || Got >= sizeof(Data)){
+        return -1;
+    }
+    Data[Got] = 0;
+    printf("\nCard /device/stats:\n%s", Data);
+    return 0;
+}
+
+static void PrintStats(void)
+{
+    int a;
+
+    printf("%-6s %6s %12s %10s %10s %10s\n", "cmd", "count", "bytes", "avg ms", "max ms", "MB/s");
+    for (a=0;a<BENCH_COUNT;a++){
+        BenchStats_t *p = &Stats[a];
+        printf("%-6s %6lu %12llu %10.2f %10.2f %10.3f\n", p->Name, p->Count, p->Bytes,
+               p->Count ? p->TotalMs / p->Count : 0.0, p->MaxMs,
+               p->TotalMs > 0 ? p->Bytes / (p->TotalMs * 1000.0) : 0.0);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    const char *Image = "ftpd_bench.img";
+    unsigned long Size = 256 * 1024;
+    unsigned char *Data;
+    char Name[32];
+    int Rounds = 3;
+    int a, opt;
+    unsigned long b;
+
+    while ((opt = getopt(argc, argv, "n:s:i:v")) != -1){
+        switch (opt){
+            case 'n': Rounds = atoi(optarg); break;
+            case 's': Size = strtoul(optarg, NULL, 0); break;
+            case 'i': Image = optarg; break;
+            case 'v': ClientVerbose = 1; break;
+            default:
+                fprintf(stderr, "usage: %s [-n rounds] [-s bytes] [-i image] [-v]\n", argv[0]);
+                return 1;
+        }
+    }
+
+    if (ClientOpen(Image, 1)){
+        return 1;
+    }
+
+    Data = malloc(Size);
+    for (b=0;b<Size;b++){
+        Data[b] = (unsigned char)((b * 7) ^ (b >> 9));
+    }
+
+    for (a=0;a<Rounds;a++){
+        snprintf(Name, sizeof(Name), "bench%d.bin", a);
+        if (BenchStor(Name, Data, Size) || BenchRetr(Name, Data, Size) || BenchList()){
+            return 1;
+        }
+    }
+
+    PrintStats();
+    if (CardStats() || ClientCommand("QUIT") || ClientExpect(221, "QUIT")){
+        return 1;
+    }
+    free(Data);
+    unlink(Image);
+    return 0;
+}
@@ -0,0 +1,209 @@
+//------------------------------------------------------------------------------------
+// Host side of the FTP link, see client.h.
+//
+// Frames are: type (1), length of the whole frame (2, MSB first), payload,
+// checksum (2, not checked).
+//------------------------------------------------------------------------------------
+#include <poll.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "cmsis_os.h"
+#include "card.h"
+#include "FTPd.h"
+#include "link.h"
+#include "client.h"
+
+#define IMAGE_SECTORS           (64 * 2048)     // 64 MB
+#define REPLY_TIMEOUT_MS        10000
+
+int ClientVerbose;
+
+static int HostFd = -1;
+
+int ClientOpen(const char * Image, int Format)
+{
+    osThreadDef(FTP_Thread, FTPThread, osPriorityNormal, 0, 0);
+    FRESULT res;
+
+    CardLog = ClientVerbose;
+    res = CardMount(Image, IMAGE_SECTORS, Format);
+    if (res != FR_OK){
+        fprintf(stderr, "Cannot set up %s: %d\n", Image, res);
+        return -1;
+    }
+    HostFd = LinkOpen();
+    if (HostFd < 0 || osThreadCreate(osThread(FTP_Thread), NULL) == NULL){
+        fprintf(stderr, "Cannot start the FTP server\n");
+        return -1;
+    }
+    return ClientExpect(220, "connect");
+}
+
+static int WriteAll(const unsigned char * p, int Len)
+{
+    int n;
+
+    while (Len){
+        n = write(HostFd, p, Len);
+        if (n <= 0){
+            return -1;
+        }
+        p += n;
+        Len -= n;
+    }
+    return 0;
+}
+
+static int ReadAll(unsigned char * p, int Len, int TimeoutMs)
+{
+    struct pollfd Pfd = {HostFd, POLLIN, 0};
+    int n;
+
+    while (Len){
+        if (poll(&Pfd, 1, TimeoutMs) <= 0){
+            return -1;
+        }
+        n = read(HostFd, p, Len);
+        if (n <= 0){
+            return -1;
+        }
+        p += n;
+        Len -= n;
+    }
+    return 0;
+}
+
+int ClientSendFrame(int Type, const void * Payload, int Len)
+{
+    unsigned char Frame[CLIENT_DATA_PAYLOAD + CLIENT_FRAME_OVERHEAD];
+    int Total = Len + CLIENT_FRAME_OVERHEAD;
+
+    if (Len > CLIENT_DATA_PAYLOAD){
+        return -1;
+    }
+    Frame[0] = Type;
+    Frame[1] = Total >> 8;
+    Frame[2] = Total & 0xff;
+    if (Len){
+        memcpy(Frame + 3, Payload, Len);
+    }
+    Frame[Len + 3] = 0;
+    Frame[Len + 4] = 0;
+    return WriteAll(Frame, Total);
+}
+
+int ClientRecvFrame(unsigned char * Payload, int Size, int * pLen, int TimeoutMs)
+{
+    unsigned char Head[3], Check[2];
+    int Len;
+
+    if (ReadAll(Head, 3, TimeoutMs)){
+        return -1;
+    }
+    Len = ((Head[1] << 8) | Head[2]) - CLIENT_FRAME_OVERHEAD;
+    if (Len < 0 || Len > Size || ReadAll(Payload, Len, TimeoutMs) || ReadAll(Check, 2, TimeoutMs)){
+        return -1;
+    }
+    *pLen = Len;
+    return Head[0];
+}
+
+int ClientCommand(const char * Fmt, ...)
+{
+    char Line[300];
+    va_list args;
+
+    va_start(args, Fmt);
+    vsnprintf(Line, sizeof(Line) - 2, Fmt, args);
+    va_end(args);
+    if (ClientVerbose){
+        printf("> %s\n", Line);
+    }
+    strcat(Line, "\r\n");
+    return ClientSendFrame(FTP_FRAME_COMMAND, Line, strlen(Line));
+}
+
+int ClientReply(unsigned char * Data, unsigned long Size, unsigned long * pGot)
+{
+    unsigned char Payload[2048];
+    int Type, Len;
+
+    for (;;){
+        Type = ClientRecvFrame(Payload, sizeof(Payload) - 1, &Len, REPLY_TIMEOUT_MS);
+        if (Type < 0){
+            fprintf(stderr, "No reply from the card\n");
+            return -1;
+        }
+        if (Type == FTP_FRAME_DATA){
+            if (Data && pGot && *pGot + Len <= Size){
+                memcpy(Data + *pGot, Payload, Len);
+            }
+            if (pGot){
+                *pGot += Len;
+            }
+            continue;
+        }
+        if (Type != FTP_FRAME_COMMAND){
+            continue;
+        }
+        Payload[Len] = 0;
+        if (ClientVerbose){
+            printf("< %s", Payload);
+        }
+        return atoi((char *)Payload);
+    }
+}
+
+int ClientExpect(int Code, const char * What)
+{
+    int Reply = ClientReply(NULL, 0, NULL);
+
+    if (Reply != Code){
+        fprintf(stderr, "%s: reply %d, expected %d\n", What, Reply, Code);
+        return -1;
+    }
+    return 0;
+}
+
+int ClientStor(const char * Path, const unsigned char * Data, unsigned long Size)
+{
+    unsigned long Pos, n;
+    int Reply;
+
+    if (ClientCommand("STOR %s", Path)){
+        return -1;
+    }
+    Reply = ClientReply(NULL, 0, NULL);
+    if (Reply != 150){
+        return Reply;
+    }
+    for (Pos=0;Pos<Size;Pos+=n){
+        n = (Size - Pos > CLIENT_DATA_PAYLOAD) ? CLIENT_DATA_PAYLOAD : Size - Pos;
+        if (ClientSendFrame(FTP_FRAME_DATA, Data + Pos, n)){
+            return -1;
+        }
+    }
+    if (ClientSendFrame(FTP_FRAME_DATA, NULL, 0)){
+        return -1;
+    }
+    return ClientReply(NULL, 0, NULL);
+}
+
+int ClientRetr(const char * Path, unsigned char * Data, unsigned long Size, unsigned long * pGot)
+{
+    int Reply;
+
+    *pGot = 0;
+    if (ClientCommand("RETR %s", Path)){
+        return -1;
+    }
+    Reply = ClientReply(NULL, 0, NULL);
+    if (Reply != 150){
+        return Reply;
+    }
+    return ClientReply(Data, Size, pGot);
+}
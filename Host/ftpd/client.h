@@ -0,0 +1,43 @@
+//------------------------------------------------------------------------------------
+// Host side of the FTP link: frames, commands and replies, as the phone sends
+// and reads them.  Used by the benchmark and the FTP server tests.
+//------------------------------------------------------------------------------------
+#ifndef _CLIENT_H
+#define _CLIENT_H
+
+#define CLIENT_DATA_PAYLOAD     512             // Data bytes per frame, as the card sends
+#define CLIENT_FRAME_OVERHEAD   5
+
+extern int ClientVerbose;
+
+// Mount the image, formatted when Format is set, start the FTP server and wait for
+// its greeting.  Returns 0, -1 on error.
+int ClientOpen(const char * Image, int Format);
+
+// Send one frame (FTP_FRAME_*), 0 on success
+int ClientSendFrame(int Type, const void * Payload, int Len);
+
+// Receive one frame, returns its type and the payload length in *pLen, -1 when
+// nothing arrives within TimeoutMs
+int ClientRecvFrame(unsigned char * Payload, int Size, int * pLen, int TimeoutMs);
+
+// Send a command line, printf style
+int ClientCommand(const char * Fmt, ...);
+
+// Wait for a reply line, data frames that come first are appended to Data (up to
+// Size bytes, the total is counted in *pGot).  Returns the reply code, -1 on a
+// dead link.
+int ClientReply(unsigned char * Data, unsigned long Size, unsigned long * pGot);
+
+// Wait for a reply, 0 when it has the given code
+int ClientExpect(int Code, const char * What);
+
+// STOR Size bytes to Path in data frames ending with an empty one.  Returns the
+// final reply code.
+int ClientStor(const char * Path, const unsigned char * Data, unsigned long Size);
+
+// RETR Path into Data, the size is returned in *pGot.  Returns the final reply
+// code.
+int ClientRetr(const char * Path, unsigned char * Data, unsigned long Size, unsigned long * pGot);
+
+#endif
@@ -0,0 +1,71 @@
+//------------------------------------------------------------------------------------
+// Socket pair standing in for the Bluetooth serial link of the FTP server.
+//
+// BT_WriteABuffer, the server's pWriteABuffer, writes to the card end.  A reader
+// thread feeds what arrives there to HandleASuccessfulRead like the SPP data
+// indication does on the card.
+//------------------------------------------------------------------------------------
+#include <errno.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "cmsis_os.h"
+#include "link.h"
+
+#define LINK_READ_SIZE          512     // Largest SPP data indication
+
+extern int HandleASuccessfulRead(char *lpBuf, DWORD dwRead);
+
+static int CardFd = -1;
+
+int BT_WriteABuffer(const char * lpBuf, DWORD dwToWrite)
+{
+    ssize_t n;
+
+    while (dwToWrite){
+        n = write(CardFd, lpBuf, dwToWrite);
+        if (n < 0){
+            if (errno == EINTR){
+                continue;
+            }
+            return -1;
+        }
+        lpBuf += n;
+        dwToWrite -= n;
+    }
+    return 0;
+}
+
+static void LinkReader(void const *argument)
+{
+    char Buf[LINK_READ_SIZE];
+    ssize_t n;
+
+    for (;;){
+        n = read(CardFd, Buf, sizeof(Buf));
+        if (n <= 0){
+            if (n < 0 && errno == EINTR){
+                continue;
+            }
+            break;
+        }
+        HandleASuccessfulRead(Buf, n);
+    }
+}
+
+int LinkOpen(void)
+{
+    osThreadDef(Link_Thread, LinkReader, osPriorityNormal, 0, 0);
+    int Fds[2];
+
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, Fds) != 0){
+        return -1;
+    }
+    CardFd = Fds[0];
+    if (osThreadCreate(osThread(Link_Thread), NULL) == NULL){
+        close(Fds[0]);
+        close(Fds[1]);
+        return -1;
+    }
+    return Fds[1];
+}
@@ -0,0 +1,10 @@
+//------------------------------------------------------------------------------------
+// Socket pair standing in for the Bluetooth serial link of the FTP server.
+//------------------------------------------------------------------------------------
+#ifndef _LINK_H
+#define _LINK_H
+
+// Start the card side of the link and return the host end, -1 on error
+int LinkOpen(void);
+
+#endif
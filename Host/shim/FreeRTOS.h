@@ -0,0 +1,29 @@
+//------------------------------------------------------------------------------------
+// Host stand in for the FreeRTOS kernel header, see os.c.
+//------------------------------------------------------------------------------------
+#ifndef INC_FREERTOS_H
+#define INC_FREERTOS_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+typedef uint32_t TickType_t;
+typedef long BaseType_t;
+typedef unsigned long UBaseType_t;
+
+#define pdFALSE                 ((BaseType_t)0)
+#define pdTRUE                  ((BaseType_t)1)
+#define pdPASS                  pdTRUE
+#define pdFAIL                  pdFALSE
+#define portMAX_DELAY           ((TickType_t)0xffffffffUL)
+#define configTICK_RATE_HZ      ((TickType_t)1000)
+#define portTICK_PERIOD_MS      ((TickType_t)1000 / configTICK_RATE_HZ)
+
+// Task handles and semaphores are host threads and counting semaphores
+typedef struct HostTask_s * TaskHandle_t;
+typedef struct HostSem_s * SemaphoreHandle_t;
+
+void * pvPortMalloc(size_t xSize);
+void vPortFree(void * pv);
+
+#endif
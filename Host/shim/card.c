@@ -0,0 +1,210 @@
+//------------------------------------------------------------------------------------
+// Host stand-ins for the card modules the FTP server calls into: globals of
+// main.c, the eMMC set up of fatfs.c, and PMIC, Bluetooth, flash and log calls.
+// The file system is a partitioned file image laid out like the eMMC.
+//------------------------------------------------------------------------------------
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "main.h"
+#include "pmic.h"
+#include "slog.h"
+#include "image_diskio.h"
+#include "card.h"
+
+sDEVICE_SETTINGS Settings = { FTP_INACTIVITY_TO_DEFAULT,        // FTP_InactivityTimeout
+                              FTP_AUTHENTICATION_TO_DEFAULT,    // FTP_AuthenticationTimeout
+                              921600L,                          // BTBaudRate
+                              BT_DISC_TIME_DEFAULT,             // BT_DiscoveryTime
+                              0,                                // BT_DisconnectOnVUSB
+                              FACE_THRESHOLD_DEFAULT,           // Face_MatchThreshold
+                              ADV_INTERVAL_MIN_DEFAULT,         // Min BLE Advertising interval
+                              ADV_INTERVAL_MAX_DEFAULT,         // Max BLE Advertising interval
+                              SPP_SEND_TIMEOUT_DEFAULT,         // Max SPP send timeout
+                              SPP_RECEIVE_TIMEOUT_DEFAULT,      // Max SPP receive timeout
+                              ADV_ENABLED,                      // Is BLE Advertising enabled?
+                              LE_TRANSFER_INTERVAL_DEFAULT,     // LE connection interval during transfers
+                              LE_IDLE_INTERVAL_DEFAULT,         // LE connection interval when idle
+                              LE_IDLE_TIMEOUT_DEFAULT};         // Idle time before the slow interval
+
+int FTPAbort = FALSE;
+int FTPAborted = FALSE;
+int FTPLocked = FALSE;          // No templates enrolled on a fresh image
+int FTPActivity = 0;
+int BTActivity = 0;
+uint8_t PMICStatus = PMIC_STAT_CHDET;
+int SPPOpened = TRUE;
+
+sFLASH_PARAM RamParam;
+static const uint8_t BootloaderVersion[2] = {1, 0};  // A 32k bootloader
+const uint8_t* pBootloaderMajeur = &BootloaderVersion[0];
+const uint8_t* pBootloaderMineur = &BootloaderVersion[1];
+
+char SD_Path0[4];
+char SD_Path1[4];
+PARTITION VolToPart[] = {{0,1},         /* Logical drive 0 ==> Physical drive 0, 1st partition */
+                         {0,2}};        /* Logical drive 1 ==> Physical drive 0, 2nd partition */
+
+int CardLog;
+
+//------------------------------------------------------------------------------------
+// Log to stderr when CardLog is set.
+//------------------------------------------------------------------------------------
+void slogf(int logDest, const char* format, ...)
+{
+    va_list args;
+
+    if (!CardLog || format[0] == 0){
+        return;
+    }
+    va_start(args, format);
+    vfprintf(stderr, format, args);
+    va_end(args);
+    fputc('\n', stderr);
+}
+
+//------------------------------------------------------------------------------------
+// Open the image and mount both volumes.  With Format set the image is
+// partitioned like the eMMC and both volumes are created empty.
+//------------------------------------------------------------------------------------
+static FATFS CardFatFs[2];
+
+FRESULT CardMount(const char * Image, DWORD Sectors, int Format)
+{
+    static BYTE Work[_MAX_SS];
+    DWORD plist[] = {90, 10, 0, 0};     // Percent of the image, vault and license
+    FRESULT res;
+
+    if (IMAGE_Open(Image, Sectors) != 0){
+        return FR_NOT_READY;
+    }
+    if (SD_Path0[0] == 0){
+        FATFS_LinkDriver(&IMAGE_Driver, SD_Path0);
+        FATFS_LinkDriver(&IMAGE_Driver, SD_Path1);
+    }
+    disk_initialize(0);
+
+    if (Format){
+        res = f_fdisk(0, plist, Work);
+        if (res == FR_OK){
+            res = f_mount(&CardFatFs[0], SD_Path0, 0);
+        }
+        if (res == FR_OK){
+            res = f_mkfs(SD_Path0, 0, 0);
+        }
+        if (res == FR_OK){
+            res = f_mount(&CardFatFs[1], SD_Path1, 0);
+        }
+        if (res == FR_OK){
+            res = f_mkfs(SD_Path1, 0, 0);
+        }
+        if (res != FR_OK){
+            return res;
+        }
+    }
+
+    res = f_mount(&CardFatFs[0], SD_Path0, 1);
+    if (res == FR_OK){
+        res = f_mount(&CardFatFs[1], SD_Path1, 1);
+    }
+    if (res == FR_OK && Format){
+        f_mkdir(VAULT_DATA_PATH);
+        f_mkdir(DEVICE_PATH);
+        f_mkdir(AUTH_PATH);
+        f_mkdir(AUTH_FACE_PATH);
+        f_mkdir(AUTH_RECOVERY_CODE_PATH);
+        f_mkdir(PASSWORD_VAULT_PATH);
+        f_mkdir(LICENSE_PATH);
+    }
+    return res;
+}
+
+void CardUnmount(void)
+{
+    f_mount(NULL, SD_Path0, 0);
+    f_mount(NULL, SD_Path1, 0);
+    IMAGE_Close();
+}
+
+//------------------------------------------------------------------------------------
+// The image is mounted by CardMount before FTPThread starts.
+//------------------------------------------------------------------------------------
+uint8_t MX_FATFS_Init(void)
+{
+    return FR_OK;
+}
+
+void PMICGetDeviceSettings(void)
+{
+}
+
+int PMICSetBoardOff(void)
+{
+    return 0;
+}
+
+int PMICStartFactoryReset(void)
+{
+    return 0;
+}
+
+int ADC_Bat_GetVal(int * val)
+{
+    *val = ADC_BAT_LEVEL_100;
+    return 0;
+}
+
+int ADC_Bat_GetPercent()
+{
+    return 100;
+}
+
+HAL_StatusTypeDef RTC_InitTime(void)
+{
+    return HAL_OK;
+}
+
+void HAL_NVIC_SystemReset(void)
+{
+    fprintf(stderr, "Card reset requested\n");
+    exit(2);
+}
+
+void FLASH_If_SaveParam(void)
+{
+}
+
+void AdvertiseLockStatus(int locked)
+{
+}
+
+//------------------------------------------------------------------------------------
+// No Bluetooth stack on the host, there are no link keys.
+//------------------------------------------------------------------------------------
+int GetLinkedKey(BD_ADDR_t BTAdd, LinkKeyInfo_t* pKey)
+{
+    return 0;
+}
+
+int AddLinkedKey(LinkKeyInfo_t * pKeyInfo)
+{
+    return FR_DENIED;
+}
+
+int DeleteLinkKey(BD_ADDR_t BD_ADDR)
+{
+    return -1;
+}
+
+LinkKeyInfo_t *ReturnAllLinkedKey(int *len)
+{
+    *len = 0;
+    return NULL;
+}
+
+enum NStatusCodes NFaceMatch(const void * probeBuff, int32_t probeLength, const void * templateBuff, int32_t templateLength, int32_t matchThreshold)
+{
+    return NST_ERROR;
+}
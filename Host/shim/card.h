@@ -0,0 +1,14 @@
+//------------------------------------------------------------------------------------
+// Host stand-ins for the card, see card.c.
+//------------------------------------------------------------------------------------
+#ifndef _CARD_H
+#define _CARD_H
+
+#include "ff.h"
+
+extern int CardLog;             // Print the card log on stderr
+
+FRESULT CardMount(const char * Image, DWORD Sectors, int Format);
+void CardUnmount(void);
+
+#endif
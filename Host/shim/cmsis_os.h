@@ -0,0 +1,67 @@
+//------------------------------------------------------------------------------------
+// Host stand in for the CMSIS-RTOS API, the subset the firmware uses.  See os.c.
+//------------------------------------------------------------------------------------
+#ifndef _CMSIS_OS_H
+#define _CMSIS_OS_H
+
+#include "FreeRTOS.h"
+#include "semphr.h"
+#include "task.h"
+
+#define osWaitForever           0xFFFFFFFF
+
+typedef enum {
+  osPriorityIdle = -3,
+  osPriorityLow = -2,
+  osPriorityBelowNormal = -1,
+  osPriorityNormal = 0,
+  osPriorityAboveNormal = 1,
+  osPriorityHigh = 2,
+  osPriorityRealtime = 3,
+} osPriority;
+
+typedef enum {
+  osOK = 0,
+  osEventTimeout = 0x40,
+  osErrorOS = 0xFF,
+} osStatus;
+
+typedef void (*os_pthread)(void const *argument);
+typedef TaskHandle_t osThreadId;
+typedef SemaphoreHandle_t osSemaphoreId;
+
+typedef struct os_thread_def {
+  char *name;
+  os_pthread pthread;
+  osPriority tpriority;
+  uint32_t instances;
+  uint32_t stacksize;
+} osThreadDef_t;
+
+typedef struct os_semaphore_def {
+  uint32_t dummy;
+} osSemaphoreDef_t;
+
+#define osThreadDef(name, thread, priority, instances, stacksz)  \
+const osThreadDef_t os_thread_def_##name = \
+{ #name, (thread), (priority), (instances), (stacksz) }
+#define osThread(name)          &os_thread_def_##name
+
+#define osSemaphoreDef(name)    \
+const osSemaphoreDef_t os_semaphore_def_##name = { 0 }
+#define osSemaphore(name)       &os_semaphore_def_##name
+
+osThreadId osThreadCreate(const osThreadDef_t *thread_def, void *argument);
+osThreadId osThreadGetId(void);
+osStatus osThreadYield(void);
+osStatus osThreadSuspendAll(void);
+osStatus osThreadResumeAll(void);
+osStatus osDelay(uint32_t millisec);
+uint32_t osKernelSysTick(void);
+
+osSemaphoreId osSemaphoreCreate(const osSemaphoreDef_t *semaphore_def, int32_t count);
+int32_t osSemaphoreWait(osSemaphoreId semaphore_id, uint32_t millisec);
+osStatus osSemaphoreRelease(osSemaphoreId semaphore_id);
+osStatus osSemaphoreDelete(osSemaphoreId semaphore_id);
+
+#endif
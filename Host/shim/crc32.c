@@ -0,0 +1,32 @@
+//------------------------------------------------------------------------------------
+// CRC-32 (the zlib/PKZIP polynomial) in software, stands in for the CRC unit
+// driver Src/FTPd/crc32.c on the host.
+//------------------------------------------------------------------------------------
+#include "crc32.h"
+
+#define CRC32_POLY_REFLECTED    0xEDB88320
+
+static uint32_t Crc32Value;
+
+void Crc32Start(void)
+{
+    Crc32Value = 0xFFFFFFFF;
+}
+
+void Crc32Feed(const void * Data, uint32_t Len)
+{
+    const uint8_t * p = (const uint8_t *)Data;
+    int a;
+
+    while(Len--){
+        Crc32Value ^= *p++;
+        for(a=0;a<8;a++){
+            Crc32Value = (Crc32Value >> 1) ^ (CRC32_POLY_REFLECTED & (0 - (Crc32Value & 1)));
+        }
+    }
+}
+
+uint32_t Crc32End(void)
+{
+    return ~Crc32Value;
+}
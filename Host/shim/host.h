@@ -0,0 +1,22 @@
+//------------------------------------------------------------------------------------
+// Host build configuration, included ahead of every firmware source (-include).
+//
+// FatFs needs its DWORD/LONG to be 32 bit, integer.h uses long which is 64 bit
+// on a 64 bit host.
+//------------------------------------------------------------------------------------
+#ifndef _HOST_H
+#define _HOST_H
+
+#include <stdint.h>
+
+#define _FF_INTEGER
+typedef unsigned char   BYTE;
+typedef short           SHORT;
+typedef unsigned short  WORD;
+typedef unsigned short  WCHAR;
+typedef int             INT;
+typedef unsigned int    UINT;
+typedef int32_t         LONG;
+typedef uint32_t        DWORD;
+
+#endif
@@ -0,0 +1,204 @@
+/**
+  ******************************************************************************
+  * @file    image_diskio.c
+  * @brief   File image disk I/O driver for the host build.
+  *
+  *          Backs FatFs physical drive 0 with a file so the FTP server runs
+  *          against the same partition layout as the eMMC:
+  *
+  *            IMAGE_Open("card.img", Sectors);
+  *            FATFS_LinkDriver(&IMAGE_Driver, SD_Path0);
+  *
+  *          Sector operations are counted by disk_read/disk_write like on
+  *          the card, see disk_get_stats().
+  ******************************************************************************
+  */
+
+/* Includes ------------------------------------------------------------------*/
+#include <fcntl.h>
+#include <unistd.h>
+#include "ff_gen_drv.h"
+#include "image_diskio.h"
+
+/* Private define ------------------------------------------------------------*/
+/* Block Size in Bytes */
+#define BLOCK_SIZE                512
+
+/* Erase block size in blocks reported to f_mkfs */
+#define IMAGE_ERASE_BLOCK_SIZE    8
+
+/* Private variables ---------------------------------------------------------*/
+/* Disk status */
+static volatile DSTATUS Stat = STA_NOINIT;
+
+/* Image file and its size in blocks */
+static int ImageFd = -1;
+static DWORD ImageBlocks;
+
+/* Private function prototypes -----------------------------------------------*/
+DSTATUS IMAGE_initialize (BYTE);
+DSTATUS IMAGE_deinitialize (BYTE);
+DSTATUS IMAGE_status (BYTE);
+DRESULT IMAGE_read (BYTE, BYTE*, DWORD, UINT);
+DRESULT IMAGE_write (BYTE, const BYTE*, DWORD, UINT);
+DRESULT IMAGE_ioctl (BYTE, BYTE, void*);
+
+Diskio_drvTypeDef  IMAGE_Driver =
+{
+  IMAGE_initialize,
+  IMAGE_deinitialize,
+  IMAGE_status,
+  IMAGE_read,
+  IMAGE_write,
+  IMAGE_ioctl,
+};
+
+/**
+  * @brief  Opens the image file, creating it when missing
+  * @param  path: Image file name
+  * @param  blocks: Image size in blocks
+  * @retval 0 on success, -1 if the file cannot be opened
+  */
+int IMAGE_Open(const char *path, DWORD blocks)
+{
+  IMAGE_Close();
+  ImageFd = open(path, O_RDWR | O_CREAT, 0644);
+  if (ImageFd < 0) return -1;
+  if (ftruncate(ImageFd, (off_t)blocks * BLOCK_SIZE) != 0)
+  {
+    IMAGE_Close();
+    return -1;
+  }
+  ImageBlocks = blocks;
+  return 0;
+}
+
+/**
+  * @brief  Closes the image file
+  * @retval None
+  */
+void IMAGE_Close(void)
+{
+  if (ImageFd >= 0) close(ImageFd);
+  ImageFd = -1;
+  Stat = STA_NOINIT;
+}
+
+/* Private functions ---------------------------------------------------------*/
+
+/**
+  * @brief  Initializes a Drive
+  * @param  lun : not used
+  * @retval DSTATUS: Operation status
+  */
+DSTATUS IMAGE_initialize(BYTE lun)
+{
+  if (ImageFd >= 0) Stat &= ~STA_NOINIT;
+  return Stat;
+}
+
+/**
+  * @brief  Deinitializes a Drive, the image stays open
+  * @param  lun : not used
+  * @retval DSTATUS: Operation status
+  */
+DSTATUS IMAGE_deinitialize(BYTE lun)
+{
+  Stat = STA_NOINIT;
+  return Stat;
+}
+
+/**
+  * @brief  Gets Disk Status
+  * @param  lun : not used
+  * @retval DSTATUS: Operation status
+  */
+DSTATUS IMAGE_status(BYTE lun)
+{
+  return Stat;
+}
+
+/**
+  * @brief  Reads Sector(s)
+  * @param  lun : not used
+  * @param  *buff: Data buffer to store read data
+  * @param  sector: Sector address (LBA)
+  * @param  count: Number of sectors to read
+  * @retval DRESULT: Operation result
+  */
+DRESULT IMAGE_read(BYTE lun, BYTE *buff, DWORD sector, UINT count)
+{
+  size_t len = (size_t)count * BLOCK_SIZE;
+
+  if (Stat & STA_NOINIT) return RES_NOTRDY;
+  if ((sector + count) > ImageBlocks) return RES_PARERR;
+
+  if (pread(ImageFd, buff, len, (off_t)sector * BLOCK_SIZE) != (ssize_t)len) return RES_ERROR;
+
+  return RES_OK;
+}
+
+/**
+  * @brief  Writes Sector(s)
+  * @param  lun : not used
+  * @param  *buff: Data to be written
+  * @param  sector: Sector address (LBA)
+  * @param  count: Number of sectors to write
+  * @retval DRESULT: Operation result
+  */
+DRESULT IMAGE_write(BYTE lun, const BYTE *buff, DWORD sector, UINT count)
+{
+  size_t len = (size_t)count * BLOCK_SIZE;
+
+  if (Stat & STA_NOINIT) return RES_NOTRDY;
+  if ((sector + count) > ImageBlocks) return RES_PARERR;
+
+  if (pwrite(ImageFd, buff, len, (off_t)sector * BLOCK_SIZE) != (ssize_t)len) return RES_ERROR;
+
+  return RES_OK;
+}
+
+/**
+  * @brief  I/O control operation
+  * @param  lun : not used
+  * @param  cmd: Control code
+  * @param  *buff: Buffer to send/receive control data
+  * @retval DRESULT: Operation result
+  */
+DRESULT IMAGE_ioctl(BYTE lun, BYTE cmd, void *buff)
+{
+  DRESULT res = RES_ERROR;
+
+  if (Stat & STA_NOINIT) return RES_NOTRDY;
+
+  switch (cmd)
+  {
+  /* Make sure that no pending write process */
+  case CTRL_SYNC :
+    res = RES_OK;
+    break;
+
+  /* Get number of sectors on the disk (DWORD) */
+  case GET_SECTOR_COUNT :
+    *(DWORD*)buff = ImageBlocks;
+    res = RES_OK;
+    break;
+
+  /* Get R/W sector size (WORD) */
+  case GET_SECTOR_SIZE :
+    *(WORD*)buff = BLOCK_SIZE;
+    res = RES_OK;
+    break;
+
+  /* Get erase block size in unit of sector (DWORD) */
+  case GET_BLOCK_SIZE :
+    *(DWORD*)buff = IMAGE_ERASE_BLOCK_SIZE;
+    res = RES_OK;
+    break;
+
+  default:
+    res = RES_PARERR;
+  }
+
+  return res;
+}
@@ -0,0 +1,21 @@
+/**
+  ******************************************************************************
+  * @file    image_diskio.h
+  * @brief   Header for image_diskio.c module
+  ******************************************************************************
+  */
+
+/* Define to prevent recursive inclusion -------------------------------------*/
+#ifndef __IMAGE_DISKIO_H
+#define __IMAGE_DISKIO_H
+
+/* Includes ------------------------------------------------------------------*/
+#include "ff_gen_drv.h"
+
+/* Exported functions ------------------------------------------------------- */
+extern Diskio_drvTypeDef  IMAGE_Driver;
+
+int IMAGE_Open(const char *path, DWORD blocks);
+void IMAGE_Close(void);
+
+#endif /* __IMAGE_DISKIO_H */
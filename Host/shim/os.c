@@ -0,0 +1,302 @@
+//------------------------------------------------------------------------------------
+// Host implementation of the FreeRTOS and CMSIS-RTOS calls the firmware makes, on
+// POSIX threads.
+//
+// Every thread gets a task record on first use, it holds the notification count
+// of the task.  Semaphores are counting semaphores, a mutex is one that starts at
+// one.  Ticks are milliseconds of CLOCK_MONOTONIC since the first call, the card
+// runs a 1 ms tick too.
+//------------------------------------------------------------------------------------
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "cmsis_os.h"
+#include "stm32f4xx_hal.h"
+
+struct HostTask_s {
+    pthread_mutex_t Lock;
+    pthread_cond_t Cond;
+    uint32_t NotifyCount;
+    os_pthread Entry;
+    void *Argument;
+};
+
+struct HostSem_s {
+    pthread_mutex_t Lock;
+    pthread_cond_t Cond;
+    int32_t Count;
+};
+
+static __thread struct HostTask_s *CurrentTask;
+static struct timespec StartTime;
+static pthread_once_t StartOnce = PTHREAD_ONCE_INIT;
+
+static void RecordStart(void)
+{
+    clock_gettime(CLOCK_MONOTONIC, &StartTime);
+}
+
+//------------------------------------------------------------------------------------
+// Absolute CLOCK_MONOTONIC time Ticks from now, for the timed waits.
+//------------------------------------------------------------------------------------
+static void Deadline(struct timespec *ts, TickType_t Ticks)
+{
+    clock_gettime(CLOCK_MONOTONIC, ts);
+    ts->tv_sec += Ticks / 1000;
+    ts->tv_nsec += (long)(Ticks % 1000) * 1000000L;
+    if (ts->tv_nsec >= 1000000000L){
+        ts->tv_sec++;
+        ts->tv_nsec -= 1000000000L;
+    }
+}
+
+static void InitCond(pthread_cond_t *Cond)
+{
+    pthread_condattr_t Attr;
+
+    pthread_condattr_init(&Attr);
+    pthread_condattr_setclock(&Attr, CLOCK_MONOTONIC);
+    pthread_cond_init(Cond, &Attr);
+    pthread_condattr_destroy(&Attr);
+}
+
+static struct HostTask_s * NewTask(void)
+{
+    struct HostTask_s *pTask = calloc(1, sizeof(*pTask));
+
+    pthread_mutex_init(&pTask->Lock, NULL);
+    InitCond(&pTask->Cond);
+    return pTask;
+}
+
+TickType_t xTaskGetTickCount(void)
+{
+    struct timespec Now;
+
+    pthread_once(&StartOnce, RecordStart);
+    clock_gettime(CLOCK_MONOTONIC, &Now);
+    return (TickType_t)((Now.tv_sec - StartTime.tv_sec) * 1000
+                        + (Now.tv_nsec - StartTime.tv_nsec) / 1000000L);
+}
+
+uint32_t osKernelSysTick(void)
+{
+    return xTaskGetTickCount();
+}
+
+uint32_t HAL_GetTick(void)
+{
+    return xTaskGetTickCount();
+}
+
+TaskHandle_t xTaskGetCurrentTaskHandle(void)
+{
+    if (CurrentTask == NULL){
+        CurrentTask = NewTask();
+    }
+    return CurrentTask;
+}
+
+osThreadId osThreadGetId(void)
+{
+    return xTaskGetCurrentTaskHandle();
+}
+
+osStatus osThreadYield(void)
+{
+    sched_yield();
+    return osOK;
+}
+
+osStatus osDelay(uint32_t millisec)
+{
+    struct timespec ts;
+
+    ts.tv_sec = millisec / 1000;
+    ts.tv_nsec = (long)(millisec % 1000) * 1000000L;
+    while (nanosleep(&ts, &ts) && errno == EINTR){
+    }
+    return osOK;
+}
+
+//------------------------------------------------------------------------------------
+// Suspending the scheduler keeps the other tasks out of the code in between,
+// a lock that the tasks calling osThreadSuspendAll share does the same here.
+//------------------------------------------------------------------------------------
+static pthread_mutex_t SchedulerLock = PTHREAD_MUTEX_INITIALIZER;
+
+osStatus osThreadSuspendAll(void)
+{
+    pthread_mutex_lock(&SchedulerLock);
+    return osOK;
+}
+
+osStatus osThreadResumeAll(void)
+{
+    pthread_mutex_unlock(&SchedulerLock);
+    return osOK;
+}
+
+static void * TaskEntry(void *Arg)
+{
+    CurrentTask = Arg;
+    CurrentTask->Entry(CurrentTask->Argument);
+    return NULL;
+}
+
+osThreadId osThreadCreate(const osThreadDef_t *thread_def, void *argument)
+{
+    struct HostTask_s *pTask = NewTask();
+    pthread_t Thread;
+
+    pTask->Entry = thread_def->pthread;
+    pTask->Argument = argument;
+    if (pthread_create(&Thread, NULL, TaskEntry, pTask)){
+        free(pTask);
+        return NULL;
+    }
+    pthread_detach(Thread);
+    return pTask;
+}
+
+BaseType_t xTaskNotifyGive(TaskHandle_t xTaskToNotify)
+{
+    pthread_mutex_lock(&xTaskToNotify->Lock);
+    xTaskToNotify->NotifyCount++;
+    pthread_cond_signal(&xTaskToNotify->Cond);
+    pthread_mutex_unlock(&xTaskToNotify->Lock);
+    return pdPASS;
+}
+
+uint32_t ulTaskNotifyTake(BaseType_t xClearCountOnExit, TickType_t xTicksToWait)
+{
+    struct HostTask_s *pTask = xTaskGetCurrentTaskHandle();
+    struct timespec ts;
+    uint32_t Count;
+
+    Deadline(&ts, xTicksToWait);
+    pthread_mutex_lock(&pTask->Lock);
+    while (pTask->NotifyCount == 0 && xTicksToWait){
+        if (xTicksToWait != portMAX_DELAY){
+            if (pthread_cond_timedwait(&pTask->Cond, &pTask->Lock, &ts) == ETIMEDOUT){
+                break;
+            }
+        }else{
+            pthread_cond_wait(&pTask->Cond, &pTask->Lock);
+        }
+    }
+    Count = pTask->NotifyCount;
+    if (Count){
+        pTask->NotifyCount = xClearCountOnExit ? 0 : Count - 1;
+    }
+    pthread_mutex_unlock(&pTask->Lock);
+    return Count;
+}
+
+//------------------------------------------------------------------------------------
+// Semaphores
+//------------------------------------------------------------------------------------
+static SemaphoreHandle_t NewSemaphore(int32_t Count)
+{
+    SemaphoreHandle_t pSem = calloc(1, sizeof(*pSem));
+
+    pthread_mutex_init(&pSem->Lock, NULL);
+    InitCond(&pSem->Cond);
+    pSem->Count = Count;
+    return pSem;
+}
+
+static BaseType_t SemaphoreTake(SemaphoreHandle_t pSem, TickType_t Ticks)
+{
+    struct timespec ts;
+    BaseType_t Taken = pdFALSE;
+
+    Deadline(&ts, Ticks);
+    pthread_mutex_lock(&pSem->Lock);
+    while (pSem->Count == 0 && Ticks){
+        if (Ticks != portMAX_DELAY){
+            if (pthread_cond_timedwait(&pSem->Cond, &pSem->Lock, &ts) == ETIMEDOUT){
+                break;
+            }
+        }else{
+            pthread_cond_wait(&pSem->Cond, &pSem->Lock);
+        }
+    }
+    if (pSem->Count){
+        pSem->Count--;
+        Taken = pdTRUE;
+    }
+    pthread_mutex_unlock(&pSem->Lock);
+    return Taken;
+}
+
+static void SemaphoreGive(SemaphoreHandle_t pSem)
+{
+    pthread_mutex_lock(&pSem->Lock);
+    pSem->Count++;
+    pthread_cond_signal(&pSem->Cond);
+    pthread_mutex_unlock(&pSem->Lock);
+}
+
+static void SemaphoreDelete(SemaphoreHandle_t pSem)
+{
+    pthread_cond_destroy(&pSem->Cond);
+    pthread_mutex_destroy(&pSem->Lock);
+    free(pSem);
+}
+
+SemaphoreHandle_t xSemaphoreCreateMutex(void)
+{
+    return NewSemaphore(1);
+}
+
+BaseType_t xSemaphoreTake(SemaphoreHandle_t xSemaphore, TickType_t xTicksToWait)
+{
+    return SemaphoreTake(xSemaphore, xTicksToWait);
+}
+
+BaseType_t xSemaphoreGive(SemaphoreHandle_t xSemaphore)
+{
+    SemaphoreGive(xSemaphore);
+    return pdTRUE;
+}
+
+void vSemaphoreDelete(SemaphoreHandle_t xSemaphore)
+{
+    SemaphoreDelete(xSemaphore);
+}
+
+osSemaphoreId osSemaphoreCreate(const osSemaphoreDef_t *semaphore_def, int32_t count)
+{
+    return NewSemaphore(count);
+}
+
+int32_t osSemaphoreWait(osSemaphoreId semaphore_id, uint32_t millisec)
+{
+    return SemaphoreTake(semaphore_id, millisec) ? osOK : osEventTimeout;
+}
+
+osStatus osSemaphoreRelease(osSemaphoreId semaphore_id)
+{
+    SemaphoreGive(semaphore_id);
+    return osOK;
+}
+
+osStatus osSemaphoreDelete(osSemaphoreId semaphore_id)
+{
+    SemaphoreDelete(semaphore_id);
+    return osOK;
+}
+
+void * pvPortMalloc(size_t xSize)
+{
+    return malloc(xSize);
+}
+
+void vPortFree(void *pv)
+{
+    free(pv);
+}
@@ -0,0 +1,11 @@
+//------------------------------------------------------------------------------------
+// Host stand in for the evaluation board BSP.
+//------------------------------------------------------------------------------------
+#ifndef __STM324xG_EVAL_H
+#define __STM324xG_EVAL_H
+
+#include "stm32f4xx_hal.h"
+
+typedef enum { LED1 = 0, LED2, LED3, LED4, LED_RED, LED_YELLOW } Led_TypeDef;
+
+#endif
@@ -0,0 +1,9 @@
+//------------------------------------------------------------------------------------
+// Host stand in for the evaluation board SD BSP.
+//------------------------------------------------------------------------------------
+#ifndef __STM324xG_EVAL_SD_H
+#define __STM324xG_EVAL_SD_H
+
+#include "stm32f4xx_hal.h"
+
+#endif
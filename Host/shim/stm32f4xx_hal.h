@@ -0,0 +1,37 @@
+//------------------------------------------------------------------------------------
+// Host stand in for the STM32F4 HAL, the types the firmware headers name and the
+// few calls the host built modules make.
+//------------------------------------------------------------------------------------
+#ifndef __STM32F4xx_HAL_H
+#define __STM32F4xx_HAL_H
+
+#include <stdint.h>
+#include <assert.h>
+
+#define __IO                    volatile
+#define __weak                  __attribute__((weak))
+
+#define assert_param(expr)      assert(expr)
+
+typedef enum {
+  HAL_OK = 0x00,
+  HAL_ERROR = 0x01,
+  HAL_BUSY = 0x02,
+  HAL_TIMEOUT = 0x03
+} HAL_StatusTypeDef;
+
+typedef struct { uint8_t WeekDay; uint8_t Month; uint8_t Date; uint8_t Year; } RTC_DateTypeDef;
+typedef struct { uint8_t Hours; uint8_t Minutes; uint8_t Seconds; uint8_t TimeFormat;
+                 uint32_t SubSeconds; } RTC_TimeTypeDef;
+typedef struct { int Instance; } UART_HandleTypeDef;
+typedef struct { int Instance; } I2C_HandleTypeDef;
+
+#define GPIO_PIN_0              ((uint16_t)0x0001)
+#define GPIO_PIN_1              ((uint16_t)0x0002)
+#define GPIO_PIN_2              ((uint16_t)0x0004)
+#define GPIO_PIN_3              ((uint16_t)0x0008)
+
+uint32_t HAL_GetTick(void);
+void HAL_NVIC_SystemReset(void);
+
+#endif
@@ -0,0 +1,4 @@
+//------------------------------------------------------------------------------------
+// Host stand in for the HAL ADC driver header.
+//------------------------------------------------------------------------------------
+#include "stm32f4xx_hal.h"
@@ -0,0 +1,11 @@
+//------------------------------------------------------------------------------------
+// Host stand in for the USB CDC class, there is no USB on the host.
+//------------------------------------------------------------------------------------
+#ifndef __USB_CDC_H
+#define __USB_CDC_H
+
+#include "usbd_def.h"
+
+typedef struct { int dummy; } USBD_CDC_ItfTypeDef;
+
+#endif
@@ -0,0 +1,12 @@
+//------------------------------------------------------------------------------------
+// Host stand in for the USB device library, there is no USB on the host.
+//------------------------------------------------------------------------------------
+#ifndef __USBD_DEF_H
+#define __USBD_DEF_H
+
+#include <stdint.h>
+
+typedef struct { int dev_state; } USBD_HandleTypeDef;
+typedef struct { int dummy; } USBD_DescriptorsTypeDef;
+
+#endif
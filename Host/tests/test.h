@@ -0,0 +1,29 @@
+//------------------------------------------------------------------------------------
+// Minimal test helpers for the host unit tests.  CHECK() records a failure and
+// carries on, TEST_RESULT() is returned from main.
+//------------------------------------------------------------------------------------
+#ifndef _TEST_H
+#define _TEST_H
+
+#include <stdio.h>
+
+static int TestFailures;
+
+#define CHECK(c) do{ \
+    if (!(c)){ \
+        printf("%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #c); \
+        TestFailures++; \
+    } \
+}while(0)
+
+#define CHECK_EQ(a, b) do{ \
+    unsigned long _a = (unsigned long)(a), _b = (unsigned long)(b); \
+    if (_a != _b){ \
+        printf("%s:%d: %s == %lu, expected %lu\n", __FILE__, __LINE__, #a, _a, _b); \
+        TestFailures++; \
+    } \
+}while(0)
+
+#define TEST_RESULT() (printf("%s\n", TestFailures ? "FAILED" : "OK"), TestFailures ? 1 : 0)
+
+#endif
@@ -0,0 +1,89 @@
+//------------------------------------------------------------------------------------
+// Unit test of the advertising discovery and duty cycle figures (Src/AdvTiming.c),
+// checked against a simulated continuously scanning central.
+//------------------------------------------------------------------------------------
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "test.h"
+#include "AdvTiming.h"
+
+#define SIM_EVENTS      200000
+#define SIM_SCANS       200000
+
+//------------------------------------------------------------------------------------
+// Advertise SIM_EVENTS events Interval ms apart plus a random 0-10 ms delay, start
+// scans at random times and return the mean wait for the next event, in ms.
+//------------------------------------------------------------------------------------
+static double SimulateDiscovery(uint16_t Interval)
+{
+    static double Events[SIM_EVENTS];
+    double Now = 0, Start, Wait = 0;
+    int a, Lo, Hi, Mid;
+
+    srand(Interval);
+    for (a=0;a<SIM_EVENTS;a++){
+        Now += Interval + (ADV_TIMING_DELAY_MAX_MS * (double)rand()) / RAND_MAX;
+        Events[a] = Now;
+    }
+    for (a=0;a<SIM_SCANS;a++){
+        Start = (Events[SIM_EVENTS - 2] * (double)rand()) / RAND_MAX;
+        Lo = 0;
+        Hi = SIM_EVENTS - 1;
+        while (Lo < Hi){
+            Mid = (Lo + Hi) / 2;
+            if (Events[Mid] < Start){
+                Lo = Mid + 1;
+            }else{
+                Hi = Mid;
+            }
+        }
+        Wait += Events[Lo] - Start;
+    }
+    return Wait / SIM_SCANS;
+}
+
+//------------------------------------------------------------------------------------
+// The mean wait is about half the spacing of the events, not the whole interval.
+//------------------------------------------------------------------------------------
+static void TestDiscoveryMean(void)
+{
+    static const uint16_t Intervals[] = {20, 30, 152, 211, 1000, 10240};
+    double Simulated;
+    int a;
+
+    for (a=0;a<sizeof(Intervals)/sizeof(Intervals[0]);a++){
+        Simulated = SimulateDiscovery(Intervals[a]);
+        CHECK(AdvTimingDiscoveryMean(Intervals[a]) >= Simulated * 0.98 - 1);
+        CHECK(AdvTimingDiscoveryMean(Intervals[a]) <= Simulated * 1.02 + 1);
+    }
+
+    // The delay adds its variance: 20 ms events are 25 ms apart on average
+    CHECK_EQ(AdvTimingDiscoveryMean(20), 13);
+    CHECK_EQ(AdvTimingDiscoveryMean(1000), 503);
+}
+
+static void TestDiscoveryMax(void)
+{
+    CHECK_EQ(AdvTimingDiscoveryMax(20), 30);
+    CHECK_EQ(AdvTimingDiscoveryMax(211), 221);
+}
+
+//------------------------------------------------------------------------------------
+// Duty cycle in 1/100 %: the event length over the mean spacing.
+//------------------------------------------------------------------------------------
+static void TestDuty(void)
+{
+    CHECK_EQ(AdvTimingSpacing(20), 25000);
+    CHECK_EQ(AdvTimingDuty(1500, 20), 600);
+    CHECK_EQ(AdvTimingDuty(1500, 152), 95);
+    CHECK_EQ(AdvTimingDuty(1500, 10240), 1);
+}
+
+int main(void)
+{
+    TestDiscoveryMean();
+    TestDiscoveryMax();
+    TestDuty();
+    return TEST_RESULT();
+}
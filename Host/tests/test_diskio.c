@@ -0,0 +1,168 @@
+//------------------------------------------------------------------------------------
+// Unit test of the sector operation counters of the disk layer (diskio.c), on the
+// RAM disk and the file image drivers.
+//------------------------------------------------------------------------------------
+#include <string.h>
+#include <unistd.h>
+
+#include "test.h"
+#include "cmsis_os.h"
+#include "ff_gen_drv.h"
+#include "image_diskio.h"
+#include "ramdisk_diskio.h"
+
+#define IMAGE_NAME      "test_diskio.img"
+#define IMAGE_BLOCKS    256
+#define FILE_SIZE       2048
+
+// One volume per drive, no partition table
+PARTITION VolToPart[] = {{0,0}, {1,0}};
+
+static char DrivePath[2][4];
+static BYTE Sector[4 * 512];
+static BYTE Back[4 * 512];
+
+//------------------------------------------------------------------------------------
+// Each call is counted once with its sectors, for the drive and the task.
+//------------------------------------------------------------------------------------
+static void TestCounts(BYTE Drive)
+{
+    DISKIO_STATS Task, Total;
+    int a;
+
+    for (a=0;a<sizeof(Sector);a++){
+        Sector[a] = (BYTE)(a * 3 + Drive);
+    }
+    memset(&Task, 0, sizeof(Task));
+    disk_reset_stats(Drive);
+    CHECK_EQ(disk_stats_attach(&Task), 0);
+
+    CHECK_EQ(disk_write(Drive, Sector, 10, 1), RES_OK);
+    CHECK_EQ(disk_write(Drive, Sector, 11, 4), RES_OK);
+    CHECK_EQ(disk_read(Drive, Back, 11, 4), RES_OK);
+    CHECK(memcmp(Back, Sector, sizeof(Sector)) == 0);
+
+    disk_get_stats(Drive, &Total);
+    CHECK_EQ(Total.WriteOps, 2);
+    CHECK_EQ(Total.WriteSectors, 5);
+    CHECK_EQ(Total.ReadOps, 1);
+    CHECK_EQ(Total.ReadSectors, 4);
+    CHECK(memcmp(&Task, &Total, sizeof(Task)) == 0);
+
+    // Out of range, still one call
+    CHECK_EQ(disk_read(Drive, Back, IMAGE_BLOCKS * 4, 1), RES_PARERR);
+    CHECK_EQ(Task.ReadOps, 2);
+
+    // Detached, only the drive counts
+    CHECK_EQ(disk_stats_attach(NULL), 0);
+    CHECK_EQ(disk_read(Drive, Back, 0, 2), RES_OK);
+    CHECK_EQ(Task.ReadSectors, 5);
+    disk_get_stats(Drive, &Total);
+    CHECK_EQ(Total.ReadSectors, 7);
+}
+
+//------------------------------------------------------------------------------------
+// The accesses of another task go to its own counters, not to the caller's.
+//------------------------------------------------------------------------------------
+static osSemaphoreId OtherDone;
+static DISKIO_STATS OtherTask;
+
+static void OtherThread(void const * argument)
+{
+    BYTE Drive = *(const BYTE *)argument;
+    static BYTE Buf[3 * 512];
+
+    disk_stats_attach(&OtherTask);
+    disk_read(Drive, Buf, 0, 3);
+    disk_read(Drive, Buf, 3, 3);
+    disk_write(Drive, Buf, 20, 1);
+    disk_stats_attach(NULL);
+    osSemaphoreRelease(OtherDone);
+}
+
+static void TestTasks(BYTE Drive)
+{
+    osThreadDef(Other_Thread, OtherThread, osPriorityNormal, 0, 0);
+    osSemaphoreDef(OTHER);
+    DISKIO_STATS Task, Total;
+
+    OtherDone = osSemaphoreCreate(osSemaphore(OTHER), 0);
+    memset(&Task, 0, sizeof(Task));
+    memset(&OtherTask, 0, sizeof(OtherTask));
+    disk_reset_stats(Drive);
+    CHECK_EQ(disk_stats_attach(&Task), 0);
+
+    CHECK_EQ(disk_read(Drive, Back, 0, 1), RES_OK);
+    CHECK(osThreadCreate(osThread(Other_Thread), &Drive) != NULL);
+    CHECK_EQ(osSemaphoreWait(OtherDone, 5000), osOK);
+
+    CHECK_EQ(Task.ReadOps, 1);
+    CHECK_EQ(Task.ReadSectors, 1);
+    CHECK_EQ(Task.WriteOps, 0);
+    CHECK_EQ(OtherTask.ReadOps, 2);
+    CHECK_EQ(OtherTask.ReadSectors, 6);
+    CHECK_EQ(OtherTask.WriteSectors, 1);
+
+    disk_get_stats(Drive, &Total);
+    CHECK_EQ(Total.ReadSectors, 7);
+    CHECK_EQ(Total.WriteSectors, 1);
+
+    disk_stats_attach(NULL);
+    osSemaphoreDelete(OtherDone);
+}
+
+//------------------------------------------------------------------------------------
+// A file written and read back through FatFs costs at least its own sectors.
+//------------------------------------------------------------------------------------
+static void TestFileSystem(BYTE Drive)
+{
+    static FATFS Fs;
+    FIL File;
+    DISKIO_STATS Task;
+    char Name[20];
+    UINT Count;
+
+    CHECK_EQ(f_mount(&Fs, DrivePath[Drive], 0), FR_OK);
+    CHECK_EQ(f_mkfs(DrivePath[Drive], 1, 0), FR_OK);
+    sprintf(Name, "%stest.bin", DrivePath[Drive]);
+
+    memset(&Task, 0, sizeof(Task));
+    CHECK_EQ(disk_stats_attach(&Task), 0);
+    CHECK_EQ(f_open(&File, Name, FA_WRITE | FA_CREATE_ALWAYS), FR_OK);
+    CHECK_EQ(f_write(&File, Sector, FILE_SIZE, &Count), FR_OK);
+    CHECK_EQ(Count, FILE_SIZE);
+    CHECK_EQ(f_close(&File), FR_OK);
+    CHECK(Task.WriteSectors >= FILE_SIZE / 512);
+
+    memset(&Task, 0, sizeof(Task));
+    CHECK_EQ(f_open(&File, Name, FA_READ), FR_OK);
+    CHECK_EQ(f_read(&File, Back, FILE_SIZE, &Count), FR_OK);
+    CHECK_EQ(Count, FILE_SIZE);
+    CHECK_EQ(f_close(&File), FR_OK);
+    CHECK(memcmp(Back, Sector, FILE_SIZE) == 0);
+    CHECK(Task.ReadSectors >= FILE_SIZE / 512);
+    CHECK_EQ(Task.WriteSectors, 0);
+
+    disk_stats_attach(NULL);
+    f_mount(NULL, DrivePath[Drive], 0);
+}
+
+int main(void)
+{
+    BYTE Drive;
+
+    CHECK_EQ(IMAGE_Open(IMAGE_NAME, IMAGE_BLOCKS), 0);
+    CHECK_EQ(FATFS_LinkDriver(&RAMDISK_Driver, DrivePath[0]), 0);
+    CHECK_EQ(FATFS_LinkDriver(&IMAGE_Driver, DrivePath[1]), 0);
+
+    for (Drive=0;Drive<2;Drive++){
+        CHECK_EQ(disk_initialize(Drive), 0);
+        TestCounts(Drive);
+        TestTasks(Drive);
+        TestFileSystem(Drive);
+    }
+
+    IMAGE_Close();
+    unlink(IMAGE_NAME);
+    return TEST_RESULT();
+}
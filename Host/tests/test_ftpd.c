@@ -0,0 +1,399 @@
+//------------------------------------------------------------------------------------
+// Tests of the FTP server (Src/FTPd) over the host link, on a fresh file image.
+// The tree is set up with FatFs directly, the server is driven like the phone
+// drives it.
+//------------------------------------------------------------------------------------
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "test.h"
+#include "cmsis_os.h"
+#include "diskio.h"
+#include "card.h"
+#include "FTPd.h"
+#include "paths.h"
+#include "client.h"
+
+#define IMAGE_NAME              "test_ftpd.img"
+#define FTP_DATA                "/apps/vault/data"
+#define MANIFEST_RECORD_SIZE    16      // ftpdmin.c
+#define WALK_MAX_DEPTH          8       // ftpdmin.c
+#define MANY_FILES              40      // More than CRC_CACHE_SIZE in ftpdmin.c
+#define MANY_FILE_SIZE          4096
+
+static unsigned char Buf[64 * 1024];
+
+//------------------------------------------------------------------------------------
+// Card side helpers
+//------------------------------------------------------------------------------------
+static void PutFile(const char * Path, const void * Data, UINT Size)
+{
+    FIL File;
+    UINT Written;
+
+    CHECK_EQ(f_open(&File, Path, FA_WRITE | FA_CREATE_ALWAYS), FR_OK);
+    CHECK_EQ(f_write(&File, Data, Size, &Written), FR_OK);
+    CHECK_EQ(Written, Size);
+    f_close(&File);
+}
+
+// Directories Levels deep below Top, with a file in each of them
+static void MakeTree(const char * Top, int Levels)
+{
+    char Path[MAX_PATH], Name[MAX_PATH + 8];
+    int a;
+
+    strcpy(Path, Top);
+    CHECK_EQ(f_mkdir(Path), FR_OK);
+    for (a=0;a<Levels;a++){
+        sprintf(Path + strlen(Path), "/d%d", a);
+        CHECK_EQ(f_mkdir(Path), FR_OK);
+        sprintf(Name, "%s/f.bin", Path);
+        PutFile(Name, Path, strlen(Path));
+    }
+}
+
+//------------------------------------------------------------------------------------
+// MANIFEST walks the whole tree and sends one record per file.  A tree nested
+// deeper than the walk allows is refused, not walked.
+//------------------------------------------------------------------------------------
+static void TestManifest(void)
+{
+    unsigned long Got;
+
+    MakeTree("/data/walk", WALK_MAX_DEPTH);
+    Got = 0;
+    CHECK_EQ(ClientCommand("MANI %s", FTP_DATA "/walk"), 0);
+    CHECK_EQ(ClientReply(NULL, 0, NULL), 150);
+    CHECK_EQ(ClientReply(Buf, sizeof(Buf), &Got), 226);
+    CHECK_EQ(Got, WALK_MAX_DEPTH * MANIFEST_RECORD_SIZE);
+
+    MakeTree("/data/deep", WALK_MAX_DEPTH + 1);
+    CHECK_EQ(ClientCommand("MANI %s", FTP_DATA "/deep"), 0);
+    CHECK_EQ(ClientReply(NULL, 0, NULL), 150);
+    Got = 0;
+    CHECK_EQ(ClientReply(Buf, sizeof(Buf), &Got), 550);
+
+    // The server is still in step
+    CHECK_EQ(ClientCommand("NOOP"), 0);
+    CHECK_EQ(ClientReply(NULL, 0, NULL), 200);
+}
+
+//------------------------------------------------------------------------------------
+// A tree with more files than the checksum cache holds is not read whole again by
+// the next MANIFEST, the files the last walk cached are still cached.
+//------------------------------------------------------------------------------------
+static void TestManifestCache(void)
+{
+    DISKIO_STATS Stats;
+    unsigned long Got;
+    char Name[40];
+    int a, Pass;
+
+    CHECK_EQ(f_mkdir("/data/many"), FR_OK);
+    memset(Buf, 'c', MANY_FILE_SIZE);
+    for (a=0;a<MANY_FILES;a++){
+        sprintf(Name, "/data/many/f%02d.bin", a);
+        PutFile(Name, Buf, MANY_FILE_SIZE);
+    }
+    for (Pass=0;Pass<3;Pass++){
+        disk_reset_stats(0);
+        Got = 0;
+        CHECK_EQ(ClientCommand("MANI %s", FTP_DATA "/many"), 0);
+        CHECK_EQ(ClientReply(NULL, 0, NULL), 150);
+        CHECK_EQ(ClientReply(Buf, sizeof(Buf), &Got), 226);
+        CHECK_EQ(Got, MANY_FILES * MANIFEST_RECORD_SIZE);
+        disk_get_stats(0, &Stats);
+        if (Pass){
+            CHECK(Stats.ReadSectors < MANY_FILES * MANY_FILE_SIZE / 512 / 2);
+        }
+    }
+}
+
+//------------------------------------------------------------------------------------
+// MGET of the same tree: every file and the end marker arrive.
+//------------------------------------------------------------------------------------
+static void TestMget(void)
+{
+    unsigned long Got = 0, Expected = 1;
+    char Path[MAX_PATH];
+    int a;
+
+    strcpy(Path, "/data/walk");
+    for (a=0;a<WALK_MAX_DEPTH;a++){
+        sprintf(Path + strlen(Path), "/d%d", a);
+        // Name relative to walk, 8 bytes of header, the file holds its directory path
+        Expected += 1 + strlen(Path + strlen("/data/walk/")) + strlen("/f.bin") + 8 + strlen(Path);
+    }
+    CHECK_EQ(ClientCommand("MGET %s", FTP_DATA "/walk"), 0);
+    CHECK_EQ(ClientReply(NULL, 0, NULL), 150);
+    CHECK_EQ(ClientReply(Buf, sizeof(Buf), &Got), 226);
+    CHECK_EQ(Got, Expected);
+    CHECK_EQ(Buf[Got - 1], 0);
+}
+
+//------------------------------------------------------------------------------------
+// MPUT one file Name of Size bytes (filled with Fill) into Dir, returns the reply.
+//------------------------------------------------------------------------------------
+static int Mput(const char * Dir, const char * Name, unsigned long Size, int Fill)
+{
+    unsigned char Hdr[300];
+    int NameLen = strlen(Name);
+    unsigned long Pos = 0, n;
+    int Reply;
+
+    CHECK_EQ(ClientCommand("MPUT %s", Dir), 0);
+    Reply = ClientReply(NULL, 0, NULL);
+    if (Reply != 150){
+        return Reply;
+    }
+    Hdr[0] = NameLen;
+    memcpy(Hdr + 1, Name, NameLen);
+    Hdr[1 + NameLen] = Size;
+    Hdr[2 + NameLen] = Size >> 8;
+    Hdr[3 + NameLen] = Size >> 16;
+    Hdr[4 + NameLen] = Size >> 24;
+    memset(Hdr + 5 + NameLen, 0, 4);
+    CHECK_EQ(ClientSendFrame(FTP_FRAME_DATA, Hdr, NameLen + 9), 0);
+    memset(Buf, Fill, sizeof(Buf));
+    while (Pos < Size){
+        n = (Size - Pos > CLIENT_DATA_PAYLOAD) ? CLIENT_DATA_PAYLOAD : Size - Pos;
+        CHECK_EQ(ClientSendFrame(FTP_FRAME_DATA, Buf, n), 0);
+        Pos += n;
+    }
+    Hdr[0] = 0;
+    CHECK_EQ(ClientSendFrame(FTP_FRAME_DATA, Hdr, 1), 0);
+    Reply = ClientReply(NULL, 0, NULL);
+    if (Reply != 226){
+        // End the flush of the rest of the data
+        CHECK_EQ(ClientSendFrame(FTP_FRAME_DATA, NULL, 0), 0);
+    }
+    return Reply;
+}
+
+static void CheckNoFile(const char * Path)
+{
+    FILINFO fno;
+
+    memset(&fno, 0, sizeof(fno));
+    CHECK_EQ(f_stat(Path, &fno), FR_NO_FILE);
+}
+
+//------------------------------------------------------------------------------------
+// MPUT writes vault files but not the files SRFT validates: firmware, settings,
+// templates and codes are refused however the path is spelled.
+//------------------------------------------------------------------------------------
+static void TestMputProtected(void)
+{
+    FILINFO fno;
+
+    CHECK_EQ(Mput(FTP_DATA "/", "plain.bin", 1000, 'p'), 226);
+    memset(&fno, 0, sizeof(fno));
+    CHECK_EQ(f_stat("/data/plain.bin", &fno), FR_OK);
+    CHECK_EQ(fno.fsize, 1000);
+
+    CHECK_EQ(Mput("/device", "firmware", 1000, 'f'), 553);
+    CheckNoFile("/device/firmware");
+    CHECK_EQ(Mput("/DEVICE/.", "settings", 100, 's'), 553);
+    CheckNoFile("/device/settings");
+    CHECK_EQ(Mput("/", "auth/code/new.bin", 10, 'c'), 553);
+    CheckNoFile("/auth/code/new.bin");
+    CHECK_EQ(Mput("/", "Device./bt.key", 10, 'k'), 553);
+    CheckNoFile("/device/bt.key");
+    CHECK_EQ(Mput("/", "file.tmp", 10, 't'), 553);
+
+    // Still in step
+    CHECK_EQ(ClientCommand("NOOP"), 0);
+    CHECK_EQ(ClientReply(NULL, 0, NULL), 200);
+}
+
+//------------------------------------------------------------------------------------
+// WRNG refuses the same files as MPUT.  A committed journal whose target is gone
+// is dropped, not replayed at every start up.
+//------------------------------------------------------------------------------------
+static void TestWrng(void)
+{
+    FIL File;
+    char Back[11];
+    UINT Got;
+
+    f_mkdir("/device");
+    PutFile("/device/settings", "settings", 8);
+    CHECK_EQ(ClientCommand("WRNG %s 0 4", "/device/settings"), 0);
+    CHECK_EQ(ClientReply(NULL, 0, NULL), 553);
+    CHECK_EQ(ClientCommand("WRNG %s 0 4 A", "/Range.jnl"), 0);
+    CHECK_EQ(ClientReply(NULL, 0, NULL), 553);
+
+    PutFile("/data/range.bin", "0123456789", 10);
+    CHECK_EQ(ClientCommand("WRNG %s 2 4 A", FTP_DATA "/range.bin"), 0);
+    CHECK_EQ(ClientReply(NULL, 0, NULL), 150);
+    // The target goes away while the data is in the journal
+    CHECK_EQ(f_unlink("/data/range.bin"), FR_OK);
+    CHECK_EQ(ClientSendFrame(FTP_FRAME_DATA, "abcd", 4), 0);
+    CHECK_EQ(ClientReply(NULL, 0, NULL), 550);
+    CHECK_EQ(ClientSendFrame(FTP_FRAME_DATA, NULL, 0), 0);
+    CheckNoFile(RANGE_JOURNAL_FILE);
+
+    PutFile("/data/range.bin", "0123456789", 10);
+    CHECK_EQ(ClientCommand("WRNG %s 2 4 A", FTP_DATA "/range.bin"), 0);
+    CHECK_EQ(ClientReply(NULL, 0, NULL), 150);
+    CHECK_EQ(ClientSendFrame(FTP_FRAME_DATA, "abcd", 4), 0);
+    CHECK_EQ(ClientReply(NULL, 0, NULL), 226);
+    CHECK_EQ(f_open(&File, "/data/range.bin", FA_READ), FR_OK);
+    memset(Back, 0, sizeof(Back));
+    CHECK_EQ(f_read(&File, Back, 10, &Got), FR_OK);
+    f_close(&File);
+    CHECK(strcmp(Back, "01abcd6789") == 0);
+    CheckNoFile(RANGE_JOURNAL_FILE);
+
+    CHECK_EQ(ClientCommand("NOOP"), 0);
+    CHECK_EQ(ClientReply(NULL, 0, NULL), 200);
+}
+
+//------------------------------------------------------------------------------------
+// XCRC of Path into Crc, the reply code is returned.
+//------------------------------------------------------------------------------------
+static int Xcrc(const char * Path, char * Crc)
+{
+    unsigned char Line[64];
+    int Type, Len;
+
+    CHECK_EQ(ClientCommand("XCRC %s", Path), 0);
+    do{
+        Type = ClientRecvFrame(Line, sizeof(Line) - 1, &Len, 5000);
+    }while (Type >= 0 && Type != FTP_FRAME_COMMAND);
+    if (Type < 0){
+        return -1;
+    }
+    Line[Len] = 0;
+    sscanf((char *)Line + 4, "%8s", Crc);
+    return atoi((char *)Line);
+}
+
+//------------------------------------------------------------------------------------
+// A file rewritten with the same size keeps its (zero) FAT timestamp, XCRC still
+// sees the new contents after WRNG and MPUT.
+//------------------------------------------------------------------------------------
+static void TestXcrcAfterWrite(void)
+{
+    char Crc[3][9];
+
+    PutFile("/data/crc.bin", "0123456789", 10);
+    CHECK_EQ(Xcrc(FTP_DATA "/crc.bin", Crc[0]), 250);
+
+    CHECK_EQ(ClientCommand("WRNG %s 2 4", FTP_DATA "/crc.bin"), 0);
+    CHECK_EQ(ClientReply(NULL, 0, NULL), 150);
+    CHECK_EQ(ClientSendFrame(FTP_FRAME_DATA, "abcd", 4), 0);
+    CHECK_EQ(ClientReply(NULL, 0, NULL), 226);
+    CHECK_EQ(Xcrc(FTP_DATA "/crc.bin", Crc[1]), 250);
+    CHECK(strcmp(Crc[0], Crc[1]) != 0);
+
+    CHECK_EQ(Mput(FTP_DATA "/", "crc.bin", 10, 'm'), 226);
+    CHECK_EQ(Xcrc(FTP_DATA "/crc.bin", Crc[2]), 250);
+    CHECK(strcmp(Crc[1], Crc[2]) != 0);
+    CHECK(strcmp(Crc[0], Crc[2]) != 0);
+}
+
+//------------------------------------------------------------------------------------
+// A command frame that does not fit after a pending partial line is dropped
+// whole, the frames after it are still read in step.
+//------------------------------------------------------------------------------------
+static void TestLongLine(void)
+{
+    char Line[CLIENT_DATA_PAYLOAD];
+
+    memset(Line, 'x', sizeof(Line));
+    memcpy(Line, "NOOP\r\n", 6);
+    CHECK_EQ(ClientSendFrame(FTP_FRAME_COMMAND, Line, 400), 0);
+    CHECK_EQ(ClientReply(NULL, 0, NULL), 200);
+    memcpy(Line + 200 - 2, "\r\n", 2);
+    CHECK_EQ(ClientSendFrame(FTP_FRAME_COMMAND, Line + 6, 200 - 6), 0);
+    CHECK_EQ(ClientReply(NULL, 0, NULL), 500);
+
+    CHECK_EQ(ClientCommand("NOOP"), 0);
+    CHECK_EQ(ClientReply(NULL, 0, NULL), 200);
+}
+
+//------------------------------------------------------------------------------------
+// Commands the host queued before a priority abort are dropped with the aborted
+// command, the first command after FTP_PRIO_ABORTED gets the first reply.
+//------------------------------------------------------------------------------------
+static void TestPriorityAbort(void)
+{
+    unsigned char Frame[16];
+    int Type, Len;
+
+    CHECK_EQ(ClientCommand("STOR %s", FTP_DATA "/aborted.bin"), 0);
+    CHECK_EQ(ClientReply(NULL, 0, NULL), 150);
+    CHECK_EQ(ClientSendFrame(FTP_FRAME_DATA, "data", 4), 0);
+    CHECK_EQ(ClientSendFrame(FTP_FRAME_COMMAND, "NOOP\r\nNO", 8), 0);
+    Frame[0] = FTP_PRIO_ABORT;
+    CHECK_EQ(ClientSendFrame(FTP_FRAME_PRIORITY, Frame, 1), 0);
+    CHECK_EQ(ClientReply(NULL, 0, NULL), 226);
+    do{
+        Type = ClientRecvFrame(Frame, sizeof(Frame), &Len, 5000);
+    }while (Type >= 0 && !(Type == FTP_FRAME_PRIORITY && Len > 0 && Frame[0] == FTP_PRIO_ABORTED));
+    CHECK_EQ(Type, FTP_FRAME_PRIORITY);
+
+    CHECK_EQ(ClientCommand("PWD"), 0);
+    CHECK_EQ(ClientReply(NULL, 0, NULL), 257);
+    CHECK_EQ(ClientCommand("NOOP"), 0);
+    CHECK_EQ(ClientReply(NULL, 0, NULL), 200);
+}
+
+//------------------------------------------------------------------------------------
+// A host that pauses between data frames, for longer than the round trips measured
+// so far but less than the receive timeout, does not end the upload.  STOR leaves
+// the data in TEMP_FILE.
+//------------------------------------------------------------------------------------
+static void TestStorPause(void)
+{
+    FILINFO fno;
+    int a;
+
+    // Fast uploads first, so the link has a short RTO
+    for (a=0;a<4;a++){
+        CHECK_EQ(ClientStor(FTP_DATA "/fast.bin", Buf, 4 * CLIENT_DATA_PAYLOAD), 226);
+    }
+
+    memset(Buf, 'p', 2 * CLIENT_DATA_PAYLOAD);
+    CHECK_EQ(ClientCommand("STOR %s", FTP_DATA "/paused.bin"), 0);
+    CHECK_EQ(ClientReply(NULL, 0, NULL), 150);
+    CHECK_EQ(ClientSendFrame(FTP_FRAME_DATA, Buf, CLIENT_DATA_PAYLOAD), 0);
+    usleep(1000 * 1000);
+    CHECK_EQ(ClientSendFrame(FTP_FRAME_DATA, Buf, CLIENT_DATA_PAYLOAD), 0);
+    CHECK_EQ(ClientSendFrame(FTP_FRAME_DATA, NULL, 0), 0);
+    CHECK_EQ(ClientReply(NULL, 0, NULL), 226);
+    // STOR closes the file after its reply
+    CHECK_EQ(ClientCommand("NOOP"), 0);
+    CHECK_EQ(ClientReply(NULL, 0, NULL), 200);
+
+    memset(&fno, 0, sizeof(fno));
+    CHECK_EQ(f_stat(TEMP_FILE, &fno), FR_OK);       // Until SRFT
+    CHECK_EQ(fno.fsize, 2 * CLIENT_DATA_PAYLOAD);
+}
+
+int main(int argc, char ** argv)
+{
+    ClientVerbose = (argc > 1 && strcmp(argv[1], "-v") == 0);
+    if (ClientOpen(IMAGE_NAME, 1)){
+        return 1;
+    }
+
+    TestManifest();
+    TestManifestCache();
+    TestMget();
+    TestMputProtected();
+    TestWrng();
+    TestXcrcAfterWrite();
+    TestLongLine();
+    TestPriorityAbort();
+    TestStorPause();
+
+    ClientCommand("QUIT");
+    ClientExpect(221, "QUIT");
+    unlink(IMAGE_NAME);
+    return TEST_RESULT();
+}
@@ -0,0 +1,187 @@
+//------------------------------------------------------------------------------------
+// Round trip tests of the streaming LZ codec (Src/FTPd/lzstream.c).
+//------------------------------------------------------------------------------------
+#include <stdlib.h>
+#include <string.h>
+
+#include "test.h"
+#include "lzstream.h"
+
+#define DATA_SIZE       (64 * 1024)
+
+static unsigned char Data[DATA_SIZE];
+static unsigned char Packed[2 * DATA_SIZE];     // One byte calls double the size
+static unsigned char Unpacked[DATA_SIZE];
+
+static unsigned long Seed;
+
+static unsigned Random(void)
+{
+    Seed = Seed * 1103515245 + 12345;
+    return (Seed >> 16) & 0x7fff;
+}
+
+//------------------------------------------------------------------------------------
+// Test inputs: noise, text-like records, long runs, and a mix of all three with
+// repeats further back than the window.
+//------------------------------------------------------------------------------------
+enum { DATA_RANDOM, DATA_TEXT, DATA_RUNS, DATA_MIXED, DATA_KINDS };
+
+static void MakeData(int Kind, int Size)
+{
+    static const char * Words[] = {"vault", "entry", "password", "user", "{\"id\":", "\r\n", " "};
+    const char * Word;
+    int a = 0, n;
+
+    Seed = Kind + 1;
+    while (a < Size){
+        int Pick = (Kind == DATA_MIXED) ? (int)(Random() % 3) : Kind;
+
+        switch (Pick){
+            case DATA_RANDOM:
+                Data[a++] = (unsigned char)Random();
+                break;
+            case DATA_TEXT:
+                Word = Words[Random() % 7];
+                n = strlen(Word);
+                n = (a + n > Size) ? Size - a : n;
+                memcpy(Data + a, Word, n);
+                a += n;
+                break;
+            default:
+                n = 1 + Random() % 200;
+                n = (a + n > Size) ? Size - a : n;
+                memset(Data + a, (unsigned char)Random(), n);
+                a += n;
+                break;
+        }
+    }
+    if (Kind == DATA_MIXED && Size > 4000){
+        // A block repeated from 3000 bytes back, beyond the window
+        memcpy(Data + Size - 1000, Data + Size - 4000, 1000);
+    }
+}
+
+//------------------------------------------------------------------------------------
+// Compress Size bytes in chunks of InChunk, checking the output bound of each
+// call.  Returns the compressed size.
+//------------------------------------------------------------------------------------
+static int Pack(int Size, int InChunk)
+{
+    static LZEncoder_t Enc;
+    int Pos, n, Out = 0, Len;
+
+    LZ_EncoderInit(&Enc);
+    for (Pos=0;Pos<Size;Pos+=n){
+        n = (Size - Pos > InChunk) ? InChunk : Size - Pos;
+        Len = LZ_Encode(&Enc, Data + Pos, n, Packed + Out);
+        CHECK(Len > 0 && Len <= LZ_MAX_OUTPUT(n));
+        if (Len <= 0){
+            break;
+        }
+        Out += Len;
+    }
+    return Out;
+}
+
+//------------------------------------------------------------------------------------
+// Expand PackedSize bytes feeding at most InChunk at a time into an output of
+// OutChunk, as the STOR path does with partial frames.  Returns the size expanded.
+//------------------------------------------------------------------------------------
+static int Unpack(int PackedSize, int InChunk, int OutChunk)
+{
+    static LZDecoder_t Dec;
+    int InPos = 0, Out = 0, Used, n, Len;
+
+    LZ_DecoderInit(&Dec);
+    while (InPos < PackedSize){
+        n = (PackedSize - InPos > InChunk) ? InChunk : PackedSize - InPos;
+        do{
+            Len = LZ_Decode(&Dec, Packed + InPos, n, &Used, Unpacked + Out,
+                            (Out + OutChunk > DATA_SIZE) ? DATA_SIZE - Out : OutChunk);
+            InPos += Used;
+            n -= Used;
+            Out += Len;
+        }while (n && Len && Out < DATA_SIZE);
+        if (Out >= DATA_SIZE){
+            break;
+        }
+    }
+    // Flush a match still being copied
+    Len = LZ_Decode(&Dec, Packed, 0, &Used, Unpacked + Out, DATA_SIZE - Out);
+    return Out + Len;
+}
+
+static void RoundTrip(int Kind, int Size, int InChunk, int DecChunk, int OutChunk)
+{
+    int PackedSize, Got;
+
+    MakeData(Kind, Size);
+    PackedSize = Pack(Size, InChunk);
+    Got = Unpack(PackedSize, DecChunk, OutChunk);
+    CHECK_EQ(Got, Size);
+    if (Got != Size || memcmp(Unpacked, Data, Size)){
+        printf("kind %d size %d chunks %d/%d/%d does not round trip\n", Kind, Size, InChunk, DecChunk, OutChunk);
+        TestFailures++;
+    }
+}
+
+static void TestRoundTrip(void)
+{
+    static const int Sizes[] = {0, 1, 2, 3, 4, 35, 127, 128, 129, 503, 504, 505, 1024, 1025, 4096, DATA_SIZE};
+    static const int InChunks[] = {1, 3, 64, 500, LZ_MAX_INPUT};
+    static const int DecChunks[] = {1, 2, 7, 512, 4096};
+    int Kind, s, i, d;
+
+    for (Kind=0;Kind<DATA_KINDS;Kind++){
+        for (s=0;s<sizeof(Sizes)/sizeof(Sizes[0]);s++){
+            for (i=0;i<sizeof(InChunks)/sizeof(InChunks[0]);i++){
+                for (d=0;d<sizeof(DecChunks)/sizeof(DecChunks[0]);d++){
+                    RoundTrip(Kind, Sizes[s], InChunks[i], DecChunks[d], DecChunks[d]);
+                }
+            }
+            // Output space smaller than a match
+            RoundTrip(Kind, Sizes[s], LZ_MAX_INPUT, 512, 5);
+        }
+    }
+}
+
+//------------------------------------------------------------------------------------
+// Repeats compress, noise is only expanded by the literal run headers.
+//------------------------------------------------------------------------------------
+static void TestRatio(void)
+{
+    int PackedSize;
+
+    MakeData(DATA_RUNS, DATA_SIZE);
+    PackedSize = Pack(DATA_SIZE, LZ_MAX_INPUT);
+    CHECK(PackedSize < DATA_SIZE / 8);
+
+    MakeData(DATA_TEXT, DATA_SIZE);
+    PackedSize = Pack(DATA_SIZE, LZ_MAX_INPUT);
+    CHECK(PackedSize < DATA_SIZE / 2);
+
+    MakeData(DATA_RANDOM, DATA_SIZE);
+    PackedSize = Pack(DATA_SIZE, LZ_MAX_INPUT);
+    CHECK(PackedSize <= LZ_MAX_OUTPUT(DATA_SIZE) + DATA_SIZE / LZ_MAX_INPUT);
+}
+
+//------------------------------------------------------------------------------------
+// Too much input in one call is refused.
+//------------------------------------------------------------------------------------
+static void TestLimits(void)
+{
+    static LZEncoder_t Enc;
+
+    LZ_EncoderInit(&Enc);
+    CHECK_EQ(LZ_Encode(&Enc, Data, LZ_MAX_INPUT + 1, Packed), -1);
+    CHECK_EQ(LZ_Encode(&Enc, Data, 0, Packed), 0);
+}
+
+int main(void)
+{
+    TestRoundTrip();
+    TestRatio();
+    TestLimits();
+    return TEST_RESULT();
+}
@@ -0,0 +1,157 @@
+//------------------------------------------------------------------------------------
+// Unit test of the PWV credit flow control (Src/PWVCredit.c).
+//------------------------------------------------------------------------------------
+#include <stdint.h>
+
+#include "test.h"
+#include "PWVCredit.h"
+
+#define NOTIFY_LEN      244     // 247 byte MTU less the notification header
+
+//------------------------------------------------------------------------------------
+// Without a grant notifications are not limited, a grant turns the limit on.
+//------------------------------------------------------------------------------------
+static void TestTxGrant(void)
+{
+    PWVTxCredits_t Tx = {0, 0, 0};
+
+    PWVTxCreditsReset(&Tx);
+    CHECK_EQ(PWVTxCreditsLimit(&Tx, 5000, NOTIFY_LEN), 5000);
+    PWVTxCreditsConsume(&Tx, 5000, NOTIFY_LEN);
+    CHECK_EQ(Tx.Used, 0);
+
+    PWVTxCreditsGrant(&Tx, 3);
+    CHECK(Tx.Enabled);
+    CHECK_EQ(PWVTxCreditsAvailable(&Tx), 3);
+    CHECK_EQ(PWVTxCreditsLimit(&Tx, 5000, NOTIFY_LEN), 3 * NOTIFY_LEN);
+    CHECK_EQ(PWVTxCreditsLimit(&Tx, 100, NOTIFY_LEN), 100);
+}
+
+//------------------------------------------------------------------------------------
+// Each notification takes a credit, a short last one too.
+//------------------------------------------------------------------------------------
+static void TestTxConsume(void)
+{
+    PWVTxCredits_t Tx = {0, 0, 0};
+
+    PWVTxCreditsGrant(&Tx, 4);
+    PWVTxCreditsConsume(&Tx, 2 * NOTIFY_LEN + 1, NOTIFY_LEN);
+    CHECK_EQ(PWVTxCreditsAvailable(&Tx), 1);
+    CHECK_EQ(PWVTxCreditsLimit(&Tx, 1000, NOTIFY_LEN), NOTIFY_LEN);
+
+    PWVTxCreditsConsume(&Tx, NOTIFY_LEN, NOTIFY_LEN);
+    CHECK_EQ(PWVTxCreditsAvailable(&Tx), 0);
+    CHECK_EQ(PWVTxCreditsLimit(&Tx, 1000, NOTIFY_LEN), 0);
+
+    // Refill resumes sending
+    PWVTxCreditsGrant(&Tx, 10);
+    CHECK_EQ(PWVTxCreditsLimit(&Tx, 1000, NOTIFY_LEN), 1000);
+}
+
+//------------------------------------------------------------------------------------
+// The counters wrap without losing the difference, a large grant does not
+// overflow the byte limit.
+//------------------------------------------------------------------------------------
+static void TestTxWrap(void)
+{
+    PWVTxCredits_t Tx = {1, 0xFFFFFFF0u, 0xFFFFFFF0u};
+
+    PWVTxCreditsGrant(&Tx, 0x20);
+    CHECK_EQ(PWVTxCreditsAvailable(&Tx), 0x20);
+    PWVTxCreditsConsume(&Tx, 0x18 * NOTIFY_LEN, NOTIFY_LEN);
+    CHECK_EQ(PWVTxCreditsAvailable(&Tx), 0x8);
+
+    Tx.Granted = Tx.Used + 0xFFFFFF00u;
+    CHECK_EQ(PWVTxCreditsLimit(&Tx, 4096, NOTIFY_LEN), 4096);
+}
+
+//------------------------------------------------------------------------------------
+// A new connection drops the credits left from the last one.
+//------------------------------------------------------------------------------------
+static void TestTxReset(void)
+{
+    PWVTxCredits_t Tx = {0, 0, 0};
+
+    PWVTxCreditsGrant(&Tx, 7);
+    PWVTxCreditsReset(&Tx);
+    CHECK(!Tx.Enabled);
+    CHECK_EQ(PWVTxCreditsAvailable(&Tx), 0);
+}
+
+//------------------------------------------------------------------------------------
+// Rx credits are kept until notified and never exceed one characteristic value.
+//------------------------------------------------------------------------------------
+static void TestRx(void)
+{
+    PWVRxCredits_t Rx;
+
+    PWVRxCreditsReset(&Rx);
+    CHECK_EQ(PWVRxCreditsNext(&Rx), 0);
+
+    PWVRxCreditsRelease(&Rx, 2048);
+    CHECK_EQ(PWVRxCreditsNext(&Rx), 2048);
+
+    // GATT out of buffers: nothing notified, the next release adds up
+    PWVRxCreditsRelease(&Rx, 2048);
+    CHECK_EQ(PWVRxCreditsNext(&Rx), 4096);
+    PWVRxCreditsNotified(&Rx, 4096);
+    CHECK_EQ(PWVRxCreditsNext(&Rx), 0);
+
+    PWVRxCreditsRelease(&Rx, 0x12345);
+    CHECK_EQ(PWVRxCreditsNext(&Rx), PWV_CREDIT_VALUE_MAX);
+    PWVRxCreditsNotified(&Rx, PWVRxCreditsNext(&Rx));
+    CHECK_EQ(PWVRxCreditsNext(&Rx), 0x12345 - PWV_CREDIT_VALUE_MAX);
+
+    CHECK_EQ(PWVRxCreditsFree(4096, 4096, 0), 0);
+    CHECK_EQ(PWVRxCreditsFree(4096, 0x00000010u, 0xFFFFFF10u), 4096 - 0x100);
+}
+
+//------------------------------------------------------------------------------------
+// Stream a file to a peer with room for a few notifications that grants a credit
+// for each one it consumes.  The peer must never be overrun and the whole file
+// must arrive.
+//------------------------------------------------------------------------------------
+static void TestTxStream(void)
+{
+    PWVTxCredits_t Tx = {0, 0, 0};
+    uint32_t Remaining = 100000;
+    uint32_t PeerQueue = 0;
+    uint32_t PeerSize = 6;
+    uint32_t Received = 0;
+    uint32_t Count, Sent;
+    int Rounds = 0;
+
+    PWVTxCreditsReset(&Tx);
+    PWVTxCreditsGrant(&Tx, PeerSize);
+
+    while(Remaining && Rounds++ < 100000){
+        // The worker sends what the credits allow, the link takes at most 4 per round
+        Count = PWVTxCreditsLimit(&Tx, Remaining, NOTIFY_LEN);
+        Sent = (Count > 4 * NOTIFY_LEN) ? 4 * NOTIFY_LEN : Count;
+        PWVTxCreditsConsume(&Tx, Sent, NOTIFY_LEN);
+        PeerQueue += (Sent + NOTIFY_LEN - 1) / NOTIFY_LEN;
+        Remaining -= Sent;
+        Received += Sent;
+        CHECK(PeerQueue <= PeerSize);
+
+        // The peer drains two and grants them back
+        if (PeerQueue){
+            uint32_t Drain = PeerQueue > 2 ? 2 : PeerQueue;
+            PeerQueue -= Drain;
+            PWVTxCreditsGrant(&Tx, (uint16_t)Drain);
+        }
+    }
+    CHECK_EQ(Received, 100000);
+    CHECK_EQ(Remaining, 0);
+}
+
+int main(void)
+{
+    TestTxGrant();
+    TestTxConsume();
+    TestTxWrap();
+    TestTxReset();
+    TestRx();
+    TestTxStream();
+    return TEST_RESULT();
+}
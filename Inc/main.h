@@ -289,6 +289,9 @@ typedef struct _DEVICE_SETTINGS
   uint32_t SPP_Send_Timeout;
   uint32_t SPP_Receive_Timeout;
   uint32_t Advertising_Enabled;
+  uint32_t LE_Transfer_Interval;        // in ms, LE connection interval while a file is moved
+  uint32_t LE_Idle_Interval;            // in ms, LE connection interval once idle
+  uint32_t LE_Idle_Timeout;             // in ms, no transfer for this long -> idle interval
 } sDEVICE_SETTINGS;
 
 extern sDEVICE_SETTINGS Settings;
@@ -326,6 +329,7 @@ extern sDEVICE_SETTINGS Settings;
 #define FTP_DEVICE_BOOTLOADER           "/device/bootld"
 #define FTP_DEVICE_SETTINGS             "/device/settings"
 #define FTP_DEVICE_RESET                "/device/reset"
+#define FTP_DEVICE_STATS                "/device/stats"
 #define FTP_VAULT_PATH                  "/apps/vault/data"
 #define FTP_AUTH_PATH                   "/auth"
 #define FTP_PASSWORD_VAULT_PATH         "/passwordvault"
@@ -337,6 +341,7 @@ extern sDEVICE_SETTINGS Settings;
 #define FTP_AUTH_SIGNOUT_PATH           "/auth/signout"
 #define FTP_LICENSE_PATH                "/license"
 #define TEMP_FILE                       "/file.tmp"
+#define RANGE_JOURNAL_FILE              "/range.jnl"
 #define TEST_10K_PATH                   "/data/10k.txt"
 
 #define FTP_DEVICE_RESET "/device/reset"
@@ -357,11 +362,19 @@ extern sDEVICE_SETTINGS Settings;
 #define SPP_TIMEOUT_MIN                100
 #define SPP_TIMEOUT_MAX                10000
 
+#define LE_TRANSFER_INTERVAL_DEFAULT   15       // Shortest interval iOS accepts
+#define LE_IDLE_INTERVAL_DEFAULT       500
+#define LE_INTERVAL_MIN                8        // Connection interval limits of the spec, in ms
+#define LE_INTERVAL_MAX                4000
+#define LE_IDLE_TIMEOUT_DEFAULT        5000
+#define LE_IDLE_TIMEOUT_MIN            1000
+#define LE_IDLE_TIMEOUT_MAX            60000
+
 #define FACE_THRESHOLD_DEFAULT         48      // For NeuroTechnology face match library
 #define FACE_THRESHOLD_MIN             28      // For NeuroTechnology face match library
 #define FACE_THRESHOLD_MAX             148      // For NeuroTechnology face match library
 
-#define DEV_SETTINGS_MAX_TOKEN          20      // For JSMN library
+#define DEV_SETTINGS_MAX_TOKEN          32      // For JSMN library
 
 #define SELFTEST_RW_PATH                "/device/SelfTest.txt"
 #define SELFTEST_eMMC_WRITE_BUFFER      "BluStor eMMC SelfTest Data."
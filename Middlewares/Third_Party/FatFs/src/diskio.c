@@ -36,17 +36,88 @@
   */
 
 /* Includes ------------------------------------------------------------------*/
+#include <string.h>
 #include "diskio.h"
 #include "ff_gen_drv.h"
 
 /* Private typedef -----------------------------------------------------------*/
+#if _FS_REENTRANT
+typedef struct {
+  osThreadId task;
+  DISKIO_STATS *st;
+} DISKIO_TASK_STATS;
+#endif /* _FS_REENTRANT */
+
 /* Private define ------------------------------------------------------------*/
+/* Tasks that can keep their own counters at the same time */
+#define DISKIO_STATS_TASKS    4
+
 /* Private variables ---------------------------------------------------------*/
 extern Disk_drvTypeDef  disk;
 
+/* Sector operation counters, so the number of disk accesses behind a file
+   system operation can be measured whatever driver is linked */
+static DISKIO_STATS stats[_VOLUMES];
+
+#if _FS_REENTRANT
+/* Counters of the tasks that attached one, see disk_stats_attach() */
+static DISKIO_TASK_STATS task_stats[DISKIO_STATS_TASKS];
+#endif /* _FS_REENTRANT */
+
 /* Private function prototypes -----------------------------------------------*/
 /* Private functions ---------------------------------------------------------*/
 
+/**
+  * @brief  Counts a sector operation for the drive and the calling task
+  * @param  pdrv: Physical drive number (0..)
+  * @param  count: Number of sectors
+  * @param  write: 0 for a read, 1 for a write
+  * @retval None
+  */
+static void count_sectors (
+	BYTE pdrv,
+	UINT count,
+	int write
+)
+{
+#if _FS_REENTRANT
+  osThreadId task = osThreadGetId();
+  DISKIO_STATS *st;
+  int i;
+#endif /* _FS_REENTRANT */
+
+  if (write)
+  {
+    stats[pdrv].WriteOps++;
+    stats[pdrv].WriteSectors += count;
+  }
+  else
+  {
+    stats[pdrv].ReadOps++;
+    stats[pdrv].ReadSectors += count;
+  }
+#if _FS_REENTRANT
+  for (i = 0; i < DISKIO_STATS_TASKS; i++)
+  {
+    if (task_stats[i].task == task)
+    {
+      st = task_stats[i].st;
+      if (write)
+      {
+        st->WriteOps++;
+        st->WriteSectors += count;
+      }
+      else
+      {
+        st->ReadOps++;
+        st->ReadSectors += count;
+      }
+      break;
+    }
+  }
+#endif /* _FS_REENTRANT */
+}
+
 /**
   * @brief  Gets Disk Status 
   * @param  pdrv: Physical drive number (0..)
@@ -111,6 +182,7 @@ DRESULT disk_read (
 {
   DRESULT res;
  
+  count_sectors(pdrv, count, 0);
   res = disk.drv[pdrv]->disk_read(disk.lun[pdrv], buff, sector, count);
   return res;
 }
@@ -133,6 +205,7 @@ DRESULT disk_write (
 {
   DRESULT res;
   
+  count_sectors(pdrv, count, 1);
   res = disk.drv[pdrv]->disk_write(disk.lun[pdrv], buff, sector, count);
   return res;
 }
@@ -159,6 +232,73 @@ DRESULT disk_ioctl (
 }
 #endif /* _USE_IOCTL == 1 */
 
+/**
+  * @brief  Gets the sector operation counters of a drive
+  * @param  pdrv: Physical drive number (0..)
+  * @param  *stats: Receives the counters
+  * @retval None
+  */
+void disk_get_stats (
+	BYTE pdrv,		/* Physical drive nmuber (0..) */
+	DISKIO_STATS *st	/* Counters of the drive */
+)
+{
+  *st = stats[pdrv];
+}
+
+/**
+  * @brief  Clears the sector operation counters of a drive
+  * @param  pdrv: Physical drive number (0..)
+  * @retval None
+  */
+void disk_reset_stats (
+	BYTE pdrv		/* Physical drive nmuber (0..) */
+)
+{
+  memset(&stats[pdrv], 0, sizeof(stats[pdrv]));
+}
+
+/**
+  * @brief  Adds the sector operations of the calling task on any drive to
+  *         its own counters, so they can be told apart from the accesses of
+  *         the other tasks.  The task owns the counters, it may read and
+  *         clear them at any time.  Needs the RTOS (_FS_REENTRANT).
+  * @param  *st: Counters of the task, NULL to stop counting
+  * @retval 0 on success, -1 when DISKIO_STATS_TASKS tasks already count
+  */
+int disk_stats_attach (
+	DISKIO_STATS *st	/* Counters of the calling task */
+)
+{
+#if _FS_REENTRANT
+  osThreadId task = osThreadGetId();
+  int i, slot = -1;
+
+  osThreadSuspendAll();
+  for (i = 0; i < DISKIO_STATS_TASKS; i++)
+  {
+    if (task_stats[i].task == task)
+    {
+      slot = i;
+      break;
+    }
+    if (slot < 0 && task_stats[i].task == NULL)
+    {
+      slot = i;
+    }
+  }
+  if (slot >= 0)
+  {
+    task_stats[slot].st = st;
+    task_stats[slot].task = st ? task : NULL;
+  }
+  osThreadResumeAll();
+  return (slot >= 0 || st == NULL) ? 0 : -1;
+#else
+  return -1;
+#endif /* _FS_REENTRANT */
+}
+
 /**
   * @brief  Gets Time from RTC 
   * @param  None
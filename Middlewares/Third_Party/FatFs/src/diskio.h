@@ -27,6 +27,14 @@ typedef enum {
 	RES_PARERR		/* 4: Invalid Parameter */
 } DRESULT;
 
+/* Sector operation counters of a drive */
+typedef struct {
+	DWORD ReadOps;		/* disk_read calls */
+	DWORD ReadSectors;	/* Sectors read */
+	DWORD WriteOps;		/* disk_write calls */
+	DWORD WriteSectors;	/* Sectors written */
+} DISKIO_STATS;
+
 
 /*---------------------------------------*/
 /* Prototypes for disk control functions */
@@ -38,6 +46,9 @@ DRESULT disk_read (BYTE pdrv, BYTE* buff, DWORD sector, UINT count);
 DRESULT disk_write (BYTE pdrv, const BYTE* buff, DWORD sector, UINT count);
 DRESULT disk_ioctl (BYTE pdrv, BYTE cmd, void* buff);
 DWORD get_fattime (void);
+void disk_get_stats (BYTE pdrv, DISKIO_STATS* stats);
+void disk_reset_stats (BYTE pdrv);
+int disk_stats_attach (DISKIO_STATS* stats);
 
 /* Disk Status Bits (DSTATUS) */
 
@@ -0,0 +1,258 @@
+/**
+  ******************************************************************************
+  * @file    ramdisk_diskio.c
+  * @brief   RAM disk I/O driver.
+  *
+  *          Backs a FatFs drive with internal RAM so file system heavy code
+  *          (template scans, log rotation, key files, f_move) can be run and
+  *          profiled without the eMMC.  The disk takes RAMDISK_BLOCK_COUNT
+  *          blocks of RAM, so the driver is only built when USE_RAMDISK is
+  *          defined.  Link it in place of SD_Driver:
+  *
+  *            FATFS_LinkDriver(&RAMDISK_Driver, SD_Path0);
+  *            f_mkfs(SD_Path0, 1, 0);
+  *
+  *          When RAMDISK_LATENCY_MODEL is defined every access is delayed
+  *          like the eMMC: a fixed overhead per command, a per sector cost
+  *          for reads and writes, and an erase stall each time
+  *          RAMDISK_ERASE_INTERVAL sectors have been written.  Sector
+  *          operations are counted by disk_read/disk_write, see
+  *          disk_get_stats().
+  ******************************************************************************
+  */
+
+#ifdef USE_RAMDISK
+
+/* Includes ------------------------------------------------------------------*/
+#include <string.h>
+#include "ff_gen_drv.h"
+#ifdef RAMDISK_LATENCY_MODEL
+#include "cmsis_os.h"
+#endif /* RAMDISK_LATENCY_MODEL */
+
+/* Private typedef -----------------------------------------------------------*/
+/* Private define ------------------------------------------------------------*/
+/* Block Size in Bytes */
+#define BLOCK_SIZE                512
+
+/* Disk size in blocks, 128 is the smallest volume f_mkfs accepts */
+#ifndef RAMDISK_BLOCK_COUNT
+#define RAMDISK_BLOCK_COUNT       128
+#endif /* RAMDISK_BLOCK_COUNT */
+
+/* Erase block size in blocks reported to f_mkfs */
+#define RAMDISK_ERASE_BLOCK_SIZE  8
+
+#ifdef RAMDISK_LATENCY_MODEL
+/* Latency model, in microseconds.  The defaults are rough eMMC figures,
+   override them with values measured on the card */
+#ifndef RAMDISK_COMMAND_US
+#define RAMDISK_COMMAND_US        300     /* Per read or write command */
+#endif
+#ifndef RAMDISK_READ_US
+#define RAMDISK_READ_US           40      /* Per sector read */
+#endif
+#ifndef RAMDISK_WRITE_US
+#define RAMDISK_WRITE_US          80      /* Per sector written */
+#endif
+#ifndef RAMDISK_ERASE_US
+#define RAMDISK_ERASE_US          15000   /* Erase stall */
+#endif
+#ifndef RAMDISK_ERASE_INTERVAL
+#define RAMDISK_ERASE_INTERVAL    256     /* Sectors written between stalls */
+#endif
+#endif /* RAMDISK_LATENCY_MODEL */
+
+/* Private variables ---------------------------------------------------------*/
+/* Disk status */
+static volatile DSTATUS Stat = STA_NOINIT;
+
+/* Disk contents */
+static BYTE RamDisk[RAMDISK_BLOCK_COUNT * BLOCK_SIZE];
+
+#ifdef RAMDISK_LATENCY_MODEL
+/* Modelled time not yet waited, and sectors written since the last stall */
+static DWORD PendingUs;
+static DWORD WrittenSinceErase;
+#endif /* RAMDISK_LATENCY_MODEL */
+
+/* Private function prototypes -----------------------------------------------*/
+DSTATUS RAMDISK_initialize (BYTE);
+DSTATUS RAMDISK_deinitialize (BYTE);
+DSTATUS RAMDISK_status (BYTE);
+DRESULT RAMDISK_read (BYTE, BYTE*, DWORD, UINT);
+#if _USE_WRITE == 1
+  DRESULT RAMDISK_write (BYTE, const BYTE*, DWORD, UINT);
+#endif /* _USE_WRITE == 1 */
+#if _USE_IOCTL == 1
+  DRESULT RAMDISK_ioctl (BYTE, BYTE, void*);
+#endif  /* _USE_IOCTL == 1 */
+
+const Diskio_drvTypeDef  RAMDISK_Driver =
+{
+  RAMDISK_initialize,
+  RAMDISK_deinitialize,
+  RAMDISK_status,
+  RAMDISK_read,
+#if  _USE_WRITE == 1
+  RAMDISK_write,
+#endif /* _USE_WRITE == 1 */
+
+#if  _USE_IOCTL == 1
+  RAMDISK_ioctl,
+#endif /* _USE_IOCTL == 1 */
+};
+
+/* Private functions ---------------------------------------------------------*/
+
+#ifdef RAMDISK_LATENCY_MODEL
+/**
+  * @brief  Waits for the modelled duration of an access
+  * @param  us: Duration of the access in microseconds
+  * @retval None
+  */
+static void RAMDISK_Wait(DWORD us)
+{
+  /* The kernel only waits whole ticks, the remainder is carried over */
+  PendingUs += us;
+  if(PendingUs >= 1000)
+  {
+    osDelay(PendingUs / 1000);
+    PendingUs %= 1000;
+  }
+}
+#endif /* RAMDISK_LATENCY_MODEL */
+
+/**
+  * @brief  Initializes a Drive
+  * @param  lun : not used
+  * @retval DSTATUS: Operation status
+  */
+DSTATUS RAMDISK_initialize(BYTE lun)
+{
+  Stat &= ~STA_NOINIT;
+  return Stat;
+}
+
+/**
+  * @brief  Deinitializes a Drive, the contents are kept
+  * @param  lun : not used
+  * @retval DSTATUS: Operation status
+  */
+DSTATUS RAMDISK_deinitialize(BYTE lun)
+{
+  Stat = STA_NOINIT;
+  return Stat;
+}
+
+/**
+  * @brief  Gets Disk Status
+  * @param  lun : not used
+  * @retval DSTATUS: Operation status
+  */
+DSTATUS RAMDISK_status(BYTE lun)
+{
+  return Stat;
+}
+
+/**
+  * @brief  Reads Sector(s)
+  * @param  lun : not used
+  * @param  *buff: Data buffer to store read data
+  * @param  sector: Sector address (LBA)
+  * @param  count: Number of sectors to read (1..128)
+  * @retval DRESULT: Operation result
+  */
+DRESULT RAMDISK_read(BYTE lun, BYTE *buff, DWORD sector, UINT count)
+{
+  if (Stat & STA_NOINIT) return RES_NOTRDY;
+  if ((sector + count) > RAMDISK_BLOCK_COUNT) return RES_PARERR;
+
+#ifdef RAMDISK_LATENCY_MODEL
+  RAMDISK_Wait(RAMDISK_COMMAND_US + (count * RAMDISK_READ_US));
+#endif /* RAMDISK_LATENCY_MODEL */
+
+  memcpy(buff, &RamDisk[sector * BLOCK_SIZE], count * BLOCK_SIZE);
+
+  return RES_OK;
+}
+
+/**
+  * @brief  Writes Sector(s)
+  * @param  lun : not used
+  * @param  *buff: Data to be written
+  * @param  sector: Sector address (LBA)
+  * @param  count: Number of sectors to write (1..128)
+  * @retval DRESULT: Operation result
+  */
+#if _USE_WRITE == 1
+DRESULT RAMDISK_write(BYTE lun, const BYTE *buff, DWORD sector, UINT count)
+{
+  if (Stat & STA_NOINIT) return RES_NOTRDY;
+  if ((sector + count) > RAMDISK_BLOCK_COUNT) return RES_PARERR;
+
+#ifdef RAMDISK_LATENCY_MODEL
+  RAMDISK_Wait(RAMDISK_COMMAND_US + (count * RAMDISK_WRITE_US));
+
+  WrittenSinceErase += count;
+  if(WrittenSinceErase >= RAMDISK_ERASE_INTERVAL)
+  {
+    WrittenSinceErase -= RAMDISK_ERASE_INTERVAL;
+    RAMDISK_Wait(RAMDISK_ERASE_US);
+  }
+#endif /* RAMDISK_LATENCY_MODEL */
+
+  memcpy(&RamDisk[sector * BLOCK_SIZE], buff, count * BLOCK_SIZE);
+
+  return RES_OK;
+}
+#endif /* _USE_WRITE == 1 */
+
+/**
+  * @brief  I/O control operation
+  * @param  lun : not used
+  * @param  cmd: Control code
+  * @param  *buff: Buffer to send/receive control data
+  * @retval DRESULT: Operation result
+  */
+#if _USE_IOCTL == 1
+DRESULT RAMDISK_ioctl(BYTE lun, BYTE cmd, void *buff)
+{
+  DRESULT res = RES_ERROR;
+
+  if (Stat & STA_NOINIT) return RES_NOTRDY;
+
+  switch (cmd)
+  {
+  /* Make sure that no pending write process */
+  case CTRL_SYNC :
+    res = RES_OK;
+    break;
+
+  /* Get number of sectors on the disk (DWORD) */
+  case GET_SECTOR_COUNT :
+    *(DWORD*)buff = RAMDISK_BLOCK_COUNT;
+    res = RES_OK;
+    break;
+
+  /* Get R/W sector size (WORD) */
+  case GET_SECTOR_SIZE :
+    *(WORD*)buff = BLOCK_SIZE;
+    res = RES_OK;
+    break;
+
+  /* Get erase block size in unit of sector (DWORD) */
+  case GET_BLOCK_SIZE :
+    *(DWORD*)buff = RAMDISK_ERASE_BLOCK_SIZE;
+    res = RES_OK;
+    break;
+
+  default:
+    res = RES_PARERR;
+  }
+
+  return res;
+}
+#endif /* _USE_IOCTL == 1 */
+
+#endif /* USE_RAMDISK */
@@ -0,0 +1,18 @@
+/**
+  ******************************************************************************
+  * @file    ramdisk_diskio.h
+  * @brief   Header for ramdisk_diskio.c module
+  ******************************************************************************
+  */
+
+/* Define to prevent recursive inclusion -------------------------------------*/
+#ifndef __RAMDISK_DISKIO_H
+#define __RAMDISK_DISKIO_H
+
+/* Includes ------------------------------------------------------------------*/
+/* Exported types ------------------------------------------------------------*/
+/* Exported constants --------------------------------------------------------*/
+/* Exported functions ------------------------------------------------------- */
+extern Diskio_drvTypeDef  RAMDISK_Driver;
+
+#endif /* __RAMDISK_DISKIO_H */
@@ -0,0 +1,44 @@
+/*****< advtiming.c >**********************************************************/
+/*                                                                            */
+/*  AdvTiming - Discovery latency and radio use of LE advertising.            */
+/*                                                                            */
+/******************************************************************************/
+#include "AdvTiming.h"
+
+#define ADV_TIMING_DELAY_MAX_US                         (ADV_TIMING_DELAY_MAX_MS * 1000)
+
+   /* The following function returns the mean spacing of the events, the*/
+   /* interval plus the mean of the uniform random delay.               */
+uint32_t AdvTimingSpacing(uint16_t Interval)
+{
+   return(((uint32_t)Interval * 1000) + (ADV_TIMING_DELAY_MAX_US / 2));
+}
+
+   /* The following function returns the mean wait for the next event.  */
+   /* A scan that starts at a random time more likely falls into a long */
+   /* spacing than a short one, so the wait is E[T^2] / 2E[T], with     */
+   /* E[T^2] = E[T]^2 + Var(T) and the variance of the uniform delay    */
+   /* D^2 / 12.                                                         */
+uint32_t AdvTimingDiscoveryMean(uint16_t Interval)
+{
+   uint64_t Mean     = AdvTimingSpacing(Interval);
+   uint64_t Variance = ((uint64_t)ADV_TIMING_DELAY_MAX_US * ADV_TIMING_DELAY_MAX_US) / 12;
+   uint64_t Wait;
+
+   Wait = ((Mean * Mean) + Variance) / (2 * Mean);
+
+   return((uint32_t)((Wait + 500) / 1000));
+}
+
+   /* The following function returns the longest wait, one interval with*/
+   /* the longest delay.                                                */
+uint32_t AdvTimingDiscoveryMax(uint16_t Interval)
+{
+   return((uint32_t)Interval + ADV_TIMING_DELAY_MAX_MS);
+}
+
+   /* The following function returns the radio duty cycle.             */
+uint32_t AdvTimingDuty(uint32_t EventUs, uint16_t Interval)
+{
+   return((uint32_t)(((uint64_t)EventUs * 10000) / AdvTimingSpacing(Interval)));
+}
@@ -0,0 +1,35 @@
+/*****< advtiming.h >**********************************************************/
+/*                                                                            */
+/*  AdvTiming - Discovery latency and radio use of LE advertising.            */
+/*                                                                            */
+/*  The controller adds a random delay of 0-10 ms to every advertising       */
+/*  interval (Core spec Vol 6 Part B 4.4.2.2), so the advertising events of  */
+/*  an interval of I ms are I + 5 ms apart on average.  A central that scans */
+/*  continuously finds the card at its next advertising event; for a scan   */
+/*  that starts at a random time that takes E[T^2] / 2E[T] over the event   */
+/*  spacing T, about half an interval, and at most I + 10 ms.  Centrals that */
+/*  scan with a duty cycle take longer.  The arithmetic has no stack        */
+/*  dependencies so it can be built and tested on a host.                   */
+/*                                                                            */
+/******************************************************************************/
+#ifndef __ADVTIMINGH__
+#define __ADVTIMINGH__
+
+#include <stdint.h>
+
+   /* The largest random delay added to each advertising interval.      */
+#define ADV_TIMING_DELAY_MAX_MS                         10
+
+   /* Mean time between advertising events, in us.                      */
+uint32_t AdvTimingSpacing(uint16_t Interval);
+
+   /* Mean and longest time to the next advertising event, in ms, for a */
+   /* central that scans continuously.                                  */
+uint32_t AdvTimingDiscoveryMean(uint16_t Interval);
+uint32_t AdvTimingDiscoveryMax(uint16_t Interval);
+
+   /* Share of the time the radio advertises, in 1/100 %, for events of */
+   /* EventUs us.                                                       */
+uint32_t AdvTimingDuty(uint32_t EventUs, uint16_t Interval);
+
+#endif
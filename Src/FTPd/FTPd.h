@@ -2,6 +2,36 @@
 #define _FTPd
 
 #define RBUF_SIZE    2048
+
+// Frame types on the link, the socket number selects the type in my_send
+#define FTP_FRAME_COMMAND       0x01
+#define FTP_FRAME_DATA          0x02
+#define FTP_FRAME_BINARY_CMD    0x03
+#define FTP_BINARY_SOCKET       3
+#define FTP_FRAME_PRIORITY      0x04
+
+// Priority frame payload: code (1) and an optional token (1)
+#define FTP_PRIO_ABORT          0x01    // Host: abort the current command
+#define FTP_PRIO_PING           0x02    // Host: answered by FTP_PRIO_PONG with the same token
+#define FTP_PRIO_PONG           0x03
+#define FTP_PRIO_ABORTED        0x04    // Card: abort finished, ready for commands
+// Data channel round trip estimates, one per link, in ms.  Srtt is scaled by 8
+// and Rttvar by 4 as in RFC 6298.
+#define FTP_LINK_USB            0
+#define FTP_LINK_BT             1
+#define FTP_LINK_COUNT          2
+
+typedef struct
+{
+  unsigned int Srtt;
+  unsigned int Rttvar;
+  unsigned int Rto;
+  unsigned int Samples;
+  unsigned int Timeouts;
+} FtpRtt_t;
+
+extern FtpRtt_t FtpRtt[FTP_LINK_COUNT];
+
 typedef struct  ringBufS
 {
   unsigned char buf[RBUF_SIZE];
@@ -13,8 +43,6 @@ typedef struct  ringBufS
 extern ringBufS rBufs1;
 extern ringBufS rBufs2;
 extern SemaphoreHandle_t gCS;
-extern osSemaphoreId FTP_RxDataReady;
-extern osSemaphoreId FTP_RxFifoEmpty;
 
 extern void PMICGetDeviceSettings(void);
 
@@ -22,6 +50,10 @@ extern void ringBufS_flush(ringBufS *rBufs, const int clearBuffer);
 extern void InitializeCriticalSection(SemaphoreHandle_t *xSemaphore);
 
 extern void FTPThread(void const *argument);
+extern void FtpResetCommands(void);
+extern void FtpWakeReceive(void);
+extern void FtpFinishAbort(void);
+extern void FtpRttExpectData(void);
 
 extern FRESULT f_move (const TCHAR* path_source, const TCHAR* path_dest);
 
@@ -0,0 +1,69 @@
+//------------------------------------------------------------------------------------
+// CRC-32 (the zlib/PKZIP polynomial) using the STM32F4 CRC unit.
+//
+// The CRC unit computes the non reflected CRC-32/MPEG-2 one 32 bit word at a time.
+// Bit reversing each input word and the result turns it into the reflected
+// CRC-32 used by zip, zlib and FTP XCRC.  Trailing bytes that do not make a whole
+// word are done in software from the hardware state.
+//------------------------------------------------------------------------------------
+#include <string.h>
+
+#include "main.h"
+#include "crc32.h"
+
+#define CRC32_POLY_REFLECTED    0xEDB88320
+
+static int Crc32Software;       // Hardware state was handed over to Crc32Value
+static uint32_t Crc32Value;
+
+//------------------------------------------------------------------------------------
+// Start a new CRC.
+//------------------------------------------------------------------------------------
+void Crc32Start(void)
+{
+    __HAL_RCC_CRC_CLK_ENABLE();
+    CRC->CR = CRC_CR_RESET;
+    Crc32Software = 0;
+}
+
+//------------------------------------------------------------------------------------
+// Add Len bytes to the CRC.
+//------------------------------------------------------------------------------------
+void Crc32Feed(const void * Data, uint32_t Len)
+{
+    const uint8_t * p = (const uint8_t *)Data;
+    uint32_t Word;
+    int a;
+
+    if (!Crc32Software){
+        while(Len >= 4){
+            memcpy(&Word, p, 4);
+            CRC->DR = __RBIT(Word);
+            p += 4;
+            Len -= 4;
+        }
+        if (Len == 0){
+            return;
+        }
+        Crc32Value = __RBIT(CRC->DR);
+        Crc32Software = 1;
+    }
+
+    while(Len--){
+        Crc32Value ^= *p++;
+        for(a=0;a<8;a++){
+            Crc32Value = (Crc32Value >> 1) ^ (CRC32_POLY_REFLECTED & (0 - (Crc32Value & 1)));
+        }
+    }
+}
+
+//------------------------------------------------------------------------------------
+// Return the CRC of all data fed since Crc32Start().
+//------------------------------------------------------------------------------------
+uint32_t Crc32End(void)
+{
+    if (!Crc32Software){
+        Crc32Value = __RBIT(CRC->DR);
+    }
+    return ~Crc32Value;
+}
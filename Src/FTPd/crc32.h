@@ -0,0 +1,17 @@
+//------------------------------------------------------------------------------------
+// CRC-32 (the zlib/PKZIP polynomial) using the STM32F4 CRC unit.
+//
+// Only one CRC can be in progress at a time.  Feed data in multiples of 4 bytes
+// to stay on the hardware path, a shorter block switches the rest of the CRC to
+// software.
+//------------------------------------------------------------------------------------
+#ifndef _CRC32_H
+#define _CRC32_H
+
+#include <stdint.h>
+
+void Crc32Start(void);
+void Crc32Feed(const void * Data, uint32_t Len);
+uint32_t Crc32End(void);
+
+#endif
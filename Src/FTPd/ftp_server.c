@@ -31,8 +31,6 @@ DWORD GetTickCount(void){
 }
 
 SemaphoreHandle_t gCS = NULL;
-osSemaphoreId FTP_RxDataReady = NULL;
-osSemaphoreId FTP_RxFifoEmpty = NULL;
 
 void InitializeCriticalSection(SemaphoreHandle_t *xSemaphore) {
   *xSemaphore = xSemaphoreCreateMutex();
@@ -64,6 +62,341 @@ DWORD WINAPI ReaderAndStatusProc(LPVOID lpV);
 ringBufS rBufs1;
 ringBufS rBufs2;
 
+// Set by my_recv when the frame it returned was a binary command frame. Those are
+// queued with bit 7 of the length MSB set.
+BOOL FTPBinaryFrame;
+#define FRAME_BINARY_FLAG 0x80
+
+// Priority frames do not go through the rings.  Received ones are handled as
+// soon as HandleASuccessfulRead sees them, the replies wait in a small queue that
+// the FTP thread sends ahead of its next frame, or while it waits for commands.
+#define PRIO_QUEUE_SIZE         4
+#define PRIO_PAYLOAD_MAX        2
+#define PRIO_FRAME_SIZE         (PRIO_PAYLOAD_MAX + 5)
+
+static char PrioQueue[PRIO_QUEUE_SIZE][PRIO_FRAME_SIZE];
+static volatile unsigned int PrioHead;      // Written by the receive side
+static volatile unsigned int PrioTail;      // Written by the FTP thread
+static volatile BOOL PrioAbort;             // FTPAbort was set by the host
+
+// The FTP thread and the thread feeding the rings wake each other with task
+// notifications.  A waiter says how many bytes it needs, and the other side only
+// notifies it once the ring can satisfy that, or when FTPAbort is set.  Both
+// thresholds are capped at half the ring so the two can never wait on each other.
+#define RX_WAIT_MAX             (RBUF_SIZE / 2)
+#define RX_WAIT_IDLE            1000    // ms, command channel, nothing else to do
+
+static osThreadId RxWaiter;                 // FTP thread waiting for data
+static ringBufS *RxWaitRing;
+static int RxWaitBytes;
+static osThreadId RoomWaiter;               // Reader waiting for room in a ring
+static ringBufS *RoomWaitRing;
+static int RoomWaitBytes;
+
+static void WakeRxWaiter(void)
+{
+  osThreadId xTask = RxWaiter;
+  
+  if (xTask != NULL) {
+    RxWaiter = NULL;
+    xTaskNotifyGive(xTask);
+  }
+}
+
+static void WakeRoomWaiter(void)
+{
+  osThreadId xTask = RoomWaiter;
+  
+  if (xTask != NULL) {
+    RoomWaiter = NULL;
+    xTaskNotifyGive(xTask);
+  }
+}
+
+// Called with gCS held after data was added to or taken from prBufs.
+static void NotifyRingWaiters(ringBufS *prBufs)
+{
+  if ((RxWaitRing == prBufs) && (prBufs->count >= RxWaitBytes)) {
+    WakeRxWaiter();
+  }
+  if ((RoomWaitRing == prBufs) && (RBUF_SIZE - prBufs->count >= RoomWaitBytes)) {
+    WakeRoomWaiter();
+  }
+}
+
+static DWORD TicksUntil(DWORD dwDeadline)
+{
+  DWORD dwNow = GetTickCount();
+  
+  return (dwDeadline > dwNow) ? dwDeadline - dwNow : 1;
+}
+
+// Wait until prBufs holds iBytes, a priority frame is queued, FTP is aborted or
+// dwTo ms have passed.
+static void WaitForRxData(ringBufS *prBufs, int iBytes, DWORD dwTo)
+{
+  if (iBytes > RX_WAIT_MAX) {
+    iBytes = RX_WAIT_MAX;
+  }
+  EnterCriticalSection(&gCS);
+  if ((prBufs->count >= iBytes) || (PrioHead != PrioTail) || FTPAbort) {
+    LeaveCriticalSection(&gCS);
+    return;
+  }
+  RxWaitRing = prBufs;
+  RxWaitBytes = iBytes;
+  RxWaiter = osThreadGetId();
+  LeaveCriticalSection(&gCS);
+  
+  ulTaskNotifyTake(pdTRUE, dwTo);
+  RxWaiter = NULL;
+  RxWaitRing = NULL;
+}
+
+// Wait until prBufs has room for iBytes or FTP is aborted.
+static void WaitForRoom(ringBufS *prBufs, int iBytes)
+{
+  if (iBytes > RX_WAIT_MAX) {
+    iBytes = RX_WAIT_MAX;
+  }
+  EnterCriticalSection(&gCS);
+  if ((RBUF_SIZE - prBufs->count >= iBytes) || FTPAbort) {
+    LeaveCriticalSection(&gCS);
+    return;
+  }
+  RoomWaitRing = prBufs;
+  RoomWaitBytes = iBytes;
+  RoomWaiter = osThreadGetId();
+  LeaveCriticalSection(&gCS);
+  
+  ulTaskNotifyTake(pdTRUE, RX_WAIT_IDLE);
+  RoomWaiter = NULL;
+  RoomWaitRing = NULL;
+}
+
+// Wake both sides, used when FTPAbort is set.
+void FtpWakeReceive(void)
+{
+  WakeRoomWaiter();
+  WakeRxWaiter();
+}
+
+static void BuildPriorityFrame(char *pbuf, char Code, char Token)
+{
+  pbuf[0] = FTP_FRAME_PRIORITY;
+  pbuf[1] = 0;
+  pbuf[2] = PRIO_FRAME_SIZE;
+  pbuf[3] = Code;
+  pbuf[4] = Token;
+  pbuf[5] = 0;
+  pbuf[6] = 0;
+}
+
+// Only called from the receive side, the queue has a single producer.
+static void QueuePriorityFrame(char Code, char Token)
+{
+  if (PrioHead - PrioTail >= PRIO_QUEUE_SIZE) {
+    return;     // Host is pinging faster than we can answer
+  }
+  BuildPriorityFrame(PrioQueue[PrioHead % PRIO_QUEUE_SIZE], Code, Token);
+  PrioHead++;
+  WakeRxWaiter();
+}
+
+static void SendPriorityFrames(void)
+{
+  while (PrioTail != PrioHead) {
+    pWriteABuffer(PrioQueue[PrioTail % PRIO_QUEUE_SIZE], PRIO_FRAME_SIZE);
+    PrioTail++;
+  }
+}
+
+static void HandlePriorityFrame(const char *Payload, int Len)
+{
+  if (Len < 1) {
+    return;
+  }
+  switch (Payload[0]) {
+    case FTP_PRIO_ABORT:
+      PrioAbort = TRUE;
+      FTPAborted = FALSE;
+      FTPAbort = TRUE;
+      FtpWakeReceive();
+      break;
+    case FTP_PRIO_PING:
+      QueuePriorityFrame(FTP_PRIO_PONG, (Len > 1) ? Payload[1] : 0);
+      break;
+  }
+}
+
+// Called by the FTP thread once it is back waiting for commands after an abort
+// requested by the host.  The host sends nothing between the abort and the
+// answer, so the rings only hold frames sent before the abort, whole, and the
+// receive side is at a frame boundary.  Commands queued before the abort are
+// dropped with them.
+static void FinishPriorityAbort(void)
+{
+  char Frame[PRIO_FRAME_SIZE];
+
+  EnterCriticalSection(&gCS);
+  ringBufS_flush(&rBufs1, FALSE);
+  ringBufS_flush(&rBufs2, FALSE);
+  LeaveCriticalSection(&gCS);
+  FtpResetCommands();
+  PrioAbort = FALSE;
+  FTPAbort = FALSE;
+  BuildPriorityFrame(Frame, FTP_PRIO_ABORTED, 0);
+  pWriteABuffer(Frame, PRIO_FRAME_SIZE);
+}
+
+// Called by the command parser before it reads the pending commands, so none of
+// them runs after an abort requested by the host.
+void FtpFinishAbort(void)
+{
+  if ((FTPAbort) && (PrioAbort))
+  {
+    FinishPriorityAbort();
+  }
+}
+
+// Data channel round trips are estimated per link, TCP style (RFC 6298).  A sample
+// is the time from a 150 reply to the first byte of the data the host sends after
+// it, the pauses of the host between its own frames are not round trips.  The
+// estimates are kept in ticks, SRTT scaled by 8 and RTTVAR by 4, and
+// Settings.SPP_Receive_Timeout is the upper limit.
+// The RTO only paces the receive waits: a data frame later than that is counted
+// in Timeouts.  A transfer ends on its empty EOF frame, or once nothing arrived
+// for Settings.SPP_Receive_Timeout, never on the RTO.
+#define RTO_MIN_USB             100
+#define RTO_MIN_BT              500
+
+FtpRtt_t FtpRtt[FTP_LINK_COUNT];
+
+static DWORD RttSendTick;
+static BOOL RttPending;                     // A 150 reply waits for its data
+
+static FtpRtt_t *FtpRttLink(void)
+{
+  return &FtpRtt[(pWriteABuffer == BT_WriteABuffer) ? FTP_LINK_BT : FTP_LINK_USB];
+}
+
+static DWORD FtpRttLimit(FtpRtt_t *pRtt, DWORD dwRto)
+{
+  DWORD dwMin = (pRtt == &FtpRtt[FTP_LINK_BT]) ? RTO_MIN_BT : RTO_MIN_USB;
+  
+  if (dwRto < dwMin) {
+    dwRto = dwMin;
+  }
+  if (dwRto > Settings.SPP_Receive_Timeout) {
+    dwRto = Settings.SPP_Receive_Timeout;
+  }
+  return dwRto;
+}
+
+static DWORD FtpRttTimeout(void)
+{
+  FtpRtt_t *pRtt = FtpRttLink();
+  
+  if (pRtt->Samples == 0) {
+    return Settings.SPP_Receive_Timeout;
+  }
+  return FtpRttLimit(pRtt, pRtt->Rto);
+}
+
+static void FtpRttSample(DWORD dwRtt)
+{
+  FtpRtt_t *pRtt = FtpRttLink();
+  int iErr;
+  
+  if (pRtt->Samples == 0) {
+    pRtt->Srtt = dwRtt << 3;
+    pRtt->Rttvar = dwRtt << 1;
+  } else {
+    iErr = (int)dwRtt - (int)(pRtt->Srtt >> 3);
+    pRtt->Srtt += iErr;
+    if (iErr < 0) {
+      iErr = -iErr;
+    }
+    pRtt->Rttvar += iErr - (int)(pRtt->Rttvar >> 2);
+  }
+  pRtt->Samples++;
+  pRtt->Rto = FtpRttLimit(pRtt, (pRtt->Srtt >> 3) + pRtt->Rttvar);
+}
+
+// No data within the RTO, back off until the next sample.
+static void FtpRttExpired(void)
+{
+  FtpRtt_t *pRtt = FtpRttLink();
+  
+  pRtt->Timeouts++;
+  if (pRtt->Samples) {
+    pRtt->Rto = FtpRttLimit(pRtt, pRtt->Rto << 1);
+  }
+}
+
+// Called as the 150 reply of a command is sent, the host answers it with data
+// frames or with its next command.
+void FtpRttExpectData(void)
+{
+  RttSendTick = GetTickCount();
+  RttPending = TRUE;
+}
+
+// The first data byte after the 150 reply closes the round trip.
+static void FtpRttDataArrived(void)
+{
+  if (RttPending) {
+    RttPending = FALSE;
+    FtpRttSample(GetTickCount() - RttSendTick);
+  }
+}
+
+// Data channel deadlines of one receive call, both restart when data arrives.
+typedef struct
+{
+  DWORD dwTo;           // RTO
+  DWORD dwIdle;         // End of the transfer
+  DWORD dwLate;
+  DWORD dwEnd;
+  BOOL bLate;
+} RxDeadline_t;
+
+static void RxDeadlineData(RxDeadline_t *pDl)
+{
+  DWORD dwNow = GetTickCount();
+  
+  pDl->dwLate = dwNow + pDl->dwTo;
+  pDl->dwEnd = dwNow + pDl->dwIdle;
+}
+
+static void RxDeadlineStart(RxDeadline_t *pDl)
+{
+  pDl->dwTo = FtpRttTimeout();
+  pDl->dwIdle = Settings.SPP_Receive_Timeout;
+  if (pDl->dwIdle < pDl->dwTo) {
+    pDl->dwIdle = pDl->dwTo;
+  }
+  pDl->bLate = FALSE;
+  RxDeadlineData(pDl);
+}
+
+// TRUE once the idle limit has passed, a late frame is counted on the way.
+static BOOL RxDeadlineExpired(RxDeadline_t *pDl)
+{
+  DWORD dwNow = GetTickCount();
+  
+  if (!pDl->bLate && (dwNow > pDl->dwLate)) {
+    pDl->bLate = TRUE;
+    FtpRttExpired();
+  }
+  return (dwNow > pDl->dwEnd);
+}
+
+static DWORD RxDeadlineWait(RxDeadline_t *pDl)
+{
+  return TicksUntil(pDl->bLate ? pDl->dwEnd : pDl->dwLate);
+}
+
 void ringBufS_put(ringBufS *rBufs, const unsigned char c);
 void ringBufS_put_multi(ringBufS *prBufs, char* buf, int iLen);
 int ringBufS_get(ringBufS *rBufs);
@@ -76,12 +409,16 @@ int my_send(SOCKET so, const char *buf, int len, int flags){
 	int iRet;
 	int iCheck = 0, i;
         char * pbuf = (char *)buf;
+        SendPriorityFrames();
 	for(;;) {
 		if (so == 2){
-			pbuf[0] = 0x02;
+			pbuf[0] = FTP_FRAME_DATA;
+		}
+		else if (so == FTP_BINARY_SOCKET){
+			pbuf[0] = FTP_FRAME_BINARY_CMD;
 		}
 		else {
-			pbuf[0] = 0x01;
+			pbuf[0] = FTP_FRAME_COMMAND;
 		}
 		i = len + 5;
 		pbuf[1] = (char)(i >> 8);
@@ -97,17 +434,15 @@ int my_send(SOCKET so, const char *buf, int len, int flags){
 }
 
 
+// Returns one whole frame.  A frame longer than len is read to its end and
+// dropped, -1 is returned, so the next call starts at a frame header.  A frame
+// cut short by FTPAbort is -1 too, the rings are flushed after the abort.
 int my_recv(SOCKET so, char *buf, int len, int flags){
-  DWORD dwTimeout, dwTo; // todo must be tune for baud other than 115200
+  RxDeadline_t Dl;
   int c, iRet = 0, iLen = 0;
   int iStep = 0;
-  if (so == 2) {
-    dwTo = 500;
-  }
-  else {
-    dwTo = 100;
-  }
-  dwTimeout = GetTickCount() + dwTo;
+  BOOL bDrop = FALSE;
+  RxDeadlineStart(&Dl);
   do{
     if ((so == 1) && (FTPAbort)) 
     {
@@ -118,7 +453,7 @@ int my_recv(SOCKET so, char *buf, int len, int flags){
     {
       if (so == 2) 
       {
-        if (GetTickCount() > dwTimeout) 
+        if (RxDeadlineExpired(&Dl)) 
         {
           iRet = 0;
           break;
@@ -134,13 +469,35 @@ int my_recv(SOCKET so, char *buf, int len, int flags){
       }
       if (c == -1) 
       {
-        osSemaphoreWait(FTP_RxDataReady , 10); 
+        if (so == 1)
+        {
+          WaitForRxData(&rBufs1, (iStep < 2) ? 2 - iStep : min(iLen, len), RX_WAIT_IDLE);
+          SendPriorityFrames();
+        }
+        else
+        {
+          WaitForRxData(&rBufs2, (iStep < 2) ? 2 - iStep : min(iLen, len), RxDeadlineWait(&Dl));
+        }
         continue;
       }
+      if (so == 2)
+      {
+        if (iStep == 0)
+        {
+          FtpRttDataArrived();
+        }
+        RxDeadlineData(&Dl);
+      }
+      else
+      {
+        // The host answered the last reply with a command, not with data
+        RttPending = FALSE;
+      }
     }
     switch (iStep) {
       case 0:
-        iLen = (int)c << 8; // len MSB
+        iLen = (int)(c & ~FRAME_BINARY_FLAG) << 8; // len MSB
+        FTPBinaryFrame = (c & FRAME_BINARY_FLAG) ? TRUE : FALSE;
         //len--;
         iStep++;
         break;
@@ -149,14 +506,16 @@ int my_recv(SOCKET so, char *buf, int len, int flags){
         //len--;
         iStep++;
         if (iLen == 0)iStep++;
+        bDrop = (iLen > len);
         //printf("iLen:%d\n", iLen);
         break;
       case 2:
         if (iLen) {
           //printf("%c", c);
-          *buf++ = c;
-          len--;
-          iRet++;
+          if (!bDrop) {
+            *buf++ = c;
+            iRet++;
+          }
           iLen--;
         }
         if (iLen == 0){
@@ -164,26 +523,27 @@ int my_recv(SOCKET so, char *buf, int len, int flags){
         }
         break;
     }
-  } while(len && (iStep < 3) && (FTPAbort == FALSE));
+  } while((iStep < 3) && (FTPAbort == FALSE));
+  
+  if (bDrop || ((iStep > 0) && (iStep < 3)))
+  {
+    iRet = -1;
+  }
    
-  osSemaphoreRelease(FTP_RxFifoEmpty);
-  osThreadYield();
   return iRet;
 }
 
 
 int my_recv2(SOCKET so, char *buf, int len, int flags){
   
-  DWORD dwTimeout, dwTo; // todo must be tune for baud other than 115200
+  RxDeadline_t Dl;
   int c, iRet = 0, iLen = 0;
   int iStep = 0;
   
   // so = 1 = command channel
   // so = 2 = data channel
        
-  dwTo = Settings.SPP_Receive_Timeout;
-  
-  dwTimeout = GetTickCount() + dwTo;
+  RxDeadlineStart(&Dl);
   
   do{
     
@@ -199,7 +559,7 @@ int my_recv2(SOCKET so, char *buf, int len, int flags){
       // an indication that there is no more data to be read
       if (so == 2) 
       {
-        if (GetTickCount() > dwTimeout) 
+        if (RxDeadlineExpired(&Dl)) 
         {
           iRet = 0;
           break;
@@ -228,10 +588,26 @@ int my_recv2(SOCKET so, char *buf, int len, int flags){
       // c = -1 = no data ready to be read
       if (c == -1) 
       {
-        osSemaphoreWait(FTP_RxDataReady , 10);  
+        if (so == 2)
+        {
+          WaitForRxData(&rBufs2, (iStep < 2) ? 2 - iStep : min(iLen, len), RxDeadlineWait(&Dl));
+        }
+        else
+        {
+          WaitForRxData(&rBufs1, (iStep < 2) ? 2 - iStep : min(iLen, len), RX_WAIT_IDLE);
+        }
         continue;
       }
       
+      // The deadlines run from the last data received
+      if (so == 2)
+      {
+        if (iStep == 0)
+        {
+          FtpRttDataArrived();
+        }
+        RxDeadlineData(&Dl);
+      }
     }
     
     
@@ -274,8 +650,6 @@ int my_recv2(SOCKET so, char *buf, int len, int flags){
     iRet = -1;
   }
   
-  osSemaphoreRelease(FTP_RxFifoEmpty);
-  osThreadYield();
   return iRet;
 }
 
@@ -283,6 +657,10 @@ int my_recv2(SOCKET so, char *buf, int len, int flags){
 int HandleASuccessfulRead(char *lpBuf, DWORD dwRead ){
 	int c;
         static ringBufS *prBufs;
+        static int iFlags;
+        static BOOL bPriority;
+        static char PrioPayload[PRIO_PAYLOAD_MAX];
+        static int iPrioLen;
 	static int iStep = 0;
 	static int iLen = 0;
 	int iCheck = 0, iRet = 0;
@@ -296,18 +674,24 @@ int HandleASuccessfulRead(char *lpBuf, DWORD dwRead ){
           return iRet;
         }
         
-	while(dwRead && (FTPAbort == FALSE)) 
+	// Keep parsing while aborting so the frames stay in step, the ring
+	// functions drop the data then.
+	while(dwRead) 
         {
                 c = *s; 
 		switch(iStep) 
                 {
 		case 0:
-			if (c == 0x02)
+                        bPriority = (c == FTP_FRAME_PRIORITY);
+                        iPrioLen = 0;
+			if (c == FTP_FRAME_DATA)
                         {
 				prBufs = &rBufs2;
+                                iFlags = 0;
 			}else 
                         {
 				prBufs = &rBufs1;	
+                                iFlags = (c == FTP_FRAME_BINARY_CMD) ? FRAME_BINARY_FLAG : 0;
 			}
                         iStep++;
                         dwRead--;
@@ -322,15 +706,25 @@ int HandleASuccessfulRead(char *lpBuf, DWORD dwRead ){
 		case 2:
 			iLen += c&0xff;	// len LSB
 			iLen -= 5;
-			ringBufS_put(prBufs, iLen >> 8);
-			ringBufS_put(prBufs, iLen & 0xff);
+                        if (!bPriority)
+                        {
+			  ringBufS_put(prBufs, (iLen >> 8) | iFlags);
+			  ringBufS_put(prBufs, iLen & 0xff);
+                        }
 			iStep++;
                         dwRead--;
                         s++;
 			break;
 		case 3:
                         c=min(iLen,dwRead);
-			ringBufS_put_multi(prBufs,s,c);
+                        if (bPriority)
+                        {
+                          memcpy(PrioPayload + iPrioLen, s, min(c, PRIO_PAYLOAD_MAX - iPrioLen));
+                          iPrioLen += min(c, PRIO_PAYLOAD_MAX - iPrioLen);
+                        }else
+                        {
+			  ringBufS_put_multi(prBufs,s,c);
+                        }
                         iLen -= c;
                         dwRead -= c;
                         s += c;
@@ -349,13 +743,16 @@ int HandleASuccessfulRead(char *lpBuf, DWORD dwRead ){
 			iCheck += c&0xff; // checksum LSB
 			iStep = 0;
 			iLen = 0;
+                        if (bPriority)
+                        {
+                          HandlePriorityFrame(PrioPayload, iPrioLen);
+                          bPriority = FALSE;
+                        }
                         dwRead--;
                         s++;
 			break;
 		}     
 	}
-        osSemaphoreRelease(FTP_RxDataReady); 
-        osThreadYield();                
 	return iRet;
 }
 
@@ -379,6 +776,7 @@ int ringBufS_get(ringBufS *prBufs)
       c  = prBufs->buf[prBufs->tail];
       prBufs->tail = modulo_inc (prBufs->tail, RBUF_SIZE);
       --prBufs->count;
+      NotifyRingWaiters(prBufs);
     }
     else
     {
@@ -412,6 +810,7 @@ int ringBufS_get_multi(ringBufS *prBufs, char* buf, int iLen)
       prBufs->tail=0;
     }
     prBufs->count -= c;
+    NotifyRingWaiters(prBufs);
     
   }else
   {
@@ -434,10 +833,11 @@ void ringBufS_put(ringBufS *prBufs, const unsigned char c)
             prBufs->head = modulo_inc (prBufs->head, RBUF_SIZE);
             ++prBufs->count;
             iWait = 0;
+            NotifyRingWaiters(prBufs);
           }
 	  LeaveCriticalSection(&gCS);
           if (iWait && (FTPAbort == FALSE)) {
-            osSemaphoreWait(FTP_RxFifoEmpty , 1);      // no delay while transferring MDR
+            WaitForRoom(prBufs, 1);
           }
     } while (iWait && (FTPAbort == FALSE));
 }
@@ -476,6 +876,7 @@ void ringBufS_put_multi(ringBufS *prBufs, char* buf, int iLen)
               prBufs->head = 0;
             }
             prBufs->count += PutNb;
+            NotifyRingWaiters(prBufs);
             
             if(iLen == 0)
             {
@@ -485,8 +886,7 @@ void ringBufS_put_multi(ringBufS *prBufs, char* buf, int iLen)
 	  LeaveCriticalSection(&gCS);
           if (iWait && (FTPAbort == FALSE)) 
           {
-            //osDelay(1);
-            osSemaphoreWait(FTP_RxFifoEmpty , 1);      // no delay while transferring MDR
+            WaitForRoom(prBufs, iLen);
           }
     } while (iWait && (FTPAbort == FALSE));
 }
@@ -504,6 +904,7 @@ void ringBufS_flush(ringBufS *prBufs, const int clearBuffer)
 void FtpServerReset(void)
 {
   HandleASuccessfulRead(NULL,0);
+  FtpResetCommands();
   ringBufS_flush(&rBufs1, TRUE);
   ringBufS_flush(&rBufs2, TRUE);
   printf("FTP Server Reset\r\n");
@@ -16,10 +16,12 @@
 #include "ff.h" 
 #include "FTPd.h"
 #include "main.h"
-#include "..\pmic.h"
+#include "../pmic.h"
 #include "slog.h"
-#include "..\SPPTask.h"
+#include "../SPPTask.h"
 #include "paths.h"
+#include "lzstream.h"
+#include "crc32.h"
 
 #define FTPDMIN_VER "1.0"
 #define LINK_KEY_HEX_LEN 49
@@ -62,11 +64,16 @@ typedef struct {
     char XferBuffer[528];
     int CommandSocket;
     int XferPort;
+    BOOL Compress;      // Next RETR/STOR is LZ compressed (OPTS COMP LZ)
+    char Tag[12];       // Sequence tag of the command being processed
+    BOOL Binary;        // Command came in a binary frame, reply in one too
+    unsigned char Seq;  // Sequence number of the binary command
 }Inst_t;
 
 extern int my_send(SOCKET s, const char *buf, int len, int flags);
 extern int my_recv(SOCKET s, char *buf, int len, int flags);
 extern int my_recv2(SOCKET so, char *buf, int len, int flags);
+extern BOOL FTPBinaryFrame;
 
 extern void AdvertiseLockStatus(int locked);
 
@@ -79,7 +86,9 @@ typedef enum {
     SYST, TYPE, MODE, RETR, 
     STOR, REST, RNFR, RNTO,
     STAT, NOOP, MDTM, xSIZE,
-    SRFT, MLST,
+    SRFT, MLST, OPTS, XCRC,
+    MANIFEST, MGET, MPUT, RRNG,
+    WRNG,
     UNKNOWN_COMMAND
 }CmdTypes;
 
@@ -104,9 +113,116 @@ static const Lookup_t CommandLookup[] = {
     "SYST", SYST, "TYPE", TYPE, "MODE", MODE, "RETR", RETR,
     "STOR", STOR, "REST", REST, "RNFR", RNFR, "RNTO", RNTO,
     "STAT", STAT, "NOOP", NOOP, "MDTM", MDTM, "SIZE", xSIZE,
-    "SRFT", SRFT, "MLST", MLST,
+    "SRFT", SRFT, "MLST", MLST, "OPTS", OPTS, "XCRC", XCRC,
+    "MANI", MANIFEST, "MGET", MGET, "MPUT", MPUT, "RRNG", RRNG,
+    "WRNG", WRNG,
 };
 
+//------------------------------------------------------------------------------------
+// Binary command frames (FTP_FRAME_BINARY_CMD) carry
+//   opcode (1), sequence (1), path length (1), path, numbers (4 each, little endian)
+// The opcode indexes BinaryOps directly and the command then runs like its text
+// form.  Replies go back in a binary frame: sequence (1) followed by the reply text.
+//------------------------------------------------------------------------------------
+typedef struct {
+    CmdTypes CmdNum;
+    unsigned char Nums;
+    char *Suffix;
+}BinaryOp_t;
+
+static const BinaryOp_t BinaryOps[] = {
+    {NOOP,      0, ""},         // 0x00
+    {PWD,       0, ""},         // 0x01
+    {CWD,       0, ""},         // 0x02
+    {LIST,      0, ""},         // 0x03
+    {NLST,      0, ""},         // 0x04
+    {RETR,      0, ""},         // 0x05
+    {STOR,      0, ""},         // 0x06
+    {DELE,      0, ""},         // 0x07
+    {DELE,      0, " -r"},      // 0x08 recursive
+    {MKD,       0, ""},         // 0x09
+    {RMD,       0, ""},         // 0x0A
+    {xSIZE,     0, ""},         // 0x0B
+    {MDTM,      0, ""},         // 0x0C
+    {RNFR,      0, ""},         // 0x0D
+    {RNTO,      0, ""},         // 0x0E
+    {XCRC,      2, ""},         // 0x0F start, end
+    {MANIFEST,  0, ""},         // 0x10
+    {MGET,      0, ""},         // 0x11
+    {MPUT,      0, ""},         // 0x12
+    {RRNG,      2, ""},         // 0x13 offset, length
+    {WRNG,      2, ""},         // 0x14 offset, length
+    {WRNG,      2, " A"},       // 0x15 offset, length, atomic
+    {QUIT,      0, ""},         // 0x16
+};
+
+// Codec state for compressed transfers, only one runs at a time.
+static union {
+    LZEncoder_t Enc;
+    LZDecoder_t Dec;
+}LZState;
+
+// Compressed STOR data received but not yet expanded, kept in Conn->XferBuffer.
+static int LZInPos, LZInLen;
+
+//------------------------------------------------------------------------------------
+// Transfer statistics, kept per command so throughput and latency changes can be
+// measured on the card.  Read back with RETR /device/stats.
+//------------------------------------------------------------------------------------
+typedef struct {
+    CmdTypes CmdNum;
+    unsigned long Count;
+    unsigned long Bytes;
+    unsigned long TotalTicks;
+    unsigned long MaxTicks;
+    unsigned long SectorsRead;
+    unsigned long SectorsWritten;
+}XferStats_t;
+
+// The counters are in RTOS ticks, the report is in ms
+#define XFER_TICKS_TO_MS(t)     ((unsigned long)(((unsigned long long)(t) * 1000) / configTICK_RATE_HZ))
+
+static XferStats_t XferStats[] = {
+    {RETR}, {STOR}, {LIST}, {NLST}, {SRFT}, {XCRC}, {MANIFEST},
+    {MGET}, {MPUT}, {RRNG}, {WRNG},
+};
+
+// Payload bytes moved by the command being processed, and the sectors the FTP
+// thread read and wrote for it.  Other tasks' disk accesses are not counted.
+static unsigned long XferBytes;
+static DISKIO_STATS XferDisk;
+
+static void UpdateXferStats(CmdTypes Cmd, unsigned long Ticks)
+{
+    int a;
+
+    for(a=0;a<sizeof(XferStats)/sizeof(XferStats_t);a++){
+        if (XferStats[a].CmdNum == Cmd){
+            XferStats[a].Count++;
+            XferStats[a].Bytes += XferBytes;
+            XferStats[a].TotalTicks += Ticks;
+            XferStats[a].SectorsRead += XferDisk.ReadSectors;
+            XferStats[a].SectorsWritten += XferDisk.WriteSectors;
+            if (Ticks > XferStats[a].MaxTicks){
+                XferStats[a].MaxTicks = Ticks;
+            }
+            break;
+        }
+    }
+}
+
+static const char * CommandName(CmdTypes Cmd)
+{
+    int a;
+
+    for(a=0;a<sizeof(CommandLookup)/sizeof(Lookup_t);a++){
+        if (CommandLookup[a].CmdNum == Cmd){
+            return CommandLookup[a].command;
+        }
+    }
+    return "?";
+}
+
 #if 0
 void ValidRxData(char* pRxData, int Size)
 {
@@ -239,28 +355,121 @@ void LinkKeyInfoToStr(LinkKeyInfo_t btkey, char *buffer){
 
 //------------------------------------------------------------------------------------
 // Get a ftp command from the command stream, convert to code and an argument string
+//
+// Hosts may pipeline commands: everything received after the first line is kept
+// and the following calls take their command from it without waiting on the link.
+// A command may start with a sequence tag, "#<tag> ", which is echoed in front of
+// each of its replies.
+//------------------------------------------------------------------------------------
+static char PendingCmds[500];
+static int PendingLen;
+
+// Drop pipelined commands of a previous connection
+void FtpResetCommands(void)
+{
+    PendingLen = 0;
+}
+
+static void SendReply(Inst_t * Conn, char *Reply);
+static void CrcCacheDrop(const char * path);
+
+//------------------------------------------------------------------------------------
+// Convert a binary command frame to a command code and an argument string.
 //------------------------------------------------------------------------------------
+static CmdTypes GetBinaryCommand(Inst_t * Conn, unsigned char * Frame, int Len, char * CmdArg)
+{
+    const BinaryOp_t * pOp;
+    unsigned char * pNum;
+    int PathLen, pos, a;
+
+    Conn->Binary = TRUE;
+    Conn->Tag[0] = 0;
+    Conn->Seq = (Len > 1) ? Frame[1] : 0;
+    if (Len < 3 || Frame[0] >= sizeof(BinaryOps)/sizeof(BinaryOp_t)){
+        SendReply(Conn, "500 command not recognized");
+        return UNKNOWN_COMMAND;
+    }
+    pOp = &BinaryOps[Frame[0]];
+    PathLen = Frame[2];
+    if (3 + PathLen + (4 * pOp->Nums) > Len || PathLen + (11 * pOp->Nums) + 4 > MAX_PATH){
+        SendReply(Conn, "501 Syntax error");
+        return UNKNOWN_COMMAND;
+    }
+
+    memcpy(CmdArg, Frame + 3, PathLen);
+    pos = PathLen;
+    pNum = Frame + 3 + PathLen;
+    for (a=0;a<pOp->Nums;a++,pNum+=4){
+        pos += sprintf(CmdArg + pos, " %lu", (unsigned long)pNum[0] | ((unsigned long)pNum[1] << 8)
+                       | ((unsigned long)pNum[2] << 16) | ((unsigned long)pNum[3] << 24));
+    }
+    strcpy(CmdArg + pos, pOp->Suffix);
+    return pOp->CmdNum;
+}
+
 static CmdTypes GetCommand(Inst_t * Conn, char *CmdArg) 
 {
     char InputString[500+1];
     int  CmdLen;
     char Command[6];
     int  a,b;
+    char * End;
 
-    // Read in command string
-    CmdLen = 0;
-    memset(InputString, 0, sizeof(InputString));
+    // Read until a whole line is buffered
     for (;;){
         int n;
-        n = my_recv(Conn->CommandSocket, InputString+CmdLen, sizeof(InputString)-CmdLen,0);
-        CmdLen += n;
-		if (strstr(InputString, "\r")){
-			break;
-		}
-		if (n <= 0){
+        FtpFinishAbort();
+        End = memchr(PendingCmds, '\r', PendingLen);
+        if (End != NULL){
+            break;
+        }
+        if (PendingLen == sizeof(PendingCmds)){
+            // Line too long, drop it
+            PendingLen = 0;
+        }
+        n = my_recv(Conn->CommandSocket, PendingCmds+PendingLen, sizeof(PendingCmds)-PendingLen,0);
+        if (n < 0 && !FTPAbort){
+            // The frame did not fit after the pending text, the line is too long
+            PendingLen = 0;
+            Conn->Binary = FALSE;
+            Conn->Tag[0] = 0;
+            SendReply(Conn, "500 Line too long");
+            return UNKNOWN_COMMAND;
+        }
+        if (n <= 0){
 			//printf("Conn->CommandSocket:%d\r\n",Conn->CommandSocket);
 			return UNKNOWN_COMMAND;
 		}
+        if (FTPBinaryFrame){
+            // Binary frames are complete commands, they never join the text
+            return GetBinaryCommand(Conn, (unsigned char *)PendingCmds + PendingLen, n, CmdArg);
+        }
+        PendingLen += n;
+    }
+    Conn->Binary = FALSE;
+
+    // Take the line and its line end out of the pending commands
+    CmdLen = End - PendingCmds;
+    memcpy(InputString, PendingCmds, CmdLen);
+    memset(InputString + CmdLen, 0, sizeof(InputString) - CmdLen);
+    End++;
+    if (End < PendingCmds + PendingLen && *End == '\n'){
+        End++;
+    }
+    PendingLen -= End - PendingCmds;
+    memmove(PendingCmds, End, PendingLen);
+
+    // Sequence tag
+    Conn->Tag[0] = 0;
+    if (InputString[0] == '#'){
+        for (a=1;a<sizeof(Conn->Tag) && isalnum(InputString[a]);a++){
+            Conn->Tag[a-1] = InputString[a];
+        }
+        Conn->Tag[a-1] = 0;
+        while (InputString[a] == ' '){
+            a++;
+        }
+        memmove(InputString, InputString + a, CmdLen + 1 - a);
     }
 
     memset(Command, 0, sizeof(Command));
@@ -270,6 +479,10 @@ static CmdTypes GetCommand(Inst_t * Conn, char *CmdArg)
 		}
         Command[a] = toupper(InputString[a]);
     }
+    // Skip the rest of long command names (MANIFEST)
+    while (isalpha(InputString[a])){
+        a++;
+    }
 
     b = 0;
     if (InputString[a++] == ' '){
@@ -300,10 +513,24 @@ static CmdTypes GetCommand(Inst_t * Conn, char *CmdArg)
 //------------------------------------------------------------------------------------
 static void SendReply(Inst_t * Conn, char *Reply) 
 {
-    char ReplyStr[MAX_PATH+20];
+    char ReplyStr[MAX_PATH+40];
     slogf(LOG_DEST_BOTH, "[sendReply] %s", Reply);
-    sprintf(ReplyStr + 3, "%s\r\n", Reply);
-    my_send(Conn->CommandSocket, ReplyStr, strlen(Reply) + 2,0);
+    if (strncmp(Reply, "150", 3) == 0){
+        FtpRttExpectData();
+    }
+    if (Conn->Binary){
+        ReplyStr[3] = Conn->Seq;
+        strncpy(ReplyStr + 4, Reply, sizeof(ReplyStr) - 5);
+        ReplyStr[sizeof(ReplyStr) - 1] = 0;
+        my_send(FTP_BINARY_SOCKET, ReplyStr, strlen(ReplyStr + 4) + 1, 0);
+        return;
+    }
+    if (Conn->Tag[0]){
+        sprintf(ReplyStr + 3, "#%s %s\r\n", Conn->Tag, Reply);
+    }else{
+        sprintf(ReplyStr + 3, "%s\r\n", Reply);
+    }
+    my_send(Conn->CommandSocket, ReplyStr, strlen(ReplyStr + 3),0);
 }
 
 //------------------------------------------------------------------------------------
@@ -413,6 +640,7 @@ static void Cmd_NLST(Inst_t * Conn, char *filename, BOOL Long, BOOL UseCtrlConn)
             }else{
                 sprintf(repbuf + 3, "%s\r\n",strname);
             }
+            XferBytes += strlen(repbuf + 3);
             my_send(xfer_sock, repbuf, strlen(repbuf + 3),0);
           }
           f_closedir(&dp);
@@ -428,6 +656,11 @@ static void Cmd_NLST(Inst_t * Conn, char *filename, BOOL Long, BOOL UseCtrlConn)
     }
 }
 
+// STOR write buffer, RETR also stages file data here before compressing it.
+#define eMMC_WRITE_BUF_SIZE     (8*1024)
+char eMMC_WriteBuf[eMMC_WRITE_BUF_SIZE];
+uint16_t eMMC_Len;
+
 //------------------------------------------------------------------------------------
 // Handle the RECV command
 //------------------------------------------------------------------------------------
@@ -440,8 +673,11 @@ static void Cmd_RETR(Inst_t * Conn, char *filename)
     char buffer[LINKKEY_STR];
     int xfer_sock = 2;
     int size, nbytes = 0;
+    BOOL Compress = Conn->Compress;
     
     slogf(LOG_DEST_BOTH, "[Cmd_RETR] %s", filename);
+    // Compression is negotiated per transfer
+    Conn->Compress = FALSE;
     
     // special treatment for Get Firmware Information only...
     if (strcmp(filename, FTP_DEVICE_FIRMWARE) == 0) {   
@@ -477,6 +713,37 @@ static void Cmd_RETR(Inst_t * Conn, char *filename)
       SendReply(Conn, "226 Transfer complete.");
       return;
     }
+
+    // special treatment for transfer statistics, one line per command:
+    // count, payload bytes, average and worst latency in ms, average B/s,
+    // sectors read and written.  Then the data channel round trip estimates per
+    // link: smoothed RTT, RTT variance and receive timeout in ms, samples, timeouts
+    if (strcmp(filename, FTP_DEVICE_STATS) == 0) {
+      char repbuf[MAX_PATH+10];
+      int a;
+      SendReply(Conn, "150 Opening BINARY mode data connection");
+      for(a=0;a<sizeof(XferStats)/sizeof(XferStats_t);a++){
+        XferStats_t *pStats = &XferStats[a];
+        sprintf(repbuf + 3, "%s: %lu %lu %lu %lu %lu %lu %lu\r\n",
+            CommandName(pStats->CmdNum), pStats->Count, pStats->Bytes,
+            pStats->Count ? XFER_TICKS_TO_MS(pStats->TotalTicks / pStats->Count) : 0,
+            XFER_TICKS_TO_MS(pStats->MaxTicks),
+            pStats->TotalTicks ? (unsigned long)(((unsigned long long)pStats->Bytes * configTICK_RATE_HZ) / pStats->TotalTicks) : 0,
+            pStats->SectorsRead, pStats->SectorsWritten);
+        my_send(xfer_sock, repbuf, strlen(repbuf + 3),0);
+      }
+      for(a=0;a<FTP_LINK_COUNT;a++){
+        FtpRtt_t *pRtt = &FtpRtt[a];
+        sprintf(repbuf + 3, "RTT %s: %u %u %u %u %u\r\n",
+            (a == FTP_LINK_BT) ? "BT" : "USB",
+            (unsigned)XFER_TICKS_TO_MS(pRtt->Srtt >> 3), (unsigned)XFER_TICKS_TO_MS(pRtt->Rttvar >> 2),
+            (unsigned)XFER_TICKS_TO_MS(pRtt->Rto),
+            pRtt->Samples, pRtt->Timeouts);
+        my_send(xfer_sock, repbuf, strlen(repbuf + 3),0);
+      }
+      SendReply(Conn, "226 Transfer complete.");
+      return;
+    }
     
     // Check to see if the file can be opened for reading
     if (f_open(&fp, filename, FA_READ | FA_OPEN_EXISTING)) {
@@ -484,17 +751,29 @@ static void Cmd_RETR(Inst_t * Conn, char *filename)
         return;
     }
     // File opened succesfully, so make the connection
-    SendReply(Conn, "150 Opening BINARY mode data connection");
+    if (Compress){
+        SendReply(Conn, "150 Opening BINARY mode data connection (LZ compressed)");
+        LZ_EncoderInit(&LZState.Enc);
+    }else{
+        SendReply(Conn, "150 Opening BINARY mode data connection");
+    }
 	Sleep(200);
 
     // Transfer file
     //ValidRxData(NULL,0);    
     for(size=1;size > 0;){
+        int nsend;
         FTPActivity++;
-        res = f_read (&fp, Conn->XferBuffer + 4, 512, (UINT *)&size);
+        if (Compress){
+            // Read no more than compresses into one frame in the worst case
+            res = f_read (&fp, eMMC_WriteBuf, LZ_MAX_INPUT, (UINT *)&size);
+        }else{
+            res = f_read (&fp, Conn->XferBuffer + 4, 512, (UINT *)&size);
+        }
 
         //ValidRxData(Conn->XferBuffer + 4, size);
         nbytes += size;
+        XferBytes += size;
         //printf("size:%d\r", nbytes);
         if (FTPAbort) {
           size = 0;
@@ -504,8 +783,14 @@ static void Cmd_RETR(Inst_t * Conn, char *filename)
             break;
         }
 
+        nsend = size;
+        if (Compress){
+            nsend = LZ_Encode(&LZState.Enc, (unsigned char *)eMMC_WriteBuf, size,
+                              (unsigned char *)Conn->XferBuffer + 4);
+        }
+
         // Write buffer to socket.
-        if(my_send(xfer_sock, Conn->XferBuffer + 1, size, 0) < 0){
+        if(my_send(xfer_sock, Conn->XferBuffer + 1, nsend, 0) < 0){
             //perror("send failed");    MDR this function generate an HardFault exeption.
             SendReply(Conn, "426 Broken pipe") ;
             size = -1;
@@ -531,9 +816,35 @@ static void Cmd_RETR(Inst_t * Conn, char *filename)
 // Handle the STOR command
 //------------------------------------------------------------------------------------
 
-#define eMMC_WRITE_BUF_SIZE     (8*1024)
-char eMMC_WriteBuf[eMMC_WRITE_BUF_SIZE];
-uint16_t eMMC_Len;
+//------------------------------------------------------------------------------------
+// Receive STOR data, expanding it when the transfer is compressed.  Returns the
+// number of bytes placed in buf like my_recv2.
+//------------------------------------------------------------------------------------
+static int RecvStorData(Inst_t * Conn, BOOL Compress, int xfer_sock, char *buf, int len)
+{
+    int n, used;
+
+    if (!Compress){
+        return my_recv2(xfer_sock, buf, len, 0);
+    }
+
+    for(;;){
+        if (LZInPos < LZInLen){
+            n = LZ_Decode(&LZState.Dec, (unsigned char *)Conn->XferBuffer + LZInPos,
+                          LZInLen - LZInPos, &used, (unsigned char *)buf, len);
+            LZInPos += used;
+            if (n > 0){
+                return n;
+            }
+        }
+        n = my_recv2(xfer_sock, Conn->XferBuffer, sizeof(Conn->XferBuffer), 0);
+        if (n <= 0){
+            return n;
+        }
+        LZInPos = 0;
+        LZInLen = n;
+    }
+}
 
 static void Cmd_STOR(Inst_t * Conn, char *filename, DWORD used_b)
 {
@@ -548,9 +859,12 @@ static void Cmd_STOR(Inst_t * Conn, char *filename, DWORD used_b)
     char buffer[LINKKEY_STR];
     bool NoMoreSpace = FALSE;
     bool ERROR_STOR = FALSE;
+    BOOL Compress = Conn->Compress;
     
     eMMC_Len = 0;
     slogf(LOG_DEST_BOTH, "[Cmd_STOR] %s", filename);
+    // Compression is negotiated per transfer
+    Conn->Compress = FALSE;
     if (BT_Key_Parser(filename, &key)){
       linkKeyInfo.BD_ADDR = key;
       Link_Key_Parser(filename, &(linkKeyInfo.LinkKey));
@@ -573,6 +887,7 @@ static void Cmd_STOR(Inst_t * Conn, char *filename, DWORD used_b)
     }
 
     // Check to see if the file can be opened for writing
+    CrcCacheDrop(TEMP_FILE);
     res = f_open(&fp, TEMP_FILE, FA_WRITE | FA_CREATE_ALWAYS);
     if(res != FR_OK){
         Send550Error(Conn);
@@ -580,7 +895,13 @@ static void Cmd_STOR(Inst_t * Conn, char *filename, DWORD used_b)
     }
 
     // File opened succesfully, so make the connection
-    SendReply(Conn, "150 Opening BINARY mode data connection");
+    if (Compress){
+        SendReply(Conn, "150 Opening BINARY mode data connection (LZ compressed)");
+        LZ_DecoderInit(&LZState.Dec);
+        LZInPos = LZInLen = 0;
+    }else{
+        SendReply(Conn, "150 Opening BINARY mode data connection");
+    }
 	Sleep(200);
 
     // Transfer file
@@ -592,12 +913,13 @@ static void Cmd_STOR(Inst_t * Conn, char *filename, DWORD used_b)
         // Get from socket.
         do
         {
-          size = my_recv2(xfer_sock, &eMMC_WriteBuf[eMMC_Len], eMMC_WRITE_BUF_SIZE-eMMC_Len, 0);
+          size = RecvStorData(Conn, Compress, xfer_sock, &eMMC_WriteBuf[eMMC_Len], eMMC_WRITE_BUF_SIZE-eMMC_Len);
           nbytes += size;
           if(size < 0){
             //perror("read failed");    MDR this function generate an HardFault exeption.
           }else{
             eMMC_Len += size;
+            XferBytes += size;
             if (eMMC_Len > (AVAILABLE_SPACE - current_usage)){
               NoMoreSpace = TRUE;
               size = -1;
@@ -776,6 +1098,7 @@ static void Cmd_SRFT(Inst_t * Conn, char * TimeStamp, char *filename)
   f_close(&fp);
   // Delete old file if any
   f_unlink(filename);
+  CrcCacheDrop(filename);
   
   // Check for Special Overload commands pre file copy
   if (strcmp(filename, FTP_DEVICE_FIRMWARE) == 0) {
@@ -984,6 +1307,85 @@ static void Cmd_SRFT(Inst_t * Conn, char * TimeStamp, char *filename)
 }
 
 
+//------------------------------------------------------------------------------------
+// Files that only STOR + SRFT may write, since Cmd_SRFT checks or acts on them:
+// everything under /device (firmware, bootloader, settings, link keys) and /auth
+// (templates, recovery codes, sign in), TEMP_FILE, the license volume, and the
+// WRNG journal that is replayed at start up.  The bulk writes (MPUT, WRNG) refuse
+// them.  Separators, "." components, case and
+// trailing dots are ignored as FatFs ignores them, relative paths are taken from
+// the current directory.
+//------------------------------------------------------------------------------------
+static BOOL PathIsBelow(const char * path, const char * dir)
+{
+    for (;;){
+        // Skip separators and "." components on both sides
+        while (*path == '/' || *path == '\\' || (path[0] == '.' && (path[1] == '/' || path[1] == '\\' || path[1] == 0))){
+            path++;
+        }
+        while (*dir == '/'){
+            dir++;
+        }
+        if (*dir == 0){
+            return TRUE;
+        }
+        while (*dir && *dir != '/'){
+            if (toupper((unsigned char)*path) != toupper((unsigned char)*dir)){
+                return FALSE;
+            }
+            path++;
+            dir++;
+        }
+        // FatFs drops trailing dots and spaces of a name
+        while (*path == '.' || *path == ' '){
+            path++;
+        }
+        if (*path != 0 && *path != '/' && *path != '\\'){
+            return FALSE;
+        }
+    }
+}
+
+static BOOL IsProtectedPath(const char * path)
+{
+    char cwd[MAX_PATH];
+    char full[2 * MAX_PATH];
+
+    if (strstr(path, "..")){
+        return TRUE;
+    }
+    if (path[0] != '/' && path[0] != '\\' && strchr(path, ':') == NULL){
+        if (f_getcwd(cwd, sizeof(cwd)) != FR_OK){
+            return TRUE;
+        }
+        sprintf(full, "%s/%s", cwd, path);
+        path = full;
+    }
+    if (path[0] == '0' && path[1] == ':'){
+        path += 2;
+    }else if (strchr(path, ':')){
+        return TRUE;    // License volume
+    }
+    return PathIsBelow(path, DEVICE_PATH) || PathIsBelow(path, AUTH_PATH)
+        || PathIsBelow(path, TEMP_FILE) || PathIsBelow(path, RANGE_JOURNAL_FILE);
+}
+
+//------------------------------------------------------------------------------------
+// Bytes in use on the vault volume, for the AVAILABLE_SPACE quota.
+//------------------------------------------------------------------------------------
+static FRESULT GetUsedSpace(long long int * pUsed)
+{
+    DWORD fre_clust;
+    FATFS *fs;
+    FRESULT res;
+
+    res = f_getfree(SD_Path0, &fre_clust, &fs);
+    if (res == FR_OK){
+        *pUsed = (long long int)(fs->n_fatent - 2 - fre_clust) * fs->csize * 512;
+    }
+    return res;
+}
+
 //------------------------------------------------------------------------------------
 // Handle MLST command
 //------------------------------------------------------------------------------------
@@ -1109,6 +1511,9 @@ static void Cmd_DELE(Inst_t * Conn, char * filename, bool recursive)
   char repbuf[40]; //TODO: remove magic number
   int status;
 
+  // A directory takes its files with it
+  CrcCacheDrop(NULL);
+
   if (strcmp(filename, FTP_AUTH_SIGNOUT_PATH) == 0) {
     FTPLocked = TRUE;
     SendReply(Conn, "231 logged out.");
@@ -1153,105 +1558,1108 @@ static void Cmd_DELE(Inst_t * Conn, char * filename, bool recursive)
   }
 }
 //------------------------------------------------------------------------------------
-// Main loop - handle the FTP commands that are implemented.
+// File checksums for XCRC.  Results are cached keyed on the path, range, size and
+// FAT timestamp, so a client syncing unchanged files does not make the card read
+// them again.  The entry used least recently is replaced, but not while MANIFEST
+// walks a tree: entries the walk has used are kept, so a tree of up to
+// CRC_CACHE_SIZE files is read once, and a larger one keeps that many files
+// cached from one listing to the next instead of cycling through all of them.
+// Files written without SRFT all have a zero timestamp, so every command that
+// changes a file drops the entries of its name, see CrcCacheDrop().
 //------------------------------------------------------------------------------------
-static void ProcessCommands(Inst_t * Conn)
+#define CRC_CACHE_SIZE 32
+
+typedef struct {
+    BOOL Valid;
+    uint32_t PathHash;
+    uint32_t NameHash;
+    DWORD Start;
+    DWORD End;
+    DWORD Size;
+    WORD Date;
+    WORD Time;
+    uint32_t Crc;
+    DWORD Used;
+}CrcCache_t;
+
+static CrcCache_t CrcCache[CRC_CACHE_SIZE];
+static DWORD CrcCacheClock;
+static DWORD CrcCacheWalk;      // Clock at the start of a MANIFEST walk
+static BOOL CrcCacheWalking;
+
+static uint32_t CrcCacheNameHash(const char * path)
 {
-    // Data buffer for reading FTP command codes
-    char buf[MAX_PATH+10];
-    char repbuf[MAX_PATH+10];
-    char * NewPath;
-    char * Prefix;
-    char *Date_Time;
-    int a;
-    int buf_len;
-    bool recursive;
-    uint8_t retSD;   
-    DWORD fre_clust, fre_sect, tot_sect, used_sect;
-    FATFS *fs;
-    Conn->PassiveSocket = 1;
+    const char * name = strrchr(path, '/');
 
-    // Indicate ready to accept commands
-    SendReply(Conn, "220 Minftpd ready");
+    name = name ? name + 1 : path;
+    Crc32Start();
+    Crc32Feed(name, strlen(name));
+    return Crc32End();
+}
 
-    for(;;){
-        // Get FTP command from input stream
-        CmdTypes FtpCommand;
-        int AuthorizedCommand;
+//------------------------------------------------------------------------------------
+// Forget the checksums of a file that changed, all of them when path is NULL.
+// Paths come relative or absolute, so every file of the same name is dropped.
+//------------------------------------------------------------------------------------
+static void CrcCacheDrop(const char * path)
+{
+    uint32_t NameHash;
+    int a;
 
-        FtpCommand = (CmdTypes)GetCommand(Conn, buf);
-        if (FtpCommand == UNKNOWN_COMMAND) {
-          continue;
-        }
-        FTPActivity++;
-        if (FTPLocked) {
-          // Check if valid templates exist
-          if (FindValidTemplate() != FR_OK) {
-            // Unlock FTP since no templates
-            FTPLocked = FALSE;
-            AdvertiseLockStatus(FTPLocked);
-            SetRootDir(FTP_ROOT_PATH);
-          }
+    if (path == NULL){
+        memset(CrcCache, 0, sizeof(CrcCache));
+        return;
+    }
+    NameHash = CrcCacheNameHash(path);
+    for(a=0;a<CRC_CACHE_SIZE;a++){
+        if (CrcCache[a].NameHash == NameHash){
+            CrcCache[a].Valid = FALSE;
         }
-        if (FTPLocked) {
-          AuthorizedCommand = FALSE;
+    }
+}
 
-          if (FtpCommand == SRFT) {
-            NewPath = FindPath(buf);
-          }else
-          {
-            NewPath = buf;
-          }
-          if (strncmp(NewPath, FTP_AUTH_SIGNIN_PATH, (sizeof(FTP_AUTH_SIGNIN_PATH) -1)) == 0) {
-            AuthorizedCommand = TRUE;
-          }else if (strncmp(NewPath, LICENSE_PATH, (sizeof(LICENSE_PATH) -1)) == 0) {
-            AuthorizedCommand = TRUE;
-          }else if (strncmp(NewPath, FTP_LICENSE_PATH, (sizeof(FTP_LICENSE_PATH) -1)) == 0) {
-            AuthorizedCommand = TRUE;
-          }else if (strncmp(NewPath, FTP_PASSWORD_VAULT_PATH, (sizeof(FTP_PASSWORD_VAULT_PATH) -1)) == 0) {
-            AuthorizedCommand = TRUE;
-          }
-          if (!AuthorizedCommand) {
-            SendReply(Conn, "530 not logged");
-            continue;
-          }
+static FRESULT GetFileCrc(const char * filename, FILINFO * pfno, DWORD Start, DWORD End, uint32_t * pCrc)
+{
+    FIL fp;
+    FRESULT res;
+    CrcCache_t Key;
+    UINT size;
+    int a;
+
+    Key.NameHash = CrcCacheNameHash(filename);
+    Crc32Start();
+    Crc32Feed(filename, strlen(filename));
+    Key.PathHash = Crc32End();
+    Key.Start = Start;
+    Key.End = End;
+    Key.Size = pfno->fsize;
+    Key.Date = pfno->fdate;
+    Key.Time = pfno->ftime;
+    Key.Valid = TRUE;
+
+    for(a=0;a<CRC_CACHE_SIZE;a++){
+        CrcCache_t *pEntry = &CrcCache[a];
+        if (pEntry->Valid && pEntry->PathHash == Key.PathHash
+            && pEntry->Start == Start && pEntry->End == End
+            && pEntry->Size == Key.Size && pEntry->Date == Key.Date
+            && pEntry->Time == Key.Time){
+            pEntry->Used = ++CrcCacheClock;
+            *pCrc = pEntry->Crc;
+            return FR_OK;
         }
-        switch(FtpCommand){
-            case SYST:
-                slogf(LOG_DEST_BOTH, "[ProcessCommands] SYST command");
-                SendReply(Conn, "215 ftpdmin v. "FTPDMIN_VER);
-                break;
+    }
 
-            case PASV:
-                slogf(LOG_DEST_BOTH, "[ProcessCommands] PASV command");
-                sprintf(repbuf, "227 Entering Passive Mode (%s,%d,%d)",
-                    OurAddrStr, Conn->XferPort >>8, Conn->XferPort & 0xff);
-                for (a=0;a<50;a++){
-                    if (repbuf[a] == 0) break;
-                    if (repbuf[a] == '.') repbuf[a] = ',';
-                }
-                SendReply(Conn, repbuf);
-                Conn->PassiveMode = TRUE;
-                break;
+    res = f_open(&fp, filename, FA_READ | FA_OPEN_EXISTING);
+    if (res != FR_OK) return res;
+    res = f_lseek(&fp, Start);
 
-            case XPWD:
-            case PWD: // Print working directory
-                slogf(LOG_DEST_BOTH, "[ProcessCommands] PWD command"); 
-                sprintf(repbuf,"257 \"%s\"", MyGetDir());
-                SendReply(Conn, repbuf);
-                break;
+    // Whole sector reads go straight to the buffer and keep the CRC unit fed
+    // with whole words.
+    Crc32Start();
+    while(res == FR_OK && Start < End){
+        FTPActivity++;
+        size = (End - Start > eMMC_WRITE_BUF_SIZE) ? eMMC_WRITE_BUF_SIZE : End - Start;
+        res = f_read(&fp, eMMC_WriteBuf, size, &size);
+        if (size == 0) break;
+        Crc32Feed(eMMC_WriteBuf, size);
+        Start += size;
+        XferBytes += size;
+    }
+    Key.Crc = Crc32End();
+    f_close(&fp);
 
-            case NLST: // Request directory, names only.
-                Cmd_NLST(Conn, buf, FALSE, FALSE);
-                break;
+    if (res == FR_OK){
+        CrcCache_t *pVictim = &CrcCache[0];
+        for(a=1;a<CRC_CACHE_SIZE && pVictim->Valid;a++){
+            if (!CrcCache[a].Valid || CrcCache[a].Used < pVictim->Used){
+                pVictim = &CrcCache[a];
+            }
+        }
+        if (!pVictim->Valid || !CrcCacheWalking || pVictim->Used <= CrcCacheWalk){
+            Key.Used = ++CrcCacheClock;
+            *pVictim = Key;
+        }
+        *pCrc = Key.Crc;
+    }
+    return res;
+}
 
-            case LIST: // Request directory, long version.
-                Cmd_NLST(Conn, buf, TRUE, FALSE);
-                break;
+//------------------------------------------------------------------------------------
+// Split "<file> <n> <n>..." into the file name and up to Max trailing numbers.  The
+// name may be quoted.  Returns the count of numbers found, or -1.
+//------------------------------------------------------------------------------------
+static int ParseFileArgs(char * arg, char ** pfilename, unsigned long * Num, int Max)
+{
+    char * p;
+    int n = 0;
+    int a;
 
-            case STAT: // Just like LIST, but use control connection.
-                Cmd_NLST(Conn, buf, TRUE, TRUE);
-                break;
+    if (arg[0] == '"'){
+        *pfilename = arg + 1;
+        p = strchr(arg + 1, '"');
+        if (p == NULL) return -1;
+        *p++ = 0;
+        while(n < Max && *p){
+            while(*p == ' ') p++;
+            if (!isdigit((unsigned char)*p)) break;
+            Num[n++] = strtoul(p, &p, 10);
+        }
+    }else{
+        // Trailing numbers, last one first
+        *pfilename = arg;
+        while(n < Max && (p = strrchr(arg, ' ')) != NULL
+              && p[1] && strspn(p + 1, "0123456789") == strlen(p + 1)){
+            Num[n++] = strtoul(p + 1, NULL, 10);
+            *p = 0;
+        }
+        for(a=0;a<n/2;a++){
+            unsigned long t = Num[a];
+            Num[a] = Num[n - 1 - a];
+            Num[n - 1 - a] = t;
+        }
+    }
+    return n;
+}
+
+//------------------------------------------------------------------------------------
+// Handle XCRC command: XCRC <file> [<start> [<end>]], the name may be quoted.
+// Replies with the CRC-32 of the file or of the byte range start..end.
+//------------------------------------------------------------------------------------
+static void Cmd_XCRC(Inst_t * Conn, char * arg)
+{
+    FILINFO fno;
+    char RepBuf[20];
+    char * filename;
+    unsigned long Num[2];
+    int n;
+    DWORD Start, End;
+    uint32_t Crc;
+
+    n = ParseFileArgs(arg, &filename, Num, 2);
+    if (n < 0){
+        SendReply(Conn, "501 Syntax error");
+        return;
+    }
+
+    filename = TranslatePath(filename);
+    slogf(LOG_DEST_BOTH, "[Cmd_XCRC] %s", filename);
+    if (filename == NULL){
+        SendReply(Conn, "550 Path permission error");
+        return;
+    }
+
+    memset(&fno, 0, sizeof(fno));
+    if (f_stat(filename, &fno)){
+        Send550Error(Conn);
+        return;
+    }
+    if(fno.fattrib & AM_DIR){
+        SendReply(Conn, "550 not a plain file.");
+        return;
+    }
+
+    Start = (n > 0) ? Num[0] : 0;
+    End = (n > 1 && Num[1] < fno.fsize) ? Num[1] : fno.fsize;
+    if (Start > End){
+        SendReply(Conn, "501 Invalid range");
+        return;
+    }
+
+    if (GetFileCrc(filename, &fno, Start, End, &Crc) != FR_OK){
+        Send550Error(Conn);
+        return;
+    }
+    sprintf(RepBuf, "250 %08lX", (unsigned long)Crc);
+    SendReply(Conn, RepBuf);
+}
+
+//------------------------------------------------------------------------------------
+// Store a little endian number of Len bytes.
+//------------------------------------------------------------------------------------
+static void PutLE(unsigned char * p, uint32_t Value, int Len)
+{
+    while(Len--){
+        *p++ = (unsigned char)Value;
+        Value >>= 8;
+    }
+}
+
+//------------------------------------------------------------------------------------
+// RRNG/WRNG random access to part of a file.  The cluster link map (fast seek) of
+// the last file accessed is kept, so a run of small reads and writes into a large
+// vault file does not walk its FAT chain each time.
+//------------------------------------------------------------------------------------
+#define RANGE_CLMT_SIZE 32
+
+static DWORD RangeClmt[RANGE_CLMT_SIZE];
+static struct {
+    BOOL Valid;
+    uint32_t PathHash;
+    DWORD Sclust;
+    DWORD Size;
+    WORD Date;
+    WORD Time;
+}RangeClmtKey;
+
+static FRESULT RangeOpen(FIL * fp, const char * filename, BYTE Mode, DWORD Offset, DWORD Length)
+{
+    FILINFO fno;
+    FRESULT res;
+    uint32_t Hash;
+
+    memset(&fno, 0, sizeof(fno));
+    res = f_stat(filename, &fno);
+    if (res == FR_OK) res = f_open(fp, filename, Mode | FA_OPEN_EXISTING);
+    if (res != FR_OK) return res;
+    if (Offset > fp->fsize){
+        f_close(fp);
+        return FR_INVALID_PARAMETER;
+    }
+
+    // Fast seek can not extend a file, use it only inside the current size
+    if (Offset && Offset + Length <= fp->fsize){
+        Crc32Start();
+        Crc32Feed(filename, strlen(filename));
+        Hash = Crc32End();
+
+        fp->cltbl = RangeClmt;
+        if (!RangeClmtKey.Valid || RangeClmtKey.PathHash != Hash
+            || RangeClmtKey.Sclust != fp->sclust || RangeClmtKey.Size != fp->fsize
+            || RangeClmtKey.Date != fno.fdate || RangeClmtKey.Time != fno.ftime){
+            RangeClmtKey.Valid = FALSE;
+            RangeClmt[0] = RANGE_CLMT_SIZE;
+            if (f_lseek(fp, CREATE_LINKMAP) == FR_OK){
+                RangeClmtKey.Valid = TRUE;
+                RangeClmtKey.PathHash = Hash;
+                RangeClmtKey.Sclust = fp->sclust;
+                RangeClmtKey.Size = fp->fsize;
+                RangeClmtKey.Date = fno.fdate;
+                RangeClmtKey.Time = fno.ftime;
+            }else{
+                // Too fragmented for the table
+                fp->cltbl = 0;
+            }
+        }
+    }
+    return f_lseek(fp, Offset);
+}
+
+//------------------------------------------------------------------------------------
+// Handle RRNG command: RRNG <file> <offset> <length>, sends the bytes of the file
+// from offset on the data connection.
+//------------------------------------------------------------------------------------
+static void Cmd_RRNG(Inst_t * Conn, char * arg)
+{
+    FIL fp;
+    FRESULT res;
+    char * filename;
+    unsigned long Num[2];
+    DWORD Remaining;
+    UINT size;
+
+    if (ParseFileArgs(arg, &filename, Num, 2) != 2){
+        SendReply(Conn, "501 Syntax error");
+        return;
+    }
+    filename = TranslatePath(filename);
+    slogf(LOG_DEST_BOTH, "[Cmd_RRNG] %s %lu %lu", filename, Num[0], Num[1]);
+    if (filename == NULL){
+        SendReply(Conn, "550 Path permission error");
+        return;
+    }
+
+    res = RangeOpen(&fp, filename, FA_READ, Num[0], 0);
+    if (res != FR_OK){
+        Send550Error(Conn);
+        return;
+    }
+    Remaining = fp.fsize - fp.fptr;
+    if (Num[1] < Remaining) Remaining = Num[1];
+
+    SendReply(Conn, "150 Opening BINARY mode data connection");
+    while (res == FR_OK && Remaining && !FTPAbort){
+        FTPActivity++;
+        size = (Remaining > 512) ? 512 : Remaining;
+        res = f_read(&fp, Conn->XferBuffer + 4, size, &size);
+        if (res != FR_OK || size == 0) break;
+        Remaining -= size;
+        XferBytes += size;
+        if (my_send(2, Conn->XferBuffer + 1, size, 0) < 0){
+            res = FR_DISK_ERR;
+        }
+    }
+    f_close(&fp);
+
+    if (FTPAbort) {
+      SendReply(Conn, "226 Abort");
+      FTPAborted = TRUE;
+    } else if (res != FR_OK) {
+      Send550Error(Conn);
+    }else{
+      SendReply(Conn, "226 Transfer Complete");
+    }
+}
+
+//------------------------------------------------------------------------------------
+// Copy Length bytes from src to dst at the current positions.
+//------------------------------------------------------------------------------------
+static FRESULT RangeCopy(FIL * dst, FIL * src, DWORD Length)
+{
+    FRESULT res = FR_OK;
+    UINT size, written;
+
+    while (res == FR_OK && Length){
+        size = (Length > eMMC_WRITE_BUF_SIZE) ? eMMC_WRITE_BUF_SIZE : Length;
+        res = f_read(src, eMMC_WriteBuf, size, &size);
+        if (res == FR_OK && size == 0) res = FR_INT_ERR;
+        if (res == FR_OK) res = f_write(dst, eMMC_WriteBuf, size, &written);
+        if (res == FR_OK && written != size) res = FR_DENIED;
+        Length -= size;
+    }
+    return res;
+}
+
+//------------------------------------------------------------------------------------
+// An atomic WRNG first receives the data into RANGE_JOURNAL_FILE:
+//   offset (4), length (4), path length (2), path, data, RANGE_JOURNAL_COMMIT (4)
+// and only then writes it to the file.  A journal that has its commit marker is
+// applied again at start up, one without it is dropped, so the file always has
+// either none or all of the new bytes.
+//------------------------------------------------------------------------------------
+#define RANGE_JOURNAL_HEADER_SIZE   10
+#define RANGE_JOURNAL_COMMIT        "RJOK"
+
+static FRESULT RangeJournalApply(void)
+{
+    FIL jp, fp;
+    FRESULT res;
+    unsigned char hdr[RANGE_JOURNAL_HEADER_SIZE];
+    char path[MAX_PATH];
+    char Commit[4];
+    DWORD Offset, Length;
+    UINT PathLen, size;
+
+    res = f_open(&jp, RANGE_JOURNAL_FILE, FA_READ | FA_OPEN_EXISTING);
+    if (res != FR_OK) return res;
+
+    res = f_read(&jp, hdr, sizeof(hdr), &size);
+    if (res == FR_OK && size != sizeof(hdr)) res = FR_INT_ERR;
+    if (res == FR_OK){
+        Offset = hdr[0] | (hdr[1] << 8) | ((DWORD)hdr[2] << 16) | ((DWORD)hdr[3] << 24);
+        Length = hdr[4] | (hdr[5] << 8) | ((DWORD)hdr[6] << 16) | ((DWORD)hdr[7] << 24);
+        PathLen = hdr[8] | (hdr[9] << 8);
+        if (PathLen >= MAX_PATH
+            || jp.fsize != RANGE_JOURNAL_HEADER_SIZE + PathLen + Length + sizeof(Commit)){
+            res = FR_INT_ERR;   // Not committed
+        }
+    }
+    if (res == FR_OK){
+        res = f_lseek(&jp, jp.fsize - sizeof(Commit));
+        if (res == FR_OK) res = f_read(&jp, Commit, sizeof(Commit), &size);
+        if (res == FR_OK && memcmp(Commit, RANGE_JOURNAL_COMMIT, sizeof(Commit))) res = FR_INT_ERR;
+    }
+    if (res == FR_OK){
+        res = f_lseek(&jp, RANGE_JOURNAL_HEADER_SIZE);
+        if (res == FR_OK) res = f_read(&jp, path, PathLen, &size);
+        path[PathLen] = 0;
+    }
+    if (res == FR_OK){
+        slogf(LOG_DEST_BOTH, "[RangeJournalApply] %s %lu %lu", path, Offset, Length);
+        CrcCacheDrop(path);
+        res = RangeOpen(&fp, path, FA_WRITE, Offset, Length);
+        if (res == FR_OK){
+            res = RangeCopy(&fp, &jp, Length);
+            if (f_close(&fp) != FR_OK) res = FR_DISK_ERR;
+        }
+    }
+    f_close(&jp);
+
+    // Keep a committed journal for the next attempt only when the disk failed,
+    // one that can never apply (target gone, offset past its end) is dropped
+    if (res == FR_DISK_ERR || res == FR_NOT_READY || res == FR_TIMEOUT){
+        return res;
+    }
+    if (res != FR_OK){
+        slogf(LOG_DEST_BOTH, "[RangeJournalApply] dropped, error %d", res);
+    }
+    f_unlink(RANGE_JOURNAL_FILE);
+    return res;
+}
+
+//------------------------------------------------------------------------------------
+// Handle WRNG command: WRNG <file> <offset> <length> [A], writes the bytes received
+// on the data connection into the file at offset.  The file may grow, but offset
+// must be inside it.  With A the write is atomic.
+//------------------------------------------------------------------------------------
+static void Cmd_WRNG(Inst_t * Conn, char * arg)
+{
+    FIL fp;
+    FRESULT res;
+    char * filename;
+    unsigned long Num[2];
+    unsigned char hdr[RANGE_JOURNAL_HEADER_SIZE];
+    BOOL Atomic = FALSE;
+    DWORD Remaining, Size;
+    long long int Used, End;
+    UINT written;
+    int len, n;
+
+    len = strlen(arg);
+    if (len > 2 && (strcmp(arg + len - 2, " A") == 0 || strcmp(arg + len - 2, " a") == 0)){
+        Atomic = TRUE;
+        arg[len - 2] = 0;
+    }
+    if (ParseFileArgs(arg, &filename, Num, 2) != 2){
+        SendReply(Conn, "501 Syntax error");
+        return;
+    }
+    filename = TranslatePath(filename);
+    slogf(LOG_DEST_BOTH, "[Cmd_WRNG] %s %lu %lu%s", filename, Num[0], Num[1], Atomic ? " atomic" : "");
+    if (filename == NULL){
+        SendReply(Conn, "550 Path permission error");
+        return;
+    }
+    // Files that SRFT validates are not written here, like MPUT
+    if (IsProtectedPath(filename)){
+        slogf(LOG_DEST_BOTH, "[Cmd_WRNG] %s refused", filename);
+        SendReply(Conn, "553 Permission denied");
+        return;
+    }
+    len = strlen(filename);
+    CrcCacheDrop(filename);
+
+    // Only the bytes past the end of the file count against the quota
+    End = (long long int)Num[0] + Num[1];
+    res = GetUsedSpace(&Used);
+    if (Atomic){
+        // Check the target before receiving anything
+        if (res == FR_OK) res = RangeOpen(&fp, filename, FA_READ, Num[0], 0);
+        if (res == FR_OK){
+            Size = fp.fsize;
+            f_close(&fp);
+            // The journal holds a copy of the data
+            Used += RANGE_JOURNAL_HEADER_SIZE + len + Num[1] + 4;
+            if (End > Size && End - Size > AVAILABLE_SPACE - Used){
+                SendReply(Conn, "552 Disk full");
+                return;
+            }
+            res = f_open(&fp, RANGE_JOURNAL_FILE, FA_WRITE | FA_CREATE_ALWAYS);
+        }
+        if (res == FR_OK){
+            PutLE(hdr, Num[0], 4);
+            PutLE(hdr + 4, Num[1], 4);
+            PutLE(hdr + 8, len, 2);
+            res = f_write(&fp, hdr, sizeof(hdr), &written);
+            if (res == FR_OK) res = f_write(&fp, filename, len, &written);
+        }
+    }else{
+        if (res == FR_OK) res = RangeOpen(&fp, filename, FA_WRITE, Num[0], Num[1]);
+        if (res == FR_OK && End > fp.fsize && End - fp.fsize > AVAILABLE_SPACE - Used){
+            f_close(&fp);
+            SendReply(Conn, "552 Disk full");
+            return;
+        }
+    }
+    if (res != FR_OK){
+        Send550Error(Conn);
+        return;
+    }
+
+    SendReply(Conn, "150 Opening BINARY mode data connection");
+    Remaining = Num[1];
+    while (res == FR_OK && Remaining && !FTPAbort){
+        FTPActivity++;
+        n = my_recv2(2, eMMC_WriteBuf, eMMC_WRITE_BUF_SIZE, 0);
+        if (n <= 0){
+            res = FR_TIMEOUT;
+            break;
+        }
+        if (n > Remaining) n = Remaining;
+        res = f_write(&fp, eMMC_WriteBuf, n, &written);
+        if (res == FR_OK && written != n) res = FR_DENIED;
+        Remaining -= n;
+        XferBytes += n;
+    }
+
+    if (Atomic){
+        if (res == FR_OK && !FTPAbort){
+            // The journal must be on the disk before the commit marker
+            res = f_sync(&fp);
+            if (res == FR_OK) res = f_write(&fp, RANGE_JOURNAL_COMMIT, 4, &written);
+        }
+        if (f_close(&fp) != FR_OK && res == FR_OK) res = FR_DISK_ERR;
+        if (res == FR_OK && !FTPAbort){
+            res = RangeJournalApply();
+        }else{
+            f_unlink(RANGE_JOURNAL_FILE);
+        }
+    }else{
+        if (f_close(&fp) != FR_OK && res == FR_OK) res = FR_DISK_ERR;
+    }
+
+    if (FTPAbort) {
+      SendReply(Conn, "226 Abort");
+      FTPAborted = TRUE;
+    } else if (res != FR_OK) {
+      Send550Error(Conn);
+      // Flush receive data to give a chance to unblock FTP client
+      while (res != FR_TIMEOUT && my_recv2(2, eMMC_WriteBuf, eMMC_WRITE_BUF_SIZE, 0) > 0);
+    }else{
+      SendReply(Conn, "226 Transfer Complete");
+    }
+}
+
+//------------------------------------------------------------------------------------
+// Handle MANIFEST command.  Sends one packed little endian record per file in the
+// directory tree over the data connection:
+//   path hash (4), size (4), FAT date (2), FAT time (2), CRC-32 (4)
+// The path hash is the CRC-32 of the path relative to the listed directory, with
+// '/' separators.  Records are batched, up to MANIFEST_FRAME_RECORDS per frame.
+//------------------------------------------------------------------------------------
+#define MANIFEST_RECORD_SIZE    16
+#define MANIFEST_FRAME_RECORDS  32
+
+//------------------------------------------------------------------------------------
+// Call Func for every file in the tree below path.  path is a MAX_PATH buffer that
+// holds the path of the current file during the call, the name relative to the
+// top of the tree starts at path + RootLen + 1.
+// The walk is iterative so the stack use does not grow with the tree, directories
+// nested deeper than WALK_MAX_DEPTH below path fail with FR_TOO_MANY_OPEN_FILES.
+//------------------------------------------------------------------------------------
+#define WALK_MAX_DEPTH          8
+
+typedef FRESULT (*WalkFunc_t)(Inst_t * Conn, char * path, int RootLen, FILINFO * pfno);
+
+static FRESULT WalkDir(Inst_t * Conn, char * path, int RootLen, WalkFunc_t Func)
+{
+    FRESULT res;
+    FILINFO fno;
+    static DIR dirs[WALK_MAX_DEPTH + 1];
+    static int lens[WALK_MAX_DEPTH + 1];    // path length of each open directory
+    static char lfn[_MAX_LFN + 1];
+    char * name;
+    int depth = 0;
+    int i;
+
+    memset(&fno, 0, sizeof(fno));
+    fno.lfname = lfn;
+    fno.lfsize = sizeof(lfn);
+
+    res = f_opendir(&dirs[0], path);
+    if (res != FR_OK) return res;
+    lens[0] = strlen(path);
+    while (depth >= 0) {
+        res = f_readdir(&dirs[depth], &fno);
+        if (res != FR_OK) break;
+        if (fno.fname[0] == 0) {
+            // End of this directory, back to its parent
+            f_closedir(&dirs[depth]);
+            if (--depth >= 0) {
+                path[lens[depth]] = 0;
+            }
+            continue;
+        }
+        name = *fno.lfname ? fno.lfname : fno.fname;
+        if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0){
+            continue;
+        }
+        i = lens[depth];
+        if (i + 1 + strlen(name) >= MAX_PATH){
+            res = FR_INVALID_NAME;
+            break;
+        }
+        sprintf(&path[i], "/%s", name);
+        if (fno.fattrib & AM_DIR) {
+            if (depth == WALK_MAX_DEPTH) {
+                res = FR_TOO_MANY_OPEN_FILES;
+                break;
+            }
+            res = f_opendir(&dirs[depth + 1], path);
+            if (res != FR_OK) break;
+            lens[++depth] = strlen(path);
+        } else {
+            res = Func(Conn, path, RootLen, &fno);
+            path[i] = 0;
+            if (res != FR_OK) break;
+        }
+        if (FTPAbort) break;
+    }
+    for (; depth >= 0; depth--) {
+        f_closedir(&dirs[depth]);
+    }
+    path[lens[0]] = 0;
+    return res;
+}
+
+//------------------------------------------------------------------------------------
+// Translate a directory argument to a physical path without a trailing '/', the
+// current directory when empty.  Returns the path length, or -1.
+//------------------------------------------------------------------------------------
+static int GetTreePath(char * dirname, char * path)
+{
+    char * NewPath;
+    int len;
+
+    if (dirname[0] == 0){
+        if (f_getcwd(path, MAX_PATH) != FR_OK) return -1;
+    }else{
+        NewPath = TranslatePath(dirname);
+        if (NewPath == NULL) return -1;
+        strncpy(path, NewPath, MAX_PATH - 1);
+        path[MAX_PATH - 1] = 0;
+    }
+    len = strlen(path);
+    while (len > 1 && path[len - 1] == '/'){
+        path[--len] = 0;
+    }
+    return len;
+}
+
+// Records waiting in Conn->XferBuffer
+static int ManifestCount;
+
+static FRESULT ManifestFile(Inst_t * Conn, char * path, int RootLen, FILINFO * pfno)
+{
+    unsigned char * rec;
+    uint32_t Crc;
+    FRESULT res;
+
+    rec = (unsigned char *)Conn->XferBuffer + 4 + (ManifestCount * MANIFEST_RECORD_SIZE);
+    Crc32Start();
+    Crc32Feed(path + RootLen + 1, strlen(path + RootLen + 1));
+    PutLE(rec, Crc32End(), 4);
+    PutLE(rec + 4, pfno->fsize, 4);
+    PutLE(rec + 8, pfno->fdate, 2);
+    PutLE(rec + 10, pfno->ftime, 2);
+    res = GetFileCrc(path, pfno, 0, pfno->fsize, &Crc);
+    PutLE(rec + 12, Crc, 4);
+
+    if (++ManifestCount == MANIFEST_FRAME_RECORDS){
+        if (my_send(2, Conn->XferBuffer + 1, ManifestCount * MANIFEST_RECORD_SIZE, 0) < 0){
+            res = FR_DISK_ERR;
+        }
+        ManifestCount = 0;
+    }
+    return res;
+}
+
+static void Cmd_MANIFEST(Inst_t * Conn, char * dirname)
+{
+    char path[MAX_PATH];
+    FRESULT res;
+    int len;
+
+    len = GetTreePath(dirname, path);
+    if (len < 0){
+        SendReply(Conn, "550 Path permission error");
+        return;
+    }
+    slogf(LOG_DEST_BOTH, "[Cmd_MANIFEST] %s", path);
+
+    SendReply(Conn, "150 Opening BINARY mode data connection");
+
+    ManifestCount = 0;
+    CrcCacheWalk = CrcCacheClock;
+    CrcCacheWalking = TRUE;
+    res = WalkDir(Conn, path, len, ManifestFile);
+    CrcCacheWalking = FALSE;
+    if (res == FR_OK && ManifestCount){
+        if (my_send(2, Conn->XferBuffer + 1, ManifestCount * MANIFEST_RECORD_SIZE, 0) < 0){
+            res = FR_DISK_ERR;
+        }
+    }
+
+    if (FTPAbort) {
+      SendReply(Conn, "226 Abort");
+      FTPAborted = TRUE;
+    } else if (res != FR_OK) {
+      Send550Error(Conn);
+    }else{
+      SendReply(Conn, "226 Transfer Complete");
+    }
+}
+
+//------------------------------------------------------------------------------------
+// MGET and MPUT transfer a set of files as one stream on the data connection.
+// Each file is a header followed by its data:
+//   name length (1), name, size (4), FAT date (2), FAT time (2)
+// with the name relative to the directory given to the command, '/' separated,
+// and numbers little endian.  A header with a zero name length ends the stream.
+//------------------------------------------------------------------------------------
+#define ARCHIVE_MAX_NAME        255
+#define ARCHIVE_HEADER_SIZE(n)  (1 + (n) + 8)
+#define ARCHIVE_FRAME_SIZE      512
+
+// Stream bytes waiting in Conn->XferBuffer
+static int ArchiveFill;
+
+static FRESULT ArchiveFlush(Inst_t * Conn)
+{
+    int n = ArchiveFill;
+
+    ArchiveFill = 0;
+    if (n && my_send(2, Conn->XferBuffer + 1, n, 0) < 0){
+        return FR_DISK_ERR;
+    }
+    return FR_OK;
+}
+
+static FRESULT ArchivePut(Inst_t * Conn, const void * Data, int Len)
+{
+    const char * p = (const char *)Data;
+    int n;
+
+    while (Len){
+        n = ARCHIVE_FRAME_SIZE - ArchiveFill;
+        if (n > Len) n = Len;
+        memcpy(Conn->XferBuffer + 4 + ArchiveFill, p, n);
+        ArchiveFill += n;
+        p += n;
+        Len -= n;
+        if (ArchiveFill == ARCHIVE_FRAME_SIZE && ArchiveFlush(Conn) != FR_OK){
+            return FR_DISK_ERR;
+        }
+    }
+    return FR_OK;
+}
+
+static FRESULT ArchiveFile(Inst_t * Conn, char * path, int RootLen, FILINFO * pfno)
+{
+    unsigned char hdr[ARCHIVE_HEADER_SIZE(ARCHIVE_MAX_NAME)];
+    const char * name = path + RootLen + 1;
+    int NameLen = strlen(name);
+    DWORD Remaining = pfno->fsize;
+    FIL fp;
+    FRESULT res;
+    UINT size;
+
+    if (NameLen > ARCHIVE_MAX_NAME) return FR_INVALID_NAME;
+    res = f_open(&fp, path, FA_READ | FA_OPEN_EXISTING);
+    if (res != FR_OK) return res;
+
+    hdr[0] = (unsigned char)NameLen;
+    memcpy(hdr + 1, name, NameLen);
+    PutLE(hdr + 1 + NameLen, Remaining, 4);
+    PutLE(hdr + 5 + NameLen, pfno->fdate, 2);
+    PutLE(hdr + 7 + NameLen, pfno->ftime, 2);
+    res = ArchivePut(Conn, hdr, ARCHIVE_HEADER_SIZE(NameLen));
+
+    // Read straight into the free part of the frame
+    while (res == FR_OK && Remaining){
+        FTPActivity++;
+        size = ARCHIVE_FRAME_SIZE - ArchiveFill;
+        if (size > Remaining) size = Remaining;
+        res = f_read(&fp, Conn->XferBuffer + 4 + ArchiveFill, size, &size);
+        if (res == FR_OK && size == 0) res = FR_INT_ERR;  // File shrunk
+        ArchiveFill += size;
+        Remaining -= size;
+        XferBytes += size;
+        if (ArchiveFill == ARCHIVE_FRAME_SIZE && res == FR_OK){
+            res = ArchiveFlush(Conn);
+        }
+    }
+    f_close(&fp);
+    return res;
+}
+
+static void Cmd_MGET(Inst_t * Conn, char * dirname)
+{
+    char path[MAX_PATH];
+    FILINFO fno;
+    DIR dp;
+    FRESULT res;
+    int len;
+
+    len = GetTreePath(dirname, path);
+    if (len < 0){
+        SendReply(Conn, "550 Path permission error");
+        return;
+    }
+    slogf(LOG_DEST_BOTH, "[Cmd_MGET] %s", path);
+
+    // f_stat does not work on a volume root, try the path as a directory first
+    memset(&fno, 0, sizeof(fno));
+    if (f_opendir(&dp, path) == FR_OK){
+        f_closedir(&dp);
+        fno.fattrib = AM_DIR;
+    }else if (f_stat(path, &fno)){
+        Send550Error(Conn);
+        return;
+    }
+
+    SendReply(Conn, "150 Opening BINARY mode data connection");
+    Sleep(200);
+
+    ArchiveFill = 0;
+    if (fno.fattrib & AM_DIR){
+        res = WalkDir(Conn, path, len, ArchiveFile);
+    }else{
+        // A single file, its name is relative to its directory
+        res = ArchiveFile(Conn, path, strrchr(path, '/') ? strrchr(path, '/') - path : -1, &fno);
+    }
+    if (res == FR_OK && !FTPAbort){
+        unsigned char End = 0;
+        res = ArchivePut(Conn, &End, 1);
+        if (res == FR_OK) res = ArchiveFlush(Conn);
+    }
+
+    if (FTPAbort) {
+      SendReply(Conn, "226 Abort");
+      FTPAborted = TRUE;
+    } else if (res != FR_OK) {
+      Send550Error(Conn);
+    }else{
+      SendReply(Conn, "226 Transfer Complete");
+    }
+}
+
+static void Cmd_MPUT(Inst_t * Conn, char * dirname)
+{
+    char path[MAX_PATH];
+    unsigned char hdr[ARCHIVE_HEADER_SIZE(ARCHIVE_MAX_NAME)];
+    int HdrLen = 0;
+    BOOL InFile = FALSE;
+    BOOL Done = FALSE;
+    DWORD Remaining = 0;
+    FILINFO fno;
+    FIL fp;
+    FRESULT res = FR_OK;
+    UINT towrite, written;
+    int len, n, pos, Files = 0;
+    char RepBuf[40];
+    long long int Used;
+    BOOL NoMoreSpace = FALSE;
+    BOOL Protected = FALSE;
+
+    len = GetTreePath(dirname, path);
+    if (len < 0){
+        SendReply(Conn, "550 Path permission error");
+        return;
+    }
+    slogf(LOG_DEST_BOTH, "[Cmd_MPUT] %s", path);
+    if (GetUsedSpace(&Used) != FR_OK){
+        Send550Error(Conn);
+        return;
+    }
+
+    SendReply(Conn, "150 Opening BINARY mode data connection");
+
+    while (!Done && res == FR_OK && !FTPAbort){
+        FTPActivity++;
+        n = my_recv2(2, eMMC_WriteBuf, eMMC_WRITE_BUF_SIZE, 0);
+        if (n <= 0){
+            res = FR_TIMEOUT;   // Stream ended without the end marker
+            break;
+        }
+        XferBytes += n;
+
+        for (pos = 0; pos < n && !Done && res == FR_OK;){
+            if (InFile){
+                // File data goes straight to its final name
+                towrite = (n - pos > Remaining) ? Remaining : n - pos;
+                res = f_write(&fp, eMMC_WriteBuf + pos, towrite, &written);
+                if (res == FR_OK && written != towrite) res = FR_DENIED;  // Disk full
+                pos += written;
+                Remaining -= written;
+            }else{
+                hdr[HdrLen++] = eMMC_WriteBuf[pos++];
+                if (hdr[0] == 0){
+                    Done = TRUE;
+                    break;
+                }
+                if (HdrLen < ARCHIVE_HEADER_SIZE(hdr[0])){
+                    continue;
+                }
+
+                // Header complete, create the file and any missing directories
+                HdrLen = 0;
+                Remaining = hdr[1 + hdr[0]] | (hdr[2 + hdr[0]] << 8)
+                          | ((DWORD)hdr[3 + hdr[0]] << 16) | ((DWORD)hdr[4 + hdr[0]] << 24);
+                memset(&fno, 0, sizeof(fno));
+                fno.fdate = hdr[5 + hdr[0]] | (hdr[6 + hdr[0]] << 8);
+                fno.ftime = hdr[7 + hdr[0]] | (hdr[8 + hdr[0]] << 8);
+                hdr[1 + hdr[0]] = 0;
+                if (strstr((char *)hdr + 1, "..") || hdr[1] == '/'
+                    || len + 1 + hdr[0] >= MAX_PATH){
+                    res = FR_INVALID_NAME;
+                    break;
+                }
+                sprintf(path + len, "/%s", (char *)hdr + 1);
+
+                // Files that SRFT validates are not written here, and the set must
+                // fit the quota like STOR
+                if (IsProtectedPath(path)){
+                    slogf(LOG_DEST_BOTH, "[Cmd_MPUT] %s refused", path);
+                    Protected = TRUE;
+                    res = FR_DENIED;
+                    break;
+                }
+                if (Remaining > AVAILABLE_SPACE - Used){
+                    NoMoreSpace = TRUE;
+                    res = FR_DENIED;
+                    break;
+                }
+                Used += Remaining;
+                {
+                    char * p;
+                    for (p = strchr(path + len + 1, '/'); p; p = strchr(p + 1, '/')){
+                        *p = 0;
+                        f_mkdir(path);
+                        *p = '/';
+                    }
+                }
+                CrcCacheDrop(path);
+                res = f_open(&fp, path, FA_WRITE | FA_CREATE_ALWAYS);
+                if (res == FR_OK){
+                    InFile = TRUE;
+                }
+            }
+
+            if (InFile && Remaining == 0){
+                InFile = FALSE;
+                res = f_close(&fp);
+                if (res == FR_OK){
+                    res = f_utime(path, &fno);
+                    Files++;
+                }
+            }
+        }
+    }
+
+    if (InFile){
+        // Drop the partly written file
+        f_close(&fp);
+        f_unlink(path);
+    }
+
+    if (FTPAbort) {
+      SendReply(Conn, "226 Abort");
+      FTPAborted = TRUE;
+    } else if (res != FR_OK) {
+      if (Protected){
+        SendReply(Conn, "553 Permission denied");
+      }else if (NoMoreSpace){
+        SendReply(Conn, "552 Disk full");
+      }else{
+        Send550Error(Conn);
+      }
+      // Flush receive data to give a chance to unblock FTP client
+      while (res != FR_TIMEOUT && my_recv2(2, eMMC_WriteBuf, eMMC_WRITE_BUF_SIZE, 0) > 0);
+    }else{
+      sprintf(RepBuf, "226 Transfer Complete, %d files", Files);
+      SendReply(Conn, RepBuf);
+    }
+}
+
+//------------------------------------------------------------------------------------
+// Main loop - handle the FTP commands that are implemented.
+//------------------------------------------------------------------------------------
+static void ProcessCommands(Inst_t * Conn)
+{
+    // Data buffer for reading FTP command codes
+    char buf[MAX_PATH+10];
+    char repbuf[MAX_PATH+10];
+    char * NewPath;
+    char * Prefix;
+    char *Date_Time;
+    int a;
+    int buf_len;
+    bool recursive;
+    uint8_t retSD;   
+    DWORD fre_clust, fre_sect, tot_sect, used_sect;
+    FATFS *fs;
+    Conn->PassiveSocket = 1;
+    disk_stats_attach(&XferDisk);
+
+    // Indicate ready to accept commands
+    SendReply(Conn, "220 Minftpd ready");
+
+    for(;;){
+        // Get FTP command from input stream
+        CmdTypes FtpCommand;
+        int AuthorizedCommand;
+        uint32_t StartTick;
+
+        FtpCommand = (CmdTypes)GetCommand(Conn, buf);
+        if (FtpCommand == UNKNOWN_COMMAND) {
+          continue;
+        }
+        FTPActivity++;
+        StartTick = osKernelSysTick();
+        XferBytes = 0;
+        memset(&XferDisk, 0, sizeof(XferDisk));
+        if (FtpCommand != RRNG && FtpCommand != WRNG) {
+          // Anything else may change the cluster chain of the file
+          RangeClmtKey.Valid = FALSE;
+        }
+        if (FTPLocked) {
+          // Check if valid templates exist
+          if (FindValidTemplate() != FR_OK) {
+            // Unlock FTP since no templates
+            FTPLocked = FALSE;
+            AdvertiseLockStatus(FTPLocked);
+            SetRootDir(FTP_ROOT_PATH);
+          }
+        }
+        if (FTPLocked) {
+          AuthorizedCommand = FALSE;
+
+          if (FtpCommand == SRFT) {
+            NewPath = FindPath(buf);
+          }else
+          {
+            NewPath = buf;
+          }
+          if (strncmp(NewPath, FTP_AUTH_SIGNIN_PATH, (sizeof(FTP_AUTH_SIGNIN_PATH) -1)) == 0) {
+            AuthorizedCommand = TRUE;
+          }else if (strncmp(NewPath, LICENSE_PATH, (sizeof(LICENSE_PATH) -1)) == 0) {
+            AuthorizedCommand = TRUE;
+          }else if (strncmp(NewPath, FTP_LICENSE_PATH, (sizeof(FTP_LICENSE_PATH) -1)) == 0) {
+            AuthorizedCommand = TRUE;
+          }else if (strncmp(NewPath, FTP_PASSWORD_VAULT_PATH, (sizeof(FTP_PASSWORD_VAULT_PATH) -1)) == 0) {
+            AuthorizedCommand = TRUE;
+          }
+          if (!AuthorizedCommand) {
+            SendReply(Conn, "530 not logged");
+            continue;
+          }
+        }
+        switch(FtpCommand){
+            case SYST:
+                slogf(LOG_DEST_BOTH, "[ProcessCommands] SYST command");
+                SendReply(Conn, "215 ftpdmin v. "FTPDMIN_VER);
+                break;
+
+            case PASV:
+                slogf(LOG_DEST_BOTH, "[ProcessCommands] PASV command");
+                sprintf(repbuf, "227 Entering Passive Mode (%s,%d,%d)",
+                    OurAddrStr, Conn->XferPort >>8, Conn->XferPort & 0xff);
+                for (a=0;a<50;a++){
+                    if (repbuf[a] == 0) break;
+                    if (repbuf[a] == '.') repbuf[a] = ',';
+                }
+                SendReply(Conn, repbuf);
+                Conn->PassiveMode = TRUE;
+                break;
+
+            case XPWD:
+            case PWD: // Print working directory
+                slogf(LOG_DEST_BOTH, "[ProcessCommands] PWD command"); 
+                sprintf(repbuf,"257 \"%s\"", MyGetDir());
+                SendReply(Conn, repbuf);
+                break;
+
+            case NLST: // Request directory, names only.
+                Cmd_NLST(Conn, buf, FALSE, FALSE);
+                break;
+
+            case LIST: // Request directory, long version.
+                Cmd_NLST(Conn, buf, TRUE, FALSE);
+                break;
+
+            case STAT: // Just like LIST, but use control connection.
+                Cmd_NLST(Conn, buf, TRUE, TRUE);
+                break;
 
             case DELE:
                 buf_len = strlen(buf) - 3;
@@ -1331,6 +2739,8 @@ static void ProcessCommands(Inst_t * Conn)
                     SendReply(Conn, "550 Permission denied");
                     break;
                 }       
+                // A directory takes its files with it
+                CrcCacheDrop(NULL);
                 if (f_rename(repbuf, NewPath)){
                     Send550Error(Conn);
                 }else{
@@ -1368,6 +2778,38 @@ static void ProcessCommands(Inst_t * Conn)
               Cmd_MLST(Conn, buf);
               break;
 
+            case XCRC:
+              Cmd_XCRC(Conn, buf);
+              break;
+
+            case MANIFEST:
+              Cmd_MANIFEST(Conn, buf);
+              break;
+
+            case MGET:
+              Cmd_MGET(Conn, buf);
+              break;
+
+            case MPUT:
+              if (GetOnly){
+                  SendReply(Conn, "553 Permission denied");
+                  break;
+              }
+              Cmd_MPUT(Conn, buf);
+              break;
+
+            case RRNG:
+              Cmd_RRNG(Conn, buf);
+              break;
+
+            case WRNG:
+              if (GetOnly){
+                  SendReply(Conn, "553 Permission denied");
+                  break;
+              }
+              Cmd_WRNG(Conn, buf);
+              break;
+
             case CWD: // Change working directory
                 NewPath = TranslatePathAbs(buf);
                 slogf(LOG_DEST_BOTH, "[ProcessCommands] CWD %s", NewPath);
@@ -1387,6 +2829,22 @@ static void ProcessCommands(Inst_t * Conn)
                 SendReply(Conn, "200 Type set to I");
                 break;
 
+            case OPTS: // OPTS COMP LZ|OFF, compress the next RETR or STOR
+                slogf(LOG_DEST_BOTH, "[ProcessCommands] OPTS %s", buf);
+                for (a=0;buf[a];a++){
+                    buf[a] = toupper(buf[a]);
+                }
+                if (strcmp(buf, "COMP LZ") == 0){
+                    Conn->Compress = TRUE;
+                    SendReply(Conn, "200 LZ compression on for next transfer");
+                }else if (strcmp(buf, "COMP OFF") == 0){
+                    Conn->Compress = FALSE;
+                    SendReply(Conn, "200 Compression off");
+                }else{
+                    SendReply(Conn, "501 Option not supported");
+                }
+                break;
+
             case NOOP:
                 slogf(LOG_DEST_BOTH, "[ProcessCommands] NOOP command");
                 SendReply(Conn, "200 OK");
@@ -1460,6 +2918,7 @@ static void ProcessCommands(Inst_t * Conn)
                 SendReply(Conn, "500 command not implemented");
                 break;
         }
+        UpdateXferStats(FtpCommand, osKernelSysTick() - StartTick);
         // MDR test power management GotoStop = TRUE;
         //osSemaphoreRelease(PMIC_Semaphore);
         //osThreadYield();
@@ -1511,12 +2970,6 @@ int ftp_main(int argc, char **argv)
 
     InitializeCriticalSection(&gCS);
     
-    osSemaphoreDef(FTP_SEM_RX_FULL);
-    FTP_RxDataReady = osSemaphoreCreate(osSemaphore(FTP_SEM_RX_FULL) , 1);
-    
-    osSemaphoreDef(FTP_SEM_RX_EMPTY);
-    FTP_RxFifoEmpty = osSemaphoreCreate(osSemaphore(FTP_SEM_RX_EMPTY) , 1);
-    
     for (argn=1;argn<argc;argn++){
         char * arg;
         arg = argv[argn];
@@ -1569,6 +3022,9 @@ int ftp_main(int argc, char **argv)
 
     XferPort = XferPortStart;
 
+    // Finish an atomic WRNG interrupted by a reset
+    RangeJournalApply();
+
     slogf(LOG_DEST_BOTH, "ftpdmin ready to accept connections");
     
     Inst_t * Conn;
@@ -1579,6 +3035,9 @@ int ftp_main(int argc, char **argv)
     }
     Conn->CommandSocket = 1;
     Conn->XferPort = XferPort;
+    Conn->Compress = FALSE;
+    Conn->Tag[0] = 0;
+    Conn->Binary = FALSE;
     
     ProcessCommands(Conn);
 
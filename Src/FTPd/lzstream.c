@@ -0,0 +1,174 @@
+//------------------------------------------------------------------------------------
+// Small streaming LZ codec used for compressed FTP transfers, see lzstream.h for
+// the stream format.
+//------------------------------------------------------------------------------------
+#include <string.h>
+
+#include "lzstream.h"
+
+#define LZ_HASH(p)  ((((p)[0] << 5) ^ ((p)[1] << 2) ^ (p)[2]) & (LZ_HASH_SIZE - 1))
+
+// Decoder states
+#define LZ_STATE_TOKEN      0
+#define LZ_STATE_LITERALS   1
+#define LZ_STATE_OFFSET     2
+#define LZ_STATE_MATCH      3
+
+//------------------------------------------------------------------------------------
+// Reset the encoder for a new stream.
+//------------------------------------------------------------------------------------
+void LZ_EncoderInit(LZEncoder_t * Enc)
+{
+    int a;
+
+    Enc->Fill = 0;
+    for(a=0;a<LZ_HASH_SIZE;a++){
+        Enc->Head[a] = -1;
+    }
+}
+
+//------------------------------------------------------------------------------------
+// Emit pending literals as one or more literal runs.
+//------------------------------------------------------------------------------------
+static int LZ_PutLiterals(const unsigned char * Lit, int Len, unsigned char * Out)
+{
+    int OutLen = 0;
+    int Run;
+
+    while(Len > 0){
+        Run = (Len > LZ_MAX_LITERALS) ? LZ_MAX_LITERALS : Len;
+        Out[OutLen++] = (unsigned char)(Run - 1);
+        memcpy(Out + OutLen, Lit, Run);
+        OutLen += Run;
+        Lit += Run;
+        Len -= Run;
+    }
+    return OutLen;
+}
+
+//------------------------------------------------------------------------------------
+// Compress Len (at most LZ_MAX_INPUT) bytes.  Out must hold LZ_MAX_OUTPUT(Len)
+// bytes.  Returns the number of bytes written to Out.
+//------------------------------------------------------------------------------------
+int LZ_Encode(LZEncoder_t * Enc, const unsigned char * In, int Len, unsigned char * Out)
+{
+    unsigned char * Buf = Enc->Buf;
+    int Pos, End, LitStart, OutLen = 0;
+    int a;
+
+    if (Len > LZ_MAX_INPUT) return -1;
+
+    // Keep only the last window of history in front of the new data.
+    if (Enc->Fill + Len > sizeof(Enc->Buf)){
+        int Drop = Enc->Fill - LZ_WINDOW_SIZE;
+        memmove(Buf, Buf + Drop, LZ_WINDOW_SIZE);
+        Enc->Fill = LZ_WINDOW_SIZE;
+        for(a=0;a<LZ_HASH_SIZE;a++){
+            Enc->Head[a] = (Enc->Head[a] >= Drop) ? Enc->Head[a] - Drop : -1;
+        }
+    }
+    memcpy(Buf + Enc->Fill, In, Len);
+
+    Pos = LitStart = Enc->Fill;
+    End = Enc->Fill + Len;
+    while(Pos < End){
+        int Cand = -1;
+        int MatchLen = 0;
+
+        if (End - Pos >= LZ_MIN_MATCH){
+            int h = LZ_HASH(Buf + Pos);
+            Cand = Enc->Head[h];
+            Enc->Head[h] = (short)Pos;
+            if (Cand >= 0 && Pos - Cand <= LZ_WINDOW_SIZE){
+                int Max = End - Pos;
+                if (Max > LZ_MAX_MATCH) Max = LZ_MAX_MATCH;
+                while(MatchLen < Max && Buf[Cand + MatchLen] == Buf[Pos + MatchLen]){
+                    MatchLen++;
+                }
+            }
+        }
+
+        if (MatchLen < LZ_MIN_MATCH){
+            Pos++;
+            continue;
+        }
+
+        OutLen += LZ_PutLiterals(Buf + LitStart, Pos - LitStart, Out + OutLen);
+        a = Pos - Cand - 1;
+        Out[OutLen++] = (unsigned char)(0x80 | ((MatchLen - LZ_MIN_MATCH) << 2) | (a >> 8));
+        Out[OutLen++] = (unsigned char)(a & 0xff);
+
+        // Index the positions covered by the match too, so later data can refer to them.
+        for(a=1;a<MatchLen && End - (Pos + a) >= LZ_MIN_MATCH;a++){
+            Enc->Head[LZ_HASH(Buf + Pos + a)] = (short)(Pos + a);
+        }
+        Pos += MatchLen;
+        LitStart = Pos;
+    }
+    OutLen += LZ_PutLiterals(Buf + LitStart, End - LitStart, Out + OutLen);
+
+    Enc->Fill = End;
+    return OutLen;
+}
+
+//------------------------------------------------------------------------------------
+// Reset the decoder for a new stream.
+//------------------------------------------------------------------------------------
+void LZ_DecoderInit(LZDecoder_t * Dec)
+{
+    memset(Dec, 0, sizeof(LZDecoder_t));
+    Dec->State = LZ_STATE_TOKEN;
+}
+
+//------------------------------------------------------------------------------------
+// Expand up to OutSize bytes from In.  Stops when Out is full or the input is
+// used up; a token split across calls is resumed on the next call.  Sets *Used to
+// the number of input bytes consumed and returns the number of bytes written.
+//------------------------------------------------------------------------------------
+int LZ_Decode(LZDecoder_t * Dec, const unsigned char * In, int Len, int * Used,
+              unsigned char * Out, int OutSize)
+{
+    int InPos = 0, OutLen = 0;
+    unsigned char c;
+
+    while(OutLen < OutSize){
+        switch(Dec->State){
+            case LZ_STATE_TOKEN:
+                if (InPos == Len) goto Done;
+                c = In[InPos++];
+                if (c & 0x80){
+                    Dec->Count = ((c >> 2) & 0x1f) + LZ_MIN_MATCH;
+                    Dec->Offset = (c & 0x03) << 8;
+                    Dec->State = LZ_STATE_OFFSET;
+                }else{
+                    Dec->Count = c + 1;
+                    Dec->State = LZ_STATE_LITERALS;
+                }
+                continue;
+
+            case LZ_STATE_OFFSET:
+                if (InPos == Len) goto Done;
+                Dec->Offset = (Dec->Offset | In[InPos++]) + 1;
+                Dec->State = LZ_STATE_MATCH;
+                continue;
+
+            case LZ_STATE_LITERALS:
+                if (InPos == Len) goto Done;
+                c = In[InPos++];
+                break;
+
+            default:
+                c = Dec->Window[(Dec->WinPos - Dec->Offset) & (LZ_WINDOW_SIZE - 1)];
+                break;
+        }
+
+        Out[OutLen++] = c;
+        Dec->Window[Dec->WinPos++ & (LZ_WINDOW_SIZE - 1)] = c;
+        if (--Dec->Count == 0){
+            Dec->State = LZ_STATE_TOKEN;
+        }
+    }
+Done:
+    *Used = InPos;
+    return OutLen;
+}
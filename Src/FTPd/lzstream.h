@@ -0,0 +1,46 @@
+//------------------------------------------------------------------------------------
+// Small streaming LZ codec used for compressed FTP transfers.
+//
+// The stream is a sequence of tokens:
+//   0LLLLLLL                   literal run, L+1 bytes (1..128) follow
+//   1MMMMMOO OOOOOOOO          match, M+3 bytes (3..34) copied from O+1 (1..1024)
+//                              bytes back in the output
+// The window is bounded to LZ_WINDOW_SIZE bytes so both sides run in a couple of
+// kilobytes of static RAM.  Tokens never span two LZ_Encode() calls, but matches
+// may refer to data from earlier calls.
+//------------------------------------------------------------------------------------
+#ifndef _LZSTREAM_H
+#define _LZSTREAM_H
+
+#define LZ_WINDOW_SIZE      1024
+#define LZ_MIN_MATCH        3
+#define LZ_MAX_MATCH        34
+#define LZ_MAX_LITERALS     128
+#define LZ_HASH_SIZE        256
+
+// Largest input accepted by one LZ_Encode() call, and the worst case output size
+#define LZ_MAX_INPUT        504
+#define LZ_MAX_OUTPUT(n)    ((n) + (((n) + LZ_MAX_LITERALS - 1) / LZ_MAX_LITERALS))
+
+typedef struct {
+    unsigned char Buf[LZ_WINDOW_SIZE + LZ_MAX_INPUT];
+    short Head[LZ_HASH_SIZE];
+    int Fill;
+}LZEncoder_t;
+
+typedef struct {
+    unsigned char Window[LZ_WINDOW_SIZE];
+    unsigned int WinPos;
+    unsigned char State;
+    int Count;
+    unsigned int Offset;
+}LZDecoder_t;
+
+void LZ_EncoderInit(LZEncoder_t * Enc);
+int LZ_Encode(LZEncoder_t * Enc, const unsigned char * In, int Len, unsigned char * Out);
+
+void LZ_DecoderInit(LZDecoder_t * Dec);
+int LZ_Decode(LZDecoder_t * Dec, const unsigned char * In, int Len, int * Used,
+              unsigned char * Out, int OutSize);
+
+#endif
@@ -192,7 +192,7 @@ char * TranslatePath(const char * FilePath)
         strcpy(NewPath, TmpPath);
         b = strlen(NewPath);
         TmpPath = FindFilename((char *)FilePath);
-        if (TmpPath[0] != 0) {
+        if (TmpPath && TmpPath[0] != 0) {
           // if filename follows prefix, add '/' separator
           NewPath[b++] = '/';
         }
@@ -250,7 +250,7 @@ char * TranslatePathAbs(const char * FilePath)
         strcpy(NewPath, TmpPath);
         b = strlen(NewPath);
         TmpPath = FindFilename((char *)FilePath);
-        if (TmpPath[0] != 0) {
+        if (TmpPath && TmpPath[0] != 0) {
           // if filename follows prefix, add '/' separator
           NewPath[b++] = '/';
         }
@@ -0,0 +1,89 @@
+/*****< pwvcredit.c >**********************************************************/
+/*                                                                            */
+/*  PWVCredit - Credit flow control of the Password Vault (PWV) service.      */
+/*                                                                            */
+/******************************************************************************/
+#include "PWVCredit.h"
+
+   /* The following function starts a connection without credit flow    */
+   /* control, credits still unused from an earlier connection are      */
+   /* dropped.                                                          */
+void PWVTxCreditsReset(PWVTxCredits_t *Credits)
+{
+   Credits->Enabled = 0;
+   Credits->Granted = Credits->Used;
+}
+
+   /* The following function adds the credits of a TX_CREDITS write.   */
+   /* The first grant turns credit flow control on for the connection.  */
+void PWVTxCreditsGrant(PWVTxCredits_t *Credits, uint16_t Grant)
+{
+   Credits->Granted += Grant;
+   Credits->Enabled  = 1;
+}
+
+   /* The following function returns the notifications the peer still  */
+   /* accepts.                                                          */
+uint32_t PWVTxCreditsAvailable(const PWVTxCredits_t *Credits)
+{
+   return(Credits->Granted - Credits->Used);
+}
+
+   /* The following function returns how many of Count bytes may be sent*/
+   /* as notifications of NotificationLength bytes each.                */
+uint32_t PWVTxCreditsLimit(const PWVTxCredits_t *Credits, uint32_t Count, uint32_t NotificationLength)
+{
+   uint32_t Available;
+
+   if(!Credits->Enabled)
+      return(Count);
+
+   /* Avoid the multiplication overflowing on a large grant.           */
+   Available = PWVTxCreditsAvailable(Credits);
+   if(Available >= ((Count + NotificationLength - 1) / NotificationLength))
+      return(Count);
+
+   return(Available * NotificationLength);
+}
+
+   /* The following function charges Sent bytes of notifications, a     */
+   /* short last notification takes a whole credit.                     */
+void PWVTxCreditsConsume(PWVTxCredits_t *Credits, uint32_t Sent, uint32_t NotificationLength)
+{
+   if(Credits->Enabled)
+      Credits->Used += (Sent + NotificationLength - 1) / NotificationLength;
+}
+
+   /* The following function forgets Rx credits that were not notified.*/
+void PWVRxCreditsReset(PWVRxCredits_t *Credits)
+{
+   Credits->Pending = 0;
+}
+
+   /* The following function releases Bytes of staging space to the     */
+   /* peer.                                                             */
+void PWVRxCreditsRelease(PWVRxCredits_t *Credits, uint32_t Bytes)
+{
+   Credits->Pending += Bytes;
+}
+
+   /* The following function returns the credits to notify next, zero if*/
+   /* there are none.  More than one characteristic value holds is left */
+   /* for the following notification.                                  */
+uint16_t PWVRxCreditsNext(const PWVRxCredits_t *Credits)
+{
+   return((uint16_t)((Credits->Pending > PWV_CREDIT_VALUE_MAX)?PWV_CREDIT_VALUE_MAX:Credits->Pending));
+}
+
+   /* The following function removes credits the peer has been notified.*/
+void PWVRxCreditsNotified(PWVRxCredits_t *Credits, uint16_t Notified)
+{
+   Credits->Pending -= Notified;
+}
+
+   /* The following function returns the free space of a staging ring of */
+   /* BufferSize bytes with the running Head and Tail indices.          */
+uint32_t PWVRxCreditsFree(uint32_t BufferSize, uint32_t Head, uint32_t Tail)
+{
+   return(BufferSize - (Head - Tail));
+}
@@ -0,0 +1,51 @@
+/*****< pwvcredit.h >**********************************************************/
+/*                                                                            */
+/*  PWVCredit - Credit flow control of the Password Vault (PWV) service.      */
+/*                                                                            */
+/*  The peer grants notification credits through the TX_CREDITS            */
+/*  characteristic, one credit per notification, and the card hands out Rx   */
+/*  credits, bytes of free staging space, through the RX_CREDITS            */
+/*  characteristic.  The bookkeeping has no stack dependencies so it can be  */
+/*  built and tested on a host.                                              */
+/*                                                                            */
+/******************************************************************************/
+#ifndef __PWVCREDITH__
+#define __PWVCREDITH__
+
+#include <stdint.h>
+
+   /* The largest credit value carried by one characteristic value.     */
+#define PWV_CREDIT_VALUE_MAX                            0xFFFF
+
+   /* The following structure holds the notification credits of one     */
+   /* connection.  Granted is only written by the GATT callback and Used*/
+   /* only by the transfer worker, both count up and wrap, so the       */
+   /* difference stays right without a lock.                            */
+typedef struct _tagPWVTxCredits_t
+{
+   volatile uint8_t  Enabled;
+   volatile uint32_t Granted;
+   volatile uint32_t Used;
+} PWVTxCredits_t;
+
+   /* The following structure holds the Rx credits the card has released*/
+   /* but not yet notified to the peer.                                 */
+typedef struct _tagPWVRxCredits_t
+{
+   uint32_t Pending;
+} PWVRxCredits_t;
+
+   /* Notifications are not credit limited until the peer's first grant.*/
+void PWVTxCreditsReset(PWVTxCredits_t *Credits);
+void PWVTxCreditsGrant(PWVTxCredits_t *Credits, uint16_t Grant);
+uint32_t PWVTxCreditsAvailable(const PWVTxCredits_t *Credits);
+uint32_t PWVTxCreditsLimit(const PWVTxCredits_t *Credits, uint32_t Count, uint32_t NotificationLength);
+void PWVTxCreditsConsume(PWVTxCredits_t *Credits, uint32_t Sent, uint32_t NotificationLength);
+
+void PWVRxCreditsReset(PWVRxCredits_t *Credits);
+void PWVRxCreditsRelease(PWVRxCredits_t *Credits, uint32_t Bytes);
+uint16_t PWVRxCreditsNext(const PWVRxCredits_t *Credits);
+void PWVRxCreditsNotified(PWVRxCredits_t *Credits, uint16_t Notified);
+uint32_t PWVRxCreditsFree(uint32_t BufferSize, uint32_t Head, uint32_t Tail);
+
+#endif
@@ -27,6 +27,9 @@
 #include <ctype.h>               /* Included for isalnum.                     */
 #include "pmic.h"
 #include "slog.h"
+#include "flash_if.h"
+#include "PWVCredit.h"
+#include "AdvTiming.h"
 
 #ifndef FCC_TESTS        // Do not compile for FCC tests
 
@@ -81,7 +84,7 @@ extern UART_HandleTypeDef UartHandle;
                                                          /* protection used   */
                                                          /* with LE Pairing.  */
 #define DEFAULT_ALERT_LEVEL                        (0)
-#define MAX_LE_CONNECTIONS                          (1)  /* Denotes the max   */
+#define MAX_LE_CONNECTIONS                          (2)  /* Denotes the max   */
                                                          /* number of LE      */
                                                          /* connections that  */
                                                          /* are allowed at    */
@@ -196,12 +199,62 @@ const uint8_t TEST_DATA[517] =
 #define EXIT_MODE                                  (-10) /* Flags exit from   */
                                                          /* any Mode.         */
 
-//#define PWV_DATA_BUFFER_LENGTH  (BTPS_CONFIGURATION_GATT_MAXIMUM_SUPPORTED_MTU_SIZE)
-#define PWV_DATA_BUFFER_LENGTH  (350)
-
-                                                         /* Defines the length*/
-                                                         /* of a SPPLE Data   */
-                                                         /* Buffer.           */
+   /* The following define the ATT MTU the PWV service negotiates.  A   */
+   /* 247 byte MTU plus the 4 byte L2CAP header fills exactly one 251   */
+   /* byte LE Data Length Extension PDU.  Each notification carries the */
+   /* MTU less the ATT opcode and attribute handle.                     */
+#define PWV_PREFERRED_MTU                          247
+#define PWV_NOTIFICATION_HEADER_LENGTH             3
+
+   /* The following define the LE Data Length Extension parameters that */
+   /* are requested when the controller supports it (HCI LE Set Data    */
+   /* Length, which this version of Bluetopia has no API for).          */
+#define LE_DATA_LENGTH_DEFAULT_TX_OCTETS           27
+#define LE_DATA_LENGTH_DEFAULT_TX_TIME             328
+#define LE_DATA_LENGTH_MAXIMUM_TX_OCTETS           251
+#define LE_DATA_LENGTH_MAXIMUM_TX_TIME             2120
+#define LE_FEATURE_DATA_PACKET_LENGTH_EXTENSION_BIT_NUMBER  5
+#define HCI_COMMAND_CODE_LE_SET_DATA_LENGTH_OCF    0x0022
+
+   /* The following define the RFCOMM configuration of the FTP serial   */
+   /* port.  The largest frame the FTP server exchanges (its 528 byte   */
+   /* transfer buffer plus framing) is used as the RFCOMM frame size,   */
+   /* so every FTP frame travels as one RFCOMM frame.  The transmit     */
+   /* buffer holds three of them so BT_WriteABuffer() can hand over a   */
+   /* whole frame while the previous ones are still being sent, the     */
+   /* receive buffer sets the number of credits granted to the peer.    */
+   /* The number of data packets queued to the lower layer is bounded   */
+   /* so a peer granting many credits cannot exhaust the stack heap.    */
+#define SPP_FTP_LARGEST_WRITE                      (528 + 5)
+#define SPP_FTP_TRANSMIT_FRAMES                    3
+#define SPP_FTP_RECEIVE_CREDITS                    6
+#define SPP_FTP_QUEUE_MAXIMUM_PACKETS              4
+#define SPP_FTP_QUEUE_THRESHOLD                    2
+
+   /* The following define the LE connection parameters requested for   */
+   /* the transfer and idle link policies next to the intervals in the  */
+   /* device settings.  The interval range is 15 ms wide and the        */
+   /* supervision timeout three times the longest time without a        */
+   /* connection event, within the limits centrals accept.              */
+#define LE_LINK_INTERVAL_RANGE                     15
+#define LE_LINK_IDLE_SLAVE_LATENCY                 2
+#define LE_LINK_SUPERVISION_TIMEOUT_MIN            2000
+#define LE_LINK_SUPERVISION_TIMEOUT_MAX            32000
+
+   /* The following defines the length of one advertising event on the  */
+   /* three advertising channels (a full PDU plus the scan response     */
+   /* window on each), used to log the radio duty cycle of a stage.     */
+#define ADVERTISE_EVENT_US                         1500
+
+   /* The following define the fast reconnect to the last bonded        */
+   /* central.  Each high duty cycle directed advertising burst is ended*/
+   /* by the controller after 1.28 s, the guard restarts advertising if */
+   /* the directed advertising timeout never arrives.  A timeout less   */
+   /* than ADVERTISE_DIRECTED_MIN_MS after a burst started is a late one*/
+   /* of the burst before and is ignored.                               */
+#define ADVERTISE_DIRECTED_BURSTS                  2
+#define ADVERTISE_DIRECTED_GUARD_MS                1500
+#define ADVERTISE_DIRECTED_MIN_MS                  1000
 
    /* Determine the Name we will use for this compilation.              */
 #define APP_DEMO_NAME                              "CYBERGATE"
@@ -223,6 +276,10 @@ const uint8_t TEST_DATA[517] =
    /* Following converts a Sniff Parameter in Milliseconds to frames.   */
 #define MILLISECONDS_TO_BASEBAND_SLOTS(_x)   ((_x) / (0.625))
 
+   /* Following defines how often VUSB is polled when the SPP thread    */
+   /* has to disconnect on plug in (there is no event for it).          */
+#define SPP_VUSB_POLL_INTERVAL                  200
+
    /* Following represents operating states of the SPP thread loop      */
 #define SPP_STATE_INIT                          0
 #define SPP_STATE_INIT_PAIRING                  1
@@ -230,11 +287,26 @@ const uint8_t TEST_DATA[517] =
 #define SPP_STATE_ADVERTISE                     3
 #define SPP_STATE_PAIRING_MODE                  4
 #define SPP_STATE_EDR_ENABLED                   5
-#define SPP_STATE_LE_FILE_TRANSFER_HOLD         6
-#define SPP_STATE_LE_FILE_TRANSFER_ACTIVE       7
-#define SPP_STATE_LE_FILE_TRANSFER_START        8
-#define SPP_STATE_PM_WAIT_LE                    9
-#define SPP_STATE_PM_WAIT_EDR                   10
+#define SPP_STATE_LE_FILE_TRANSFER_ACTIVE       6
+#define SPP_STATE_PM_WAIT_LE                    7
+#define SPP_STATE_PM_WAIT_EDR                   8
+
+   /* Following defines the LE file transfer worker.  The file is read  */
+   /* from the eMMC in whole sectors so FatFs can read straight into the*/
+   /* buffer with multi-block transfers.                                */
+#define LE_TRANSFER_BLOCK_SIZE                  (4 * _MAX_SS)
+#define LE_TRANSFER_QUEUE_SIZE                  16
+
+   /* Following defines the RAM staging ring for PWV File Writes.  The  */
+   /* GATT callback only copies into the ring and the worker commits it */
+   /* to the eMMC in LE_TRANSFER_BLOCK_SIZE blocks.  The size must be a */
+   /* power of two and a multiple of the block size.                    */
+#define LE_STAGING_BUFFER_SIZE                  (2 * LE_TRANSFER_BLOCK_SIZE)
+
+   /* Following defines how many received files may be staged at once,  */
+   /* i.e. how far the GATT callback may run ahead of the worker.  The  */
+   /* number must be a power of two.                                    */
+#define LE_STAGING_FILES                        2
 
    /* Following represents defines for custom password vault service    */
 
@@ -275,7 +347,7 @@ static GATT_Characteristic_Descriptor_16_Entry_t Client_Characteristic_Configura
    /* The PWV File Write Characteristic Declaration.                  */
 static BTPSCONST GATT_Characteristic_Declaration_128_Entry_t PWV_File_Write_Declaration =
 {
-   (GATT_CHARACTERISTIC_PROPERTIES_WRITE),
+   (GATT_CHARACTERISTIC_PROPERTIES_WRITE|GATT_CHARACTERISTIC_PROPERTIES_WRITE_WITHOUT_RESPONSE),
    PWV_FILE_WRITE_CHARACTERISTIC_BLUETOOTH_UUID_CONSTANT
 };
 
@@ -287,6 +359,36 @@ static BTPSCONST GATT_Characteristic_Value_128_Entry_t PWV_File_Write_Value =
    NULL
 };
 
+   /* The PWV Tx Credits Characteristic Declaration.                  */
+static BTPSCONST GATT_Characteristic_Declaration_128_Entry_t PWV_Tx_Credits_Declaration =
+{
+   (GATT_CHARACTERISTIC_PROPERTIES_READ|GATT_CHARACTERISTIC_PROPERTIES_WRITE|GATT_CHARACTERISTIC_PROPERTIES_WRITE_WITHOUT_RESPONSE),
+   PWV_TX_CREDITS_CHARACTERISTIC_BLUETOOTH_UUID_CONSTANT
+};
+
+   /* The PWV Tx Credits Characteristic Value.                        */
+static BTPSCONST GATT_Characteristic_Value_128_Entry_t PWV_Tx_Credits_Value =
+{
+   PWV_TX_CREDITS_CHARACTERISTIC_BLUETOOTH_UUID_CONSTANT,
+   0,
+   NULL
+};
+
+   /* The PWV Rx Credits Characteristic Declaration.                  */
+static BTPSCONST GATT_Characteristic_Declaration_128_Entry_t PWV_Rx_Credits_Declaration =
+{
+   (GATT_CHARACTERISTIC_PROPERTIES_READ|GATT_CHARACTERISTIC_PROPERTIES_NOTIFY),
+   PWV_RX_CREDITS_CHARACTERISTIC_BLUETOOTH_UUID_CONSTANT
+};
+
+   /* The PWV Rx Credits Characteristic Value.                        */
+static BTPSCONST GATT_Characteristic_Value_128_Entry_t PWV_Rx_Credits_Value =
+{
+   PWV_RX_CREDITS_CHARACTERISTIC_BLUETOOTH_UUID_CONSTANT,
+   0,
+   NULL
+};
+
 BTPSCONST GATT_Service_Attribute_Entry_t PWV_Service[] =
 {
    {GATT_ATTRIBUTE_FLAGS_READABLE,          aetPrimaryService128,            (Byte_t *)&PWV_Service_UUID},                    //0
@@ -295,22 +397,37 @@ BTPSCONST GATT_Service_Attribute_Entry_t PWV_Service[] =
    {GATT_ATTRIBUTE_FLAGS_READABLE_WRITABLE, aetCharacteristicDescriptor16,   (Byte_t *)&Client_Characteristic_Configuration}, //3
    {GATT_ATTRIBUTE_FLAGS_READABLE,          aetCharacteristicDeclaration128, (Byte_t *)&PWV_File_Write_Declaration},          //4
    {GATT_ATTRIBUTE_FLAGS_WRITABLE,          aetCharacteristicValue128,       (Byte_t *)&PWV_File_Write_Value},                //5
+   {GATT_ATTRIBUTE_FLAGS_READABLE,          aetCharacteristicDeclaration128, (Byte_t *)&PWV_Rx_Credits_Declaration},          //6
+   {GATT_ATTRIBUTE_FLAGS_READABLE,          aetCharacteristicValue128,       (Byte_t *)&PWV_Rx_Credits_Value},                //7
+   {GATT_ATTRIBUTE_FLAGS_READABLE_WRITABLE, aetCharacteristicDescriptor16,   (Byte_t *)&Client_Characteristic_Configuration}, //8
+   {GATT_ATTRIBUTE_FLAGS_READABLE,          aetCharacteristicDeclaration128, (Byte_t *)&PWV_Tx_Credits_Declaration},          //9
+   {GATT_ATTRIBUTE_FLAGS_READABLE_WRITABLE, aetCharacteristicValue128,       (Byte_t *)&PWV_Tx_Credits_Value},                //10
 };
 #define PWV_SERVICE_ATTRIBUTE_COUNT                    (sizeof(PWV_Service)/sizeof(GATT_Service_Attribute_Entry_t))
 
 #define PWV_CONTROL_POINT_CHARACTERISTIC_ATTRIBUTE_OFFSET               2
 #define PWV_CONTROL_POINT_CHARACTERISTIC_CCD_ATTRIBUTE_OFFSET           3
 #define PWV_FILE_WRITE_CHARACTERISTIC_ATTRIBUTE_OFFSET                  5
+#define PWV_RX_CREDITS_CHARACTERISTIC_ATTRIBUTE_OFFSET                  7
+#define PWV_RX_CREDITS_CHARACTERISTIC_CCD_ATTRIBUTE_OFFSET              8
+#define PWV_TX_CREDITS_CHARACTERISTIC_ATTRIBUTE_OFFSET                  10
 
 #define PWV_ERROR_FILE_OPEN_FAIL                                        1
 #define PWV_ERROR_FILE_NOT_OPEN                                         2
 #define PWV_ERROR_FILE_CLOSE_FAIL                                       3
 #define PWV_ERROR_FILE_WRITE_FAIL                                       4
+#define PWV_ERROR_TRANSFER_BUSY                                         5
 
 #define PWV_CMD_ENABLE_EDR                                              1
 #define PWV_CMD_SEND_FILE                                               2
 #define PWV_CMD_OPEN_FILE                                               3
 #define PWV_CMD_CLOSE_FILE                                              4
+#define PWV_CMD_GET_LINK_PARAMS                                         5
+
+   /* The PWV_CMD_GET_LINK_PARAMS response is notified on the Control   */
+   /* Point as the command code followed by the ATT MTU, the LE TX      */
+   /* octets and the LE TX time, all little endian words.               */
+#define PWV_LINK_PARAMS_RESPONSE_LENGTH         (BYTE_SIZE + 3 * WORD_SIZE)
 
    /* The following type definition represents the structure which holds*/
    /* all information about the parameter, in particular the parameter  */
@@ -435,8 +552,20 @@ typedef struct _tagConnectionInfo_t
    GAP_LE_Address_Type_t AddressType;
    BD_ADDR_t             BD_ADDR;
    unsigned int          SecurityTimerID;
+   Word_t                MTU;
+   Word_t                TxOctets;
+   Word_t                TxTime;
+   Word_t                ConnectionInterval;
+   Byte_t                LinkSpeed;
+   PWVTxCredits_t        TxCredits;
 } ConnectionInfo_t;
 
+   /* The following define the connection parameter policy requested    */
+   /* from the central, see LERequestLinkSpeed().                       */
+#define LE_LINK_SPEED_UNCHANGED                             0
+#define LE_LINK_SPEED_TRANSFER                              1
+#define LE_LINK_SPEED_IDLE                                  2
+
 #define CONNECTION_INFO_FLAGS_CONNECTION_ENCRYPTED          0x01
 #define CONNECTION_INFO_FLAGS_CONNECTION_AWAITING_PASSKEY   0x02
 #define CONNECTION_INFO_FLAGS_CONNECTION_VALID              0x80
@@ -451,9 +580,35 @@ typedef struct _tagApplicationStateInfo_t
    unsigned int         DISInstanceID;
    unsigned int         BASInstanceID;
    unsigned int         BatteryLevel;
-   ConnectionInfo_t     LEConnectionInfo;
+   ConnectionInfo_t     LEConnectionInfo[MAX_LE_CONNECTIONS];
 } ApplicationStateInfo_t;
 
+   /* The following structure describes one stage of the advertising    */
+   /* schedule.  Advertising starts fast after wake up, a button press  */
+   /* or a disconnect so a central finds the card quickly, and slows    */
+   /* down stage by stage to save the battery.  A stage with a Duration */
+   /* of zero lasts until advertising restarts, its interval of zero    */
+   /* means the Advertising_Interval_Min/Max device settings.  All      */
+   /* values are in ms.                                                 */
+typedef struct _tagAdvertiseStage_t
+{
+   DWord_t Duration;
+   Word_t  IntervalMin;
+   Word_t  IntervalMax;
+} AdvertiseStage_t;
+
+   /* The following structure describes one file received through PWV  */
+   /* File Writes.  The GATT callback fills it in on OPEN_FILE and sets */
+   /* the end of the file in the staging ring on CLOSE_FILE, so the     */
+   /* worker never commits the data of the next file to this one.      */
+typedef struct _tagLEStagingFile_t
+{
+   uint32_t           OpenIndex;
+   volatile uint32_t  CloseIndex;
+   volatile Boolean_t Closed;
+   uint8_t            FilePath[FILEPATH_LE_MAX_LENGTH];
+} LEStagingFile_t;
+
 #define APPLICATION_STATE_INFO_FLAGS_LE_CONNECTED           0x01
 #define APPLICATION_STATE_INFO_FLAGS_CAPS_LOCKED            0x02
 
@@ -496,6 +651,35 @@ typedef struct _tagDeviceInfo_t
    /* the DeviceInfo_t structure.                                       */
 #define DEVICE_INFO_FLAGS_IRK_VALID                      0x01
 
+   /* The following define the size of the device info table.  Up to    */
+   /* DEVICE_INFO_TABLE_SIZE bonded devices are kept, the extra slots   */
+   /* hold connected devices that are not bonded and are never saved.   */
+   /* Entries are chained by NextDeviceInfoPtr in DEVICE_INFO_HASH_SIZE */
+   /* buckets (a power of two) hashed from the Connection BD_ADDR.      */
+#define DEVICE_INFO_TABLE_SIZE                           8
+#define DEVICE_INFO_SLOTS                                (DEVICE_INFO_TABLE_SIZE + MAX_LE_CONNECTIONS)
+#define DEVICE_INFO_HASH_SIZE                            16
+
+   /* The following structure is one record of BT_LE_KEY_FILENAME.  The */
+   /* file is a log: every change of a device entry appends the whole   */
+   /* entry (or its deletion) and the last record of a device wins.  A  */
+   /* record is only used if its CRC matches, a record torn by a reset  */
+   /* ends the log.  The log is rewritten with one record per device    */
+   /* once it holds DEVICE_INFO_COMPACT_RECORDS records.                */
+typedef struct _tagDeviceInfoRecord_t
+{
+   DWord_t       Magic;
+   Byte_t        Type;
+   DeviceInfo_t  DeviceInfo;
+   Word_t        Crc16;
+} DeviceInfoRecord_t;
+
+#define DEVICE_INFO_RECORD_MAGIC                         0x4B454C42
+#define DEVICE_INFO_RECORD_SAVE                          1
+#define DEVICE_INFO_RECORD_DELETE                        2
+#define DEVICE_INFO_COMPACT_RECORDS                      64
+#define DEVICE_INFO_COMPACT_FILENAME                     "/device/btle.tmp"
+
    /* Internal Variables to this Module (Remember that all variables    */
    /* declared static are initialized to 0 automatically by the         */
    /* compiler as part of standard C/C++).                              */
@@ -504,9 +688,9 @@ static ApplicationStateInfo_t ApplicationStateInfo; /* Container for all of the
 
 int                        UI_Mode;                 /* Holds the UI Mode.              */
 
-static Byte_t              PWVBuffer[PWV_DATA_BUFFER_LENGTH+1];  /* Buffer that is */
-                                                    /* used for Sending/Receiving      */
-                                                    /* SPPLE Service Data.             */
+static Byte_t              LETransferBuffer[LE_TRANSFER_BLOCK_SIZE];  /* Read     */
+                                                    /* ahead buffer of the LE file     */
+                                                    /* transfer worker.                */
 static uint16_t            PWVBufferIndex;
 
 static unsigned int        BluetoothStackID;        /* Variable which holds the Handle */
@@ -524,6 +708,10 @@ static int                 ServerPortID;            /* Variable which contains t
 static Word_t              Connection_Handle;       /* Holds the Connection Handle of  */
                                                     /* the most recent SPP Connection. */
 
+static volatile osThreadId SPPTransmitWaiter;       /* Thread in BT_WriteABuffer()     */
+                                                    /* waiting for room in the SPP     */
+                                                    /* transmit buffer.                */
+
 
 _Pragma("diag_suppress=Pe550")
 static Boolean_t           Connected;               /* Variable which flags whether or */
@@ -594,8 +782,20 @@ static GAPLE_Parameters_t  LE_Parameters;           /* Holds GAP Parameters like
 static Boolean_t           LocalDeviceIsMaster;     /* Boolean that tells if the local */
                                                     /* device is the master of the     */
                                                     /* current connection.             */
-static DeviceInfo_t       *DeviceInfoList;          /* Holds the list head for the     */
-                                                    /* device info list.               */
+static DeviceInfo_t        DeviceInfoTable[DEVICE_INFO_SLOTS];/* Holds the entries of */
+                                                    /* the known LE devices.           */
+static DeviceInfo_t       *DeviceInfoHash[DEVICE_INFO_HASH_SIZE];/* Hash chains of the */
+                                                    /* entries by Connection BD_ADDR.  */
+static unsigned int        DeviceInfoRecords;       /* Records in BT_LE_KEY_FILENAME.  */
+static DeviceInfo_t       *LastBondedDeviceInfo;    /* Bonded entry saved last, the    */
+                                                    /* directed advertising target.    */
+static DWord_t             DeviceInfoAge[DEVICE_INFO_SLOTS];/* Use stamp of each slot,*/
+                                                    /* 0 when free.                    */
+static DWord_t             DeviceInfoUseCount;      /* Last use stamp given out.       */
+static FIL                 DeviceInfoFile;          /* File and record buffer of the   */
+static DeviceInfoRecord_t  DeviceInfoRecordBuffer;  /* BT_LE_KEY_FILENAME functions,   */
+                                                    /* kept off the small stack of the */
+                                                    /* Bluetooth thread they run on.   */
 static unsigned int        LLSInstanceID;           /* The following holds the LLS     */
                                                     /* Instance ID that is returned    */
                                                     /* from LLS_Initialize_Service().  */
@@ -615,8 +815,6 @@ static unsigned int        DISInstanceID;           /* Holds the Instance ID for
                                                     /* DIS Service.                    */
 static unsigned int        BASInstanceID;           /* Holds the Instance ID for the   */
                                                     /* BAS Service.                    */
-static unsigned int        ConnectionID;            /* Holds the Connection ID of the  */
-                                                    /* currently connected device.     */
 static IAS_Control_Point_Command_t   AlertLevelControlPointCommand;/* Variable which is*/
                                                     /* used to hold the Alert Level    */
                                                     /* control point command set by    */
@@ -627,12 +825,47 @@ static BD_ADDR_t           ConnectionBD_ADDR;       /* Holds the BD_ADDR of the
 static GAP_Encryption_Mode_t GAPEncryptionMode;    /* Holds the encryption mode of     */
                                                    /* currently connected device.      */
 static int                 AdvertisingStatus = FALSE;      /* Current Advertising status */
+static unsigned int        AdvertiseStage;          /* Current advertising schedule    */
+                                                    /* stage and when it started.      */
+static TickType_t          AdvertiseStageTick;
+static uint8_t             AdvertiseWhitelist;      /* Connect filter of the last      */
+                                                    /* AdvertiseLEEnable().            */
+static unsigned int        AdvertiseDirectedBursts; /* Directed bursts left before the */
+                                                    /* fall back to undirected, zero   */
+                                                    /* while undirected.               */
+static volatile TickType_t AdvertiseDirectedTimeoutTick;/* When the controller reported*/
+                                                    /* the last directed timeout.      */
+static Boolean_t           AdvertiseReconnectPending;/* A reconnect is being timed     */
+static TickType_t          AdvertiseReconnectTick;  /* from this tick.                 */
+
+static Advertising_Data_t   AdvertisingData[2];     /* Advertising data for the        */
+static Byte_t               AdvertisingDataLength[2];/* unlocked and locked card.      */
+static Scan_Response_Data_t ScanResponseData;       /* Scan response data.             */
+static Byte_t               ScanResponseDataLength;
+static int                  AdvertisingDataWritten = -1; /* Lock status of the         */
+                                                    /* advertising data in the chip,   */
+                                                    /* -1 when unknown.                */
+static Boolean_t            ScanResponseDataWritten;/* Scan response data is in the    */
+                                                    /* chip.                           */
+
+   /* The advertising schedule, 20-30 ms for the first 30 s and about   */
+   /* 200 ms for the next minute are the intervals iOS and Android      */
+   /* scanners pick up fastest.                                         */
+static const AdvertiseStage_t AdvertiseSchedule[] =
+{
+   { 30000,  20,  30 },
+   { 60000, 152, 211 },
+   {     0,   0,   0 }
+};
+
+#define ADVERTISE_STAGE_COUNT (sizeof(AdvertiseSchedule)/sizeof(AdvertiseStage_t))
 
    /* Variables which contain information used by the loopback          */
    /* functionality of this test application.                           */
 static unsigned int        BufferLength;
 
-static unsigned char       Buffer[530];
+static unsigned char       Buffer[SPP_FTP_LARGEST_WRITE + 1]; /* One frame     */
+                                                    /* plus a terminator.              */
 
 static Boolean_t           BufferFull;
 
@@ -640,16 +873,57 @@ static Boolean_t           FTPModeActive = TRUE;
 
 int BT_LinkedDeviceNb = 0;
 
-static uint8_t SPP_event = SPP_EVT_NONE;
+static osMessageQId SPP_EventQueue = NULL;         /* Events posted to the SPP thread */
+                                                    /* by the stack, PMIC and console  */
+                                                    /* callbacks.                      */
+static volatile Boolean_t SPP_ConsoleInputPending;  /* A console event is queued, set  */
+                                                    /* by the UART interrupt, cleared  */
+                                                    /* by the SPP thread.              */
+static volatile uint32_t SPP_EventsDropped;         /* Events lost to a full queue,    */
+static volatile uint8_t  SPP_EventDropped;          /* the last one lost and the count */
+static uint32_t          SPP_EventsDroppedLogged;   /* already logged.                 */
+static Boolean_t GATTBufferFull;                    /* Set when a PWV notification was */
+                                                    /* refused for lack of buffers.    */
+static Boolean_t LEDataLengthSupported;             /* Controller supports LE Data     */
+                                                    /* Length Extension.               */
 static uint8_t SPP_state = SPP_STATE_INIT;
 static uint8_t SPP_state_timer_id = 0;
 static uint8_t pairing_mode = 0;
 static uint8_t le_transfer_filepath[FILEPATH_LE_MAX_LENGTH];
-static uint16_t le_transfer_index = 0;
-static FIL fp_download;
+static osMessageQId LETransferQueue = NULL;        /* Wake-ups of the LE file transfer*/
+                                                    /* worker, what to do is in the    */
+                                                    /* staging ring and files.         */
+static volatile Boolean_t LESendRequested;          /* fp_upload is open for the worker*/
+                                                    /* to send.                        */
+static FIL fp_upload;                               /* File being sent by the worker.  */
+static FIL fp_download;                             /* File being received, only used  */
+                                                    /* by the worker.                  */
+static Byte_t LEStagingBuffer[LE_STAGING_BUFFER_SIZE];/* PWV File Writes waiting for    */
+                                                    /* the eMMC.                       */
+static volatile uint32_t LEStagingHead;             /* Written by the GATT callback.   */
+static volatile uint32_t LEStagingTail;             /* Written by the worker.          */
+static LEStagingFile_t LEStagingFiles[LE_STAGING_FILES];/* Files being received.      */
+static volatile uint32_t LEStagingFileHead;         /* Files opened by the GATT        */
+                                                    /* callback.                       */
+static volatile uint32_t LEStagingFileTail;         /* Files finished by the worker.   */
+static volatile Boolean_t LEStagingSignalled;       /* A wake-up for staged data is    */
+                                                    /* queued.                         */
+static Boolean_t LEReceiveOpen;                     /* OPEN_FILE seen, owned by the    */
+                                                    /* GATT callback.                  */
+static Boolean_t LEReceiveActive;                   /* OPEN_FILE handled, owned by the */
+                                                    /* worker.                         */
+static Boolean_t LEReceiveOK;                       /* Received file is writable, owned*/
+                                                    /* by the worker.                  */
+static PWVRxCredits_t LERxCredits;                  /* Rx credits not yet notified.    */
 static DeviceInfo_t *le_transfer_DeviceInfo;
+static volatile unsigned int le_transfer_ConnectionID;/* GATT connection that owns the  */
+                                                    /* LE file transfer.               */
+static volatile Boolean_t LESendPending;            /* SEND_FILE not yet taken up by   */
+                                                    /* the SPP thread.                 */
 static DeviceInfo_t *SPP_Paired_Device = NULL;
 static uint32_t LETransferStartTime, LETransferEndTime;
+static TickType_t LELinkActivityTick;               /* Last time a file transfer was   */
+                                                    /* started or running.             */
 
 #define NUM_SUPPORTED_HCI_VERSIONS              (sizeof(HCIVersionStrings)/sizeof(char *) - 1)
 
@@ -776,13 +1050,42 @@ static BTPSCONST char *HCIVersionStrings[] =
 /* Internal function prototypes.                                     */
 
 // PWV prototypes
-static unsigned int PWVSendData(unsigned int BluetoothStackID, DeviceInfo_t *DeviceInfo, unsigned int DataLength, Byte_t *Data);
+static unsigned int PWVSendData(unsigned int BluetoothStackID, unsigned int ConnectionID, DeviceInfo_t *DeviceInfo, unsigned int DataLength, Byte_t *Data);
 static void BTPSAPI GATT_ServerEventCallback(unsigned int BluetoothStackID, GATT_Server_Event_Data_t *GATT_ServerEventData, unsigned long CallbackParameter);
 static int RegisterPasswordVault(void);
+static unsigned int PWVNotificationLength(ConnectionInfo_t *ConnectionInfo);
+static void ConfigureSPPParameters(void);
+static void QueryLEDataLengthSupport(void);
+static ConnectionInfo_t *SearchLEConnectionByBD_ADDR(BD_ADDR_t BD_ADDR);
+static ConnectionInfo_t *SearchLEConnectionByID(unsigned int ConnectionID);
+static ConnectionInfo_t *CreateLEConnection(GAP_LE_Address_Type_t AddressType, BD_ADDR_t BD_ADDR);
+static void DeleteLEConnection(ConnectionInfo_t *ConnectionInfo);
+static unsigned int LEConnectionCount(void);
+static DeviceInfo_t *SearchLEConnectionDeviceInfo(ConnectionInfo_t *ConnectionInfo);
+static void SetLEDataLength(void);
+static void LERequestLinkSpeed(ConnectionInfo_t *ConnectionInfo, Byte_t LinkSpeed);
+static Boolean_t LELinkSpeedPending(void);
+static void LEUpdateLinkSpeed(uint8_t event);
+static void PWVSendLinkParams(ConnectionInfo_t *ConnectionInfo, DeviceInfo_t *DeviceInfo);
+static Boolean_t Set_LE_Transfer_Event(uint8_t event);
+static Boolean_t LEStagingPut(Byte_t *Data, unsigned int Length);
+static void LEStagingClose(void);
+static uint32_t LEStagingFileEnd(void);
+static void PWVSendRxCredits(unsigned int Credits);
+static Boolean_t LETransferAvailable(ConnectionInfo_t *ConnectionInfo);
+static void LEReceiveCommit(uint32_t End, Boolean_t Flush);
+static void LEReceiveStart(LEStagingFile_t *StagingFile);
+static void LEReceiveClose(void);
+static void LEReceiveService(void);
+static Boolean_t LETransferSendFile(void);
+static void LETransferThread(void const *argument);
 
 // HIDS protoypes
-static DeviceInfo_t *SearchLEDeviceInfoEntryByBD_ADDR(DeviceInfo_t **ListHead, GAP_LE_Address_Type_t AddressType, BD_ADDR_t BD_ADDR);
-static DeviceInfo_t *DeleteLEDeviceInfoEntry(DeviceInfo_t **ListHead, GAP_LE_Address_Type_t AddressType, BD_ADDR_t BD_ADDR);
+static DeviceInfo_t *SearchLEDeviceInfoEntryByBD_ADDR(GAP_LE_Address_Type_t AddressType, BD_ADDR_t BD_ADDR);
+static DeviceInfo_t *DeleteLEDeviceInfoEntry(GAP_LE_Address_Type_t AddressType, BD_ADDR_t BD_ADDR);
+static void MoveDeviceInfoEntry(DeviceInfo_t *DeviceInfo, GAP_LE_Address_Type_t AddressType, BD_ADDR_t BD_ADDR);
+static DeviceInfo_t *DeleteDeviceInfoEntry(BD_ADDR_t BD_ADDR);
+static void FreeDeviceInfoEntryMemory(DeviceInfo_t *EntryToFree);
 static int SlaveSecurityReEstablishment(unsigned int BluetoothStackID, BD_ADDR_t BD_ADDR);
 
 // Other protoypes
@@ -800,11 +1103,24 @@ static int GetLinkedKeyNb(void);
 static int PINCodeResponse(ParameterList_t *TempParam);
 static int OpenServer(ParameterList_t *TempParam);
 static int AdvertiseLE(ParameterList_t *TempParam);
+static void BuildAdvertisingData(void);
+static int AdvertiseWriteAdvertisingData(int locked);
+static int AdvertiseWriteScanResponseData(void);
 static int AdvertiseLEEnable(uint8_t whitelist);
+static DeviceInfo_t *AdvertiseReconnectTarget(void);
+static int AdvertiseLEReconnect(void);
+static void AdvertiseDirectedNext(unsigned int Bursts);
+static int AdvertiseLEStart(void);
 static int AdvertiseLEDisable(void);
-static DeviceInfo_t *SearchDeviceInfoEntryByBD_ADDR(DeviceInfo_t **ListHead, BD_ADDR_t BD_ADDR);
+static void AdvertiseStageInterval(Word_t *IntervalMin, Word_t *IntervalMax);
+static void AdvertiseSetStage(unsigned int Stage);
+static void AdvertiseUpdateSchedule(uint8_t event);
+static DeviceInfo_t *SearchDeviceInfoEntryByBD_ADDR(BD_ADDR_t BD_ADDR);
 int BT_WriteABuffer(const char * lpBuf, DWORD dwToWrite);
-static int SaveDeviceInfoList(void);
+static int SaveDeviceInfoEntry(DeviceInfo_t *DeviceInfo);
+static int SaveDeviceInfoDeletion(DeviceInfo_t *DeviceInfo);
+static void SaveDeviceInfoConfiguration(DeviceInfo_t *DeviceInfo);
+static int CompactDeviceInfoList(void);
 static int LoadDeviceInfoList(void);
 
 #ifdef CONSOLE_SUPPORT
@@ -1687,43 +2003,162 @@ static void ConfigureCapabilities(GAP_LE_Pairing_Capabilities_t *Capabilities)
 }
 
 
-   /* The following function adds the specified Entry to the specified  */
-   /* List.  This function allocates and adds an entry to the list that */
-   /* has the same attributes as parameters to this function.  This     */
-   /* function will return FALSE if NO Entry was added.  This can occur */
-   /* if the element passed in was deemed invalid or the actual List    */
-   /* Head was invalid.                                                 */
+   /* The following function returns the hash bucket of a Connection   */
+   /* BD_ADDR in DeviceInfoHash.                                        */
+static unsigned int DeviceInfoHashIndex(BD_ADDR_t BD_ADDR)
+{
+   return((BD_ADDR.BD_ADDR0 ^ BD_ADDR.BD_ADDR1 ^ BD_ADDR.BD_ADDR2 ^ BD_ADDR.BD_ADDR3 ^ BD_ADDR.BD_ADDR4 ^ BD_ADDR.BD_ADDR5) & (DEVICE_INFO_HASH_SIZE - 1));
+}
+
+   /* The following function adds an entry of the device info table to  */
+   /* the hash chain of its Connection BD_ADDR.                         */
+static void LinkDeviceInfoEntry(DeviceInfo_t *DeviceInfo)
+{
+   unsigned int Index = DeviceInfoHashIndex(DeviceInfo->ConnectionBD_ADDR);
+
+   DeviceInfo->NextDeviceInfoPtr = DeviceInfoHash[Index];
+   DeviceInfoHash[Index]         = DeviceInfo;
+}
+
+   /* The following function removes an entry of the device info table  */
+   /* from the hash chain of its Connection BD_ADDR.  The entry keeps   */
+   /* its table slot until FreeDeviceInfoEntryMemory() is called.       */
+static void UnlinkDeviceInfoEntry(DeviceInfo_t *DeviceInfo)
+{
+   DeviceInfo_t **Link = &DeviceInfoHash[DeviceInfoHashIndex(DeviceInfo->ConnectionBD_ADDR)];
+
+   while((*Link) && (*Link != DeviceInfo))
+      Link = &((*Link)->NextDeviceInfoPtr);
+
+   if(*Link)
+      *Link = DeviceInfo->NextDeviceInfoPtr;
+
+   DeviceInfo->NextDeviceInfoPtr = NULL;
+}
+
+   /* The following function marks an entry of the device info table as*/
+   /* the one used last.  The entry used least recently is the first to */
+   /* be evicted and compaction keeps this order in the file.           */
+static void TouchDeviceInfoEntry(DeviceInfo_t *DeviceInfo)
+{
+   DeviceInfoAge[DeviceInfo - DeviceInfoTable] = ++DeviceInfoUseCount;
+}
+
+   /* The following function adds an entry with the specified Connection*/
+   /* BD_ADDR to the device info table.  When the table is full the     */
+   /* entry of a device that is neither bonded nor connected is reused, */
+   /* a bonded entry is only evicted by LimitBondedDeviceInfoEntries()  */
+   /* once a new device has bonded.  This function will return FALSE if */
+   /* NO Entry was added.  This can occur if the BD_ADDR is invalid or  */
+   /* no slot could be found.                                           */
    /* ** NOTE ** This function does not insert duplicate entries into   */
-   /*            the list.  An element is considered a duplicate if the */
+   /*            the table.  An element is considered a duplicate if the*/
    /*            Connection BD_ADDR.  When this occurs, this function   */
-   /*            returns NULL.                                          */
-static Boolean_t CreateNewDeviceInfoEntry(DeviceInfo_t **ListHead, GAP_LE_Address_Type_t ConnectionAddressType, BD_ADDR_t ConnectionBD_ADDR)
+   /*            returns FALSE.                                         */
+static Boolean_t CreateNewDeviceInfoEntry(GAP_LE_Address_Type_t ConnectionAddressType, BD_ADDR_t ConnectionBD_ADDR)
 {
-   Boolean_t     ret_val = FALSE;
-   DeviceInfo_t *DeviceInfoPtr;
+   unsigned int  Index;
+   DeviceInfo_t *DeviceInfoPtr = NULL;
 
    /* Verify that the passed in parameters seem semi-valid.             */
-   if((ListHead) && (!COMPARE_NULL_BD_ADDR(ConnectionBD_ADDR)))
+   if((!COMPARE_NULL_BD_ADDR(ConnectionBD_ADDR)) && (!SearchDeviceInfoEntryByBD_ADDR(ConnectionBD_ADDR)))
    {
-      /* Allocate the memory for the entry.                             */
-      if((DeviceInfoPtr = BTPS_AllocateMemory(sizeof(DeviceInfo_t))) != NULL)
+      /* A slot with a NULL Connection BD_ADDR is free.                 */
+      for(Index=0;Index<DEVICE_INFO_SLOTS;Index++)
+      {
+         if(COMPARE_NULL_BD_ADDR(DeviceInfoTable[Index].ConnectionBD_ADDR))
+         {
+            DeviceInfoPtr = &DeviceInfoTable[Index];
+            break;
+         }
+      }
+
+      for(Index=0;(!DeviceInfoPtr) && (Index<DEVICE_INFO_SLOTS);Index++)
+      {
+         if((!DeviceInfoTable[Index].EncryptionKeySize) && (!SearchLEConnectionByBD_ADDR(DeviceInfoTable[Index].ConnectionBD_ADDR)))
+         {
+            DeviceInfoPtr = &DeviceInfoTable[Index];
+            UnlinkDeviceInfoEntry(DeviceInfoPtr);
+         }
+      }
+
+      if(DeviceInfoPtr)
       {
          /* Initialize the entry.                                       */
          BTPS_MemInitialize(DeviceInfoPtr, 0, sizeof(DeviceInfo_t));
          DeviceInfoPtr->ConnectionAddressType = ConnectionAddressType;
          DeviceInfoPtr->ConnectionBD_ADDR     = ConnectionBD_ADDR;
 
-         ret_val = BSC_AddGenericListEntry_Actual(ekBD_ADDR_t, BTPS_STRUCTURE_OFFSET(DeviceInfo_t, ConnectionBD_ADDR), BTPS_STRUCTURE_OFFSET(DeviceInfo_t, NextDeviceInfoPtr), (void **)(ListHead), (void *)(DeviceInfoPtr));
-         if(!ret_val)
-         {
-            /* Failed to add to list so we should free the memory that  */
-            /* we allocated for the entry.                              */
-            BTPS_FreeMemory(DeviceInfoPtr);
-         }
+         LinkDeviceInfoEntry(DeviceInfoPtr);
+         TouchDeviceInfoEntry(DeviceInfoPtr);
       }
+      else
+         slogf(LOG_DEST_BOTH, "Device info table full (%u)", DEVICE_INFO_SLOTS);
    }
    
-   return(ret_val);
+   return((Boolean_t)(DeviceInfoPtr != NULL));
+}
+
+   /* The following function keeps at most DEVICE_INFO_TABLE_SIZE bonded*/
+   /* entries in the table by evicting the ones used least recently that*/
+   /* are not connected, never the entry that has just bonded (Keep).   */
+   /* An evicted entry is logged as deleted in BT_LE_KEY_FILENAME unless*/
+   /* the file is being replayed (SaveEviction is FALSE).               */
+static void LimitBondedDeviceInfoEntries(DeviceInfo_t *Keep, Boolean_t SaveEviction)
+{
+   unsigned int  Index;
+   unsigned int  Bonded = 0;
+   DeviceInfo_t *DeviceInfoPtr;
+   BoardStr_t    BoardStr;
+
+   for(Index=0;Index<DEVICE_INFO_SLOTS;Index++)
+   {
+      if((!COMPARE_NULL_BD_ADDR(DeviceInfoTable[Index].ConnectionBD_ADDR)) && (DeviceInfoTable[Index].EncryptionKeySize))
+         Bonded++;
+   }
+
+   while(Bonded > DEVICE_INFO_TABLE_SIZE)
+   {
+      DeviceInfoPtr = NULL;
+      for(Index=0;Index<DEVICE_INFO_SLOTS;Index++)
+      {
+         if((!COMPARE_NULL_BD_ADDR(DeviceInfoTable[Index].ConnectionBD_ADDR)) && (DeviceInfoTable[Index].EncryptionKeySize) && (&DeviceInfoTable[Index] != Keep) && (!SearchLEConnectionByBD_ADDR(DeviceInfoTable[Index].ConnectionBD_ADDR)) && ((!DeviceInfoPtr) || (DeviceInfoAge[Index] < DeviceInfoAge[DeviceInfoPtr - DeviceInfoTable])))
+            DeviceInfoPtr = &DeviceInfoTable[Index];
+      }
+
+      if(!DeviceInfoPtr)
+         break;
+
+      BD_ADDRToStr(DeviceInfoPtr->ConnectionBD_ADDR, BoardStr);
+      UnlinkDeviceInfoEntry(DeviceInfoPtr);
+      if(SaveEviction)
+      {
+         slogf(LOG_DEST_BOTH, "Bonded devices full, evicted %s", BoardStr);
+         SaveDeviceInfoDeletion(DeviceInfoPtr);
+      }
+      else
+         slogf(LOG_DEST_BOTH, "btle.key: bonded devices full, dropped %s", BoardStr);
+      FreeDeviceInfoEntryMemory(DeviceInfoPtr);
+      Bonded--;
+   }
+}
+
+   /* The following function changes the Connection BD_ADDR of an entry,*/
+   /* e.g. to the identity address received while pairing.  An older   */
+   /* entry for the new BD_ADDR is dropped.                             */
+static void MoveDeviceInfoEntry(DeviceInfo_t *DeviceInfo, GAP_LE_Address_Type_t AddressType, BD_ADDR_t BD_ADDR)
+{
+   DeviceInfo_t *OldDeviceInfo;
+
+   UnlinkDeviceInfoEntry(DeviceInfo);
+
+   if((OldDeviceInfo = DeleteDeviceInfoEntry(BD_ADDR)) != NULL)
+      FreeDeviceInfoEntryMemory(OldDeviceInfo);
+
+   DeviceInfo->ConnectionAddressType = AddressType;
+   DeviceInfo->ConnectionBD_ADDR     = BD_ADDR;
+
+   LinkDeviceInfoEntry(DeviceInfo);
 }
 
    /* The following function provides a mechanism of sending a Slave    */
@@ -1848,140 +2283,104 @@ static int EncryptionInformationRequestResponse(BD_ADDR_t BD_ADDR, Byte_t KeySiz
 }
 
 
-   /* The following function searches the specified List for the        */
+   /* The following function searches the device info table for the    */
    /* specified Connection BD_ADDR.  This function returns NULL if      */
-   /* either the List Head is invalid, the BD_ADDR is invalid, or the   */
-   /* Connection BD_ADDR was NOT found.                                 */
-static DeviceInfo_t *SearchLEDeviceInfoEntryByBD_ADDR(DeviceInfo_t **ListHead, GAP_LE_Address_Type_t AddressType, BD_ADDR_t BD_ADDR)
+   /* either the BD_ADDR is invalid, or the Connection BD_ADDR was NOT  */
+   /* found.                                                            */
+static DeviceInfo_t *SearchLEDeviceInfoEntryByBD_ADDR(GAP_LE_Address_Type_t AddressType, BD_ADDR_t BD_ADDR)
 {
-   DeviceInfo_t *DeviceInfo;
+   unsigned int  Index;
+   DeviceInfo_t *DeviceInfo = NULL;
 
    /* Verify that the input parameters are semi-valid.                  */
-   if((ListHead) && (!COMPARE_NULL_BD_ADDR(BD_ADDR)))
+   if(!COMPARE_NULL_BD_ADDR(BD_ADDR))
    {
       /* Check to see if this is a resolvable address type.  If so we   */
-      /* will search the list based on the IRK.                         */
+      /* will search the table based on the IRK.                        */
       if((AddressType == latRandom) && (GAP_LE_TEST_RESOLVABLE_ADDRESS_BITS(BD_ADDR)))
       {
-         /* Walk the list and attempt to resolve this entry to an       */
-         /* existing entry with IRK.                                    */
-         DeviceInfo = *ListHead;
-         while(DeviceInfo)
+         /* A resolvable address does not hash to its entry, so try the */
+         /* IRK of every entry.                                         */
+         for(Index=0;Index<DEVICE_INFO_SLOTS;Index++)
          {
             /* Check to see if the IRK is valid.                        */
-            if(DeviceInfo->Flags & DEVICE_INFO_FLAGS_IRK_VALID)
+            if((!COMPARE_NULL_BD_ADDR(DeviceInfoTable[Index].ConnectionBD_ADDR)) && (DeviceInfoTable[Index].Flags & DEVICE_INFO_FLAGS_IRK_VALID))
             {
                /* Attempt to resolve this address with the stored IRK.  */
-               if(GAP_LE_Resolve_Address(ApplicationStateInfo.BluetoothStackID, &(DeviceInfo->IRK), BD_ADDR))
+               if(GAP_LE_Resolve_Address(ApplicationStateInfo.BluetoothStackID, &(DeviceInfoTable[Index].IRK), BD_ADDR))
                {
                   /* Address resolved so just exit from the loop.       */
+                  DeviceInfo = &DeviceInfoTable[Index];
                   break;
                }
             }
-
-            DeviceInfo = DeviceInfo->NextDeviceInfoPtr;
          }
       }
-      else
-         DeviceInfo = NULL;
 
-      /* If all else fail we will attempt to search the list by just the*/
-      /* BD_ADDR.                                                       */
+      /* If all else fail we will attempt to search the table by just   */
+      /* the BD_ADDR.                                                   */
       if(DeviceInfo == NULL)
-         DeviceInfo = BSC_SearchGenericListEntry(ekBD_ADDR_t, (void *)(&BD_ADDR), BTPS_STRUCTURE_OFFSET(DeviceInfo_t, ConnectionBD_ADDR), BTPS_STRUCTURE_OFFSET(DeviceInfo_t, NextDeviceInfoPtr), (void **)(ListHead));
+         DeviceInfo = SearchDeviceInfoEntryByBD_ADDR(BD_ADDR);
    }
-   else
-      DeviceInfo = NULL;
 
    return(DeviceInfo);
 }
 
-   /* The following function searches the specified List for the        */
-   /* specified Connection BD_ADDR.  This function returns NULL if      */
-   /* either the List Head is invalid, the BD_ADDR is invalid, or the   */
+   /* The following function searches the device info table for the    */
+   /* specified Connection BD_ADDR.  This function returns NULL if the  */
    /* Connection BD_ADDR was NOT found.                                 */
-static DeviceInfo_t *SearchDeviceInfoEntryByBD_ADDR(DeviceInfo_t **ListHead, BD_ADDR_t BD_ADDR)
+static DeviceInfo_t *SearchDeviceInfoEntryByBD_ADDR(BD_ADDR_t BD_ADDR)
 {
-   return(BSC_SearchGenericListEntry(ekBD_ADDR_t, (void *)(&BD_ADDR), BTPS_STRUCTURE_OFFSET(DeviceInfo_t, ConnectionBD_ADDR), BTPS_STRUCTURE_OFFSET(DeviceInfo_t, NextDeviceInfoPtr), (void **)(ListHead)));
+   DeviceInfo_t *DeviceInfo = DeviceInfoHash[DeviceInfoHashIndex(BD_ADDR)];
+
+   while((DeviceInfo) && (!COMPARE_BD_ADDR(DeviceInfo->ConnectionBD_ADDR, BD_ADDR)))
+      DeviceInfo = DeviceInfo->NextDeviceInfoPtr;
+
+   return(DeviceInfo);
 }
 
-   /* The following function searches the specified Key Info List for   */
-   /* the specified BD_ADDR and removes it from the List.  This function*/
-   /* returns NULL if either the List Head is invalid, the BD_ADDR is   */
-   /* invalid, or the specified Entry was NOT present in the list.  The */
-   /* entry returned will have the Next Entry field set to NULL, and    */
-   /* the caller is responsible for deleting the memory associated with */
-   /* this entry by calling the FreeKeyEntryMemory() function.          */
-static DeviceInfo_t *DeleteLEDeviceInfoEntry(DeviceInfo_t **ListHead, GAP_LE_Address_Type_t AddressType, BD_ADDR_t BD_ADDR)
+   /* The following function searches the device info table for the    */
+   /* specified BD_ADDR and removes it from its hash chain.  This       */
+   /* function returns NULL if either the BD_ADDR is invalid, or the    */
+   /* specified Entry was NOT present in the table.  The caller is      */
+   /* responsible for releasing the slot of the entry returned by       */
+   /* calling the FreeDeviceInfoEntryMemory() function.                 */
+static DeviceInfo_t *DeleteLEDeviceInfoEntry(GAP_LE_Address_Type_t AddressType, BD_ADDR_t BD_ADDR)
 {
-   DeviceInfo_t *LastEntry;
    DeviceInfo_t *DeviceInfo;
 
-   if((ListHead) && (!COMPARE_NULL_BD_ADDR(BD_ADDR)))
-   {
-      /* Check to see if this is a resolvable address type.  If so we   */
-      /* will search the list based on the IRK.                         */
-      if((AddressType == latRandom) && (GAP_LE_TEST_RESOLVABLE_ADDRESS_BITS(BD_ADDR)))
-      {
-         /* Now, let's search the list until we find the correct entry. */
-         DeviceInfo = *ListHead;
-         LastEntry  = NULL;
-         while((DeviceInfo) && ((!(DeviceInfo->Flags & DEVICE_INFO_FLAGS_IRK_VALID)) || (!GAP_LE_Resolve_Address(ApplicationStateInfo.BluetoothStackID, &(DeviceInfo->IRK), BD_ADDR))))
-         {
-            LastEntry  = DeviceInfo;
-
-            DeviceInfo = DeviceInfo->NextDeviceInfoPtr;
-         }
-
-         /* Check to see if we found the specified entry.               */
-         if(DeviceInfo)
-         {
-            /* OK, now let's remove the entry from the list.  We have to*/
-            /* check to see if the entry was the first entry in the     */
-            /* list.                                                    */
-            if(LastEntry)
-            {
-               /* Entry was NOT the first entry in the list.            */
-               LastEntry->NextDeviceInfoPtr = DeviceInfo->NextDeviceInfoPtr;
-            }
-            else
-               *ListHead = DeviceInfo->NextDeviceInfoPtr;
-
-            DeviceInfo->NextDeviceInfoPtr = NULL;
-         }
-      }
-      else
-         DeviceInfo = NULL;
-
-      /* If all else fail we will attempt to search the list by just the*/
-      /* BD_ADDR.                                                       */
-      if(DeviceInfo == NULL)
-         DeviceInfo = BSC_DeleteGenericListEntry(ekBD_ADDR_t, (void *)(&BD_ADDR), BTPS_STRUCTURE_OFFSET(DeviceInfo_t, ConnectionBD_ADDR), BTPS_STRUCTURE_OFFSET(DeviceInfo_t, NextDeviceInfoPtr), (void **)(ListHead));
-   }
-   else
-      DeviceInfo = NULL;
+   if((DeviceInfo = SearchLEDeviceInfoEntryByBD_ADDR(AddressType, BD_ADDR)) != NULL)
+      UnlinkDeviceInfoEntry(DeviceInfo);
 
    return(DeviceInfo);
 }
 
 
-   /* The following function searches the specified Key Info List for   */
-   /* the specified BD_ADDR and removes it from the List.  This function*/
-   /* returns NULL if either the List Head is invalid, the BD_ADDR is   */
-   /* invalid, or the specified Entry was NOT present in the list.  The */
-   /* entry returned will have the Next Entry field set to NULL, and    */
-   /* the caller is responsible for deleting the memory associated with */
-   /* this entry by calling the FreeKeyEntryMemory() function.          */
-static DeviceInfo_t *DeleteDeviceInfoEntry(DeviceInfo_t **ListHead, BD_ADDR_t BD_ADDR)
+   /* The following function searches the device info table for the    */
+   /* specified BD_ADDR and removes it from its hash chain.  This       */
+   /* function returns NULL if the specified Entry was NOT present in   */
+   /* the table.  The caller is responsible for releasing the slot of   */
+   /* the entry returned by calling the FreeDeviceInfoEntryMemory()     */
+   /* function.                                                         */
+static DeviceInfo_t *DeleteDeviceInfoEntry(BD_ADDR_t BD_ADDR)
 {
-   return(BSC_DeleteGenericListEntry(ekBD_ADDR_t, (void *)(&BD_ADDR), BTPS_STRUCTURE_OFFSET(DeviceInfo_t, ConnectionBD_ADDR), BTPS_STRUCTURE_OFFSET(DeviceInfo_t, NextDeviceInfoPtr), (void **)(ListHead)));
+   DeviceInfo_t *DeviceInfo;
+
+   if((DeviceInfo = SearchDeviceInfoEntryByBD_ADDR(BD_ADDR)) != NULL)
+      UnlinkDeviceInfoEntry(DeviceInfo);
+
+   return(DeviceInfo);
 }
 
-   /* This function frees the specified Key Info Information member     */
-   /* memory.                                                           */
+   /* This function releases the table slot of the specified device     */
+   /* info entry.                                                       */
 static void FreeDeviceInfoEntryMemory(DeviceInfo_t *EntryToFree)
 {
-   BSC_FreeGenericListEntryMemory((void *)(EntryToFree));
+   if(EntryToFree == LastBondedDeviceInfo)
+      LastBondedDeviceInfo = NULL;
+
+   DeviceInfoAge[EntryToFree - DeviceInfoTable] = 0;
+   BTPS_MemInitialize(EntryToFree, 0, sizeof(DeviceInfo_t));
 }
 
    /* The following function is responsible for the specified string    */
@@ -2092,7 +2491,7 @@ static int RegisterLLS(void)
    int ret_val;
 
    /* Verify that there is no active connection.                        */
-   if(!ConnectionID)
+   if(!LEConnectionCount())
    {
       /* Verify that the Service is not already registered.             */
       if(!LLSInstanceID)
@@ -2140,7 +2539,7 @@ static int RegisterTPS(void)
    int ret_val;
 
    /* Verify that there is no active connection.                        */
-   if(!ConnectionID)
+   if(!LEConnectionCount())
    {
       /* Verify that the Service is not already registered.             */
       if(!TPSInstanceID)
@@ -2182,7 +2581,7 @@ static int RegisterIAS(void)
    int ret_val;
 
    /* Verify that there is no active connection.                        */
-   if(!ConnectionID)
+   if(!LEConnectionCount())
    {
       /* Verify that the Service is not already registered.             */
       if(!IASInstanceID)
@@ -2225,7 +2624,7 @@ static int RegisterPasswordVault(void)
    GATT_Attribute_Handle_Group_t ServiceHandleGroup;
 
    /* Verify that there is no active connection.                        */
-   if(!ConnectionID)
+   if(!LEConnectionCount())
    {
       /* Verify that the Service is not already registered.             */
       if(!PasswordVaultServiceID)
@@ -2265,253 +2664,611 @@ static int RegisterPasswordVault(void)
    return(ret_val);
 }
 
-   /* The following function is responsible for enabling LE             */
-   /* Advertisements.  This function returns zero on successful         */
-   /* execution and a negative value on all errors.                     */
-static int AdvertiseLE(ParameterList_t *TempParam)
+   /* The following function sets the RFCOMM frame size, buffers and   */
+   /* lower layer queuing used by the FTP serial port, capped by what   */
+   /* the stack supports, and logs the values the stack took.  The      */
+   /* peer can only lower the frame size when it opens the port, the    */
+   /* buffers then hold more of its frames.  This must be called before */
+   /* any SPP connection exists.                                        */
+static void ConfigureSPPParameters(void)
 {
-   int                                ret_val = 0;
-   int                                Length;
-   int                                locked = 1;
-   int                                NameInAdData = 0;
-   int                                AdvertiseDataLength;
-   int                                ScanResponseDataLength;
-   int                                serviceUUIDCount;
-   int                                serviceUUIDIndex;
-   GAP_LE_Advertising_Parameters_t    AdvertisingParameters;
-   GAP_LE_Connectability_Parameters_t ConnectabilityParameters;
-   //GAP_LE_Address_Type_t              OwnAddressType = latPublic;
-   GAP_LE_Address_Type_t              OwnAddressType = latRandom;
-   BD_ADDR_t                          BD_ADDR;
-   union
+   int                        Result;
+   unsigned int               MaximumPackets;
+   unsigned int               Threshold;
+   SPP_Configuration_Params_t SPPConfigurationParams;
+
+   SPPConfigurationParams.MaximumFrameSize   = (SPP_FTP_LARGEST_WRITE < SPP_FRAME_SIZE_MAXIMUM)?SPP_FTP_LARGEST_WRITE:SPP_FRAME_SIZE_MAXIMUM;
+   SPPConfigurationParams.TransmitBufferSize = SPPConfigurationParams.MaximumFrameSize * SPP_FTP_TRANSMIT_FRAMES;
+   SPPConfigurationParams.ReceiveBufferSize  = SPPConfigurationParams.MaximumFrameSize * SPP_FTP_RECEIVE_CREDITS;
+   if((Result = SPP_Set_Configuration_Parameters(BluetoothStackID, &SPPConfigurationParams)) != 0)
+      slogf(LOG_DEST_BOTH, "SPP_Set_Configuration_Parameters() failed: %d", Result);
+
+   if((Result = SPP_Set_Queuing_Parameters(BluetoothStackID, SPP_FTP_QUEUE_MAXIMUM_PACKETS, SPP_FTP_QUEUE_THRESHOLD)) != 0)
+      slogf(LOG_DEST_BOTH, "SPP_Set_Queuing_Parameters() failed: %d", Result);
+
+   if((!SPP_Get_Configuration_Parameters(BluetoothStackID, &SPPConfigurationParams)) && (SPPConfigurationParams.MaximumFrameSize))
    {
-      Advertising_Data_t   AdvertisingData;
-      Scan_Response_Data_t ScanResponseData;
-   } Advertisement_Data_Buffer;
-   
-   // Is advertising disabled?
-   if (!Settings.Advertising_Enabled) {     
-      Display(("[AdvertiseLE] Advertising disabled by user settings\r\n"));
-      return -1;
+      slogf(LOG_DEST_BOTH, "SPP frame size %u, transmit buffer %u, receive buffer %u (%u credits)", SPPConfigurationParams.MaximumFrameSize, SPPConfigurationParams.TransmitBufferSize,
+            SPPConfigurationParams.ReceiveBufferSize, SPPConfigurationParams.ReceiveBufferSize / SPPConfigurationParams.MaximumFrameSize);
    }
 
-   /* First, check that valid Bluetooth Stack ID exists.                */
-   if(BluetoothStackID)
+   if(!SPP_Get_Queuing_Parameters(BluetoothStackID, &MaximumPackets, &Threshold))
+      slogf(LOG_DEST_BOTH, "SPP queuing %u packets, threshold %u", MaximumPackets, Threshold);
+}
+
+   /* The following function reads the LE features of the local         */
+   /* controller and notes whether LE Data Length Extension can be      */
+   /* requested on new connections.                                     */
+static void QueryLEDataLengthSupport(void)
+{
+   Byte_t        StatusResult;
+   LE_Features_t LE_Features;
+
+   LEDataLengthSupported = FALSE;
+
+   if((!HCI_LE_Read_Local_Supported_Features(BluetoothStackID, &StatusResult, &LE_Features)) && (StatusResult == HCI_ERROR_CODE_NO_ERROR))
    {
-      /* Make sure that all of the parameters required for this function*/
-      /* appear to be at least semi-valid.                              */
-      if(TempParam) 
-      {
-         if  ((TempParam->NumberofParameters >= 1) && ((TempParam->Params[0].intParam == 0) || (TempParam->Params[0].intParam == 1)))
-         {
-      
-             /* Determine whether to enable or disable Advertising.         */
-             if(TempParam->Params[0].intParam == 0)
-             {
-                /* Disable Advertising.                                     */
-                ret_val = GAP_LE_Advertising_Disable(BluetoothStackID);
-                if(!ret_val)
-                {
-                   Display(("   GAP_LE_Advertising_Disable success.\r\n"));
-                }
-                else
-                {
-                   DisplayFunctionError("GAP_LE_Advertising_Disable", ret_val);
+      if(TEST_LE_FEATURES_BIT(LE_Features, LE_FEATURE_DATA_PACKET_LENGTH_EXTENSION_BIT_NUMBER))
+         LEDataLengthSupported = TRUE;
+   }
 
-                   ret_val = FUNCTION_ERROR;
-                }
-             }
-             else
-             {
-                 /* AdvertiseLE [1 = Enable]  [0 = Unlocked, 1 = Locked] [1 = Random Address] [Random BD Address] */
-                 /* Check for lock status parameter                       */
-                 if ((TempParam->NumberofParameters >= 2) && ((TempParam->Params[1].intParam == 0) || (TempParam->Params[1].intParam == 1))) {
-                               locked = TempParam->Params[1].intParam;
-                 } else if (TempParam->NumberofParameters >= 2) {
-                               ret_val = INVALID_PARAMETERS_ERROR;
-                 }
-                    
-                /* Verifying enable Advertising.parameters                  */
-                if(TempParam->NumberofParameters >= 3) 
-				{
-                    if (TempParam->Params[2].intParam == 1)
-                    {
-                       OwnAddressType = latRandom;
-                       if (BTPS_StringLength(TempParam->Params[3].strParam) >= (sizeof(BD_ADDR_t)*2))
-    		           {
-    		                /* Convert the parameter to a Bluetooth Device Address.        */
-                       	        StrToBD_ADDR(TempParam->Params[3].strParam, &BD_ADDR);
-    	  	           }
-    		           else
-    		   	           ret_val = INVALID_PARAMETERS_ERROR;
-                    }
-                    else 
-                       if ((TempParam->Params[2].intParam != 0) || (TempParam->NumberofParameters < 3))
-      		   	           ret_val = INVALID_PARAMETERS_ERROR;
-	            }
-                
-                if (!ret_val)
-                {                        
-                   /* Enable Advertising.                                   */
-                   /* Set the Advertising Data.                             */
-                   BTPS_MemInitialize(&(Advertisement_Data_Buffer.AdvertisingData), 0, sizeof(Advertising_Data_t));
-
-                   /* Set the Flags A/D Field (1 byte type and 1 byte Flags.*/
-                   Advertisement_Data_Buffer.AdvertisingData.Advertising_Data[0] = 2;
-                   Advertisement_Data_Buffer.AdvertisingData.Advertising_Data[1] = HCI_LE_ADVERTISING_REPORT_DATA_TYPE_FLAGS;
-//#if 1 // db??? Android issue
-                  Advertisement_Data_Buffer.AdvertisingData.Advertising_Data[2] = HCI_LE_ADVERTISING_FLAGS_BR_EDR_NOT_SUPPORTED_FLAGS_BIT_MASK;
-                  Advertisement_Data_Buffer.AdvertisingData.Advertising_Data[2] |= HCI_LE_ADVERTISING_FLAGS_GENERAL_DISCOVERABLE_MODE_FLAGS_BIT_MASK;
-//#else
-                   /* Configure the flags field based on the Discoverability*/
-                   /* Mode.                                                 */
-                   //if(LE_Parameters.DiscoverabilityMode == dmGeneralDiscoverableMode)
-                   //   Advertisement_Data_Buffer.AdvertisingData.Advertising_Data[2] = HCI_LE_ADVERTISING_FLAGS_GENERAL_DISCOVERABLE_MODE_FLAGS_BIT_MASK;
-                   //else
-                   //{
-                   //   if(LE_Parameters.DiscoverabilityMode == dmLimitedDiscoverableMode)
-                   //      Advertisement_Data_Buffer.AdvertisingData.Advertising_Data[2] = HCI_LE_ADVERTISING_FLAGS_LIMITED_DISCOVERABLE_MODE_FLAGS_BIT_MASK;
-                   //}
-//#endif
-                   
-                   /* Configure the Device Appearance value.                         */
-                  Advertisement_Data_Buffer.AdvertisingData.Advertising_Data[3]   = 3;
-                  Advertisement_Data_Buffer.AdvertisingData.Advertising_Data[4] = HCI_LE_ADVERTISING_REPORT_DATA_TYPE_APPEARANCE;
-                  ASSIGN_HOST_WORD_TO_LITTLE_ENDIAN_UNALIGNED_WORD(&(Advertisement_Data_Buffer.AdvertisingData.Advertising_Data[5]), GAP_DEVICE_APPEARENCE_VALUE_HID_KEYBOARD);
-                              
-                   
-                   AdvertiseDataLength = 7;
-                   
-                   // Build complete UUID service list if any are active
-                   if (LLSInstanceID || TPSInstanceID || IASInstanceID || BASInstanceID) {
-                     
-                        // Save current position so we can update it with the correct length after we are done
-                        // assembling all of the service UUIDs
-                        serviceUUIDIndex = AdvertiseDataLength;
-                        serviceUUIDCount = 0;          
-                        AdvertiseDataLength += 2;
-                        
-                        // Link loss service
-                        if(LLSInstanceID)
-                        {
-                                serviceUUIDCount++;
-                                LLS_ASSIGN_LLS_SERVICE_UUID_16(&(Advertisement_Data_Buffer.AdvertisingData.Advertising_Data[AdvertiseDataLength]));
-                                AdvertiseDataLength                                           += 2;
-                        }
-                              
-                        // TX power service
-                        if(TPSInstanceID)
-                        {                
-                                serviceUUIDCount++;
-                                TPS_ASSIGN_TPS_SERVICE_UUID_16(&(Advertisement_Data_Buffer.AdvertisingData.Advertising_Data[AdvertiseDataLength]));
-                                AdvertiseDataLength                                          += 2;
-                        }
-                   
-                        // Immediate alert service
-                        if(IASInstanceID)
-                        {                    
-                                serviceUUIDCount++;
-                                IAS_ASSIGN_IAS_SERVICE_UUID_16(&(Advertisement_Data_Buffer.AdvertisingData.Advertising_Data[AdvertiseDataLength]));
-                                AdvertiseDataLength                                          += 2;
-                        }
-                   
-                        // Battery alert service
-                        if(BASInstanceID)
-                        {
-                                serviceUUIDCount++;
-                                BAS_ASSIGN_BAS_SERVICE_UUID_16(&(Advertisement_Data_Buffer.AdvertisingData.Advertising_Data[AdvertiseDataLength]));
-                                AdvertiseDataLength                                          += 2;
-                        }   
-                   
-                        // Calculate and update length of service UUID data
-                        if (serviceUUIDCount > 0) {
-                                Advertisement_Data_Buffer.AdvertisingData.Advertising_Data[serviceUUIDIndex] = 1 + serviceUUIDCount * 2; 
-                                Advertisement_Data_Buffer.AdvertisingData.Advertising_Data[serviceUUIDIndex+1] = HCI_LE_ADVERTISING_REPORT_DATA_TYPE_16_BIT_SERVICE_UUID_COMPLETE;
-                        }
-                   }
-                   
-                   /* Add Manufacturer Specific Data                        */
-                   /* 1 byte type code = 0xFF                               */
-                   /* 0x0387 = BluStor Unique Identifier                    */
-                   /* Lock Flag = [0x00 = unlocked, 0x01 = locked]          */
-                   Advertisement_Data_Buffer.AdvertisingData.Advertising_Data[AdvertiseDataLength] = 4;
-                   Advertisement_Data_Buffer.AdvertisingData.Advertising_Data[AdvertiseDataLength+1] = HCI_LE_ADVERTISING_REPORT_DATA_TYPE_MANUFACTURER_SPECIFIC;
-                   Advertisement_Data_Buffer.AdvertisingData.Advertising_Data[AdvertiseDataLength+2] = 0x03;
-                   Advertisement_Data_Buffer.AdvertisingData.Advertising_Data[AdvertiseDataLength+3] = 0x87;
-                   if (locked) {
-                      Advertisement_Data_Buffer.AdvertisingData.Advertising_Data[AdvertiseDataLength+4] = 0x01;
-                   } else {
-                      Advertisement_Data_Buffer.AdvertisingData.Advertising_Data[AdvertiseDataLength+4] = 0x00;
-                   }
-                   AdvertiseDataLength                                          += 5;
-                   
-                   /* If we have room, add the complete local name to the advertising data */
-                   Length = BTPS_StringLength(APP_CYBERGATE_LE);
-                   if ((AdvertiseDataLength + 2  + Length) <= ADVERTISING_DATA_MAXIMUM_SIZE) {
-                        Advertisement_Data_Buffer.AdvertisingData.Advertising_Data[AdvertiseDataLength] = 1 + Length;
-                        Advertisement_Data_Buffer.AdvertisingData.Advertising_Data[AdvertiseDataLength+1] = HCI_LE_ADVERTISING_REPORT_DATA_TYPE_LOCAL_NAME_COMPLETE;
-                        BTPS_MemCopy(&(Advertisement_Data_Buffer.AdvertisingData.Advertising_Data[AdvertiseDataLength+2]),APP_CYBERGATE_LE, Length);
-                        AdvertiseDataLength = AdvertiseDataLength + 2 + Length;
-                        NameInAdData = 1;
-                   }
-                   
-                   /* Write the advertising data to the chip.               */
-                   ret_val = GAP_LE_Set_Advertising_Data(BluetoothStackID, AdvertiseDataLength, &(Advertisement_Data_Buffer.AdvertisingData));
-                   if(!ret_val)
-                   {
-                      BTPS_MemInitialize(&(Advertisement_Data_Buffer.ScanResponseData), 0, sizeof(Scan_Response_Data_t));
-                      ScanResponseDataLength = 0;
+   slogf(LOG_DEST_BOTH, "LE Data Length Extension %s", (LEDataLengthSupported)?"supported":"not supported");
+}
 
-                      Length = BTPS_StringLength(APP_CYBERGATE_LE);
-                      
-                      /* If we didn't include fullname in advertisement data, try to include it in scan data */
-                      if(Length <= (ADVERTISING_DATA_MAXIMUM_SIZE - 2 - 18) && (!NameInAdData))
-                      {
-                         Advertisement_Data_Buffer.ScanResponseData.Scan_Response_Data[ScanResponseDataLength] = (Byte_t)(1 + Length);
-                         Advertisement_Data_Buffer.ScanResponseData.Scan_Response_Data[ScanResponseDataLength + 1] = HCI_LE_ADVERTISING_REPORT_DATA_TYPE_LOCAL_NAME_COMPLETE;
-
-                         BTPS_MemCopy(&(Advertisement_Data_Buffer.ScanResponseData.Scan_Response_Data[ScanResponseDataLength + 2]),APP_CYBERGATE_LE,Length);                   
-                         ScanResponseDataLength += (2 + Length);
-                      } else {
- 
-                         // Otherwise, we can skip adding any scan data and move on
-                         ret_val = 0;
-                      }
-                      /* Set the Scan Response Data.                        */
-                      Length = 16;
-                      Advertisement_Data_Buffer.ScanResponseData.Scan_Response_Data[ScanResponseDataLength + 0] = (Byte_t)(1 + Length);
-                      Advertisement_Data_Buffer.ScanResponseData.Scan_Response_Data[ScanResponseDataLength + 1] = HCI_LE_ADVERTISING_REPORT_DATA_TYPE_128_BIT_SERVICE_UUID_COMPLETE;
-                      PWV_ASSIGN_PWV_SERVICE_UUID_128(&(Advertisement_Data_Buffer.ScanResponseData.Scan_Response_Data[ScanResponseDataLength + 2]));
-                      ScanResponseDataLength += (2 + Length);
-                      //BTPS_MemCopy(&(Advertisement_Data_Buffer.ScanResponseData.Scan_Response_Data[2]),PWV_SERVICE_BLUETOOTH_UUID_CONSTANT,Length);                                 
-                      ret_val = GAP_LE_Set_Scan_Response_Data(BluetoothStackID, ScanResponseDataLength, &(Advertisement_Data_Buffer.ScanResponseData));
+   /* The following function returns the LE connection with the       */
+   /* specified remote address, or NULL if there is none.               */
+static ConnectionInfo_t *SearchLEConnectionByBD_ADDR(BD_ADDR_t BD_ADDR)
+{
+   unsigned int Index;
 
-                      if(!ret_val)
-                      {
-                         /* Set up the advertising parameters.              */
-                         AdvertisingParameters.Advertising_Channel_Map   = HCI_LE_ADVERTISING_CHANNEL_MAP_DEFAULT;
-                         AdvertisingParameters.Scan_Request_Filter       = fpNoFilter;
-                         if((TempParam->NumberofParameters >= 5) && (TempParam->Params[4].intParam == 1)) {
-                           slogf(LOG_DEST_BOTH, "Connect with whitelist");
-                           AdvertisingParameters.Connect_Request_Filter    = fpWhiteList;
-                         } else {
-                           slogf(LOG_DEST_BOTH, "Connect to all");
-                           AdvertisingParameters.Connect_Request_Filter    = fpNoFilter;
-                         }
-                         AdvertisingParameters.Advertising_Interval_Min  = Settings.Advertising_Interval_Min;         //1000;
-                         AdvertisingParameters.Advertising_Interval_Max  = Settings.Advertising_Interval_Max;         //1500;
+   for(Index=0;Index<MAX_LE_CONNECTIONS;Index++)
+   {
+      if((ApplicationStateInfo.LEConnectionInfo[Index].Flags & CONNECTION_INFO_FLAGS_CONNECTION_VALID) && (COMPARE_BD_ADDR(ApplicationStateInfo.LEConnectionInfo[Index].BD_ADDR, BD_ADDR)))
+         return(&(ApplicationStateInfo.LEConnectionInfo[Index]));
+   }
 
-                         /* Configure the Connectability Parameters.        */
-                         /* * NOTE * Since we do not ever put ourselves to  */
-                         /*          be direct connectable then we will set */
-                         /*          the DirectAddress to all 0s.           */
+   return(NULL);
+}
 
-                         //ConnectabilityParameters.Connectability_Mode   = LE_Parameters.ConnectableMode;
-                         ConnectabilityParameters.Connectability_Mode   = lcmConnectable;
-                         ConnectabilityParameters.Own_Address_Type      = OwnAddressType;
-                         //ConnectabilityParameters.Direct_Address_Type   = latPublic;
-                         //ASSIGN_BD_ADDR(ConnectabilityParameters.Direct_Address, 0, 0, 0, 0, 0, 0);
-                         ConnectabilityParameters.Direct_Address = BD_ADDR;
+   /* The following function returns the LE connection with the        */
+   /* specified GATT Connection ID, or NULL if there is none.           */
+static ConnectionInfo_t *SearchLEConnectionByID(unsigned int ConnectionID)
+{
+   unsigned int Index;
+
+   if(ConnectionID)
+   {
+      for(Index=0;Index<MAX_LE_CONNECTIONS;Index++)
+      {
+         if((ApplicationStateInfo.LEConnectionInfo[Index].Flags & CONNECTION_INFO_FLAGS_CONNECTION_VALID) && (ApplicationStateInfo.LEConnectionInfo[Index].ConnectionID == ConnectionID))
+            return(&(ApplicationStateInfo.LEConnectionInfo[Index]));
+      }
+   }
+
+   return(NULL);
+}
+
+   /* The following function takes a free connection entry for a new LE */
+   /* connection.  It returns NULL when all MAX_LE_CONNECTIONS entries  */
+   /* are in use.                                                       */
+static ConnectionInfo_t *CreateLEConnection(GAP_LE_Address_Type_t AddressType, BD_ADDR_t BD_ADDR)
+{
+   unsigned int      Index;
+   ConnectionInfo_t *ConnectionInfo;
+
+   if((ConnectionInfo = SearchLEConnectionByBD_ADDR(BD_ADDR)) == NULL)
+   {
+      for(Index=0;Index<MAX_LE_CONNECTIONS;Index++)
+      {
+         if(!(ApplicationStateInfo.LEConnectionInfo[Index].Flags & CONNECTION_INFO_FLAGS_CONNECTION_VALID))
+         {
+            ConnectionInfo = &(ApplicationStateInfo.LEConnectionInfo[Index]);
+            break;
+         }
+      }
+   }
+
+   if(ConnectionInfo)
+   {
+      BTPS_MemInitialize(ConnectionInfo, 0, sizeof(ConnectionInfo_t));
+      ConnectionInfo->Flags       = CONNECTION_INFO_FLAGS_CONNECTION_VALID;
+      ConnectionInfo->AddressType = AddressType;
+      ConnectionInfo->BD_ADDR     = BD_ADDR;
+
+      ApplicationStateInfo.Flags |= APPLICATION_STATE_INFO_FLAGS_LE_CONNECTED;
+   }
+
+   return(ConnectionInfo);
+}
+
+   /* The following function frees the entry of a closed LE connection. */
+   /* The LE connected flag is only cleared with the last connection.   */
+static void DeleteLEConnection(ConnectionInfo_t *ConnectionInfo)
+{
+   BTPS_MemInitialize(ConnectionInfo, 0, sizeof(ConnectionInfo_t));
+
+   if(!LEConnectionCount())
+      ApplicationStateInfo.Flags &= ~APPLICATION_STATE_INFO_FLAGS_LE_CONNECTED;
+}
+
+   /* The following function returns the number of LE connections.      */
+static unsigned int LEConnectionCount(void)
+{
+   unsigned int Index;
+   unsigned int Count = 0;
+
+   for(Index=0;Index<MAX_LE_CONNECTIONS;Index++)
+   {
+      if(ApplicationStateInfo.LEConnectionInfo[Index].Flags & CONNECTION_INFO_FLAGS_CONNECTION_VALID)
+         Count++;
+   }
+
+   return(Count);
+}
+
+   /* The following function returns the device info of the peer of an */
+   /* LE connection, or NULL if there is none.                          */
+static DeviceInfo_t *SearchLEConnectionDeviceInfo(ConnectionInfo_t *ConnectionInfo)
+{
+   if(!ConnectionInfo)
+      return(NULL);
+
+   return(SearchLEDeviceInfoEntryByBD_ADDR(ConnectionInfo->AddressType, ConnectionInfo->BD_ADDR));
+}
+
+   /* The following function asks the controller to use the largest LE  */
+   /* data PDU on each new connection.  The command blocks until the    */
+   /* controller answers, so it must be called from the SPP thread and  */
+   /* never from a stack callback.  A connection whose TxOctets is still*/
+   /* zero has not been set up yet.                                     */
+static void SetLEDataLength(void)
+{
+   int               Result;
+   unsigned int      Index;
+   Word_t            ConnectionHandle;
+   Byte_t            CommandData[3 * WORD_SIZE];
+   Byte_t            StatusResult;
+   Byte_t            LengthResult;
+   Byte_t            BufferResult[8];
+   ConnectionInfo_t *ConnectionInfo;
+
+   for(Index=0;Index<MAX_LE_CONNECTIONS;Index++)
+   {
+      ConnectionInfo = &(ApplicationStateInfo.LEConnectionInfo[Index]);
+      if((!(ConnectionInfo->Flags & CONNECTION_INFO_FLAGS_CONNECTION_VALID)) || (ConnectionInfo->TxOctets))
+         continue;
+
+      /* Until the controller accepts a change the default PDU is in    */
+      /* use.                                                           */
+      ConnectionInfo->TxOctets = LE_DATA_LENGTH_DEFAULT_TX_OCTETS;
+      ConnectionInfo->TxTime   = LE_DATA_LENGTH_DEFAULT_TX_TIME;
+
+      if((LEDataLengthSupported) && (!GAP_LE_Query_Connection_Handle(BluetoothStackID, ConnectionInfo->BD_ADDR, &ConnectionHandle)))
+      {
+         ASSIGN_HOST_WORD_TO_LITTLE_ENDIAN_UNALIGNED_WORD(&CommandData[0], ConnectionHandle);
+         ASSIGN_HOST_WORD_TO_LITTLE_ENDIAN_UNALIGNED_WORD(&CommandData[WORD_SIZE], LE_DATA_LENGTH_MAXIMUM_TX_OCTETS);
+         ASSIGN_HOST_WORD_TO_LITTLE_ENDIAN_UNALIGNED_WORD(&CommandData[2 * WORD_SIZE], LE_DATA_LENGTH_MAXIMUM_TX_TIME);
+
+         LengthResult = sizeof(BufferResult);
+         Result       = HCI_Send_Raw_Command(BluetoothStackID, HCI_COMMAND_CODE_LE_CONTROLLER_COMMANDS_OGF, HCI_COMMAND_CODE_LE_SET_DATA_LENGTH_OCF, sizeof(CommandData), CommandData, &StatusResult, &LengthResult, BufferResult, TRUE);
+         if((!Result) && (StatusResult == HCI_ERROR_CODE_NO_ERROR))
+         {
+            ConnectionInfo->TxOctets = LE_DATA_LENGTH_MAXIMUM_TX_OCTETS;
+            ConnectionInfo->TxTime   = LE_DATA_LENGTH_MAXIMUM_TX_TIME;
+         }
+         else
+            slogf(LOG_DEST_BOTH, "LE Set Data Length failed: %d (0x%02X)", Result, StatusResult);
+      }
+
+      slogf(LOG_DEST_BOTH, "LE data length: %u octets, %u us", ConnectionInfo->TxOctets, ConnectionInfo->TxTime);
+   }
+}
+
+   /* The following function is called when a connection parameter    */
+   /* request failed or the central rejected it.  The policy of the     */
+   /* connection is unknown again, and the idle policy is only asked    */
+   /* for after another Settings.LE_Idle_Timeout, not on every event.   */
+static void LELinkSpeedRetryLater(ConnectionInfo_t *ConnectionInfo)
+{
+   if(ConnectionInfo)
+      ConnectionInfo->LinkSpeed = LE_LINK_SPEED_UNCHANGED;
+   LELinkActivityTick = xTaskGetTickCount();
+}
+
+   /* The following function asks the central of a connection for the  */
+   /* connection parameters of a link policy: a short interval and no   */
+   /* slave latency while a file is moved, a long interval with some    */
+   /* latency once the link is idle.  Nothing is sent when the policy   */
+   /* does not change.  The central may refuse or pick other values, the*/
+   /* interval in use is logged from etLE_Connection_Parameter_Updated. */
+static void LERequestLinkSpeed(ConnectionInfo_t *ConnectionInfo, Byte_t LinkSpeed)
+{
+   int     Result;
+   Word_t  IntervalMin;
+   Word_t  IntervalMax;
+   Word_t  Latency;
+   DWord_t Supervision;
+
+   if((!ConnectionInfo) || (ConnectionInfo->LinkSpeed == LinkSpeed))
+      return;
+
+   if(LinkSpeed == LE_LINK_SPEED_TRANSFER)
+   {
+      IntervalMin = (Word_t)Settings.LE_Transfer_Interval;
+      Latency     = 0;
+   }
+   else
+   {
+      IntervalMin = (Word_t)Settings.LE_Idle_Interval;
+      Latency     = LE_LINK_IDLE_SLAVE_LATENCY;
+   }
+
+   /* The settings may hold the longest interval of the spec.           */
+   IntervalMax = IntervalMin + LE_LINK_INTERVAL_RANGE;
+   if(IntervalMax > LE_INTERVAL_MAX)
+      IntervalMax = LE_INTERVAL_MAX;
+
+   Supervision = 3 * (DWord_t)IntervalMax * (Latency + 1);
+   if(Supervision < LE_LINK_SUPERVISION_TIMEOUT_MIN)
+      Supervision = LE_LINK_SUPERVISION_TIMEOUT_MIN;
+   if(Supervision > LE_LINK_SUPERVISION_TIMEOUT_MAX)
+      Supervision = LE_LINK_SUPERVISION_TIMEOUT_MAX;
+
+   Result = GAP_LE_Connection_Parameter_Update_Request(BluetoothStackID, ConnectionInfo->BD_ADDR, IntervalMin, IntervalMax, Latency, (Word_t)Supervision);
+   if(!Result)
+   {
+      ConnectionInfo->LinkSpeed = LinkSpeed;
+      slogf(LOG_DEST_BOTH, "LE link %s: %u-%u ms, latency %u", (LinkSpeed == LE_LINK_SPEED_TRANSFER)?"transfer":"idle", IntervalMin, IntervalMax, Latency);
+   }
+   else
+   {
+      slogf(LOG_DEST_BOTH, "GAP_LE_Connection_Parameter_Update_Request() failed: %d", Result);
+      LELinkSpeedRetryLater(ConnectionInfo);
+   }
+}
+
+   /* The following function returns TRUE while an LE connection has  */
+   /* not been moved to the idle link policy.                           */
+static Boolean_t LELinkSpeedPending(void)
+{
+   unsigned int Index;
+
+   for(Index=0;Index<MAX_LE_CONNECTIONS;Index++)
+   {
+      if((ApplicationStateInfo.LEConnectionInfo[Index].Flags & CONNECTION_INFO_FLAGS_CONNECTION_VALID) && (ApplicationStateInfo.LEConnectionInfo[Index].LinkSpeed != LE_LINK_SPEED_IDLE))
+         return(TRUE);
+   }
+
+   return(FALSE);
+}
+
+   /* The following function applies the link policy from the SPP      */
+   /* thread.  A starting transfer switches its connection to the      */
+   /* transfer parameters at once, the idle parameters follow          */
+   /* Settings.LE_Idle_Timeout ms after the last transfer ended.  A    */
+   /* connection that never moved a file goes idle after the same time.*/
+static void LEUpdateLinkSpeed(uint8_t event)
+{
+   unsigned int Index;
+
+   if((event == SPP_EVT_LE_SEND_FILE) || (event == SPP_EVT_LE_TRANSFER_START))
+   {
+      LELinkActivityTick = xTaskGetTickCount();
+      LERequestLinkSpeed(SearchLEConnectionByID(le_transfer_ConnectionID), LE_LINK_SPEED_TRANSFER);
+   }
+   else if((SPP_state == SPP_STATE_LE_FILE_TRANSFER_ACTIVE) || (LEReceiveActive) || (event == SPP_EVT_LE_TRANSFER_DONE) || (event == SPP_EVT_LE_TRANSFER_FAILED) || (event == SPP_EVT_LE_RECEIVE_DONE))
+      LELinkActivityTick = xTaskGetTickCount();
+   else if((LELinkSpeedPending()) && ((xTaskGetTickCount() - LELinkActivityTick) >= Settings.LE_Idle_Timeout))
+   {
+      for(Index=0;Index<MAX_LE_CONNECTIONS;Index++)
+      {
+         if(ApplicationStateInfo.LEConnectionInfo[Index].Flags & CONNECTION_INFO_FLAGS_CONNECTION_VALID)
+            LERequestLinkSpeed(&(ApplicationStateInfo.LEConnectionInfo[Index]), LE_LINK_SPEED_IDLE);
+      }
+   }
+}
+
+   /* The following function returns the payload of one PWV            */
+   /* notification on a connection.                                     */
+static unsigned int PWVNotificationLength(ConnectionInfo_t *ConnectionInfo)
+{
+   return(((ConnectionInfo->MTU > ATT_PROTOCOL_MTU_MINIMUM_LE)?ConnectionInfo->MTU:ATT_PROTOCOL_MTU_MINIMUM_LE) - PWV_NOTIFICATION_HEADER_LENGTH);
+}
+
+   /* The following function notifies the Control Point with the ATT MTU*/
+   /* and LE data length in use on a connection.                        */
+static void PWVSendLinkParams(ConnectionInfo_t *ConnectionInfo, DeviceInfo_t *DeviceInfo)
+{
+   Byte_t Response[PWV_LINK_PARAMS_RESPONSE_LENGTH];
+
+   Response[0] = PWV_CMD_GET_LINK_PARAMS;
+   ASSIGN_HOST_WORD_TO_LITTLE_ENDIAN_UNALIGNED_WORD(&Response[BYTE_SIZE], ConnectionInfo->MTU);
+   ASSIGN_HOST_WORD_TO_LITTLE_ENDIAN_UNALIGNED_WORD(&Response[BYTE_SIZE + WORD_SIZE], ConnectionInfo->TxOctets);
+   ASSIGN_HOST_WORD_TO_LITTLE_ENDIAN_UNALIGNED_WORD(&Response[BYTE_SIZE + 2 * WORD_SIZE], ConnectionInfo->TxTime);
+
+   PWVSendData(BluetoothStackID, ConnectionInfo->ConnectionID, DeviceInfo, sizeof(Response), Response);
+}
+
+   /* The following function builds the advertising data for both lock */
+   /* states and the scan response data.  None of it changes after the  */
+   /* services are registered, so it is built once at start up instead  */
+   /* of each time advertising is enabled or the lock status changes.   */
+static void BuildAdvertisingData(void)
+{
+   int     Index;
+   int     Length;
+   int     NameInAdData = 0;
+   int     serviceUUIDCount;
+   int     serviceUUIDIndex;
+   Byte_t  AdvertiseDataLength;
+   Byte_t *Data;
+
+   BTPS_MemInitialize(AdvertisingData, 0, sizeof(AdvertisingData));
+   Data = AdvertisingData[0].Advertising_Data;
+
+   /* Set the Flags A/D Field (1 byte type and 1 byte Flags.            */
+   Data[0] = 2;
+   Data[1] = HCI_LE_ADVERTISING_REPORT_DATA_TYPE_FLAGS;
+   Data[2] = HCI_LE_ADVERTISING_FLAGS_BR_EDR_NOT_SUPPORTED_FLAGS_BIT_MASK;
+   Data[2] |= HCI_LE_ADVERTISING_FLAGS_GENERAL_DISCOVERABLE_MODE_FLAGS_BIT_MASK;
+
+   /* Configure the Device Appearance value.                            */
+   Data[3] = 3;
+   Data[4] = HCI_LE_ADVERTISING_REPORT_DATA_TYPE_APPEARANCE;
+   ASSIGN_HOST_WORD_TO_LITTLE_ENDIAN_UNALIGNED_WORD(&(Data[5]), GAP_DEVICE_APPEARENCE_VALUE_HID_KEYBOARD);
+
+   AdvertiseDataLength = 7;
+
+   // Build complete UUID service list if any are active
+   if (LLSInstanceID || TPSInstanceID || IASInstanceID || BASInstanceID) {
+
+        // Save current position so we can update it with the correct length after we are done
+        // assembling all of the service UUIDs
+        serviceUUIDIndex = AdvertiseDataLength;
+        serviceUUIDCount = 0;
+        AdvertiseDataLength += 2;
+
+        // Link loss service
+        if(LLSInstanceID)
+        {
+                serviceUUIDCount++;
+                LLS_ASSIGN_LLS_SERVICE_UUID_16(&(Data[AdvertiseDataLength]));
+                AdvertiseDataLength += 2;
+        }
+
+        // TX power service
+        if(TPSInstanceID)
+        {
+                serviceUUIDCount++;
+                TPS_ASSIGN_TPS_SERVICE_UUID_16(&(Data[AdvertiseDataLength]));
+                AdvertiseDataLength += 2;
+        }
+
+        // Immediate alert service
+        if(IASInstanceID)
+        {
+                serviceUUIDCount++;
+                IAS_ASSIGN_IAS_SERVICE_UUID_16(&(Data[AdvertiseDataLength]));
+                AdvertiseDataLength += 2;
+        }
+
+        // Battery alert service
+        if(BASInstanceID)
+        {
+                serviceUUIDCount++;
+                BAS_ASSIGN_BAS_SERVICE_UUID_16(&(Data[AdvertiseDataLength]));
+                AdvertiseDataLength += 2;
+        }
+
+        // Calculate and update length of service UUID data
+        if (serviceUUIDCount > 0) {
+                Data[serviceUUIDIndex] = 1 + serviceUUIDCount * 2;
+                Data[serviceUUIDIndex+1] = HCI_LE_ADVERTISING_REPORT_DATA_TYPE_16_BIT_SERVICE_UUID_COMPLETE;
+        }
+   }
+
+   /* Add Manufacturer Specific Data                                    */
+   /* 1 byte type code = 0xFF                                           */
+   /* 0x0387 = BluStor Unique Identifier                                */
+   /* Lock Flag = [0x00 = unlocked, 0x01 = locked], patched per variant */
+   Data[AdvertiseDataLength] = 4;
+   Data[AdvertiseDataLength+1] = HCI_LE_ADVERTISING_REPORT_DATA_TYPE_MANUFACTURER_SPECIFIC;
+   Data[AdvertiseDataLength+2] = 0x03;
+   Data[AdvertiseDataLength+3] = 0x87;
+   Index = AdvertiseDataLength + 4;
+   AdvertiseDataLength += 5;
+
+   /* If we have room, add the complete local name to the advertising data */
+   Length = BTPS_StringLength(APP_CYBERGATE_LE);
+   if ((AdvertiseDataLength + 2  + Length) <= ADVERTISING_DATA_MAXIMUM_SIZE) {
+        Data[AdvertiseDataLength] = 1 + Length;
+        Data[AdvertiseDataLength+1] = HCI_LE_ADVERTISING_REPORT_DATA_TYPE_LOCAL_NAME_COMPLETE;
+        BTPS_MemCopy(&(Data[AdvertiseDataLength+2]),APP_CYBERGATE_LE, Length);
+        AdvertiseDataLength = AdvertiseDataLength + 2 + Length;
+        NameInAdData = 1;
+   }
+
+   /* The locked variant only differs in the lock flag.                 */
+   AdvertisingData[1] = AdvertisingData[0];
+   AdvertisingData[0].Advertising_Data[Index] = 0x00;
+   AdvertisingData[1].Advertising_Data[Index] = 0x01;
+   AdvertisingDataLength[0] = AdvertiseDataLength;
+   AdvertisingDataLength[1] = AdvertiseDataLength;
+
+   BTPS_MemInitialize(&ScanResponseData, 0, sizeof(Scan_Response_Data_t));
+   ScanResponseDataLength = 0;
+
+   /* If we didn't include fullname in advertisement data, try to include it in scan data */
+   if(Length <= (ADVERTISING_DATA_MAXIMUM_SIZE - 2 - 18) && (!NameInAdData))
+   {
+      ScanResponseData.Scan_Response_Data[ScanResponseDataLength] = (Byte_t)(1 + Length);
+      ScanResponseData.Scan_Response_Data[ScanResponseDataLength + 1] = HCI_LE_ADVERTISING_REPORT_DATA_TYPE_LOCAL_NAME_COMPLETE;
+
+      BTPS_MemCopy(&(ScanResponseData.Scan_Response_Data[ScanResponseDataLength + 2]),APP_CYBERGATE_LE,Length);
+      ScanResponseDataLength += (2 + Length);
+   }
+
+   /* Add the PWV service UUID to the Scan Response Data.               */
+   Length = 16;
+   ScanResponseData.Scan_Response_Data[ScanResponseDataLength + 0] = (Byte_t)(1 + Length);
+   ScanResponseData.Scan_Response_Data[ScanResponseDataLength + 1] = HCI_LE_ADVERTISING_REPORT_DATA_TYPE_128_BIT_SERVICE_UUID_COMPLETE;
+   PWV_ASSIGN_PWV_SERVICE_UUID_128(&(ScanResponseData.Scan_Response_Data[ScanResponseDataLength + 2]));
+   ScanResponseDataLength += (2 + Length);
+
+   /* Nothing in the chip matches the new data yet.                     */
+   AdvertisingDataWritten  = -1;
+   ScanResponseDataWritten = FALSE;
+}
+
+   /* The following function writes the advertising data for a lock    */
+   /* status to the chip.  Nothing is sent when the chip already has it.*/
+   /* This function returns zero on success or the error of            */
+   /* GAP_LE_Set_Advertising_Data().                                    */
+static int AdvertiseWriteAdvertisingData(int locked)
+{
+   int ret_val;
+
+   locked = (locked)?1:0;
+   if(!AdvertisingDataLength[locked])
+      BuildAdvertisingData();
+
+   if(AdvertisingDataWritten == locked)
+      return(0);
+
+   ret_val = GAP_LE_Set_Advertising_Data(BluetoothStackID, AdvertisingDataLength[locked], &(AdvertisingData[locked]));
+   AdvertisingDataWritten = (ret_val)?-1:locked;
+
+   return(ret_val);
+}
+
+   /* The following function writes the scan response data to the chip */
+   /* unless it is already there.  This function returns zero on        */
+   /* success or the error of GAP_LE_Set_Scan_Response_Data().          */
+static int AdvertiseWriteScanResponseData(void)
+{
+   int ret_val;
+
+   if(!ScanResponseDataLength)
+      BuildAdvertisingData();
+
+   if(ScanResponseDataWritten)
+      return(0);
+
+   ret_val = GAP_LE_Set_Scan_Response_Data(BluetoothStackID, ScanResponseDataLength, &ScanResponseData);
+   ScanResponseDataWritten = (ret_val)?FALSE:TRUE;
+
+   return(ret_val);
+}
+
+   /* The following function is responsible for enabling LE             */
+   /* Advertisements.  This function returns zero on successful         */
+   /* execution and a negative value on all errors.                     */
+static int AdvertiseLE(ParameterList_t *TempParam)
+{
+   int                                ret_val = 0;
+   int                                locked = 1;
+   GAP_LE_Advertising_Parameters_t    AdvertisingParameters;
+   GAP_LE_Connectability_Parameters_t ConnectabilityParameters;
+   //GAP_LE_Address_Type_t              OwnAddressType = latPublic;
+   GAP_LE_Address_Type_t              OwnAddressType = latRandom;
+   BD_ADDR_t                          BD_ADDR;
+   BoardStr_t                         BoardStr;
+   
+   // Is advertising disabled?
+   if (!Settings.Advertising_Enabled) {     
+      Display(("[AdvertiseLE] Advertising disabled by user settings\r\n"));
+      return -1;
+   }
+
+   /* First, check that valid Bluetooth Stack ID exists.                */
+   if(BluetoothStackID)
+   {
+      /* Make sure that all of the parameters required for this function*/
+      /* appear to be at least semi-valid.                              */
+      if(TempParam) 
+      {
+         if  ((TempParam->NumberofParameters >= 1) && ((TempParam->Params[0].intParam == 0) || (TempParam->Params[0].intParam == 1)))
+         {
+      
+             /* Determine whether to enable or disable Advertising.         */
+             if(TempParam->Params[0].intParam == 0)
+             {
+                /* Disable Advertising.                                     */
+                ret_val = GAP_LE_Advertising_Disable(BluetoothStackID);
+                if(!ret_val)
+                {
+                   Display(("   GAP_LE_Advertising_Disable success.\r\n"));
+                }
+                else
+                {
+                   DisplayFunctionError("GAP_LE_Advertising_Disable", ret_val);
+
+                   ret_val = FUNCTION_ERROR;
+                }
+             }
+             else
+             {
+                 /* AdvertiseLE [1 = Enable]  [0 = Unlocked, 1 = Locked] [1 = Random Address] [Random BD Address] */
+                 /* Check for lock status parameter                       */
+                 if ((TempParam->NumberofParameters >= 2) && ((TempParam->Params[1].intParam == 0) || (TempParam->Params[1].intParam == 1))) {
+                               locked = TempParam->Params[1].intParam;
+                 } else if (TempParam->NumberofParameters >= 2) {
+                               ret_val = INVALID_PARAMETERS_ERROR;
+                 }
+                    
+                /* Verifying enable Advertising.parameters                  */
+                if(TempParam->NumberofParameters >= 3) 
+				{
+                    if (TempParam->Params[2].intParam == 1)
+                    {
+                       OwnAddressType = latRandom;
+                       if (BTPS_StringLength(TempParam->Params[3].strParam) >= (sizeof(BD_ADDR_t)*2))
+    		           {
+    		                /* Convert the parameter to a Bluetooth Device Address.        */
+                       	        StrToBD_ADDR(TempParam->Params[3].strParam, &BD_ADDR);
+    	  	           }
+    		           else
+    		   	           ret_val = INVALID_PARAMETERS_ERROR;
+                    }
+                    else 
+                       if ((TempParam->Params[2].intParam != 0) || (TempParam->NumberofParameters < 3))
+      		   	           ret_val = INVALID_PARAMETERS_ERROR;
+	            }
+                
+                if (!ret_val)
+                {                        
+                   /* Enable Advertising.                                   */
+                   /* Write the advertising data for the lock status and    */
+                   /* the scan response data to the chip.                   */
+                   ret_val = AdvertiseWriteAdvertisingData(locked);
+                   if(!ret_val)
+                   {
+                      ret_val = AdvertiseWriteScanResponseData();
+
+                      if(!ret_val)
+                      {
+                         /* Set up the advertising parameters.              */
+                         AdvertisingParameters.Advertising_Channel_Map   = HCI_LE_ADVERTISING_CHANNEL_MAP_DEFAULT;
+                         AdvertisingParameters.Scan_Request_Filter       = fpNoFilter;
+                         if((TempParam->NumberofParameters >= 5) && (TempParam->Params[4].intParam == 1)) {
+                           slogf(LOG_DEST_BOTH, "Connect with whitelist");
+                           AdvertisingParameters.Connect_Request_Filter    = fpWhiteList;
+                         } else {
+                           slogf(LOG_DEST_BOTH, "Connect to all");
+                           AdvertisingParameters.Connect_Request_Filter    = fpNoFilter;
+                         }
+                         AdvertiseStageInterval(&AdvertisingParameters.Advertising_Interval_Min, &AdvertisingParameters.Advertising_Interval_Max);
+
+                         /* Configure the Connectability Parameters.        */
+                         /* * NOTE * The Direct Address is only used by     */
+                         /*          directed advertising, see below.       */
+
+                         //ConnectabilityParameters.Connectability_Mode   = LE_Parameters.ConnectableMode;
+                         ConnectabilityParameters.Connectability_Mode   = lcmConnectable;
+                         ConnectabilityParameters.Own_Address_Type      = OwnAddressType;
+                         //ConnectabilityParameters.Direct_Address_Type   = latPublic;
+                         //ASSIGN_BD_ADDR(ConnectabilityParameters.Direct_Address, 0, 0, 0, 0, 0, 0);
+                         ConnectabilityParameters.Direct_Address = BD_ADDR;
                          
                          // Create compliant psuedo-random BD_ADDR based on the original address
                          if(!GAP_Query_Local_BD_ADDR(BluetoothStackID, &BD_ADDR))
@@ -2534,6 +3291,18 @@ static int AdvertiseLE(ParameterList_t *TempParam)
                              //GAP_LE_Generate_Resolvable_Address(BluetoothStackID, &IRK, &BD_ADDR);
                              GAP_LE_Set_Random_Address(BluetoothStackID, BD_ADDR);
                              ConnectabilityParameters.Direct_Address = BD_ADDR;
+
+                             /* High duty cycle directed advertising   */
+                             /* to the last bonded central.            */
+                             if((TempParam->NumberofParameters >= 6) && (TempParam->Params[5].intParam) && (LastBondedDeviceInfo))
+                             {
+                                ConnectabilityParameters.Connectability_Mode = lcmDirectConnectable;
+                                ConnectabilityParameters.Direct_Address_Type = LastBondedDeviceInfo->ConnectionAddressType;
+                                ConnectabilityParameters.Direct_Address      = LastBondedDeviceInfo->ConnectionBD_ADDR;
+                                BD_ADDRToStr(LastBondedDeviceInfo->ConnectionBD_ADDR, BoardStr);
+                                slogf(LOG_DEST_BOTH, "Directed advertising to %s", BoardStr);
+                             }
+
                              ret_val = GAP_LE_Advertising_Enable(BluetoothStackID, TRUE, &AdvertisingParameters, &ConnectabilityParameters, GAP_LE_Event_Callback, 0);
                              if(!ret_val)
                              {
@@ -2593,21 +3362,97 @@ static int AdvertiseLE(ParameterList_t *TempParam)
           ret_val = INVALID_PARAMETERS_ERROR;
       }
    }
-   else
+   else
+   {
+      /* No valid Bluetooth Stack ID exists.                            */
+      ret_val = INVALID_STACK_ID_ERROR;
+   }
+
+   return(ret_val);
+}
+
+   /* The following function starts advertising at the first stage of  */
+   /* the advertising schedule.                                         */
+static int AdvertiseLEEnable(uint8_t whitelist)
+{
+   AdvertiseWhitelist      = whitelist;
+   AdvertiseDirectedBursts = 0;
+   AdvertiseStage          = 0;
+   AdvertiseStageTick      = xTaskGetTickCount();
+
+   return(AdvertiseLEStart());
+}
+
+   /* The following function returns the central to reconnect to with  */
+   /* directed advertising, or NULL if there is none.  Pairing mode     */
+   /* waits for a new central and a central that is still connected    */
+   /* needs no reconnect.                                               */
+static DeviceInfo_t *AdvertiseReconnectTarget(void)
+{
+   unsigned int Index;
+
+   if((!LastBondedDeviceInfo) || (pairing_mode))
+      return(NULL);
+
+   for(Index=0;Index<MAX_LE_CONNECTIONS;Index++)
+   {
+      if((ApplicationStateInfo.LEConnectionInfo[Index].Flags & CONNECTION_INFO_FLAGS_CONNECTION_VALID) && (SearchLEConnectionDeviceInfo(&(ApplicationStateInfo.LEConnectionInfo[Index])) == LastBondedDeviceInfo))
+         return(NULL);
+   }
+
+   return(LastBondedDeviceInfo);
+}
+
+   /* The following function starts advertising after a disconnect or  */
+   /* a wake up.  The last bonded central gets ADVERTISE_DIRECTED_BURSTS*/
+   /* bursts of directed advertising first, the advertising schedule    */
+   /* follows.  The time to the next connection is logged with the mode */
+   /* that was advertising so both can be compared.                     */
+static int AdvertiseLEReconnect(void)
+{
+   AdvertiseReconnectPending = TRUE;
+   AdvertiseReconnectTick    = xTaskGetTickCount();
+
+   if(AdvertiseReconnectTarget())
    {
-      /* No valid Bluetooth Stack ID exists.                            */
-      ret_val = INVALID_STACK_ID_ERROR;
+      AdvertiseWhitelist      = 0;
+      AdvertiseDirectedBursts = ADVERTISE_DIRECTED_BURSTS;
+      AdvertiseStage          = 0;
+      AdvertiseStageTick      = xTaskGetTickCount();
+
+      if(!AdvertiseLEStart())
+         return(0);
    }
 
-   return(ret_val);
+   return(AdvertiseLEEnable(0));
 }
 
-static int AdvertiseLEEnable(uint8_t whitelist)
+   /* The following function starts the next directed advertising burst*/
+   /* once the last one has ended, or the first stage of the advertising*/
+   /* schedule when Bursts is zero.                                     */
+static void AdvertiseDirectedNext(unsigned int Bursts)
+{
+   AdvertiseDirectedBursts = Bursts;
+   AdvertiseStageTick      = xTaskGetTickCount();
+
+   /* The controller has already stopped after a timeout.              */
+   AdvertiseLEDisable();
+
+   if((!AdvertiseDirectedBursts) || (AdvertiseLEStart()))
+   {
+      slogf(LOG_DEST_BOTH, "Directed advertising done, undirected");
+      AdvertiseLEEnable(AdvertiseWhitelist);
+   }
+}
+
+   /* The following function starts advertising at the current stage of */
+   /* the advertising schedule.                                         */
+static int AdvertiseLEStart(void)
 {
    int ret_val = 0;
    ParameterList_t parm;
    
-   parm.NumberofParameters = 5;
+   parm.NumberofParameters = 6;
    parm.Params[0].intParam = 1;
    if (FTPLocked) {
       parm.Params[1].intParam = 1;
@@ -2616,7 +3461,8 @@ static int AdvertiseLEEnable(uint8_t whitelist)
    }
    parm.Params[2].intParam = 0;
    parm.Params[3].strParam = NULL;
-   parm.Params[4].intParam = whitelist;
+   parm.Params[4].intParam = AdvertiseWhitelist;
+   parm.Params[5].intParam = (AdvertiseDirectedBursts)?1:0;
    if (Settings.Advertising_Enabled) {
       ret_val = AdvertiseLE(&parm);
       if(!ret_val) {
@@ -2643,13 +3489,110 @@ static int AdvertiseLEDisable(void)
    return ret_val;
 }
 
+   /* The following function returns the advertising interval range of */
+   /* the current schedule stage.                                       */
+static void AdvertiseStageInterval(Word_t *IntervalMin, Word_t *IntervalMax)
+{
+   const AdvertiseStage_t *Stage = &AdvertiseSchedule[AdvertiseStage];
+
+   /* A fast stage never advertises slower than the device settings.   */
+   if((Stage->IntervalMin) && (Stage->IntervalMax <= Settings.Advertising_Interval_Max))
+   {
+      *IntervalMin = Stage->IntervalMin;
+      *IntervalMax = Stage->IntervalMax;
+   }
+   else
+   {
+      *IntervalMin = (Word_t)Settings.Advertising_Interval_Min;
+      *IntervalMax = (Word_t)Settings.Advertising_Interval_Max;
+   }
+}
+
+   /* The following function moves advertising to another stage of the */
+   /* schedule.  The controller only takes new advertising parameters   */
+   /* while advertising is off, so running advertising is restarted.    */
+   /* The discovery latency of a continuously scanning central (see     */
+   /* AdvTiming.h, the controller may use any interval of the range) and*/
+   /* the largest radio duty cycle are logged so the schedule can be    */
+   /* checked against battery life.                                     */
+static void AdvertiseSetStage(unsigned int Stage)
+{
+   Word_t   IntervalMin;
+   Word_t   IntervalMax;
+   uint32_t Duty;
+
+   AdvertiseStage     = Stage;
+   AdvertiseStageTick = xTaskGetTickCount();
+
+   if(AdvertisingStatus)
+   {
+      AdvertiseLEDisable();
+      AdvertiseLEStart();
+   }
+
+   AdvertiseStageInterval(&IntervalMin, &IntervalMax);
+   Duty = AdvTimingDuty(ADVERTISE_EVENT_US, IntervalMin);
+   slogf(LOG_DEST_BOTH, "Advertising stage %u: %u-%u ms, discovery mean %u-%u ms, max %u ms, radio up to %u.%02u%%", Stage, IntervalMin, IntervalMax,
+         AdvTimingDiscoveryMean(IntervalMin), AdvTimingDiscoveryMean(IntervalMax), AdvTimingDiscoveryMax(IntervalMax), Duty / 100, Duty % 100);
+}
+
+   /* The following function runs the advertising schedule from the SPP*/
+   /* thread.  Waking up or a button press start over at the fast stage,*/
+   /* otherwise the next stage follows when the current one has run its*/
+   /* course.  Waking up tries the last bonded central with directed    */
+   /* advertising first, a button press ends directed advertising.     */
+static void AdvertiseUpdateSchedule(uint8_t event)
+{
+   if((!AdvertisingStatus) || (LEConnectionCount() >= MAX_LE_CONNECTIONS))
+      return;
+
+   if((event == SPP_EVT_BUTTON_WAKEUP) && (AdvertiseReconnectTarget()))
+   {
+      AdvertiseLEDisable();
+      AdvertiseLEReconnect();
+   }
+   else if(AdvertiseDirectedBursts)
+   {
+      if(event == SPP_EVT_BUTTON_MEDIUM_PRESS)
+         AdvertiseDirectedNext(0);
+      else if((event == SPP_EVT_LE_DIRECTED_TIMEOUT) && ((int32_t)(AdvertiseDirectedTimeoutTick - AdvertiseStageTick) < ADVERTISE_DIRECTED_MIN_MS))
+         slogf(LOG_DEST_BOTH, "Directed advertising: late timeout ignored");
+      else if((event == SPP_EVT_LE_DIRECTED_TIMEOUT) || ((xTaskGetTickCount() - AdvertiseStageTick) >= ADVERTISE_DIRECTED_GUARD_MS))
+         AdvertiseDirectedNext(AdvertiseDirectedBursts - 1);
+   }
+   else if((event == SPP_EVT_BUTTON_WAKEUP) || (event == SPP_EVT_BUTTON_MEDIUM_PRESS))
+   {
+      if(AdvertiseStage)
+         AdvertiseSetStage(0);
+      else
+         AdvertiseStageTick = xTaskGetTickCount();
+
+      /* Time the reconnect undirected as well.                        */
+      if(event == SPP_EVT_BUTTON_WAKEUP)
+      {
+         AdvertiseReconnectPending = TRUE;
+         AdvertiseReconnectTick    = AdvertiseStageTick;
+      }
+   }
+   else if((AdvertiseSchedule[AdvertiseStage].Duration) && ((xTaskGetTickCount() - AdvertiseStageTick) >= AdvertiseSchedule[AdvertiseStage].Duration))
+      AdvertiseSetStage(AdvertiseStage + 1);
+}
+
 /* The following function changes the BLE Advertising data to indicate  */
-/* if the card is locked or unlocked.  In order to do this, BLE         */
-/* advertising must first be disabled and then renabled with the        */
-/* updated advertising data parameters.                                 */
+/* if the card is locked or unlocked.  While advertising the chip takes */
+/* the new advertising data in place, otherwise BLE advertising is      */
+/* disabled and then renabled with the updated advertising data.        */
 void AdvertiseLockStatus(int locked) {
   
-  if (Settings.Advertising_Enabled) {
+  if ((Settings.Advertising_Enabled) && (AdvertisingStatus) && (BluetoothStackID)) {
+  
+    int ret_val = AdvertiseWriteAdvertisingData(locked);
+
+    if (ret_val) {
+      DisplayFunctionError("GAP_LE_Set_Advertising_Data(dtAdvertising)", ret_val);
+    }
+
+  } else if (Settings.Advertising_Enabled) {
   
     ParameterList_t parm;
     
@@ -2819,10 +3762,7 @@ static int OpenStack(HCI_DriverInformation_t *HCI_DriverInformation, BTPS_Initia
             GAP_LE_Diversify_Function(BluetoothStackID, (Encryption_Key_t *)(&IR), 1,0, &IRK);
             GAP_LE_Diversify_Function(BluetoothStackID, (Encryption_Key_t *)(&IR), 3, 0, &DHK);
             
-            /* Flag that we have no Key Information in the Key List.    */
-            DeviceInfoList = NULL;
-            
-            /* Load in DeviceInfoList from flash                        */
+            /* Load in the device info table from flash.                */
             LoadDeviceInfoList();
             
             /* Regenerate IRK and DHK from the constant Identity Root Key. */
@@ -2964,6 +3904,10 @@ static int CloseStack(void)
       /* Flag that the Stack is no longer initialized.                  */
       BluetoothStackID = 0;
 
+      /* The controller has to be given the advertising data again.     */
+      AdvertisingDataWritten  = -1;
+      ScanResponseDataWritten = FALSE;
+
       /* Flag success to the caller.                                    */
       ret_val          = 0;
    }
@@ -5622,24 +6566,32 @@ static int ConnectLEDevice(unsigned int BluetoothStackID, BD_ADDR_t BD_ADDR, GAP
 
 int DisconnectLE() {
     
-   int Result;
+   int          Result;
+   unsigned int Index;
    slogf(LOG_DEST_BOTH, "Send disconnect");
    /* First, determine if the input parameters appear to be semi-valid. */
-   if((BluetoothStackID) && (!COMPARE_NULL_BD_ADDR(ApplicationStateInfo.LEConnectionInfo.BD_ADDR)))
+   if(BluetoothStackID)
    {
       /* Make sure that a device with address BD_ADDR is connected      */
       if(ApplicationStateInfo.Flags & APPLICATION_STATE_INFO_FLAGS_LE_CONNECTED)
       {
-         Result = GAP_LE_Disconnect(BluetoothStackID, ApplicationStateInfo.LEConnectionInfo.BD_ADDR);
-         
-         if(!Result)
+         /* Disconnect every LE connection.                             */
+         Result = 0;
+         for(Index=0;Index<MAX_LE_CONNECTIONS;Index++)
          {
-            Display(("Disconnect Request successful.\r\n"));
-         }
-         else
-         {
-            /* Unable to disconnect device.                             */
-            Display(("Unable to disconnect device: %d.\r\n", Result));
+            if(!(ApplicationStateInfo.LEConnectionInfo[Index].Flags & CONNECTION_INFO_FLAGS_CONNECTION_VALID))
+               continue;
+
+            if(!GAP_LE_Disconnect(BluetoothStackID, ApplicationStateInfo.LEConnectionInfo[Index].BD_ADDR))
+            {
+               Display(("Disconnect Request successful.\r\n"));
+            }
+            else
+            {
+               /* Unable to disconnect device.                          */
+               Result = -1;
+               Display(("Unable to disconnect device.\r\n"));
+            }
          }
       }
       else
@@ -5660,12 +6612,14 @@ int DisconnectLE() {
 #endif // CONSOLE_SUPPORT
 
    /* The following function attempts to send the specified data length         */
-   /* out of the specified data buffer. If the GATT buffers fill up, it will    */
+   /* out of the specified data buffer to the PWV client on the GATT connection */
+   /* ConnectionID. If the GATT buffers fill up, it will                        */
    /* send what it can and return the number of bytes that were sent            */
    /* successfully.                                                             */
    /*                                                                           */
-static unsigned int PWVSendData(unsigned int BluetoothStackID, DeviceInfo_t *DeviceInfo, unsigned int DataLength, Byte_t *Data)
+static unsigned int PWVSendData(unsigned int BluetoothStackID, unsigned int ConnectionID, DeviceInfo_t *DeviceInfo, unsigned int DataLength, Byte_t *Data)
 {
+   ConnectionInfo_t *ConnectionInfo;
    int          Result;
    Boolean_t    Done;
    unsigned int DataCount;
@@ -5675,7 +6629,7 @@ static unsigned int PWVSendData(unsigned int BluetoothStackID, DeviceInfo_t *Dev
    unsigned int TotalBytesTransmitted = 0;
 
    /* Verify that the input parameters are semi-valid.                  */
-   if((BluetoothStackID) && (DeviceInfo))
+   if((BluetoothStackID) && (DeviceInfo) && ((ConnectionInfo = SearchLEConnectionByID(ConnectionID)) != NULL))
    {
       /* Loop while we have data to send and we can send it.            */
       Done              = FALSE;
@@ -5684,8 +6638,8 @@ static unsigned int PWVSendData(unsigned int BluetoothStackID, DeviceInfo_t *Dev
       while(!Done)
       {
          /* Get the maximum length of what we can send in this       */
-         /* transaction.                                             */
-         MaxLength = PWV_DATA_BUFFER_LENGTH;
+         /* transaction, one notification per negotiated ATT MTU.    */
+         MaxLength = PWVNotificationLength(ConnectionInfo);
 
          /* If we do not have any outstanding data get some more     */
          /* data.                                                    */
@@ -5762,7 +6716,7 @@ static unsigned int PWVSendData(unsigned int BluetoothStackID, DeviceInfo_t *Dev
                   
                   if(Result == BTPS_ERROR_INSUFFICIENT_BUFFER_SPACE)
                   {
-                     SPP_event = SPP_EVT_GATT_BUFFER_FULL;
+                     GATTBufferFull = TRUE;
                   }
                }
             }
@@ -5807,8 +6761,8 @@ static void BTPSAPI GATT_ServerEventCallback(unsigned int BluetoothStackID, GATT
    Word_t        AttributeOffset;
    Byte_t        ErrorCode;
    DeviceInfo_t *DeviceInfo;
-   FRESULT res = FR_OK;
-   UINT written;
+   ConnectionInfo_t *ConnectionInfo;
+   LEStagingFile_t *StagingFile;
    Byte_t error[] = {0x99};
    uint8_t *value_array;
      
@@ -5825,9 +6779,10 @@ static void BTPSAPI GATT_ServerEventCallback(unsigned int BluetoothStackID, GATT
                /* readable characteristics are long).                   */
                if(GATT_ServerEventData->Event_Data.GATT_Read_Request_Data->AttributeValueOffset == 0)
                {
-                  /* Grab the device info for the currently          */
-                  /* connected device.                               */
-                  if((DeviceInfo = SearchLEDeviceInfoEntryByBD_ADDR(&DeviceInfoList, ApplicationStateInfo.LEConnectionInfo.AddressType, ApplicationStateInfo.LEConnectionInfo.BD_ADDR)) != NULL)
+                  /* Grab the device info for the device on this     */
+                  /* connection.                                     */
+                  ConnectionInfo = SearchLEConnectionByID(GATT_ServerEventData->Event_Data.GATT_Read_Request_Data->ConnectionID);
+                  if((DeviceInfo = SearchLEConnectionDeviceInfo(ConnectionInfo)) != NULL)
                   {
                      /* Determine which request this read is coming  */
                      /* for.                                         */
@@ -5839,8 +6794,19 @@ static void BTPSAPI GATT_ServerEventCallback(unsigned int BluetoothStackID, GATT
                         case PWV_CONTROL_POINT_CHARACTERISTIC_CCD_ATTRIBUTE_OFFSET:
                            ASSIGN_HOST_WORD_TO_LITTLE_ENDIAN_UNALIGNED_WORD(Temp, DeviceInfo->ServerInfo.Control_Point_Client_Configuration_Descriptor);
                            break;
+                        case PWV_RX_CREDITS_CHARACTERISTIC_ATTRIBUTE_OFFSET:
+                           /* The free space in the staging ring.      */
+                           ASSIGN_HOST_WORD_TO_LITTLE_ENDIAN_UNALIGNED_WORD(Temp, ((LEReceiveOpen) && (le_transfer_ConnectionID == ConnectionInfo->ConnectionID))?PWVRxCreditsFree(LE_STAGING_BUFFER_SIZE, LEStagingHead, LEStagingTail):0);
+                           break;
+                        case PWV_RX_CREDITS_CHARACTERISTIC_CCD_ATTRIBUTE_OFFSET:
+                           ASSIGN_HOST_WORD_TO_LITTLE_ENDIAN_UNALIGNED_WORD(Temp, DeviceInfo->ServerInfo.Rx_Credit_Client_Configuration_Descriptor);
+                           break;
+                        case PWV_TX_CREDITS_CHARACTERISTIC_ATTRIBUTE_OFFSET:
+                           /* The notification credits still unused.   */
+                           ASSIGN_HOST_WORD_TO_LITTLE_ENDIAN_UNALIGNED_WORD(Temp, min(PWVTxCreditsAvailable(&(ConnectionInfo->TxCredits)), PWV_CREDIT_VALUE_MAX));
+                           break;
                      }
-                     if(ApplicationStateInfo.LEConnectionInfo.Flags & CONNECTION_INFO_FLAGS_CONNECTION_ENCRYPTED)
+                     if(ConnectionInfo->Flags & CONNECTION_INFO_FLAGS_CONNECTION_ENCRYPTED)
                      {
                         GATT_Read_Response(BluetoothStackID, GATT_ServerEventData->Event_Data.GATT_Read_Request_Data->TransactionID, WORD_SIZE, Temp);
                      }
@@ -5872,11 +6838,12 @@ static void BTPSAPI GATT_ServerEventCallback(unsigned int BluetoothStackID, GATT
                   /* Verify that the value is of the correct length.    */
                   if(((GATT_ServerEventData->Event_Data.GATT_Write_Request_Data->AttributeValueLength)))
                   {
-                     /* Grab the device info for the currently       */
-                     /* connected device.                            */
-                     if((DeviceInfo = SearchLEDeviceInfoEntryByBD_ADDR(&DeviceInfoList, ApplicationStateInfo.LEConnectionInfo.AddressType, ApplicationStateInfo.LEConnectionInfo.BD_ADDR)) != NULL)
+                     /* Grab the device info for the device on this  */
+                     /* connection.                                  */
+                     ConnectionInfo = SearchLEConnectionByID(GATT_ServerEventData->Event_Data.GATT_Write_Request_Data->ConnectionID);
+                     if((DeviceInfo = SearchLEConnectionDeviceInfo(ConnectionInfo)) != NULL)
                      {
-                        if(ApplicationStateInfo.LEConnectionInfo.Flags & CONNECTION_INFO_FLAGS_CONNECTION_ENCRYPTED)
+                        if(ConnectionInfo->Flags & CONNECTION_INFO_FLAGS_CONNECTION_ENCRYPTED)
                         {
                            /* Since the value appears valid go ahead and*/
                            /* accept the write request.                 */
@@ -5905,33 +6872,69 @@ static void BTPSAPI GATT_ServerEventCallback(unsigned int BluetoothStackID, GATT
                               switch(value_array[0]){
                                  case PWV_CMD_ENABLE_EDR:
                                     slogf(LOG_DEST_BOTH, "Enable EDR");
-                                    SPP_event = SPP_EVT_ENABLE_EDR;
+                                    Set_SPP_Event(SPP_EVT_ENABLE_EDR);
                                     break;
                                  case PWV_CMD_SEND_FILE:
+                                    if(!LETransferAvailable(ConnectionInfo))
+                                    {
+                                       error[0] = PWV_ERROR_TRANSFER_BUSY;
+                                       PWVSendData(BluetoothStackID, ConnectionInfo->ConnectionID, DeviceInfo, 1, error);
+                                       break;
+                                    }
+                                    le_transfer_ConnectionID = ConnectionInfo->ConnectionID;
+                                    le_transfer_DeviceInfo   = DeviceInfo;
+                                    LESendPending            = TRUE;
                                     memcpy(le_transfer_filepath, value_array+2, value_array[1]);
-                                    SPP_event = SPP_EVT_LE_SEND_FILE;
+                                    Set_SPP_Event(SPP_EVT_LE_SEND_FILE);
                                     break;
                                  case PWV_CMD_OPEN_FILE:
-                                    slogf(LOG_DEST_BOTH, "Open file");
-                                    eMMC_PowerOn();
-                                    res = f_open(&fp_download, value_array+2, FA_READ | FA_WRITE | FA_OPEN_ALWAYS);
-                                    RTC_GetElapsedTime(&LETransferStartTime);
-                                    if(res != FR_OK)
+                                    /* The file is opened by the worker,  */
+                                    /* writes are staged until it is.     */
+                                    /* An open file is closed first.      */
+                                    if((LETransferAvailable(ConnectionInfo)) && (LEReceiveOpen) && (le_transfer_ConnectionID == ConnectionInfo->ConnectionID))
+                                    {
+                                       LEStagingClose();
+                                       Set_LE_Transfer_Event(SPP_EVT_LE_CLOSE_FILE);
+                                    }
+
+                                    if((!LETransferAvailable(ConnectionInfo)) || ((LEStagingFileHead - LEStagingFileTail) >= LE_STAGING_FILES))
                                     {
-                                       error[0] = PWV_ERROR_FILE_OPEN_FAIL;
-                                       PWVSendData(BluetoothStackID, DeviceInfo, 1, error);
+                                       error[0] = PWV_ERROR_TRANSFER_BUSY;
+                                       PWVSendData(BluetoothStackID, ConnectionInfo->ConnectionID, DeviceInfo, 1, error);
+                                       break;
                                     }
+                                    le_transfer_ConnectionID = ConnectionInfo->ConnectionID;
+                                    le_transfer_DeviceInfo   = DeviceInfo;
+                                    slogf(LOG_DEST_BOTH, "Open file");
+                                    RTC_GetElapsedTime(&LETransferStartTime);
+
+                                    /* Start the new file on a block      */
+                                    /* boundary of the ring.              */
+                                    StagingFile = &LEStagingFiles[LEStagingFileHead & (LE_STAGING_FILES - 1)];
+                                    memcpy(StagingFile->FilePath, value_array+2, min(value_array[1], FILEPATH_LE_MAX_LENGTH - 1));
+                                    StagingFile->FilePath[min(value_array[1], FILEPATH_LE_MAX_LENGTH - 1)] = '\0';
+                                    LEStagingHead          = (LEStagingHead + LE_TRANSFER_BLOCK_SIZE - 1) & ~(LE_TRANSFER_BLOCK_SIZE - 1);
+                                    StagingFile->OpenIndex = LEStagingHead;
+                                    StagingFile->Closed    = FALSE;
+                                    LEStagingFileHead++;
+                                    LEReceiveOpen          = TRUE;
+                                    Set_LE_Transfer_Event(SPP_EVT_LE_OPEN_FILE);
+                                    Set_SPP_Event(SPP_EVT_LE_TRANSFER_START);
                                     break;
                                  case PWV_CMD_CLOSE_FILE:
-                                    RTC_GetElapsedTime(&LETransferEndTime);
                                     slogf(LOG_DEST_BOTH, "Close file");
-                                    slogf(LOG_DEST_BOTH, "File transfer time: %d", LETransferEndTime - LETransferStartTime);
-                                    f_close(&fp_download);
+                                    if((LEReceiveOpen) && (le_transfer_ConnectionID == ConnectionInfo->ConnectionID))
+                                    {
+                                       LEStagingClose();
+                                       Set_LE_Transfer_Event(SPP_EVT_LE_CLOSE_FILE);
+                                    }
+                                    break;
+                                 case PWV_CMD_GET_LINK_PARAMS:
+                                    PWVSendLinkParams(ConnectionInfo, DeviceInfo);
                                     break;
                                  default:
                                     break;
                               }    
-                              le_transfer_DeviceInfo = DeviceInfo;
                               break;
                            case PWV_CONTROL_POINT_CHARACTERISTIC_CCD_ATTRIBUTE_OFFSET:
                               /* Cache the previous CCD Value.       */
@@ -5939,6 +6942,8 @@ static void BTPSAPI GATT_ServerEventCallback(unsigned int BluetoothStackID, GATT
 
                               /* Note the updated Control Point CCCD Value.     */
                               DeviceInfo->ServerInfo.Control_Point_Client_Configuration_Descriptor = Value;
+                              if(PreviousValue != Value)
+                                 SaveDeviceInfoConfiguration(DeviceInfo);
 
                               /* If we were not previously configured*/
                               /* for notifications send the initial  */
@@ -5948,22 +6953,47 @@ static void BTPSAPI GATT_ServerEventCallback(unsigned int BluetoothStackID, GATT
                                  
                               }
                               break;
+                           case PWV_RX_CREDITS_CHARACTERISTIC_CCD_ATTRIBUTE_OFFSET:
+                              if(DeviceInfo->ServerInfo.Rx_Credit_Client_Configuration_Descriptor != Value)
+                              {
+                                 DeviceInfo->ServerInfo.Rx_Credit_Client_Configuration_Descriptor = Value;
+                                 SaveDeviceInfoConfiguration(DeviceInfo);
+                              }
+                              break;
+                           case PWV_TX_CREDITS_CHARACTERISTIC_ATTRIBUTE_OFFSET:
+                              /* The peer grants more notifications, the */
+                              /* first grant turns credit flow control on*/
+                              /* for the connection.                     */
+                              if(GATT_ServerEventData->Event_Data.GATT_Write_Request_Data->AttributeValueLength == PWV_TX_CREDIT_VALUE_LENGTH)
+                              {
+                                 PWVTxCreditsGrant(&(ConnectionInfo->TxCredits), Value);
+                                 if(le_transfer_ConnectionID == ConnectionInfo->ConnectionID)
+                                    Set_LE_Transfer_Event(SPP_EVT_LE_TX_CREDITS);
+                              }
+                              break;
                            case PWV_FILE_WRITE_CHARACTERISTIC_ATTRIBUTE_OFFSET:
-                              if(fp_download.fs != 0)
+                              if((LEReceiveOpen) && (le_transfer_ConnectionID == ConnectionInfo->ConnectionID))
                               {
-                                 slogf(LOG_DEST_BOTH, "Write data");
-                                 res = f_write(&fp_download, (void *) GATT_ServerEventData->Event_Data.GATT_Write_Request_Data->AttributeValue, GATT_ServerEventData->Event_Data.GATT_Write_Request_Data->AttributeValueLength, &written);
-                                 if(res != FR_OK)
+                                 /* Only stage the data here, the eMMC   */
+                                 /* write would stall the stack.         */
+                                 if(!LEStagingPut(GATT_ServerEventData->Event_Data.GATT_Write_Request_Data->AttributeValue, GATT_ServerEventData->Event_Data.GATT_Write_Request_Data->AttributeValueLength))
                                  {
+                                    /* The peer wrote past its Rx credits.*/
                                     error[0] = PWV_ERROR_FILE_WRITE_FAIL;
-                                    PWVSendData(BluetoothStackID, DeviceInfo, 1, error);
+                                    PWVSendData(BluetoothStackID, ConnectionInfo->ConnectionID, DeviceInfo, 1, error);
+                                 }
+                                 else if(((LEStagingHead - LEStagingTail) >= LE_TRANSFER_BLOCK_SIZE) && (!LEStagingSignalled))
+                                 {
+                                    /* A dropped wake-up leaves the flag  */
+                                    /* clear, the next write tries again. */
+                                    LEStagingSignalled = Set_LE_Transfer_Event(SPP_EVT_LE_STAGING_DATA);
                                  }
                               }
                               else
                               {
                                  slogf(LOG_DEST_BOTH, "File not open");
                                  error[0] = PWV_ERROR_FILE_NOT_OPEN;
-                                 PWVSendData(BluetoothStackID, DeviceInfo, 1, error);
+                                 PWVSendData(BluetoothStackID, ConnectionInfo->ConnectionID, DeviceInfo, 1, error);
                               }
                               break;
                         }
@@ -6181,7 +7211,7 @@ static void BTPSAPI GAP_Event_Callback(unsigned int BluetoothStackID, GAP_Event_
                     Display(("Error storing Link!\r\n"));
                   }
                   
-                  SPP_event = SPP_EVT_EDR_PAIR_COMPLETE;
+                  Set_SPP_Event(SPP_EVT_EDR_PAIR_COMPLETE);
                   break;
                case atIOCapabilityRequest:
 #ifdef CONSOLE_SUPPORT                  
@@ -6412,6 +7442,7 @@ static void BTPSAPI SPP_Event_Callback(unsigned int BluetoothStackID, SPP_Event_
 #endif // CONSOLE_SUPPORT
    Boolean_t Done;
    uint32_t TimeFromLastConnect;
+   osThreadId TransmitWaiter;
 
    /* **** SEE SPPAPI.H for a list of all possible event types.  This   */
    /* program only services its required events.                   **** */
@@ -6538,7 +7569,7 @@ static void BTPSAPI SPP_Event_Callback(unsigned int BluetoothStackID, SPP_Event_
             //eMMC_TurnOff = TRUE;
             SPPOpened = FALSE;
             RTC_InitTime();
-            SPP_event = SPP_EVT_SPP_DISCONNECT;
+            Set_SPP_Event(SPP_EVT_SPP_DISCONNECT);
             /*
             if (!Settings.FTP_AuthenticationTimeout) {
               // Lock FTP server if timeout is set to 0
@@ -6659,8 +7690,10 @@ static void BTPSAPI SPP_Event_Callback(unsigned int BluetoothStackID, SPP_Event_
                else
                {
                  if (FTPModeActive) {
-                   /* Read as much data as possible.                  */
-                   if((TempLength = SPP_Data_Read(BluetoothStackID, SerialPortID, (Word_t)sizeof(Buffer)-1, (Byte_t *)Buffer)) > 0)
+                   /* Read one frame at a time until the receive buffer */
+                   /* is empty, so the credits go back to the peer      */
+                   /* without waiting for its next frame.               */
+                   while((TempLength = SPP_Data_Read(BluetoothStackID, SerialPortID, (Word_t)sizeof(Buffer)-1, (Byte_t *)Buffer)) > 0)
                    {
                      if (pWriteABuffer == BT_WriteABuffer) { 
                       HandleASuccessfulRead((char *)Buffer,TempLength);
@@ -6685,8 +7718,16 @@ static void BTPSAPI SPP_Event_Callback(unsigned int BluetoothStackID, SPP_Event_
             ret_val = SPP_Respond_Port_Information(BluetoothStackID, SPP_Event_Data->Event_Data.SPP_Send_Port_Information_Indication_Data->SerialPortID, &SPP_Event_Data->Event_Data.SPP_Send_Port_Information_Indication_Data->SPPPortInformation);
             break;
          case etPort_Transmit_Buffer_Empty_Indication:
-            /* The transmit buffer is now empty after being full.  Next */
-            /* check the current application state.                     */
+            /* The transmit buffer is now empty after being full, wake  */
+            /* BT_WriteABuffer() if it is waiting to send the rest of a */
+            /* frame.                                                   */
+            if((TransmitWaiter = SPPTransmitWaiter) != NULL)
+            {
+               SPPTransmitWaiter = NULL;
+               xTaskNotifyGive(TransmitWaiter);
+            }
+
+            /* Next check the current application state.                */
             if(SendInfo.BytesToSend)
             {
                /* Send the remainder of the last attempt.               */
@@ -6859,6 +7900,7 @@ static void BTPSAPI GAP_LE_Event_Callback(unsigned int BluetoothStackID, GAP_LE_
    BoardStr_t                                    BoardStr;
    unsigned int                                  Index;
    DeviceInfo_t                                 *DeviceInfo;
+   ConnectionInfo_t                             *ConnectionInfo;
    Long_Term_Key_t                               GeneratedLTK;
    GAP_LE_Security_Information_t                 GAP_LE_Security_Information;
    GAP_LE_Advertising_Report_Data_t             *DeviceEntryPtr;
@@ -6930,25 +7972,39 @@ static void BTPSAPI GAP_LE_Event_Callback(unsigned int BluetoothStackID, GAP_LE_
 
                if(GAP_LE_Event_Data->Event_Data.GAP_LE_Connection_Complete_Event_Data->Status == HCI_ERROR_CODE_NO_ERROR)
                {
+                  /* HIDS: Save the Connection Information.                   */
+                  if((ConnectionInfo = CreateLEConnection(GAP_LE_Event_Data->Event_Data.GAP_LE_Connection_Complete_Event_Data->Peer_Address_Type, GAP_LE_Event_Data->Event_Data.GAP_LE_Connection_Complete_Event_Data->Peer_Address)) == NULL)
+                  {
+                     /* Every connection entry is in use.               */
+                     slogf(LOG_DEST_BOTH, "LE connection refused, %u in use", MAX_LE_CONNECTIONS);
+                     GAP_LE_Disconnect(BluetoothStackID, GAP_LE_Event_Data->Event_Data.GAP_LE_Connection_Complete_Event_Data->Peer_Address);
+                     break;
+                  }
+
+                  /* Log how long the central took to come back.      */
+                  if(AdvertiseReconnectPending)
+                  {
+                     slogf(LOG_DEST_BOTH, "Reconnect latency %u ms (%s)", (unsigned int)(xTaskGetTickCount() - AdvertiseReconnectTick), (AdvertiseDirectedBursts)?"directed":"undirected");
+                     AdvertiseReconnectPending = FALSE;
+                  }
+                  AdvertiseDirectedBursts = 0;
+
                   ConnectionBD_ADDR   = GAP_LE_Event_Data->Event_Data.GAP_LE_Connection_Complete_Event_Data->Peer_Address;
                   LocalDeviceIsMaster = GAP_LE_Event_Data->Event_Data.GAP_LE_Connection_Complete_Event_Data->Master;
-                  
-                  /* HIDS: Save the Connection Information.                   */
-                  ApplicationStateInfo.Flags                        |= APPLICATION_STATE_INFO_FLAGS_LE_CONNECTED;
-                  ApplicationStateInfo.LEConnectionInfo.Flags        = CONNECTION_INFO_FLAGS_CONNECTION_VALID;
-                  ApplicationStateInfo.LEConnectionInfo.BD_ADDR      = GAP_LE_Event_Data->Event_Data.GAP_LE_Connection_Complete_Event_Data->Peer_Address;
-                  ApplicationStateInfo.LEConnectionInfo.AddressType  = GAP_LE_Event_Data->Event_Data.GAP_LE_Connection_Complete_Event_Data->Peer_Address_Type;
+
+                  ConnectionInfo->ConnectionInterval = GAP_LE_Event_Data->Event_Data.GAP_LE_Connection_Complete_Event_Data->Current_Connection_Parameters.Connection_Interval;
 
                   /* Make sure that no entry already exists.            */
-                  if((DeviceInfo = SearchLEDeviceInfoEntryByBD_ADDR(&DeviceInfoList, GAP_LE_Event_Data->Event_Data.GAP_LE_Connection_Complete_Event_Data->Peer_Address_Type, GAP_LE_Event_Data->Event_Data.GAP_LE_Connection_Complete_Event_Data->Peer_Address)) == NULL)
+                  if((DeviceInfo = SearchLEDeviceInfoEntryByBD_ADDR(GAP_LE_Event_Data->Event_Data.GAP_LE_Connection_Complete_Event_Data->Peer_Address_Type, GAP_LE_Event_Data->Event_Data.GAP_LE_Connection_Complete_Event_Data->Peer_Address)) == NULL)
                   {
                      Display(("New device"));
                      /* No entry exists so create one.                  */
-                     if(!CreateNewDeviceInfoEntry(&DeviceInfoList, GAP_LE_Event_Data->Event_Data.GAP_LE_Connection_Complete_Event_Data->Peer_Address_Type, ConnectionBD_ADDR))
+                     if(!CreateNewDeviceInfoEntry(GAP_LE_Event_Data->Event_Data.GAP_LE_Connection_Complete_Event_Data->Peer_Address_Type, ConnectionBD_ADDR))
                         Display(("Failed to add device to Device Info List.\r\n"));
                   }
                   else
                   {
+                     TouchDeviceInfoEntry(DeviceInfo);
                     
                      /* HIDS: We have paired with this device previously.*/
                      /* Therefore we will start a timer and if the       */
@@ -6959,7 +8015,7 @@ static void BTPSAPI GAP_LE_Event_Callback(unsigned int BluetoothStackID, GAP_LE_
                      {
                         slogf(LOG_DEST_BOTH, "Start security timer");
                         /* Save the Security Timer ID.                  */
-                        ApplicationStateInfo.LEConnectionInfo.SecurityTimerID = (unsigned int)Result;
+                        ConnectionInfo->SecurityTimerID = (unsigned int)Result;
                      }
                      else
                         Display(("Error - BSC_StartTimer() returned %d.\r\n", Result));
@@ -6999,14 +8055,11 @@ static void BTPSAPI GAP_LE_Event_Callback(unsigned int BluetoothStackID, GAP_LE_
                      }
                   } 
                } 
-               else  
+               else if(GAP_LE_Event_Data->Event_Data.GAP_LE_Connection_Complete_Event_Data->Status == HCI_ERROR_CODE_DIRECTED_ADVERTISING_TIMEOUT)
                {
-
-                    /* Clear the LE Connection Information.               */
-                    BTPS_MemInitialize(&(ApplicationStateInfo.LEConnectionInfo), 0, sizeof(ApplicationStateInfo.LEConnectionInfo));
-
-                    /* Clear the LE Connection Flag.                      */
-                    ApplicationStateInfo.Flags &= ~APPLICATION_STATE_INFO_FLAGS_LE_CONNECTED;
+                  /* A directed advertising burst ended unanswered.     */
+                  AdvertiseDirectedTimeoutTick = xTaskGetTickCount();
+                  Set_SPP_Event(SPP_EVT_LE_DIRECTED_TIMEOUT);
                }
             }
             BTActivity++;
@@ -7014,10 +8067,22 @@ static void BTPSAPI GAP_LE_Event_Callback(unsigned int BluetoothStackID, GAP_LE_
          case etLE_Disconnection_Complete:
             Display(("etLE_Disconnection_Complete with size %d.\r\n", (int)GAP_LE_Event_Data->Event_Data_Size));
 
-            SPP_event = SPP_EVT_LE_DISCONNECT;
-            
+            Set_SPP_Event(SPP_EVT_LE_DISCONNECT);
+
             if(GAP_LE_Event_Data->Event_Data.GAP_LE_Disconnection_Complete_Event_Data)
             {
+               ConnectionInfo = SearchLEConnectionByBD_ADDR(GAP_LE_Event_Data->Event_Data.GAP_LE_Disconnection_Complete_Event_Data->Peer_Address);
+
+               /* If this connection owned the file transfer have the   */
+               /* worker commit and close a file still being received.  */
+               if((ConnectionInfo) && (ConnectionInfo->ConnectionID) && (ConnectionInfo->ConnectionID == le_transfer_ConnectionID))
+               {
+                  if(LEReceiveOpen)
+                     LEStagingClose();
+                  Set_LE_Transfer_Event(SPP_EVT_LE_DISCONNECT);
+                  le_transfer_ConnectionID = 0;
+               }
+
                Display(("   Status: 0x%02X.\r\n", GAP_LE_Event_Data->Event_Data.GAP_LE_Disconnection_Complete_Event_Data->Status));
                Display(("   Reason: 0x%02X.\r\n", GAP_LE_Event_Data->Event_Data.GAP_LE_Disconnection_Complete_Event_Data->Reason));
 
@@ -7026,26 +8091,19 @@ static void BTPSAPI GAP_LE_Event_Callback(unsigned int BluetoothStackID, GAP_LE_
 
                /* Check to see if the device info is present in the     */
                /* list.                                                 */
-               if((DeviceInfo = SearchLEDeviceInfoEntryByBD_ADDR(&DeviceInfoList, GAP_LE_Event_Data->Event_Data.GAP_LE_Disconnection_Complete_Event_Data->Peer_Address_Type, GAP_LE_Event_Data->Event_Data.GAP_LE_Disconnection_Complete_Event_Data->Peer_Address)) != NULL)  
+               if((DeviceInfo = SearchLEDeviceInfoEntryByBD_ADDR(GAP_LE_Event_Data->Event_Data.GAP_LE_Disconnection_Complete_Event_Data->Peer_Address_Type, GAP_LE_Event_Data->Event_Data.GAP_LE_Disconnection_Complete_Event_Data->Peer_Address)) != NULL)  
                {
                  
                   /* Check to see if the link is encrypted.  If it isn't*/
                   /* we will delete the device structure.               */
-                  if(!(ApplicationStateInfo.LEConnectionInfo.Flags & CONNECTION_INFO_FLAGS_CONNECTION_ENCRYPTED))
+                  if((!ConnectionInfo) || (!(ConnectionInfo->Flags & CONNECTION_INFO_FLAGS_CONNECTION_ENCRYPTED)))
                   {
                      /* Connection is not encrypted so delete the device*/
                      /* structure.                                      */
-                     //DeviceInfo = DeleteLEDeviceInfoEntry(&DeviceInfoList, DeviceInfo->ConnectionAddressType, DeviceInfo->ConnectionBD_ADDR);
+                     //DeviceInfo = DeleteLEDeviceInfoEntry(DeviceInfo->ConnectionAddressType, DeviceInfo->ConnectionBD_ADDR);
                      //if(DeviceInfo)
                      //   FreeDeviceInfoEntryMemory(DeviceInfo);
                   }
-                  
-
-                  /* Clear the LE Connection Information.                  */
-                  BTPS_MemInitialize(&(ApplicationStateInfo.LEConnectionInfo), 0, sizeof(ApplicationStateInfo.LEConnectionInfo));
-
-                  /* Clear the LE Connection Flag.                         */
-                  ApplicationStateInfo.Flags &= ~APPLICATION_STATE_INFO_FLAGS_LE_CONNECTED;
                    
                   /* Flag that no service discovery operation is        */
                   /* outstanding for this device.                       */
@@ -7055,7 +8113,7 @@ static void BTPSAPI GAP_LE_Event_Callback(unsigned int BluetoothStackID, GAP_LE_
                   /* link will be encrypted iff the device is paired.   */
                    if(GAPEncryptionMode == emDisabled)
                   {
-                  //    DeviceInfo = DeleteDeviceInfoEntry(&DeviceInfoList, ConnectionBD_ADDR);
+                  //    DeviceInfo = DeleteDeviceInfoEntry(ConnectionBD_ADDR);
                   //        if(NULL != DeviceInfo)
                   //        {
                   //                FreeDeviceInfoEntryMemory(DeviceInfo);
@@ -7066,12 +8124,43 @@ static void BTPSAPI GAP_LE_Event_Callback(unsigned int BluetoothStackID, GAP_LE_
                else
                   Display(("Warning - Disconnect from unknown device.\r\n"));
 
-               /* Clear the saved Connection BD_ADDR.                   */
-               ASSIGN_BD_ADDR(ConnectionBD_ADDR, 0, 0, 0, 0, 0, 0);
-               LocalDeviceIsMaster = FALSE;
-               GAPEncryptionMode = emDisabled;
+               /* Clear the LE Connection Information.                  */
+               if(ConnectionInfo)
+                  DeleteLEConnection(ConnectionInfo);
+
+               /* Clear the saved Connection BD_ADDR if it was this     */
+               /* device.                                               */
+               if(COMPARE_BD_ADDR(ConnectionBD_ADDR, GAP_LE_Event_Data->Event_Data.GAP_LE_Disconnection_Complete_Event_Data->Peer_Address))
+               {
+                  ASSIGN_BD_ADDR(ConnectionBD_ADDR, 0, 0, 0, 0, 0, 0);
+                  LocalDeviceIsMaster = FALSE;
+                  GAPEncryptionMode = emDisabled;
+               }
+            }
+
+            /* Advertising may still be running for a free connection.  */
+            if(AdvertisingStatus)
+               AdvertiseLEDisable();
+            AdvertiseLEReconnect();
+            break;
+         case etLE_Connection_Parameter_Update_Response:
+            if((GAP_LE_Event_Data->Event_Data.GAP_LE_Connection_Parameter_Update_Response_Event_Data) && (!GAP_LE_Event_Data->Event_Data.GAP_LE_Connection_Parameter_Update_Response_Event_Data->Accepted))
+            {
+               /* Rejected, ask again after another idle period or with */
+               /* the next policy change.                               */
+               slogf(LOG_DEST_BOTH, "LE connection parameters rejected");
+               LELinkSpeedRetryLater(SearchLEConnectionByBD_ADDR(GAP_LE_Event_Data->Event_Data.GAP_LE_Connection_Parameter_Update_Response_Event_Data->BD_ADDR));
+            }
+            break;
+         case etLE_Connection_Parameter_Updated:
+            if((GAP_LE_Event_Data->Event_Data.GAP_LE_Connection_Parameter_Updated_Event_Data) && (GAP_LE_Event_Data->Event_Data.GAP_LE_Connection_Parameter_Updated_Event_Data->Status == HCI_ERROR_CODE_NO_ERROR))
+            {
+               if((ConnectionInfo = SearchLEConnectionByBD_ADDR(GAP_LE_Event_Data->Event_Data.GAP_LE_Connection_Parameter_Updated_Event_Data->BD_ADDR)) != NULL)
+                  ConnectionInfo->ConnectionInterval = GAP_LE_Event_Data->Event_Data.GAP_LE_Connection_Parameter_Updated_Event_Data->Current_Connection_Parameters.Connection_Interval;
+               slogf(LOG_DEST_BOTH, "LE connection interval %u ms, latency %u, supervision %u ms", GAP_LE_Event_Data->Event_Data.GAP_LE_Connection_Parameter_Updated_Event_Data->Current_Connection_Parameters.Connection_Interval,
+                     GAP_LE_Event_Data->Event_Data.GAP_LE_Connection_Parameter_Updated_Event_Data->Current_Connection_Parameters.Slave_Latency,
+                     GAP_LE_Event_Data->Event_Data.GAP_LE_Connection_Parameter_Updated_Event_Data->Current_Connection_Parameters.Supervision_Timeout);
             }
-            AdvertiseLEEnable(0);
             break;
          
                         
@@ -7079,18 +8168,22 @@ static void BTPSAPI GAP_LE_Event_Callback(unsigned int BluetoothStackID, GAP_LE_
          case etLE_Encryption_Change:
             Display(("etLE_Encryption_Change with size %d.\r\n",(int)GAP_LE_Event_Data->Event_Data_Size));
              /* Verify that the link is currently encrypted.             */
+            if((ConnectionInfo = SearchLEConnectionByBD_ADDR(GAP_LE_Event_Data->Event_Data.GAP_LE_Encryption_Change_Event_Data->BD_ADDR)) == NULL)
+               break;
             if((GAP_LE_Event_Data->Event_Data.GAP_LE_Encryption_Change_Event_Data->Encryption_Change_Status == HCI_ERROR_CODE_NO_ERROR) && (GAP_LE_Event_Data->Event_Data.GAP_LE_Encryption_Change_Event_Data->Encryption_Mode == emEnabled))
-               ApplicationStateInfo.LEConnectionInfo.Flags |= CONNECTION_INFO_FLAGS_CONNECTION_ENCRYPTED;
+               ConnectionInfo->Flags |= CONNECTION_INFO_FLAGS_CONNECTION_ENCRYPTED;
             else
-               ApplicationStateInfo.LEConnectionInfo.Flags &= ~CONNECTION_INFO_FLAGS_CONNECTION_ENCRYPTED;
+               ConnectionInfo->Flags &= ~CONNECTION_INFO_FLAGS_CONNECTION_ENCRYPTED;
             break;
          case etLE_Encryption_Refresh_Complete:
             Display(("etLE_Encryption_Refresh_Complete with size %d.\r\n", (int)GAP_LE_Event_Data->Event_Data_Size));
             /* Verify that the link is currently encrypted.             */
+            if((ConnectionInfo = SearchLEConnectionByBD_ADDR(GAP_LE_Event_Data->Event_Data.GAP_LE_Encryption_Refresh_Complete_Event_Data->BD_ADDR)) == NULL)
+               break;
             if(GAP_LE_Event_Data->Event_Data.GAP_LE_Encryption_Refresh_Complete_Event_Data->Status == HCI_ERROR_CODE_NO_ERROR)
-               ApplicationStateInfo.LEConnectionInfo.Flags |= CONNECTION_INFO_FLAGS_CONNECTION_ENCRYPTED;
+               ConnectionInfo->Flags |= CONNECTION_INFO_FLAGS_CONNECTION_ENCRYPTED;
             else
-               ApplicationStateInfo.LEConnectionInfo.Flags &= ~CONNECTION_INFO_FLAGS_CONNECTION_ENCRYPTED;
+               ConnectionInfo->Flags &= ~CONNECTION_INFO_FLAGS_CONNECTION_ENCRYPTED;
             break;
          case etLE_Authentication:
             Display(("etLE_Authentication with size %d.\r\n", (int)GAP_LE_Event_Data->Event_Data_Size));
@@ -7101,6 +8194,9 @@ static void BTPSAPI GAP_LE_Event_Callback(unsigned int BluetoothStackID, GAP_LE_
             {
                BD_ADDRToStr(Authentication_Event_Data->BD_ADDR, BoardStr);
 
+               /* Find the connection being authenticated.              */
+               ConnectionInfo = SearchLEConnectionByBD_ADDR(Authentication_Event_Data->BD_ADDR);
+
                switch(Authentication_Event_Data->GAP_LE_Authentication_Event_Type)
                {
                   case latLongTermKeyRequest:
@@ -7140,10 +8236,10 @@ static void BTPSAPI GAP_LE_Event_Callback(unsigned int BluetoothStackID, GAP_LE_
                         /* Master is trying to re-encrypt the Link so   */
                         /* therefore we should cancel the Security Timer*/
                         /* if it is active.                             */
-                        if(ApplicationStateInfo.LEConnectionInfo.SecurityTimerID)
+                        if((ConnectionInfo) && (ConnectionInfo->SecurityTimerID))
                         {
-                           BSC_StopTimer(BluetoothStackID, ApplicationStateInfo.LEConnectionInfo.SecurityTimerID);
-                           ApplicationStateInfo.LEConnectionInfo.SecurityTimerID = 0;
+                           BSC_StopTimer(BluetoothStackID, ConnectionInfo->SecurityTimerID);
+                           ConnectionInfo->SecurityTimerID = 0;
                         }
                         
                      }
@@ -7164,7 +8260,7 @@ static void BTPSAPI GAP_LE_Event_Callback(unsigned int BluetoothStackID, GAP_LE_
                      /* device. If we have paired we will attempt to    */
                      /* re-establish security using a previously        */
                      /* exchanged LTK.                                  */
-                     if((DeviceInfo = SearchLEDeviceInfoEntryByBD_ADDR(&DeviceInfoList, GAP_LE_Event_Data->Event_Data.GAP_LE_Disconnection_Complete_Event_Data->Peer_Address_Type, GAP_LE_Event_Data->Event_Data.GAP_LE_Disconnection_Complete_Event_Data->Peer_Address)) != NULL)
+                     if((DeviceInfo = SearchLEDeviceInfoEntryByBD_ADDR(GAP_LE_Event_Data->Event_Data.GAP_LE_Disconnection_Complete_Event_Data->Peer_Address_Type, GAP_LE_Event_Data->Event_Data.GAP_LE_Disconnection_Complete_Event_Data->Peer_Address)) != NULL)
                      {
                         /* Determine if a Valid Long Term Key is stored */
                         /* for this device.                             */
@@ -7214,10 +8310,10 @@ static void BTPSAPI GAP_LE_Event_Callback(unsigned int BluetoothStackID, GAP_LE_
                      /* Master is trying to pair with us so therefore we*/
                      /* should cancel the Security Timer if it is       */
                      /* active.                                         */
-                     if(ApplicationStateInfo.LEConnectionInfo.SecurityTimerID)
+                     if((ConnectionInfo) && (ConnectionInfo->SecurityTimerID))
                      {
-                        BSC_StopTimer(BluetoothStackID, ApplicationStateInfo.LEConnectionInfo.SecurityTimerID);
-                        ApplicationStateInfo.LEConnectionInfo.SecurityTimerID = 0;
+                        BSC_StopTimer(BluetoothStackID, ConnectionInfo->SecurityTimerID);
+                        ConnectionInfo->SecurityTimerID = 0;
                      }
 
                      /* This is a pairing request. Respond with a       */
@@ -7256,9 +8352,12 @@ static void BTPSAPI GAP_LE_Event_Callback(unsigned int BluetoothStackID, GAP_LE_
                            Display(("Respond with: PassKeyResponse [passkey].\r\n"));
 
                            /* Flag that we are awaiting a Passkey Input.*/
-                           ApplicationStateInfo.LEConnectionInfo.Flags         |= CONNECTION_INFO_FLAGS_CONNECTION_AWAITING_PASSKEY;
-                           ApplicationStateInfo.LEConnectionInfo.PasskeyDigits  = 0;
-                           ApplicationStateInfo.LEConnectionInfo.Passkey        = 0;
+                           if(ConnectionInfo)
+                           {
+                              ConnectionInfo->Flags         |= CONNECTION_INFO_FLAGS_CONNECTION_AWAITING_PASSKEY;
+                              ConnectionInfo->PasskeyDigits  = 0;
+                              ConnectionInfo->Passkey        = 0;
+                           }
                         }
                         else
                         {
@@ -7282,9 +8381,11 @@ static void BTPSAPI GAP_LE_Event_Callback(unsigned int BluetoothStackID, GAP_LE_
                         GAP_LE_Disconnect(BluetoothStackID, Authentication_Event_Data->BD_ADDR);
 
                         /* Delete the stored device info structure.     */
-                        if((DeviceInfo = DeleteLEDeviceInfoEntry(&DeviceInfoList, ApplicationStateInfo.LEConnectionInfo.AddressType, ApplicationStateInfo.LEConnectionInfo.BD_ADDR)) != NULL)
+                        if((ConnectionInfo) && ((DeviceInfo = DeleteLEDeviceInfoEntry(ConnectionInfo->AddressType, ConnectionInfo->BD_ADDR)) != NULL))
+                        {
+                           SaveDeviceInfoDeletion(DeviceInfo);
                            FreeDeviceInfoEntryMemory(DeviceInfo);
-                        SaveDeviceInfoList();
+                        }
                      }
                      break;
                   case latPairingStatus:
@@ -7301,11 +8402,18 @@ static void BTPSAPI GAP_LE_Event_Callback(unsigned int BluetoothStackID, GAP_LE_
 
                         /* Search for the Device entry for our current  */
                         /* LE connection.                               */
-                        if((DeviceInfo = SearchLEDeviceInfoEntryByBD_ADDR(&DeviceInfoList, ApplicationStateInfo.LEConnectionInfo.AddressType, ApplicationStateInfo.LEConnectionInfo.BD_ADDR)) != NULL)
+                        if((DeviceInfo = SearchLEConnectionDeviceInfo(ConnectionInfo)) != NULL)
                         {
                            /* Save the encryption key size.             */
                            DeviceInfo->EncryptionKeySize = Authentication_Event_Data->Authentication_Event_Data.Pairing_Status.Negotiated_Encryption_Key_Size;
                            SPP_Paired_Device = DeviceInfo;
+
+                           /* Only a new bond may evict an older one.   */
+                           LimitBondedDeviceInfoEntries(DeviceInfo, TRUE);
+
+                           /* Pairing LE successful so save Device      */
+                           /* pairing data.                             */
+                           SaveDeviceInfoEntry(DeviceInfo);
                         }
                         
                         
@@ -7313,10 +8421,7 @@ static void BTPSAPI GAP_LE_Event_Callback(unsigned int BluetoothStackID, GAP_LE_
                         /* connection                                   */
                         //GAP_LE_Query_Encryption_Mode(BluetoothStackID, ConnectionBD_ADDR, &GAPEncryptionMode);
                         
-                        /* Pairing LE successful so disable pairing     */
-                        /* capability and save Device pairing data      */
-                        SaveDeviceInfoList();
-                        SPP_event = SPP_EVT_LE_PAIR_COMPLETE;
+                        Set_SPP_Event(SPP_EVT_LE_PAIR_COMPLETE);
                      }
                      else
                      {             
@@ -7326,9 +8431,11 @@ static void BTPSAPI GAP_LE_Event_Callback(unsigned int BluetoothStackID, GAP_LE_
                         
                         /* Failed to pair so delete the key entry for   */
                         /* this device and disconnect the link.         */
-                        if((DeviceInfo = DeleteLEDeviceInfoEntry(&DeviceInfoList, ApplicationStateInfo.LEConnectionInfo.AddressType, ApplicationStateInfo.LEConnectionInfo.BD_ADDR)) != NULL)
+                        if((ConnectionInfo) && ((DeviceInfo = DeleteLEDeviceInfoEntry(ConnectionInfo->AddressType, ConnectionInfo->BD_ADDR)) != NULL))
+                        {
+                           SaveDeviceInfoDeletion(DeviceInfo);
                            FreeDeviceInfoEntryMemory(DeviceInfo);
-                        SaveDeviceInfoList();
+                        }
                      }
                      break;
                   case latEncryptionInformationRequest:
@@ -7354,7 +8461,7 @@ static void BTPSAPI GAP_LE_Event_Callback(unsigned int BluetoothStackID, GAP_LE_
                      {
                         /* Search for the entry for this slave to store */
                         /* the information into.                        */
-                        if((DeviceInfo = SearchLEDeviceInfoEntryByBD_ADDR(&DeviceInfoList, GAP_LE_Event_Data->Event_Data.GAP_LE_Disconnection_Complete_Event_Data->Peer_Address_Type, GAP_LE_Event_Data->Event_Data.GAP_LE_Disconnection_Complete_Event_Data->Peer_Address)) != NULL)
+                        if((DeviceInfo = SearchLEDeviceInfoEntryByBD_ADDR(GAP_LE_Event_Data->Event_Data.GAP_LE_Disconnection_Complete_Event_Data->Peer_Address_Type, GAP_LE_Event_Data->Event_Data.GAP_LE_Disconnection_Complete_Event_Data->Peer_Address)) != NULL)
                         {
                            DeviceInfo->LTK               = Authentication_Event_Data->Authentication_Event_Data.Encryption_Information.LTK;
                            DeviceInfo->EDIV              = Authentication_Event_Data->Authentication_Event_Data.Encryption_Information.EDIV;
@@ -7373,12 +8480,11 @@ static void BTPSAPI GAP_LE_Event_Callback(unsigned int BluetoothStackID, GAP_LE_
 
                      /* Search for the Device entry for our current LE  */
                      /* connection.                                     */
-                     if((DeviceInfo = SearchLEDeviceInfoEntryByBD_ADDR(&DeviceInfoList, ApplicationStateInfo.LEConnectionInfo.AddressType, ApplicationStateInfo.LEConnectionInfo.BD_ADDR)) != NULL)
+                     if((DeviceInfo = SearchLEConnectionDeviceInfo(ConnectionInfo)) != NULL)
                      {
                         /* Store the received IRK and also updated the  */
                         /* BD_ADDR that is stored to the "Base" BD_ADDR.*/
-                        DeviceInfo->ConnectionAddressType  = Authentication_Event_Data->Authentication_Event_Data.Identity_Information.Address_Type;
-                        DeviceInfo->ConnectionBD_ADDR      = Authentication_Event_Data->Authentication_Event_Data.Identity_Information.Address;
+                        MoveDeviceInfoEntry(DeviceInfo, Authentication_Event_Data->Authentication_Event_Data.Identity_Information.Address_Type, Authentication_Event_Data->Authentication_Event_Data.Identity_Information.Address);
                         DeviceInfo->IRK          = Authentication_Event_Data->Authentication_Event_Data.Identity_Information.IRK;
                         DeviceInfo->Flags       |= DEVICE_INFO_FLAGS_IRK_VALID;
                      }
@@ -7421,8 +8527,9 @@ static void BTPSAPI GAP_LE_Event_Callback(unsigned int BluetoothStackID, GAP_LE_
    /*          outstanding.                                             */
 static void BTPSAPI GATT_Connection_Event_Callback(unsigned int BluetoothStackID, GATT_Connection_Event_Data_t *GATT_Connection_Event_Data, unsigned long CallbackParameter)
 {
-   BoardStr_t    BoardStr;
-   Byte_t        AlertLevel;
+   BoardStr_t        BoardStr;
+   Byte_t            AlertLevel;
+   ConnectionInfo_t *ConnectionInfo;
 
    /* Verify that all parameters to this callback are Semi-Valid.       */
    if((BluetoothStackID) && (GATT_Connection_Event_Data))
@@ -7433,9 +8540,6 @@ static void BTPSAPI GATT_Connection_Event_Callback(unsigned int BluetoothStackID
          case etGATT_Connection_Device_Connection:
             if(GATT_Connection_Event_Data->Event_Data.GATT_Device_Connection_Data)
             {
-               /* Save the Connection ID for later use.                 */
-               ConnectionID = GATT_Connection_Event_Data->Event_Data.GATT_Device_Connection_Data->ConnectionID;
-
                Display(("\r\netGATT_Connection_Device_Connection with size %u: \r\n", GATT_Connection_Event_Data->Event_Data_Size));
                BD_ADDRToStr(GATT_Connection_Event_Data->Event_Data.GATT_Device_Connection_Data->RemoteDevice, BoardStr);
                Display(("   Connection ID:   %u.\r\n", GATT_Connection_Event_Data->Event_Data.GATT_Device_Connection_Data->ConnectionID));
@@ -7443,19 +8547,27 @@ static void BTPSAPI GATT_Connection_Event_Callback(unsigned int BluetoothStackID
                Display(("   Remote Device:   %s.\r\n", BoardStr));
                Display(("   Connection MTU:  %u.\r\n", GATT_Connection_Event_Data->Event_Data.GATT_Device_Connection_Data->MTU));
 
-               ApplicationStateInfo.Flags                         |= APPLICATION_STATE_INFO_FLAGS_LE_CONNECTED;
-               ApplicationStateInfo.LEConnectionInfo.ConnectionID  = GATT_Connection_Event_Data->Event_Data.GATT_Device_Connection_Data->ConnectionID;
-               SPP_event = SPP_EVT_LE_CONNECT;
-               AdvertisingStatus = FALSE;
-               if(SearchLEDeviceInfoEntryByBD_ADDR(&DeviceInfoList, ApplicationStateInfo.LEConnectionInfo.AddressType, ApplicationStateInfo.LEConnectionInfo.BD_ADDR) != NULL)
+               /* Save the Connection ID for later use.                 */
+               if((ConnectionInfo = SearchLEConnectionByBD_ADDR(GATT_Connection_Event_Data->Event_Data.GATT_Device_Connection_Data->RemoteDevice)) != NULL)
                {
-                  if(LocalDeviceIsMaster)
-                  {
-                     /* Attempt to update the MTU to the maximum        */
-                     /* supported.                                      */
-                     GATT_Exchange_MTU_Request(BluetoothStackID, ConnectionID, BTPS_CONFIGURATION_GATT_MAXIMUM_SUPPORTED_MTU_SIZE, GATT_ClientEventCallback_LLS, 0);
-                  }
+                  ConnectionInfo->ConnectionID = GATT_Connection_Event_Data->Event_Data.GATT_Device_Connection_Data->ConnectionID;
+                  ConnectionInfo->MTU          = GATT_Connection_Event_Data->Event_Data.GATT_Device_Connection_Data->MTU;
+
+                  /* Notifications are not credit limited until the peer*/
+                  /* grants credits on this connection.                 */
+                  PWVTxCreditsReset(&(ConnectionInfo->TxCredits));
+
+                  /* Attempt to update the MTU to the preferred size in */
+                  /* either role, most centrals wait for the peripheral */
+                  /* to ask.                                            */
+                  if(ConnectionInfo->MTU < PWV_PREFERRED_MTU)
+                     GATT_Exchange_MTU_Request(BluetoothStackID, ConnectionInfo->ConnectionID, PWV_PREFERRED_MTU, GATT_ClientEventCallback_LLS, 0);
                }
+               else
+                  Display(("Warning - GATT connection from unknown device.\r\n"));
+
+               Set_SPP_Event(SPP_EVT_LE_CONNECT);
+               AdvertisingStatus = FALSE;
                
               
             }
@@ -7475,9 +8587,6 @@ static void BTPSAPI GATT_Connection_Event_Callback(unsigned int BluetoothStackID
          case etGATT_Connection_Device_Disconnection:
             if(GATT_Connection_Event_Data->Event_Data.GATT_Device_Disconnection_Data)
             {
-               /* Clear the Connection ID.                              */
-               ConnectionID = 0;
-
                Display(("\r\netGATT_Connection_Device_Disconnection with size %u: \r\n", GATT_Connection_Event_Data->Event_Data_Size));
                BD_ADDRToStr(GATT_Connection_Event_Data->Event_Data.GATT_Device_Disconnection_Data->RemoteDevice, BoardStr);
                Display(("   Connection ID:   %u.\r\n", GATT_Connection_Event_Data->Event_Data.GATT_Device_Disconnection_Data->ConnectionID));
@@ -7496,7 +8605,18 @@ static void BTPSAPI GATT_Connection_Event_Callback(unsigned int BluetoothStackID
                Display(("Error - Null Disconnection Data.\r\n"));
             break;
          case etGATT_Connection_Device_Buffer_Empty:
-            SPP_event = SPP_EVT_GATT_BUFFER_EMPTY;
+            /* Only the transfer worker waits for queue space.          */
+            if((GATT_Connection_Event_Data->Event_Data.GATT_Device_Buffer_Empty_Data) && (GATT_Connection_Event_Data->Event_Data.GATT_Device_Buffer_Empty_Data->ConnectionID == le_transfer_ConnectionID))
+               Set_LE_Transfer_Event(SPP_EVT_GATT_BUFFER_EMPTY);
+            break;
+         case etGATT_Connection_Device_Connection_MTU_Update:
+            if(GATT_Connection_Event_Data->Event_Data.GATT_Device_Connection_MTU_Update_Data)
+            {
+               if((ConnectionInfo = SearchLEConnectionByID(GATT_Connection_Event_Data->Event_Data.GATT_Device_Connection_MTU_Update_Data->ConnectionID)) != NULL)
+                  ConnectionInfo->MTU = GATT_Connection_Event_Data->Event_Data.GATT_Device_Connection_MTU_Update_Data->MTU;
+
+               slogf(LOG_DEST_BOTH, "LE MTU: %u", GATT_Connection_Event_Data->Event_Data.GATT_Device_Connection_MTU_Update_Data->MTU);
+            }
             break;
       }
 
@@ -7542,13 +8662,32 @@ static void BTPSAPI GATT_Connection_Event_Callback(unsigned int BluetoothStackID
 static void BTPSAPI BAS_Event_Callback(unsigned int BluetoothStackID, BAS_Event_Data_t *BAS_Event_Data, unsigned long CallbackParameter)
 {
    int           Result;
+   unsigned int  ConnectionID;
+   Word_t        PreviousValue;
    DeviceInfo_t *DeviceInfo;
 
    /* Verify that all parameters to this callback are Semi-Valid.       */
    if((BluetoothStackID) && (BAS_Event_Data))
    {
-      /* Search for the Device entry for our current LE connection.     */
-      if((DeviceInfo = SearchLEDeviceInfoEntryByBD_ADDR(&DeviceInfoList, ApplicationStateInfo.LEConnectionInfo.AddressType, ApplicationStateInfo.LEConnectionInfo.BD_ADDR)) != NULL)
+      /* Determine the LE connection the event is for.                  */
+      switch(BAS_Event_Data->Event_Data_Type)
+      {
+         case etBAS_Server_Read_Client_Configuration_Request:
+            ConnectionID = (BAS_Event_Data->Event_Data.BAS_Read_Client_Configuration_Data)?BAS_Event_Data->Event_Data.BAS_Read_Client_Configuration_Data->ConnectionID:0;
+            break;
+         case etBAS_Server_Client_Configuration_Update:
+            ConnectionID = (BAS_Event_Data->Event_Data.BAS_Client_Configuration_Update_Data)?BAS_Event_Data->Event_Data.BAS_Client_Configuration_Update_Data->ConnectionID:0;
+            break;
+         case etBAS_Server_Read_Battery_Level_Request:
+            ConnectionID = (BAS_Event_Data->Event_Data.BAS_Read_Battery_Level_Data)?BAS_Event_Data->Event_Data.BAS_Read_Battery_Level_Data->ConnectionID:0;
+            break;
+         default:
+            ConnectionID = 0;
+            break;
+      }
+
+      /* Search for the Device entry for this LE connection.            */
+      if((DeviceInfo = SearchLEConnectionDeviceInfo(SearchLEConnectionByID(ConnectionID))) != NULL)
       {
          /* Determine the Battery Service Event that occurred.          */
          switch(BAS_Event_Data->Event_Data_Type)
@@ -7569,10 +8708,13 @@ static void BTPSAPI BAS_Event_Callback(unsigned int BluetoothStackID, BAS_Event_
                   Display(("Battery Client Configuration Update: %s.\r\n", (BAS_Event_Data->Event_Data.BAS_Client_Configuration_Update_Data->Notify?"ENABLED":"DISABLED")));
 
                   /* Update the stored configuration for this device.   */
+                  PreviousValue = DeviceInfo->BASServerInformation.Battery_Level_Client_Configuration;
                   if(BAS_Event_Data->Event_Data.BAS_Client_Configuration_Update_Data->Notify)
                      DeviceInfo->BASServerInformation.Battery_Level_Client_Configuration = GATT_CLIENT_CONFIGURATION_CHARACTERISTIC_NOTIFY_ENABLE;
                   else
                      DeviceInfo->BASServerInformation.Battery_Level_Client_Configuration = 0;
+                  if(PreviousValue != DeviceInfo->BASServerInformation.Battery_Level_Client_Configuration)
+                     SaveDeviceInfoConfiguration(DeviceInfo);
                }
                break;
             case etBAS_Server_Read_Battery_Level_Request:
@@ -7654,7 +8796,7 @@ static void BTPSAPI IAS_EventCallback(unsigned int BluetoothStackID, IAS_Event_D
                Display(("   Connection Type:  %s.\r\n", ((IAS_Event_Data->Event_Data.IAS_Alert_Level_Control_Point_Command_Data->ConnectionType == gctLE)?"LE":"BR/EDR")));
                Display(("   Remote Device:    %s.\r\n", BoardStr));
 
-               if(SearchLEDeviceInfoEntryByBD_ADDR(&DeviceInfoList, ApplicationStateInfo.LEConnectionInfo.AddressType, ApplicationStateInfo.LEConnectionInfo.BD_ADDR) != NULL)
+               if(SearchLEConnectionDeviceInfo(SearchLEConnectionByID(IAS_Event_Data->Event_Data.IAS_Alert_Level_Control_Point_Command_Data->ConnectionID)) != NULL)
                {
                   /* Validate event parameters                          */
                   if(IAS_Event_Data->Event_Data.IAS_Alert_Level_Control_Point_Command_Data->InstanceID == IASInstanceID)
@@ -7752,7 +8894,7 @@ static void BTPSAPI LLS_EventCallback(unsigned int BluetoothStackID, LLS_Event_D
                Display(("   Remote Device:    %s.\r\n", BoardStr));
                Display(("   Alert Level:      %u.\r\n", LLS_Event_Data->Event_Data.LLS_Alert_Level_Update_Data->AlertLevel));
 
-               if(SearchLEDeviceInfoEntryByBD_ADDR(&DeviceInfoList, ApplicationStateInfo.LEConnectionInfo.AddressType, ApplicationStateInfo.LEConnectionInfo.BD_ADDR) != NULL)
+               if(SearchLEConnectionDeviceInfo(SearchLEConnectionByID(LLS_Event_Data->Event_Data.LLS_Alert_Level_Update_Data->ConnectionID)) != NULL)
                {
                   LLS_Set_Alert_Level(BluetoothStackID, LLSInstanceID, LLS_Event_Data->Event_Data.LLS_Alert_Level_Update_Data->AlertLevel);
                }
@@ -7858,7 +9000,7 @@ static void BTPSAPI GATT_ClientEventCallback_LLS(unsigned int BluetoothStackID,
                /* is.                                                   */
                if(ValueLength != 0)
                {
-                  if(((DeviceInfo = SearchLEDeviceInfoEntryByBD_ADDR(&DeviceInfoList, ApplicationStateInfo.LEConnectionInfo.AddressType, ApplicationStateInfo.LEConnectionInfo.BD_ADDR)) != NULL) && (CallbackParameter != 0))
+                  if(((DeviceInfo = SearchLEConnectionDeviceInfo(SearchLEConnectionByID(GATT_Client_Event_Data->Event_Data.GATT_Read_Response_Data->ConnectionID))) != NULL) && (CallbackParameter != 0))
                   {
                      if(CallbackParameter == DeviceInfo->LLS_ClientInfo.Alert_Level)
                      {
@@ -7937,24 +9079,37 @@ static void BTPSAPI GATT_ClientEventCallback_LLS(unsigned int BluetoothStackID,
    /* subsequent connections.                                           */
 static void BTPSAPI BSC_TimerCallback(unsigned int BluetoothStackID, unsigned int TimerID, unsigned long CallbackParameter)
 {
+   unsigned int      Index;
+   ConnectionInfo_t *ConnectionInfo = NULL;
+
    /* Verify that the input parameters are semi-valid.                  */
    if((BluetoothStackID) && (TimerID))
    {
+      /* Find the LE Connection the Security Timer belongs to.          */
+      for(Index = 0; Index < MAX_LE_CONNECTIONS; Index++)
+      {
+         if((ApplicationStateInfo.LEConnectionInfo[Index].Flags & CONNECTION_INFO_FLAGS_CONNECTION_VALID) && (ApplicationStateInfo.LEConnectionInfo[Index].SecurityTimerID == TimerID))
+         {
+            ConnectionInfo = &(ApplicationStateInfo.LEConnectionInfo[Index]);
+            break;
+         }
+      }
+
       /* Verify that the LE Connection is still active.                 */
-      if((ApplicationStateInfo.Flags & APPLICATION_STATE_INFO_FLAGS_LE_CONNECTED) && (ApplicationStateInfo.LEConnectionInfo.SecurityTimerID == TimerID))
+      if(ConnectionInfo)
       {
          /* Invalidate the Timer ID that just expired.                  */
-         ApplicationStateInfo.LEConnectionInfo.SecurityTimerID = 0;
+         ConnectionInfo->SecurityTimerID = 0;
 
          /* If the connection is not currently encrypted then we will   */
          /* send a Slave Security Request.                              */
-         if(!(ApplicationStateInfo.LEConnectionInfo.Flags & CONNECTION_INFO_FLAGS_CONNECTION_ENCRYPTED))
-            SlaveSecurityReEstablishment(BluetoothStackID, ApplicationStateInfo.LEConnectionInfo.BD_ADDR);
+         if(!(ConnectionInfo->Flags & CONNECTION_INFO_FLAGS_CONNECTION_ENCRYPTED))
+            SlaveSecurityReEstablishment(BluetoothStackID, ConnectionInfo->BD_ADDR);
       }
       else if(SPP_state_timer_id == TimerID)
       {
          SPP_state_timer_id = 0;
-         SPP_event = SPP_EVT_SM_TIMEOUT;
+         Set_SPP_Event(SPP_EVT_SM_TIMEOUT);
       }
    }
 }
@@ -8031,13 +9186,10 @@ int InitializeApplication(HCI_DriverInformation_t *HCI_DriverInformation, BTPS_I
                       UserInterface_Server();
 #endif
                      {
-                       SPP_Configuration_Params_t SPPConfigurationParams;
                        ParameterList_t parm;
+                       int             Result;
                        
-                       SPPConfigurationParams.MaximumFrameSize   = 518;
-                       SPPConfigurationParams.TransmitBufferSize = 1034;
-                       SPPConfigurationParams.ReceiveBufferSize  = 3108;
-                       ret_val = SPP_Set_Configuration_Parameters(BluetoothStackID, &SPPConfigurationParams);
+                       ConfigureSPPParameters();
                        
                        parm.NumberofParameters = 1;
                        parm.Params[0].intParam = 1;
@@ -8047,7 +9199,17 @@ int InitializeApplication(HCI_DriverInformation_t *HCI_DriverInformation, BTPS_I
                        RegisterIAS();
                        RegisterTPS();
                        RegisterPasswordVault();
-                       SPP_event = SPP_EVT_INIT_START;
+
+                       /* Raise the ATT MTU the PWV service can           */
+                       /* negotiate, this is only allowed while no GATT   */
+                       /* connection exists.  On failure the stack keeps  */
+                       /* its default MTU and transfers use smaller       */
+                       /* notifications.                                  */
+                       if((Result = GATT_Change_Maximum_Supported_MTU(BluetoothStackID, PWV_PREFERRED_MTU)) != 0)
+                          slogf(LOG_DEST_BOTH, "GATT_Change_Maximum_Supported_MTU(%u) failed: %d", PWV_PREFERRED_MTU, Result);
+                       QueryLEDataLengthSupport();
+                       BuildAdvertisingData();
+                       Set_SPP_Event(SPP_EVT_INIT_START);
                        BTActivity++;
                      }
 #ifdef CONSOLE_SUPPORT           
@@ -8150,50 +9312,274 @@ static int GetLinkedKeyNb(void)
   return (res);
 }
 
+   /* The following function fills in a BT_LE_KEY_FILENAME record for a*/
+   /* device entry.  A deletion only keeps the address of the device.   */
+static void BuildDeviceInfoRecord(DeviceInfoRecord_t *Record, Byte_t Type, DeviceInfo_t *DeviceInfo)
+{
+   BTPS_MemInitialize(Record, 0, sizeof(DeviceInfoRecord_t));
+   Record->Magic = DEVICE_INFO_RECORD_MAGIC;
+   Record->Type  = Type;
+
+   if(Type == DEVICE_INFO_RECORD_SAVE)
+   {
+      BTPS_MemCopy(&(Record->DeviceInfo), DeviceInfo, sizeof(DeviceInfo_t));
+      Record->DeviceInfo.NextDeviceInfoPtr = NULL;
+   }
+   else
+   {
+      Record->DeviceInfo.ConnectionAddressType = DeviceInfo->ConnectionAddressType;
+      Record->DeviceInfo.ConnectionBD_ADDR     = DeviceInfo->ConnectionBD_ADDR;
+   }
+
+   Record->Crc16 = slow_crc16(0, (unsigned char *)Record, BTPS_STRUCTURE_OFFSET(DeviceInfoRecord_t, Crc16));
+}
+
+   /* The following function applies one record read from              */
+   /* BT_LE_KEY_FILENAME to the device info table.                      */
+static void ApplyDeviceInfoRecord(DeviceInfoRecord_t *Record)
+{
+   DeviceInfo_t *DeviceInfo;
+   DeviceInfo_t *NextDeviceInfoPtr;
+   BoardStr_t    BoardStr;
+
+   if(Record->Type == DEVICE_INFO_RECORD_DELETE)
+   {
+      if((DeviceInfo = DeleteDeviceInfoEntry(Record->DeviceInfo.ConnectionBD_ADDR)) != NULL)
+         FreeDeviceInfoEntryMemory(DeviceInfo);
+   }
+   else if(Record->Type == DEVICE_INFO_RECORD_SAVE)
+   {
+      if((DeviceInfo = SearchDeviceInfoEntryByBD_ADDR(Record->DeviceInfo.ConnectionBD_ADDR)) == NULL)
+      {
+         if(CreateNewDeviceInfoEntry(Record->DeviceInfo.ConnectionAddressType, Record->DeviceInfo.ConnectionBD_ADDR))
+            DeviceInfo = SearchDeviceInfoEntryByBD_ADDR(Record->DeviceInfo.ConnectionBD_ADDR);
+         else
+         {
+            BD_ADDRToStr(Record->DeviceInfo.ConnectionBD_ADDR, BoardStr);
+            slogf(LOG_DEST_BOTH, "btle.key: dropped record of %s", BoardStr);
+         }
+      }
+
+      if(DeviceInfo)
+      {
+         NextDeviceInfoPtr = DeviceInfo->NextDeviceInfoPtr;
+         BTPS_MemCopy(DeviceInfo, &(Record->DeviceInfo), sizeof(DeviceInfo_t));
+         DeviceInfo->NextDeviceInfoPtr = NextDeviceInfoPtr;
+         TouchDeviceInfoEntry(DeviceInfo);
+
+         /* The bonded entry saved last is the directed advertising */
+         /* target.                                                 */
+         if(DeviceInfo->EncryptionKeySize)
+         {
+            LastBondedDeviceInfo = DeviceInfo;
+            LimitBondedDeviceInfoEntries(DeviceInfo, FALSE);
+         }
+      }
+   }
+}
+
+   /* The following function appends one record to BT_LE_KEY_FILENAME.  */
+   /* Once the file holds DEVICE_INFO_COMPACT_RECORDS records it is     */
+   /* rewritten from the table instead, which already holds the change,*/
+   /* the record is still appended if that fails.  The compaction is    */
+   /* done before DeviceInfoFile and DeviceInfoRecordBuffer are used.   */
+static int AppendDeviceInfoRecord(Byte_t Type, DeviceInfo_t *DeviceInfo)
+{
+   FRESULT res;
+   UINT written;
+
+   if((DeviceInfoRecords >= DEVICE_INFO_COMPACT_RECORDS) && (CompactDeviceInfoList() == FR_OK))
+      return(FR_OK);
+
+   BuildDeviceInfoRecord(&DeviceInfoRecordBuffer, Type, DeviceInfo);
+
+   eMMC_PowerOn();
+   res = f_open(&DeviceInfoFile, BT_LE_KEY_FILENAME, FA_WRITE | FA_OPEN_ALWAYS);
+   if(res == FR_OK)
+   {
+      res = f_lseek(&DeviceInfoFile, f_size(&DeviceInfoFile));
+      if(res == FR_OK)
+      {
+         res = f_write(&DeviceInfoFile, (void *) &DeviceInfoRecordBuffer, sizeof(DeviceInfoRecord_t), &written);
+         if((res == FR_OK) && (written != sizeof(DeviceInfoRecord_t)))
+            res = FR_DISK_ERR;
+      }
+      f_close(&DeviceInfoFile);
+   }
+
+   if(res == FR_OK)
+      DeviceInfoRecords++;
+   else
+      slogf(LOG_DEST_BOTH, "Append btle.key failed: %d", res);
+
+   return(res);
+}
+
+   /* The following function saves the current contents of a device    */
+   /* entry, only the entry itself is written.  A bonded entry becomes  */
+   /* the directed advertising target.                                  */
+static int SaveDeviceInfoEntry(DeviceInfo_t *DeviceInfo)
+{
+   if(DeviceInfo->EncryptionKeySize)
+      LastBondedDeviceInfo = DeviceInfo;
+
+   TouchDeviceInfoEntry(DeviceInfo);
+
+   return(AppendDeviceInfoRecord(DEVICE_INFO_RECORD_SAVE, DeviceInfo));
+}
+
+   /* The following function saves a changed Client Configuration of a  */
+   /* bonded device, only the entry itself is appended so a phone       */
+   /* enabling notifications on every reconnect costs one record.       */
+   /* Configurations of devices that are not bonded are not kept.       */
+static void SaveDeviceInfoConfiguration(DeviceInfo_t *DeviceInfo)
+{
+   if(DeviceInfo->EncryptionKeySize)
+      SaveDeviceInfoEntry(DeviceInfo);
+}
+
+   /* The following function saves the deletion of a device entry.  It  */
+   /* must be called before the slot is released.                       */
+static int SaveDeviceInfoDeletion(DeviceInfo_t *DeviceInfo)
+{
+   return(AppendDeviceInfoRecord(DEVICE_INFO_RECORD_DELETE, DeviceInfo));
+}
+
+   /* The following function rewrites BT_LE_KEY_FILENAME with one record*/
+   /* per device in the table.  The new file is written next to the old */
+   /* one and only replaces it once complete, LoadDeviceInfoList()      */
+   /* finishes a swap interrupted by a reset.  The entries are written  */
+   /* from the least recently used one, the last bonded entry last, so  */
+   /* loading restores both the eviction order and the directed         */
+   /* advertising target.                                               */
+static int CompactDeviceInfoList(void)
+{
+   FRESULT res;
+   FRESULT close_res;
+   UINT written;
+   unsigned int Index;
+   unsigned int Records = 0;
+   DWord_t Age = 0;
+   DeviceInfo_t *DeviceInfo;
+
+   eMMC_PowerOn();
+   res = f_open(&DeviceInfoFile, DEVICE_INFO_COMPACT_FILENAME, FA_WRITE | FA_CREATE_ALWAYS);
+   if(res == FR_OK)
+   {
+      while(res == FR_OK)
+      {
+         /* Next bonded entry by use stamp, a free slot has none.       */
+         DeviceInfo = NULL;
+         for(Index=0;Index<DEVICE_INFO_SLOTS;Index++)
+         {
+            if((DeviceInfoAge[Index] > Age) && (DeviceInfoTable[Index].EncryptionKeySize) && (&DeviceInfoTable[Index] != LastBondedDeviceInfo) && ((!DeviceInfo) || (DeviceInfoAge[Index] < DeviceInfoAge[DeviceInfo - DeviceInfoTable])))
+               DeviceInfo = &DeviceInfoTable[Index];
+         }
+
+         if(!DeviceInfo)
+            DeviceInfo = LastBondedDeviceInfo;
+         if(!DeviceInfo)
+            break;
+
+         BuildDeviceInfoRecord(&DeviceInfoRecordBuffer, DEVICE_INFO_RECORD_SAVE, DeviceInfo);
+         res = f_write(&DeviceInfoFile, (void *) &DeviceInfoRecordBuffer, sizeof(DeviceInfoRecord_t), &written);
+         if((res == FR_OK) && (written != sizeof(DeviceInfoRecord_t)))
+            res = FR_DISK_ERR;
+         Records++;
+
+         if(DeviceInfo == LastBondedDeviceInfo)
+            break;
+         Age = DeviceInfoAge[DeviceInfo - DeviceInfoTable];
+      }
+      close_res = f_close(&DeviceInfoFile);
+      if(res == FR_OK)
+         res = close_res;
+   }
+
+   if(res == FR_OK)
+   {
+      f_unlink(BT_LE_KEY_FILENAME);
+      res = f_rename(DEVICE_INFO_COMPACT_FILENAME, BT_LE_KEY_FILENAME);
+   }
+
+   if(res == FR_OK)
+   {
+      slogf(LOG_DEST_BOTH, "Compacted btle.key: %u records to %u", DeviceInfoRecords, Records);
+      DeviceInfoRecords = Records;
+   }
+   else
+      slogf(LOG_DEST_BOTH, "Compact btle.key failed: %d", res);
+
+   return(res);
+}
+
+   /* The following function loads the device info table by replaying   */
+   /* BT_LE_KEY_FILENAME.  Replay stops at the first record that is     */
+   /* incomplete or fails its CRC and the file is cut there, so later   */
+   /* appends follow the last good record.  A file from before the log */
+   /* format holds bare DeviceInfo_t entries and is converted.  The file*/
+   /* is closed before the conversion reuses DeviceInfoFile.            */
 static int LoadDeviceInfoList(void)
 {
-  FIL fp;
-  FRESULT res;
-  UINT read; 
-  DeviceInfo_t DeviceInfo;
-  DeviceInfo_t *DeviceInfoPtr;
-  DeviceInfo_t *PreviousDeviceInfoPtr = NULL;
-  
+   FRESULT res;
+   UINT read;
+   DWORD Valid = 0;
+   Boolean_t Legacy;
+   DeviceInfoRecord_t *Record = &DeviceInfoRecordBuffer;
+
+   /* Start from an empty table.                                        */
+   BTPS_MemInitialize(DeviceInfoTable, 0, sizeof(DeviceInfoTable));
+   BTPS_MemInitialize(DeviceInfoHash, 0, sizeof(DeviceInfoHash));
+   BTPS_MemInitialize(DeviceInfoAge, 0, sizeof(DeviceInfoAge));
+   DeviceInfoRecords    = 0;
+   LastBondedDeviceInfo = NULL;
+
    eMMC_PowerOn();
-   res = f_open(&fp, BT_LE_KEY_FILENAME, FA_READ | FA_OPEN_EXISTING);
+
+   /* Finish a compaction interrupted after the old file was removed.   */
+   if((f_stat(BT_LE_KEY_FILENAME, NULL) == FR_NO_FILE) && (f_stat(DEVICE_INFO_COMPACT_FILENAME, NULL) == FR_OK))
+      f_rename(DEVICE_INFO_COMPACT_FILENAME, BT_LE_KEY_FILENAME);
+
+   res = f_open(&DeviceInfoFile, BT_LE_KEY_FILENAME, FA_READ | FA_WRITE | FA_OPEN_EXISTING);
    if (res == FR_OK)
    {
+     res = f_read(&DeviceInfoFile, (void *) &Record->Magic, sizeof(Record->Magic), &read);
+     Legacy = (Boolean_t)((res == FR_OK) && (read == sizeof(Record->Magic)) && (Record->Magic != DEVICE_INFO_RECORD_MAGIC));
+     f_lseek(&DeviceInfoFile, 0);
+
      do
      {
-       res = f_read(&fp, (void *) &DeviceInfo, sizeof(DeviceInfo_t), &read);
-       if(read == sizeof(DeviceInfo_t))
+       if(Legacy)
        {
-         /* Allocate the memory for the entry.                             */
-         if((DeviceInfoPtr = BTPS_AllocateMemory(sizeof(DeviceInfo_t))) != NULL)
-         {
-            /* Initialize the entry.                                       */
-            BTPS_MemInitialize(DeviceInfoPtr, 0, sizeof(DeviceInfo_t));
-            BTPS_MemCopy(DeviceInfoPtr, &DeviceInfo, sizeof(DeviceInfo_t));
-            DeviceInfoPtr->NextDeviceInfoPtr = NULL;
+         res = f_read(&DeviceInfoFile, (void *) &Record->DeviceInfo, sizeof(DeviceInfo_t), &read);
+         if(read != sizeof(DeviceInfo_t))
+           break;
+         Record->Type = DEVICE_INFO_RECORD_SAVE;
+       }
+       else
+       {
+         res = f_read(&DeviceInfoFile, (void *) Record, sizeof(DeviceInfoRecord_t), &read);
+         if((read != sizeof(DeviceInfoRecord_t)) || (Record->Magic != DEVICE_INFO_RECORD_MAGIC) || (Record->Crc16 != slow_crc16(0, (unsigned char *)Record, BTPS_STRUCTURE_OFFSET(DeviceInfoRecord_t, Crc16))))
+           break;
+         Valid += sizeof(DeviceInfoRecord_t);
+         DeviceInfoRecords++;
+       }
 
-            /* Initialize the list head                                    */
-            if(DeviceInfoList == NULL) 
-            {
-              DeviceInfoList = DeviceInfoPtr;
-            }
-            else
-            {
-              PreviousDeviceInfoPtr->NextDeviceInfoPtr = DeviceInfoPtr;
-            }
-            PreviousDeviceInfoPtr = DeviceInfoPtr;
+       ApplyDeviceInfoRecord(Record);
+     } while(res == FR_OK);
 
+     if((!Legacy) && (Valid != f_size(&DeviceInfoFile)))
+     {
+       slogf(LOG_DEST_BOTH, "btle.key: dropped %u bytes after record %u", f_size(&DeviceInfoFile) - Valid, DeviceInfoRecords);
+       if(f_lseek(&DeviceInfoFile, Valid) == FR_OK)
+         f_truncate(&DeviceInfoFile);
+     }
+     f_close(&DeviceInfoFile);
+     slogf(LOG_DEST_BOTH, "Loaded DeviceInfoList: %u records", DeviceInfoRecords);
 
-            slogf(LOG_DEST_BOTH, "Read DeviceInfo");
-         }
-       }
-     } while(read == sizeof (DeviceInfo_t));
-     slogf(LOG_DEST_BOTH, "Loaded DeviceInfoList");
-     f_close(&fp);
+     /* Until the conversion succeeds the next save tries it again.    */
+     if((Legacy) && ((res = CompactDeviceInfoList()) != FR_OK))
+       DeviceInfoRecords = DEVICE_INFO_COMPACT_RECORDS;
    }
    return res;
 }
@@ -8235,6 +9621,7 @@ int BT_WriteABuffer(const char * lpBuf, DWORD dwToWrite){
    char * ptr = (char *)lpBuf;
    TickType_t xTO = Settings.SPP_Send_Timeout;
    TickType_t xTimeOut;
+   TickType_t xNow;
    
    xTimeOut = xTaskGetTickCount() + xTO;
 
@@ -8242,12 +9629,16 @@ int BT_WriteABuffer(const char * lpBuf, DWORD dwToWrite){
    if((BluetoothStackID) && (SerialPortID))
    {
       while(dwToWrite) {
+        /* Register before writing, the transmit buffer empty event   */
+        /* can arrive before SPP_Data_Write() returns.                 */
+        SPPTransmitWaiter = osThreadGetId();
         Result = SPP_Data_Write(BluetoothStackID, SerialPortID, (Word_t)dwToWrite, (Byte_t *)ptr);
         if (Result < 0) {
           ret_val = Result;
           break;
         }
-        if (xTaskGetTickCount() > xTimeOut) {
+        xNow = xTaskGetTickCount();
+        if (xNow > xTimeOut) {
           // Timeout, communication is broken
           ret_val = -1;
           break;
@@ -8256,9 +9647,13 @@ int BT_WriteABuffer(const char * lpBuf, DWORD dwToWrite){
         ptr += Result;
         if (dwToWrite) {
           //printf("tow: %d/%d\r\n", dwToWrite, Result);
-          BTPS_Delay(5);
+          /* Sleep until SPP_Event_Callback() reports the transmit    */
+          /* buffer empty.  A wakeup meant for something else only    */
+          /* costs another write attempt.                              */
+          ulTaskNotifyTake(pdTRUE, xTimeOut - xNow + 1);
         }
       }
+      SPPTransmitWaiter = NULL;
    }
    else
    {
@@ -8270,36 +9665,6 @@ int BT_WriteABuffer(const char * lpBuf, DWORD dwToWrite){
   
 }
 
-static int SaveDeviceInfoList(void)
-{
-  FIL fp;
-  FRESULT res = FR_OK;
-  UINT written;
-  DeviceInfo_t *DeviceInfo = DeviceInfoList;
-  
-  eMMC_PowerOn();
-  res = f_open(&fp, BT_LE_KEY_FILENAME, FA_READ | FA_WRITE | FA_OPEN_ALWAYS);
-  if(res == FR_OK)
-  {
-    slogf(LOG_DEST_BOTH, "Open btle.key");
-    while((DeviceInfo != NULL) && (res == FR_OK)) {
-      res = f_write(&fp, (void *) DeviceInfo, sizeof(DeviceInfo_t), &written);
-      DeviceInfo = DeviceInfo->NextDeviceInfoPtr;
-    }
-    f_close(&fp);
-    
-    if (written != sizeof(DeviceInfo_t)) 
-    {
-      res = FR_DISK_ERR;
-    }
-    else 
-    {  
-      slogf(LOG_DEST_BOTH, "Save DeviceInfoList success.");
-    }
-  }
-  return (res);
-}
-
 //YouShouldFreeThisVectorAfterUsage
 LinkKeyInfo_t *ReturnAllLinkedKey(int *len){
   FIL fp;
@@ -8453,9 +9818,64 @@ int8_t SPP_Enter_Pairing_Mode(void)
    return result;
 }
 
+   /* The following function posts an event to the SPP thread.  It may */
+   /* be called from the stack callbacks, other threads or interrupts.  */
+   /* An event that does not fit in the queue is counted, the SPP thread*/
+   /* logs it.  Returns FALSE when the event was dropped.               */
+static Boolean_t Post_SPP_Event(uint8_t event)
+{
+  if((SPP_EventQueue != NULL) && (osMessagePut(SPP_EventQueue, event, 0) != osOK)) {
+    SPP_EventDropped = event;
+    SPP_EventsDropped++;
+    return(FALSE);
+  }
+  return(TRUE);
+}
+
 void Set_SPP_Event(uint8_t event)
 {
-  SPP_event = event;
+  Post_SPP_Event(event);
+}
+
+   /* The following function returns how long the SPP thread may block */
+   /* waiting for the next event before it has work of its own to do.  */
+static uint32_t SPP_GetEventTimeout(void)
+{
+   uint32_t Timeout = osWaitForever;
+   uint32_t Elapsed;
+
+   /* VUSB has no event of its own so poll it when it is being tracked.*/
+   if(Settings.BT_DisconnectOnVUSB)
+      Timeout = SPP_VUSB_POLL_INTERVAL;
+
+   /* Wake up to move an LE link that is not idle yet to the idle      */
+   /* parameters.                                                       */
+   if(LELinkSpeedPending())
+   {
+      Elapsed = xTaskGetTickCount() - LELinkActivityTick;
+      Elapsed = (Elapsed < Settings.LE_Idle_Timeout)?(Settings.LE_Idle_Timeout - Elapsed):1;
+      if(Elapsed < Timeout)
+         Timeout = Elapsed;
+   }
+
+   /* Wake up to end a directed advertising burst whose timeout is     */
+   /* overdue, or to move advertising to its next, slower stage.        */
+   if((AdvertisingStatus) && (AdvertiseDirectedBursts))
+   {
+      Elapsed = xTaskGetTickCount() - AdvertiseStageTick;
+      Elapsed = (Elapsed < ADVERTISE_DIRECTED_GUARD_MS)?(ADVERTISE_DIRECTED_GUARD_MS - Elapsed):1;
+      if(Elapsed < Timeout)
+         Timeout = Elapsed;
+   }
+   else if((AdvertisingStatus) && (AdvertiseSchedule[AdvertiseStage].Duration))
+   {
+      Elapsed = xTaskGetTickCount() - AdvertiseStageTick;
+      Elapsed = (Elapsed < AdvertiseSchedule[AdvertiseStage].Duration)?(AdvertiseSchedule[AdvertiseStage].Duration - Elapsed):1;
+      if(Elapsed < Timeout)
+         Timeout = Elapsed;
+   }
+
+   return Timeout;
 }
 
 uint8_t SPP_Pairing_Mode(void) 
@@ -8465,6 +9885,330 @@ uint8_t SPP_Pairing_Mode(void)
 
 
 
+   /* The following function wakes up the LE file transfer worker.  The */
+   /* event is only a hint, the worker takes the work from the staging  */
+   /* ring, LEStagingFiles[] and LESendRequested, which the caller sets */
+   /* first.  It never blocks; a full queue already holds a wake-up the */
+   /* worker has not seen, so a dropped one loses nothing.  Returns     */
+   /* FALSE if the event was dropped.                                   */
+static Boolean_t Set_LE_Transfer_Event(uint8_t event)
+{
+  return((Boolean_t)((LETransferQueue != NULL) && (osMessagePut(LETransferQueue, event, 0) == osOK)));
+}
+
+   /* The following function copies a PWV File Write into the staging   */
+   /* ring.  It is only called from the GATT callback and returns FALSE */
+   /* when the write does not fit, i.e. the peer ignored its Rx credits.*/
+static Boolean_t LEStagingPut(Byte_t *Data, unsigned int Length)
+{
+   unsigned int Index;
+   unsigned int Count;
+
+   if(Length > PWVRxCreditsFree(LE_STAGING_BUFFER_SIZE, LEStagingHead, LEStagingTail))
+      return(FALSE);
+
+   Index = LEStagingHead & (LE_STAGING_BUFFER_SIZE - 1);
+   Count = min(Length, LE_STAGING_BUFFER_SIZE - Index);
+   memcpy(&LEStagingBuffer[Index], Data, Count);
+   memcpy(LEStagingBuffer, &Data[Count], Length - Count);
+
+   /* Publish the data to the worker only once it is copied.            */
+   LEStagingHead += Length;
+
+   return(TRUE);
+}
+
+   /* The following function ends the file the GATT callback is         */
+   /* receiving at the current head of the staging ring.  It is only    */
+   /* called from the GATT callback, the caller posts the event.        */
+static void LEStagingClose(void)
+{
+   LEStagingFile_t *StagingFile = &LEStagingFiles[(LEStagingFileHead - 1) & (LE_STAGING_FILES - 1)];
+
+   /* The end is published before the flag the worker tests.          */
+   StagingFile->CloseIndex = LEStagingHead;
+   StagingFile->Closed     = TRUE;
+   LEReceiveOpen           = FALSE;
+}
+
+   /* The following function returns the ring index up to which the    */
+   /* worker may commit the file it is writing.  The head is read before*/
+   /* the Closed flag, so data the GATT callback stages for a following */
+   /* file after closing this one is never included.                    */
+static uint32_t LEStagingFileEnd(void)
+{
+   LEStagingFile_t *StagingFile = &LEStagingFiles[LEStagingFileTail & (LE_STAGING_FILES - 1)];
+   uint32_t         End         = LEStagingHead;
+
+   if(StagingFile->Closed)
+      End = StagingFile->CloseIndex;
+
+   return(End);
+}
+
+   /* The following function returns TRUE if a connection may start an */
+   /* LE file transfer.  There is one staging ring and one file of each */
+   /* direction, so the transfer belongs to the connection that started */
+   /* it until it ends or that connection goes away.  Other connections */
+   /* are told PWV_ERROR_TRANSFER_BUSY meanwhile.  Called from the GATT */
+   /* callback.                                                         */
+static Boolean_t LETransferAvailable(ConnectionInfo_t *ConnectionInfo)
+{
+   /* The SPP thread leaves the active state once a send wound down.   */
+   if((LESendPending) || (SPP_state == SPP_STATE_LE_FILE_TRANSFER_ACTIVE))
+      return((Boolean_t)(le_transfer_ConnectionID == ConnectionInfo->ConnectionID));
+
+   if((!le_transfer_ConnectionID) || (le_transfer_ConnectionID == ConnectionInfo->ConnectionID) || (!SearchLEConnectionByID(le_transfer_ConnectionID)))
+      return(TRUE);
+
+   return((Boolean_t)((!LEReceiveOpen) && (!LEReceiveActive)));
+}
+
+   /* The following function returns Rx credits (bytes of staging space)*/
+   /* to the PWV client.  Credits that cannot be notified because GATT  */
+   /* is out of buffers are kept and sent with the next call.           */
+static void PWVSendRxCredits(unsigned int Credits)
+{
+   Byte_t Value[PWV_RX_CREDIT_VALUE_LENGTH];
+   Word_t Next;
+
+   PWVRxCreditsRelease(&LERxCredits, Credits);
+
+   if(((Next = PWVRxCreditsNext(&LERxCredits)) != 0) && (SearchLEConnectionByID(le_transfer_ConnectionID)) && (le_transfer_DeviceInfo) && (le_transfer_DeviceInfo->ServerInfo.Rx_Credit_Client_Configuration_Descriptor == GATT_CLIENT_CONFIGURATION_CHARACTERISTIC_NOTIFY_ENABLE))
+   {
+      ASSIGN_HOST_WORD_TO_LITTLE_ENDIAN_UNALIGNED_WORD(Value, Next);
+      if(GATT_Handle_Value_Notification(BluetoothStackID, PasswordVaultServiceID, le_transfer_ConnectionID, PWV_RX_CREDITS_CHARACTERISTIC_ATTRIBUTE_OFFSET, PWV_RX_CREDIT_VALUE_LENGTH, Value) > 0)
+         PWVRxCreditsNotified(&LERxCredits, Next);
+   }
+}
+
+   /* The following function writes the staged data up to the End ring  */
+   /* index to the received file.  Whole blocks only are written unless */
+   /* Flush is set, which keeps every write but the last sector aligned.*/
+   /* The space is handed back to the peer as Rx credits.  A failed     */
+   /* write is reported once and the rest of the file is discarded.     */
+static void LEReceiveCommit(uint32_t End, Boolean_t Flush)
+{
+   uint32_t Count;
+   UINT     Length;
+   UINT     written;
+   Byte_t   error[1];
+
+   while((Count = End - LEStagingTail) != 0)
+   {
+      if(Count >= LE_TRANSFER_BLOCK_SIZE)
+         Length = LE_TRANSFER_BLOCK_SIZE;
+      else
+      {
+         if(!Flush)
+            break;
+
+         Length = Count;
+      }
+
+      if(LEReceiveOK)
+      {
+         if((f_write(&fp_download, &LEStagingBuffer[LEStagingTail & (LE_STAGING_BUFFER_SIZE - 1)], Length, &written) != FR_OK) || (written != Length))
+         {
+            LEReceiveOK = FALSE;
+            error[0]    = PWV_ERROR_FILE_WRITE_FAIL;
+            PWVSendData(BluetoothStackID, le_transfer_ConnectionID, le_transfer_DeviceInfo, 1, error);
+         }
+      }
+
+      LEStagingTail += Length;
+      PWVSendRxCredits(Length);
+   }
+}
+
+   /* The following function opens the next file of LEStagingFiles[]   */
+   /* for the worker and grants the peer the free staging space.        */
+static void LEReceiveStart(LEStagingFile_t *StagingFile)
+{
+   Byte_t error[1];
+
+   eMMC_PowerOn();
+   LEReceiveActive    = TRUE;
+   LEStagingTail      = StagingFile->OpenIndex;
+   PWVRxCreditsReset(&LERxCredits);
+   LEReceiveOK        = (f_open(&fp_download, (const TCHAR *)StagingFile->FilePath, FA_READ | FA_WRITE | FA_OPEN_ALWAYS) == FR_OK);
+   if(!LEReceiveOK)
+   {
+      error[0] = PWV_ERROR_FILE_OPEN_FAIL;
+      PWVSendData(BluetoothStackID, le_transfer_ConnectionID, le_transfer_DeviceInfo, 1, error);
+   }
+
+   /* Grant the peer the whole free staging space.                      */
+   PWVSendRxCredits(PWVRxCreditsFree(LE_STAGING_BUFFER_SIZE, LEStagingHead, LEStagingTail));
+}
+
+   /* The following function commits the rest of the file the worker   */
+   /* is writing and closes it.  A close error is only reported while   */
+   /* the connection is still there, after a disconnect nobody listens. */
+static void LEReceiveClose(void)
+{
+   Byte_t error[1];
+
+   LEReceiveActive = FALSE;
+   LEReceiveCommit(LEStagingFileEnd(), TRUE);
+   if((LEReceiveOK) && (f_close(&fp_download) != FR_OK) && (SearchLEConnectionByID(le_transfer_ConnectionID)))
+   {
+      error[0] = PWV_ERROR_FILE_CLOSE_FAIL;
+      PWVSendData(BluetoothStackID, le_transfer_ConnectionID, le_transfer_DeviceInfo, 1, error);
+   }
+   LEStagingFileTail++;
+
+   RTC_GetElapsedTime(&LETransferEndTime);
+   Set_SPP_Event(SPP_EVT_LE_RECEIVE_DONE);
+}
+
+   /* The following function brings the received files up to date with*/
+   /* what the GATT callback staged.  It is called on every wake-up of  */
+   /* the worker, whatever the event, and works from LEStagingFiles[]:  */
+   /* a file past the tail is opened, its data committed, and once it is*/
+   /* closed (by CLOSE_FILE, the next OPEN_FILE or a disconnect) it is  */
+   /* finished.  Each file carries its own start and end in the staging */
+   /* ring, so a commit never runs into the next file even when the GATT*/
+   /* callback is a whole file ahead of the worker.                     */
+static void LEReceiveService(void)
+{
+   LEStagingFile_t *StagingFile;
+   uint32_t         End;
+
+   /* Data staged from here on posts a new wake-up.                     */
+   LEStagingSignalled = FALSE;
+
+   while(LEStagingFileTail != LEStagingFileHead)
+   {
+      StagingFile = &LEStagingFiles[LEStagingFileTail & (LE_STAGING_FILES - 1)];
+      if(!LEReceiveActive)
+         LEReceiveStart(StagingFile);
+
+      End = LEStagingFileEnd();
+      if(!StagingFile->Closed)
+      {
+         LEReceiveCommit(End, FALSE);
+         break;
+      }
+
+      LEReceiveClose();
+   }
+
+   /* Credits a full GATT buffer held back are retried on any wake-up,  */
+   /* not only on the buffer empty event.                               */
+   PWVSendRxCredits(0);
+}
+
+   /* The following function streams the file opened in fp_upload to   */
+   /* the PWV client.  The notification queue of the controller is kept */
+   /* full from a read ahead block and the worker only waits when GATT  */
+   /* refuses a notification, until the buffer empty indication, or    */
+   /* when the peer has granted no more notification credits, until its */
+   /* next grant.  The function returns TRUE if the whole file was sent.*/
+static Boolean_t LETransferSendFile(void)
+{
+   osEvent      event;
+   FRESULT      res;
+   UINT         Length;
+   unsigned int Index;
+   unsigned int Count;
+   unsigned int Sent;
+   unsigned int NotificationLength;
+   Boolean_t    ret_val = FALSE;
+   ConnectionInfo_t *ConnectionInfo;
+
+   Length = 0;
+   Index  = 0;
+   while(1)
+   {
+      /* Read the next block once the current one is fully sent.        */
+      if(Index == Length)
+      {
+         /* A short block was the end of the file.                      */
+         if((Length) && (Length < LE_TRANSFER_BLOCK_SIZE))
+         {
+            ret_val = TRUE;
+            break;
+         }
+
+         res = f_read(&fp_upload, LETransferBuffer, LE_TRANSFER_BLOCK_SIZE, &Length);
+         Index = 0;
+         if(res != FR_OK)
+            break;
+
+         if(!Length)
+         {
+            ret_val = TRUE;
+            break;
+         }
+      }
+
+      /* The connection that asked for the file is gone.                */
+      if((ConnectionInfo = SearchLEConnectionByID(le_transfer_ConnectionID)) == NULL)
+         break;
+
+      /* Only send as many notifications as the peer has credits for.   */
+      NotificationLength = PWVNotificationLength(ConnectionInfo);
+      Count              = PWVTxCreditsLimit(&(ConnectionInfo->TxCredits), Length - Index, NotificationLength);
+
+      GATTBufferFull = FALSE;
+      Sent           = (Count)?PWVSendData(BluetoothStackID, le_transfer_ConnectionID, le_transfer_DeviceInfo, Count, &LETransferBuffer[Index]):0;
+      Index         += Sent;
+      PWVTxCreditsConsume(&(ConnectionInfo->TxCredits), Sent, NotificationLength);
+
+      if(Index < Length)
+      {
+         /* Anything other than a full notification queue or running out*/
+         /* of credits is an error.                                     */
+         if((Sent < Count) && (!GATTBufferFull))
+            break;
+
+         /* Wait for the controller to drain its buffers or for the peer*/
+         /* to grant credits.  Either indication may already be queued, */
+         /* which simply retries.                                       */
+         event = osMessageGet(LETransferQueue, Settings.SPP_Send_Timeout);
+         if(event.status != osEventMessage)
+            break;
+
+         /* File Writes received meanwhile are still committed.  A      */
+         /* disconnect is seen by the connection check above.           */
+         LEReceiveService();
+      }
+   }
+
+   f_close(&fp_upload);
+
+   return(ret_val);
+}
+
+   /* The following function is the LE file transfer worker thread.  It */
+   /* sends the file the SPP thread hands it, reporting the outcome back*/
+   /* with an SPP event, and commits the PWV File Writes staged by the  */
+   /* GATT callback to the eMMC.                                        */
+static void LETransferThread(void const *argument)
+{
+   osEvent event;
+
+   while(1)
+   {
+      /* The event only wakes the worker up, the work is in the state.  */
+      event = osMessageGet(LETransferQueue, osWaitForever);
+      if(event.status == osEventMessage)
+      {
+         LEReceiveService();
+
+         if(LESendRequested)
+         {
+            LESendRequested = FALSE;
+            if(LETransferSendFile())
+               Set_SPP_Event(SPP_EVT_LE_TRANSFER_DONE);
+            else
+               Set_SPP_Event(SPP_EVT_LE_TRANSFER_FAILED);
+         }
+      }
+   }
+}
+
    /* The following function is the main user interface thread.  It     */
    /* opens the Bluetooth Stack and then drives the main user interface.*/
 void SPPThread(void const *argument)
@@ -8476,11 +10220,10 @@ void SPPThread(void const *argument)
    HCI_HCILLConfiguration_t      HCILLConfig;
    HCI_Driver_Reconfigure_Data_t DriverReconfigureData;
    uint8_t result = 0;
+   uint8_t SPP_event;
+   osEvent event;
    DeviceInfo_t                 *DeviceInfo;
-   FIL fp;
    FRESULT res;
-   UINT read;
-   int16_t sent;
    
 #ifdef CONSOLE_SUPPORT
    HAL_ConfigureConsole(&UartHandle);
@@ -8494,6 +10237,12 @@ void SPPThread(void const *argument)
    HCI_DRIVER_SET_COMM_INFORMATION(&HCI_DriverInformation, 1, Settings.BTBaudRate, cpHCILL_RTS_CTS);
    HCI_DriverInformation.DriverInformation.COMMDriverInformation.InitializationDelay = 100;
 
+   /* Create the event queue before the stack callbacks can post to it. */
+   osMessageQDef(SPP_EVT_QUEUE, SPP_EVENT_QUEUE_SIZE, uint32_t);
+   SPP_EventQueue = osMessageCreate(osMessageQ(SPP_EVT_QUEUE), NULL);
+
+   osMessageQDef(LE_TRANSFER_QUEUE, LE_TRANSFER_QUEUE_SIZE, uint32_t);
+   LETransferQueue = osMessageCreate(osMessageQ(LE_TRANSFER_QUEUE), NULL);
 
    /* Initialize the application.                                       */
    if((Result = InitializeApplication(&HCI_DriverInformation, &BTPS_Initialization)) > 0)
@@ -8518,15 +10267,52 @@ void SPPThread(void const *argument)
       }
       
       SelfTest.SerialBT = SELF_TEST_SUCCESS;
+
+      /* Start the LE file transfer worker.                             */
+      osThreadDef(LE_Transfer_Thread, LETransferThread, osPriorityNormal, 0, 4 * configMINIMAL_STACK_SIZE);
+      osThreadCreate(osThread(LE_Transfer_Thread), NULL);
       
       //eMMC_TurnOff = TRUE;
 
-      /* Loop forever and process UART characters.                      */
+      /* Loop forever and process the posted events.                    */
       while(1)
       {
+         event = osMessageGet(SPP_EventQueue, SPP_GetEventTimeout());
+         SPP_event = (event.status == osEventMessage)?(uint8_t)event.value.v:SPP_EVT_NONE;
+
+         if(SPP_EventsDropped != SPP_EventsDroppedLogged)
+         {
+            SPP_EventsDroppedLogged = SPP_EventsDropped;
+            slogf(LOG_DEST_BOTH, "SPP event queue full: %u events dropped, last %u", SPP_EventsDroppedLogged, SPP_EventDropped);
+         }
+
+         /* Input arriving from here on posts a new console event.     */
+         if(SPP_event == SPP_EVT_CONSOLE_INPUT)
+         {
+            SPP_ConsoleInputPending = FALSE;
 #ifdef CONSOLE_SUPPORT           
-         ProcessCharacters(NULL);
+            ProcessCharacters(NULL);
 #endif // CONSOLE_SUPPORT           
+         }
+
+         /* The data length request waits for the controller so it is   */
+         /* issued here rather than from the GATT connection callback.  */
+         if(SPP_event == SPP_EVT_LE_CONNECT)
+         {
+            LELinkActivityTick = xTaskGetTickCount();
+            SetLEDataLength();
+
+            /* The controller stops advertising on a connection, keep  */
+            /* advertising while another central can still connect.    */
+            if((!AdvertisingStatus) && (LEConnectionCount() < MAX_LE_CONNECTIONS))
+               AdvertiseLEEnable(AdvertiseWhitelist);
+         }
+
+         LEUpdateLinkSpeed(SPP_event);
+         AdvertiseUpdateSchedule(SPP_event);
+
+         if(SPP_event == SPP_EVT_LE_RECEIVE_DONE)
+            slogf(LOG_DEST_BOTH, "File transfer time: %d", LETransferEndTime - LETransferStartTime);
          
          switch(SPP_state) {
          case SPP_STATE_INIT:
@@ -8555,11 +10341,14 @@ void SPPThread(void const *argument)
                }
                break;
             case SPP_EVT_LE_SEND_FILE:
-               res = f_open(&fp, le_transfer_filepath, FA_READ | FA_OPEN_EXISTING);
+               res = f_open(&fp_upload, le_transfer_filepath, FA_READ | FA_OPEN_EXISTING);
                if (res == FR_OK)
                {
                   slogf(LOG_DEST_BOTH,"Sending data. . .");
-                  SPP_state = SPP_STATE_LE_FILE_TRANSFER_START;
+                  RTC_GetElapsedTime(&LETransferStartTime);
+                  LESendRequested = TRUE;
+                  Set_LE_Transfer_Event(SPP_EVT_LE_SEND_FILE);
+                  SPP_state = SPP_STATE_LE_FILE_TRANSFER_ACTIVE;
                }
                break;
             }
@@ -8637,63 +10426,26 @@ void SPPThread(void const *argument)
                break;            
             }
             break;
-         case SPP_STATE_LE_FILE_TRANSFER_START:
-            res = f_read(&fp, (void *) &PWVBuffer, PWV_DATA_BUFFER_LENGTH, &read);
-            if((res == FR_OK) && (read <= PWV_DATA_BUFFER_LENGTH))
-            {
-               RTC_GetElapsedTime(&LETransferStartTime);
-               SPP_state = SPP_STATE_LE_FILE_TRANSFER_ACTIVE;
-            }
-            else
-            {
-               SPP_state = SPP_STATE_IDLE;
-            }
          case SPP_STATE_LE_FILE_TRANSFER_ACTIVE:
-            sent = PWVSendData(BluetoothStackID, le_transfer_DeviceInfo, read - le_transfer_index, PWVBuffer + le_transfer_index);
-            if((sent + le_transfer_index == read))
-            {
-               if(read < PWV_DATA_BUFFER_LENGTH)
-               {
-                  slogf(LOG_DEST_BOTH, "Sent file");
-                  le_transfer_index = 0;
-                  f_close(&fp);
-                  RTC_GetElapsedTime(&LETransferEndTime);
-                  slogf(LOG_DEST_BOTH, "File transfer time: %d", LETransferEndTime - LETransferStartTime);
-                  SPP_state = SPP_STATE_IDLE;
-               }
-               else
-               {
-                  le_transfer_index = 0;
-                  SPP_state = SPP_STATE_LE_FILE_TRANSFER_START;
-               }
-            }
-            else
-            {
-               if(SPP_event == SPP_EVT_GATT_BUFFER_FULL)
-               {
-                  slogf(LOG_DEST_BOTH, "GATT buffers full");
-                  le_transfer_index += sent;
-                  SPP_state = SPP_STATE_LE_FILE_TRANSFER_HOLD;
-               }
-               else
-               {
-                  slogf(LOG_DEST_BOTH, "Error sending file over LE");
-                  le_transfer_index = 0;
-                  f_close(&fp);
-                  SPP_state = SPP_STATE_IDLE;
-               }
-            }
-            break;
-         case SPP_STATE_LE_FILE_TRANSFER_HOLD:
             switch(SPP_event){
-            case SPP_EVT_GATT_BUFFER_EMPTY:
-               slogf(LOG_DEST_BOTH, "GATT buffers ready");
-               SPP_state = SPP_STATE_LE_FILE_TRANSFER_ACTIVE;
+            case SPP_EVT_LE_TRANSFER_DONE:
+               RTC_GetElapsedTime(&LETransferEndTime);
+               slogf(LOG_DEST_BOTH, "Sent file");
+               slogf(LOG_DEST_BOTH, "File transfer time: %d", LETransferEndTime - LETransferStartTime);
+               SPP_state = SPP_STATE_IDLE;
+               break;
+            case SPP_EVT_LE_TRANSFER_FAILED:
+               slogf(LOG_DEST_BOTH, "Error sending file over LE");
+               SPP_state = SPP_STATE_IDLE;
                break;
             }
             break;
          }
-         SPP_event = SPP_EVT_NONE;
+
+         /* A send request has either started or been dropped, the     */
+         /* transfer is free for other connections again once idle.    */
+         if(SPP_event == SPP_EVT_LE_SEND_FILE)
+            LESendPending = FALSE;
          
          if (Settings.BT_DisconnectOnVUSB) {
            static uint8_t PmicChdetTrk = -1;
@@ -8704,18 +10456,14 @@ void SPPThread(void const *argument)
                // VUSB present
                // Disable pairability, discoverability and close SPP server
                SPP_Off();
-               SPP_event = SPP_EVT_PLUG_IN;
+               Set_SPP_Event(SPP_EVT_PLUG_IN);
              } else {
                // VUSB absent
                SPP_On();
              }
            }
            
-         } else {
-
-        }
-
-         BTPS_Delay(200);
+         }
       }
    }
    
@@ -8880,6 +10628,11 @@ void HAL_Console_RxCpltCallback(UART_HandleTypeDef *huart)
     if (HAL_ConsoleContext.RxBytesFree) {
       HAL_UART_Receive_IT(huart, &(HAL_ConsoleContext.RxBuffer[HAL_ConsoleContext.RxInIndex]), 1);
     }
+    /* One queued event covers all the input until the SPP thread takes */
+    /* it, a pasted line cannot fill the queue.                         */
+    if (!SPP_ConsoleInputPending) {
+      SPP_ConsoleInputPending = Post_SPP_Event(SPP_EVT_CONSOLE_INPUT);
+    }
   }
 }
 
@@ -8999,17 +10752,24 @@ static int GetInput(void)
 /* The following function processes terminal input.                  */
 static void ProcessCharacters(void *UserParameter)
 {
-   /* Check to see if we have a command to process.                     */
-   int ret_val = GetInput();
-   if(ret_val > 0)
-   {
-      /* Attempt to process a character.                                */
-      ProcessCommandLine(Input);
-   }
-   else if (COMMAND_LINE_ENTER_PRESSED == ret_val)
+   int ret_val;
+
+   /* One event is posted for all the pending input, so read until the  */
+   /* receive buffer is empty.                                          */
+   do
    {
-       DisplayPrompt();
-   }
+      /* Check to see if we have a command to process.                  */
+      ret_val = GetInput();
+      if(ret_val > 0)
+      {
+         /* Attempt to process a character.                             */
+         ProcessCommandLine(Input);
+      }
+      else if (COMMAND_LINE_ENTER_PRESSED == ret_val)
+      {
+          DisplayPrompt();
+      }
+   } while(HAL_ConsoleContext.RxBytesFree != HAL_ConsoleContext.RxBufferSize);
 }
 
 
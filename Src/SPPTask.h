@@ -93,6 +93,19 @@ typedef struct _tagLinkKeyInfo_t
 #define SPP_EVT_GATT_BUFFER_EMPTY       13
 #define SPP_EVT_LE_SEND_FILE            14
 #define SPP_EVT_GATT_BUFFER_FULL        15
+#define SPP_EVT_CONSOLE_INPUT           16
+#define SPP_EVT_LE_TRANSFER_DONE        17
+#define SPP_EVT_LE_TRANSFER_FAILED      18
+#define SPP_EVT_LE_OPEN_FILE            19
+#define SPP_EVT_LE_CLOSE_FILE           20
+#define SPP_EVT_LE_STAGING_DATA         21
+#define SPP_EVT_LE_RECEIVE_DONE         22
+#define SPP_EVT_LE_TX_CREDITS           23
+#define SPP_EVT_LE_TRANSFER_START       24
+#define SPP_EVT_LE_DIRECTED_TIMEOUT     25
+
+ /* Define the depth of the SPP thread event queue                      */
+#define SPP_EVENT_QUEUE_SIZE            16
 
 void SPPThread(void const *argument);
 int InitializeApplication(HCI_DriverInformation_t *HCI_DriverInformation, BTPS_Initialization_t *BTPS_Initialization);
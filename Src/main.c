@@ -171,7 +171,10 @@ sDEVICE_SETTINGS Settings = { FTP_INACTIVITY_TO_DEFAULT,        // FTP_Inactivit
                               ADV_INTERVAL_MAX_DEFAULT,         // Max BLE Advertising interval
                               SPP_SEND_TIMEOUT_DEFAULT,         // Max SPP send timeout
                               SPP_RECEIVE_TIMEOUT_DEFAULT,      // Max SPP receive timeout  
-                              ADV_ENABLED};                     // Is BLE Advertising enabled?  
+                              ADV_ENABLED,                      // Is BLE Advertising enabled?  
+                              LE_TRANSFER_INTERVAL_DEFAULT,     // LE connection interval during transfers
+                              LE_IDLE_INTERVAL_DEFAULT,         // LE connection interval when idle
+                              LE_IDLE_TIMEOUT_DEFAULT};         // Idle time before the slow interval
 
 // ---- FTP management
 int FTPAbort = FALSE;
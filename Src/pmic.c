@@ -427,6 +427,45 @@ void PMICGetDeviceSettings(void)
           }
         }
         i++;
+      } else if (jsoneq(buf, &jt[i], "le_transfer_interval") == 0) {
+        memset(param, 0, sizeof(param));
+        if ((jt[i+1].end - jt[i+1].start) <= sizeof(param)) {
+          strncpy(param, (buf + jt[i+1].start), (jt[i+1].end - jt[i+1].start));
+          value = strtoul(param, NULL, 0);
+          if (value < LE_INTERVAL_MIN) {
+            value = LE_INTERVAL_MIN;
+          } else if (value > LE_INTERVAL_MAX) {
+            value = LE_INTERVAL_MAX;
+          }
+          Settings.LE_Transfer_Interval = value;
+        }
+        i++;
+      } else if (jsoneq(buf, &jt[i], "le_idle_interval") == 0) {
+        memset(param, 0, sizeof(param));
+        if ((jt[i+1].end - jt[i+1].start) <= sizeof(param)) {
+          strncpy(param, (buf + jt[i+1].start), (jt[i+1].end - jt[i+1].start));
+          value = strtoul(param, NULL, 0);
+          if (value < LE_INTERVAL_MIN) {
+            value = LE_INTERVAL_MIN;
+          } else if (value > LE_INTERVAL_MAX) {
+            value = LE_INTERVAL_MAX;
+          }
+          Settings.LE_Idle_Interval = value;
+        }
+        i++;
+      } else if (jsoneq(buf, &jt[i], "le_idle_timeout") == 0) {
+        memset(param, 0, sizeof(param));
+        if ((jt[i+1].end - jt[i+1].start) <= sizeof(param)) {
+          strncpy(param, (buf + jt[i+1].start), (jt[i+1].end - jt[i+1].start));
+          value = strtoul(param, NULL, 0);
+          if (value < LE_IDLE_TIMEOUT_MIN) {
+            value = LE_IDLE_TIMEOUT_MIN;
+          } else if (value > LE_IDLE_TIMEOUT_MAX) {
+            value = LE_IDLE_TIMEOUT_MAX;
+          }
+          Settings.LE_Idle_Timeout = value;
+        }
+        i++;
       }
     }
   } while (0);
@@ -447,6 +486,9 @@ void PMICGetDeviceSettings(void)
   slogf(LOG_DEST_BOTH,"SPP_Send_Timeout: %d ms", Settings.SPP_Send_Timeout);
   slogf(LOG_DEST_BOTH,"SPP_Receive_Timeout: %d ms", Settings.SPP_Receive_Timeout);
   slogf(LOG_DEST_BOTH,"Advertising_Enabled: %d", Settings.Advertising_Enabled);
+  slogf(LOG_DEST_BOTH,"LE_Transfer_Interval: %d ms", Settings.LE_Transfer_Interval);
+  slogf(LOG_DEST_BOTH,"LE_Idle_Interval: %d ms", Settings.LE_Idle_Interval);
+  slogf(LOG_DEST_BOTH,"LE_Idle_Timeout: %d ms", Settings.LE_Idle_Timeout);
   slogf(LOG_DEST_CONSOLE,"");
   
 }
@@ -1690,8 +1732,7 @@ void PMICThread(void const *argument)
           state = 0;
           FTPAbort = TRUE;
           FTPAborted = FALSE;
-          osSemaphoreRelease(FTP_RxFifoEmpty);
-          osSemaphoreRelease(FTP_RxDataReady);
+          FtpWakeReceive();
           AbortTimeout = (osKernelSysTick() + FTP_ABORT_TIMEOUT);
           
           //wait for abort response from FTP server                        
@@ -1726,8 +1767,7 @@ void PMICThread(void const *argument)
         // Port has been opened
         FTPAbort = TRUE;
         FTPAborted = FALSE;
-        osSemaphoreRelease(FTP_RxFifoEmpty);
-        osSemaphoreRelease(FTP_RxDataReady);
+        FtpWakeReceive();
         AbortTimeout = (osKernelSysTick() + FTP_ABORT_TIMEOUT);
         //wait for abort response from FTP server                        
         while ((!FTPAborted) && (osKernelSysTick() < AbortTimeout)) {
@@ -1744,8 +1784,7 @@ void PMICThread(void const *argument)
         // Port has been closed
         FTPAbort = TRUE;
         FTPAborted = FALSE;
-        osSemaphoreRelease(FTP_RxFifoEmpty);
-        osSemaphoreRelease(FTP_RxDataReady);
+        FtpWakeReceive();
         AbortTimeout = (osKernelSysTick() + FTP_ABORT_TIMEOUT);
         //wait for abort response from FTP server                        
         while ((!FTPAborted) && (osKernelSysTick() < AbortTimeout)) {
@@ -1988,8 +2027,7 @@ void PMICThread(void const *argument)
           state = 0;
           FTPAbort = TRUE;
           FTPAborted = FALSE;
-          osSemaphoreRelease(FTP_RxFifoEmpty);
-          osSemaphoreRelease(FTP_RxDataReady);
+          FtpWakeReceive();
           AbortTimeout = (osKernelSysTick() + PMIC_ABORT_TIMEOUT);
           //wait for abort response from FTP server                        
           while ((!FTPAborted) && (osKernelSysTick() < AbortTimeout)) {
@@ -2024,8 +2062,7 @@ void PMICThread(void const *argument)
         // Port has been opened
         FTPAbort = TRUE;
         FTPAborted = FALSE;
-        osSemaphoreRelease(FTP_RxFifoEmpty);
-        osSemaphoreRelease(FTP_RxDataReady);
+        FtpWakeReceive();
         AbortTimeout = (osKernelSysTick() + PMIC_ABORT_TIMEOUT);
         //wait for abort response from FTP server                        
         while ((!FTPAborted) && (osKernelSysTick() < AbortTimeout)) {
@@ -2042,8 +2079,7 @@ void PMICThread(void const *argument)
         // Port has been closed
         FTPAbort = TRUE;
         FTPAborted = FALSE;
-        osSemaphoreRelease(FTP_RxFifoEmpty);
-        osSemaphoreRelease(FTP_RxDataReady);
+        FtpWakeReceive();
         AbortTimeout = (osKernelSysTick() + PMIC_ABORT_TIMEOUT);
         //wait for abort response from FTP server                        
         while ((!FTPAborted) && (osKernelSysTick() < AbortTimeout)) {
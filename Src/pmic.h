@@ -17,7 +17,7 @@
 #include "stm32f4xx_hal_adc.h"
 #include "cmsis_os.h"
 #include "main.h"
-#include "ftpd\ftpd.h"
+#include "FTPd/FTPd.h"
 
 #include "BTTypes.h"
 
@@ -27,7 +27,7 @@
 #else
 #include "SPPTask.h"
 #endif
-#include "JSMN\jsmn.h"
+#include "JSMN/jsmn.h"
 #endif // FIRMWARE
 
 /* I2C handler declaration */
@@ -99,7 +99,7 @@ USBD_CDC_ItfTypeDef USBD_CDC_fops =
   CDC_Itf_Receive
 };
 
-osSemaphoreId CDC_RxSemaphore;
+static osThreadId CDC_RxThreadId;     // Notified for each packet received
 
 bool CDC_Started = FALSE;
 
@@ -128,11 +128,8 @@ void CDC_Stop(void)
 
 void CDC_Init(void)
 {
-  osSemaphoreDef(CDC_SEM);
-  CDC_RxSemaphore = osSemaphoreCreate(osSemaphore(CDC_SEM) , 1);
-  
   osThreadDef(CDC_Thread, CDC_RxThread, osPriorityBelowNormal/*osPriorityNormal*/, 0, 8 * configMINIMAL_STACK_SIZE);
-  osThreadCreate(osThread(CDC_Thread), NULL);
+  CDC_RxThreadId = osThreadCreate(osThread(CDC_Thread), NULL);
   
   /* Init Device Library */
   USBD_Init(&USBD_Device, &VCP_Desc, 0);
@@ -156,7 +153,10 @@ void CDC_Init(void)
 void CDC_Reset(void)
 {
   memset(CDC_RxBuff,0,sizeof(CDC_RxBuff));
-  osSemaphoreRelease(CDC_RxSemaphore);
+  if (CDC_RxThreadId != NULL)
+  {
+    xTaskNotifyGive(CDC_RxThreadId);
+  }
   
   USBD_LL_Reset(&USBD_Device);
   
@@ -304,6 +304,8 @@ static int8_t CDC_Itf_Control (uint8_t cmd, uint8_t* pbuf, uint16_t length)
   */
     static int8_t CDC_Itf_Receive(uint8_t* Buf, uint32_t *Len)
 {  
+  BaseType_t xHigherPriorityTaskWoken = pdFALSE;
+  
   //BSP_LED_On(LED3);
   
   CDC_RxBuff[CDC_RxHead].Len = *Len;
@@ -325,7 +327,11 @@ static int8_t CDC_Itf_Control (uint8_t cmd, uint8_t* pbuf, uint16_t length)
     {
     CDC_RxFifoFull=1;
   }
-  osSemaphoreRelease(CDC_RxSemaphore);          // indicate to CDC_RxThread that data are available.
+  if (CDC_RxThreadId != NULL)
+  {
+    vTaskNotifyGiveFromISR(CDC_RxThreadId, &xHigherPriorityTaskWoken);   // indicate to CDC_RxThread that data are available.
+    portYIELD_FROM_ISR(xHigherPriorityTaskWoken);
+  }
   
   return (USBD_OK);
 }
@@ -399,34 +405,31 @@ static void CDC_RxThread(void const *argument)
 {
   for(;;)
   {
-    if (CDC_RxSemaphore != NULL)
+    /* Wait for CDC_Itf_Receive to notify that a packet is available */
+    if(ulTaskNotifyTake(pdTRUE, osWaitForever) != 0)
     {
-      /* Try to obtain the semaphore */
-      if(osSemaphoreWait(CDC_RxSemaphore , osWaitForever) == osOK)
+      while(CDC_RxBuff[CDC_RxTail].Len)
       {
-        while(CDC_RxBuff[CDC_RxTail].Len)
+        CDC_RxCharThread += CDC_RxBuff[CDC_RxTail].Len;
+        //printf("CDC_Rx %d char\r\n",CDC_RxBuff[CDC_RxTail].Len);
+        if (pWriteABuffer == CDC_WriteABuffer) {
+          HandleASuccessfulRead((char*)CDC_RxBuff[CDC_RxTail].RxBuff, CDC_RxBuff[CDC_RxTail].Len);      // pass received Data to FTP server.
+        }
+
+        CDC_RxBuff[CDC_RxTail].Len = 0;   // mark buffer as free.
+        
+        CDC_RxTail++;
+        if(CDC_RxTail >= CDC_RX_BUFF_NB)
+        {
+          CDC_RxTail=0;
+        }
+        
+        if(CDC_RxFifoFull)
         {
-          CDC_RxCharThread += CDC_RxBuff[CDC_RxTail].Len;
-          //printf("CDC_Rx %d char\r\n",CDC_RxBuff[CDC_RxTail].Len);
-          if (pWriteABuffer == CDC_WriteABuffer) {
-            HandleASuccessfulRead((char*)CDC_RxBuff[CDC_RxTail].RxBuff, CDC_RxBuff[CDC_RxTail].Len);      // pass received Data to FTP server.
-          }
-
-          CDC_RxBuff[CDC_RxTail].Len = 0;   // mark buffer as free.
-          
-          CDC_RxTail++;
-          if(CDC_RxTail >= CDC_RX_BUFF_NB)
-          {
-            CDC_RxTail=0;
-          }
-          
-          if(CDC_RxFifoFull)
-          {
-            CDC_RxFifoFull=0;
-            USBD_CDC_SetRxBuffer(&USBD_Device, CDC_RxBuff[CDC_RxHead].RxBuff);
-            //BSP_LED_Off(LED3);
-            USBD_CDC_ReceivePacket(&USBD_Device);         // indicate that we have consummed USB data and that we are ready to receive new one.
-          }
+          CDC_RxFifoFull=0;
+          USBD_CDC_SetRxBuffer(&USBD_Device, CDC_RxBuff[CDC_RxHead].RxBuff);
+          //BSP_LED_Off(LED3);
+          USBD_CDC_ReceivePacket(&USBD_Device);         // indicate that we have consummed USB data and that we are ready to receive new one.
         }
       }
     }